@@ -18,6 +18,16 @@ layout (binding = 3) uniform sampler2D cloud;
 layout (binding = 4) uniform sampler2D night;
 layout (binding = 5) uniform sampler2D specular;
 
+// Virtual textures
+layout (binding = 8) uniform usampler2D diffuseIndirection;
+layout (binding = 9) uniform usampler2D cloudIndirection;
+layout (binding = 10) uniform usampler2D nightIndirection;
+layout (binding = 11) uniform usampler2D specularIndirection;
+layout (binding = 12) uniform sampler2D diffuseCache;
+layout (binding = 13) uniform sampler2D cloudCache;
+layout (binding = 14) uniform sampler2D nightCache;
+layout (binding = 15) uniform sampler2D specularCache;
+
 layout (location = 0) out vec4 outColor;
 
 #if defined(HAS_ATMO)
@@ -28,9 +38,42 @@ layout (binding = 6) uniform sampler2D atmo;
 layout (binding = 7) uniform sampler1D ringOcclusion;
 #endif
 
+// Samples the finest loaded tile of a virtual texture around the level with
+// one texel per pixel, or the tail texture if there is none
+// (params: x max level or 0 if not virtual, y tile size, z cache tiles)
+vec4 textureVirtual(sampler2D tail, usampler2D indirection, sampler2D cache,
+	vec4 params, vec2 uv)
+{
+	vec2 dx = dFdx(uv);
+	vec2 dy = dFdy(uv);
+	int maxLevel = int(params.x);
+	if (maxLevel == 0) return textureGrad(tail, uv, dx, dy);
+
+	float tileSize = params.y;
+	float footprint = max(length(vec2(dx.x, dx.y*0.5)), length(vec2(dy.x, dy.y*0.5)));
+	int level = clamp(int(floor(-log2(footprint*tileSize)+0.5)), 0, maxLevel);
+	vec2 wrapped = vec2(fract(uv.x), clamp(uv.y, 0, 1));
+
+	uvec4 entry = uvec4(0);
+	if (level > 0)
+	{
+		ivec2 grid = ivec2(1<<level, 1<<(level-1));
+		entry = texelFetch(indirection,
+			clamp(ivec2(wrapped*grid), ivec2(0), grid-1), maxLevel-level);
+	}
+	int tileLevel = int(entry.z);
+	if (tileLevel == 0) return textureGrad(tail, uv, dx, dy);
+
+	// Half a texel inside the tile, neighbours in the cache are unrelated
+	vec2 tileGrid = vec2(1<<tileLevel, 1<<(tileLevel-1));
+	vec2 inTile = clamp(fract(wrapped*tileGrid), vec2(0.5/tileSize), vec2(1-0.5/tileSize));
+	return textureLod(cache, (vec2(entry.xy)+inTile)/params.z, 0);
+}
+
 void main()
 {
-	vec3 day = texture(diffuse, passUv).rgb;
+	vec3 day = textureVirtual(diffuse, diffuseIndirection, diffuseCache,
+		planetUBO.virtualParams[0], passUv).rgb;
 
 	// Light calculations
 	vec3 normal = normalize(passNormal);
@@ -42,7 +85,8 @@ void main()
 	float lambert = clamp(max(dot(lightDir, normal), sceneUBO.ambientColor),0,1);
 
 	// Specular calculation
-	float spec = texture(specular, passUv).r;
+	float spec = textureVirtual(specular, specularIndirection, specularCache,
+		planetUBO.virtualParams[3], passUv).r;
 	vec3 H = normalize(lightDir + viewDir);
 	float NdotH = clamp(dot(normal, H), 0, 1);
 
@@ -54,8 +98,10 @@ void main()
 	float specIntensity = mix(specIntensity0, specIntensity1, spec);
 
 	// Clouds & night
-	float nightTex = texture(night, passUv).r * planetUBO.nightIntensity;
-	float cloudTex = texture(cloud, passUv+vec2(planetUBO.cloudDisp, 0)).r;
+	float nightTex = textureVirtual(night, nightIndirection, nightCache,
+		planetUBO.virtualParams[2], passUv).r * planetUBO.nightIntensity;
+	float cloudTex = textureVirtual(cloud, cloudIndirection, cloudCache,
+		planetUBO.virtualParams[1], passUv+vec2(planetUBO.cloudDisp, 0)).r;
 
 	vec3 nightFinal = vec3(nightTex*clamp(-lambert*10+0.2,0,1)*(1-cloudTex));
 	float k = mix(specIntensity, 0, cloudTex);
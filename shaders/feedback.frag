@@ -0,0 +1,23 @@
+layout (location = 1) in vec2 passUv;
+
+layout (binding = 1, std140) uniform planetDynamicUBO
+{
+	PlanetUBO planetUBO;
+};
+
+layout (location = 0) out uvec4 outFeedback;
+
+void main()
+{
+	// Derivatives are FEEDBACK_SCALE times larger than at full resolution
+	vec2 dx = dFdx(passUv);
+	vec2 dy = dFdy(passUv);
+	float footprint = max(length(vec2(dx.x, dx.y*0.5)), length(vec2(dy.x, dy.y*0.5)))/FEEDBACK_SCALE;
+
+	// Log2 of the width of the whole texture in pixels, 8.8 fixed point
+	float log2Width = clamp(-log2(footprint), 0, 255);
+	outFeedback = uvec4(
+		uint(planetUBO.feedbackId),
+		uvec2(clamp(passUv, 0, 1)*65535),
+		uint(log2Width*256));
+}
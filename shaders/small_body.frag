@@ -0,0 +1,8 @@
+layout (location = 0) in float passIntensity;
+
+layout (location = 0) out vec4 outColor;
+
+void main()
+{
+	outColor = vec4(vec3(passIntensity), 1.0);
+}
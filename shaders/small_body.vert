@@ -0,0 +1,38 @@
+out gl_PerVertex
+{
+  vec4 gl_Position;
+  float gl_PointSize;
+  float gl_ClipDistance[];
+};
+
+layout(location = 0) in vec4 inPoint;
+
+layout (binding = 0, std140) uniform sceneDynamicUBO
+{
+	SceneUBO sceneUBO;
+};
+
+layout (binding = 1, std140) uniform smallBodyDynamicUBO
+{
+	SmallBodyUBO smallBodyUBO;
+};
+
+layout (location = 0) out float passIntensity;
+
+const float AU = 1.495978707e8;
+
+void main()
+{
+	vec3 pos = inPoint.xyz + smallBodyUBO.parentPos.xyz;
+
+	// Apparent magnitude from absolute magnitude (phase ignored)
+	float starDist = distance(inPoint.xyz, smallBodyUBO.starPos.xyz)/AU;
+	float viewDist = length(pos)/AU;
+	float magnitude = inPoint.w + 5.0*log(max(1e-6, starDist*viewDist))/log(10.0);
+	passIntensity = min(10.0, smallBodyUBO.brightness*pow(10.0, -0.4*magnitude));
+
+	gl_Position = sceneUBO.projMat*sceneUBO.viewMat*vec4(pos,1);
+	// Logarithmic depth buffer
+	gl_Position.z = logDepth(
+		gl_Position.w, sceneUBO.logDepthFarPlane, sceneUBO.logDepthC);
+}
@@ -0,0 +1,230 @@
+#include "async_reader.hpp"
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#endif
+
+using namespace std;
+
+#ifdef USE_IO_URING
+
+// No liburing, the three system calls are enough for plain reads
+
+static int ioUringSetup(const unsigned entries, io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(const int ring, const unsigned toSubmit,
+	const unsigned minComplete, const unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, flags,
+		nullptr, 0);
+}
+
+static int ioUringRegister(const int ring, const unsigned opcode,
+	const void *arg, const unsigned args)
+{
+	return (int)syscall(__NR_io_uring_register, ring, opcode, arg, args);
+}
+
+static unsigned *ringField(void *ring, const unsigned offset)
+{
+	return (unsigned*)((uint8_t*)ring + offset);
+}
+
+AsyncReader::~AsyncReader()
+{
+	close();
+}
+
+bool AsyncReader::init(const unsigned queueDepth)
+{
+	close();
+
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	_ring = ioUringSetup(queueDepth, &params);
+	if (_ring < 0)
+	{
+		_ring = -1;
+		return false;
+	}
+	_queueDepth = params.sq_entries;
+
+	_sqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	_cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+	const bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (singleMap) _sqRingSize = _cqRingSize = max(_sqRingSize, _cqRingSize);
+
+	_sqRing = mmap(nullptr, _sqRingSize, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+	if (_sqRing == MAP_FAILED)
+	{
+		_sqRing = nullptr;
+		close();
+		return false;
+	}
+	_cqRing = singleMap?_sqRing:mmap(nullptr, _cqRingSize, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+	_sqesSize = params.sq_entries*sizeof(io_uring_sqe);
+	_sqes = mmap(nullptr, _sqesSize, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, _ring, IORING_OFF_SQES);
+	if (_cqRing == MAP_FAILED || _sqes == MAP_FAILED)
+	{
+		if (_cqRing == MAP_FAILED) _cqRing = nullptr;
+		if (_sqes == MAP_FAILED) _sqes = nullptr;
+		close();
+		return false;
+	}
+
+	_sqHead = ringField(_sqRing, params.sq_off.head);
+	_sqTail = ringField(_sqRing, params.sq_off.tail);
+	_sqMask = ringField(_sqRing, params.sq_off.ring_mask);
+	_sqArray = ringField(_sqRing, params.sq_off.array);
+	_cqHead = ringField(_cqRing, params.cq_off.head);
+	_cqTail = ringField(_cqRing, params.cq_off.tail);
+	_cqMask = ringField(_cqRing, params.cq_off.ring_mask);
+	_cqes = (uint8_t*)_cqRing + params.cq_off.cqes;
+	return true;
+}
+
+bool AsyncReader::registerBuffer(void *ptr, const size_t size)
+{
+	if (_ring == -1) return false;
+	if (_buffer) ioUringRegister(_ring, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+	_buffer = nullptr;
+	_bufferSize = 0;
+
+	iovec iov;
+	iov.iov_base = ptr;
+	iov.iov_len = size;
+	if (ioUringRegister(_ring, IORING_REGISTER_BUFFERS, &iov, 1) < 0) return false;
+	_buffer = (const uint8_t*)ptr;
+	_bufferSize = size;
+	return true;
+}
+
+bool AsyncReader::submit(const int fd, const uint64_t offset, void *ptr,
+	const size_t size, const uint64_t userData)
+{
+	// Completions can't overflow with at most one per submission entry
+	if (_ring == -1 || _inFlight >= _queueDepth) return false;
+
+	// Only this thread moves the tail, the kernel moves the head
+	const unsigned tail = *_sqTail;
+	const unsigned head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+	if (tail-head >= _queueDepth) return false;
+
+	const unsigned index = tail & *_sqMask;
+	io_uring_sqe &sqe = ((io_uring_sqe*)_sqes)[index];
+	memset(&sqe, 0, sizeof(sqe));
+	const uint8_t *dst = (const uint8_t*)ptr;
+	const bool fixed = _buffer && dst >= _buffer && dst+size <= _buffer+_bufferSize;
+	sqe.opcode = fixed?IORING_OP_READ_FIXED:IORING_OP_READ;
+	sqe.fd = fd;
+	sqe.off = offset;
+	sqe.addr = (uint64_t)(uintptr_t)ptr;
+	sqe.len = size;
+	sqe.buf_index = 0;
+	sqe.user_data = userData;
+	_sqArray[index] = index;
+	__atomic_store_n(_sqTail, tail+1, __ATOMIC_RELEASE);
+
+	_toSubmit += 1;
+	_inFlight += 1;
+	return true;
+}
+
+void AsyncReader::flush()
+{
+	while (_toSubmit > 0)
+	{
+		const int submitted = ioUringEnter(_ring, _toSubmit, 0, 0);
+		if (submitted < 0)
+		{
+			// Interrupted or out of kernel resources, the next call retries
+			if (errno == EINTR) continue;
+			return;
+		}
+		_toSubmit -= submitted;
+	}
+}
+
+int AsyncReader::reap(vector<Completion> &completions, const bool wait)
+{
+	if (_ring == -1) return 0;
+	flush();
+
+	while (true)
+	{
+		// Only this thread moves the head, the kernel moves the tail
+		int count = 0;
+		unsigned head = *_cqHead;
+		const unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+		for (;head != tail;++head)
+		{
+			const io_uring_cqe &cqe = ((const io_uring_cqe*)_cqes)[head & *_cqMask];
+			completions.push_back({cqe.user_data, cqe.res});
+			count += 1;
+		}
+		__atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+		_inFlight -= count;
+
+		if (count > 0 || !wait || _inFlight == 0) return count;
+		const int submitted = ioUringEnter(_ring, _toSubmit, 1, IORING_ENTER_GETEVENTS);
+		if (submitted < 0)
+		{
+			if (errno == EINTR) continue;
+			// Would fail again at each call
+			close();
+			return -1;
+		}
+		else
+		{
+			_toSubmit -= std::min((unsigned)submitted, _toSubmit);
+		}
+	}
+}
+
+void AsyncReader::close()
+{
+	if (_sqes) munmap(_sqes, _sqesSize);
+	if (_cqRing && _cqRing != _sqRing) munmap(_cqRing, _cqRingSize);
+	if (_sqRing) munmap(_sqRing, _sqRingSize);
+	if (_ring != -1) ::close(_ring);
+	_sqes = _cqRing = _sqRing = nullptr;
+	_ring = -1;
+	_queueDepth = _inFlight = _toSubmit = 0;
+	_buffer = nullptr;
+	_bufferSize = 0;
+}
+
+#else
+
+AsyncReader::~AsyncReader() {}
+bool AsyncReader::init(unsigned) { return false; }
+bool AsyncReader::registerBuffer(void*, size_t) { return false; }
+bool AsyncReader::submit(int, uint64_t, void*, size_t, uint64_t) { return false; }
+void AsyncReader::flush() {}
+int AsyncReader::reap(vector<Completion>&, bool) { return 0; }
+void AsyncReader::close() {}
+
+#endif
+
+unsigned AsyncReader::getInFlight() const
+{
+	return _inFlight;
+}
+
+unsigned AsyncReader::getQueueDepth() const
+{
+	return _queueDepth;
+}
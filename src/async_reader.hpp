@@ -0,0 +1,111 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Asynchronous file reads with a deep queue, driven by a single thread
+ *
+ * Backed by io_uring on Linux (built with USE_IO_URING), reads are queued
+ * in a submission ring shared with the kernel and many of them are in flight
+ * at once, which is what SSDs need to reach full throughput. init() fails
+ * where io_uring isn't available (other platforms, older kernels or when it
+ * is disabled), callers then fall back to blocking reads.
+ *
+ * Not thread-safe : a single thread submits and reaps reads.
+ */
+class AsyncReader
+{
+public:
+	/// Finished read
+	struct Completion
+	{
+		/// Value given to submit()
+		uint64_t userData;
+		/// Number of bytes read, negative errno on failure
+		int result;
+	};
+
+	AsyncReader() = default;
+	AsyncReader(const AsyncReader &) = delete;
+	AsyncReader &operator=(const AsyncReader &) = delete;
+	~AsyncReader();
+
+	/**
+	 * Creates the submission and completion rings
+	 * @param queueDepth largest number of reads in flight
+	 * @return false if asynchronous reads aren't supported
+	 */
+	bool init(unsigned queueDepth);
+	/**
+	 * Registers the memory reads are written to, so that the kernel doesn't
+	 * map it again at each read. Optional, reads to other memory are still
+	 * possible
+	 * @param ptr start of the memory
+	 * @param size size of the memory in bytes
+	 * @return false if the memory can't be registered
+	 */
+	bool registerBuffer(void *ptr, size_t size);
+	/**
+	 * Queues a read, sent to the kernel at the next flush() or reap()
+	 * @param fd file descriptor to read from
+	 * @param offset offset in bytes in the file
+	 * @param ptr where to write, inside the registered buffer or not
+	 * @param size number of bytes to read
+	 * @param userData value given back on completion
+	 * @return false if the queue is full
+	 */
+	bool submit(int fd, uint64_t offset, void *ptr, size_t size, uint64_t userData);
+	/// Sends queued reads to the kernel
+	void flush();
+	/**
+	 * Sends queued reads and gets finished ones
+	 * @param completions output, finished reads are appended to it
+	 * @param wait whether to wait for at least one read if none is finished
+	 * @return number of finished reads appended, -1 if waiting failed for
+	 * another reason than a signal: the reader is then closed and reads in
+	 * flight never complete
+	 */
+	int reap(std::vector<Completion> &completions, bool wait);
+	/// Returns the number of reads submitted and not reaped yet
+	unsigned getInFlight() const;
+	/// Returns the largest number of reads in flight
+	unsigned getQueueDepth() const;
+
+private:
+	/// Unmaps rings and closes the ring descriptor
+	void close();
+
+	/// Ring descriptor, -1 if not initialized
+	int _ring = -1;
+	/// Number of submission entries
+	unsigned _queueDepth = 0;
+	/// Reads submitted and not reaped yet
+	unsigned _inFlight = 0;
+	/// Reads queued and not sent to the kernel yet
+	unsigned _toSubmit = 0;
+
+	// Ring mappings
+	void *_sqRing = nullptr;
+	size_t _sqRingSize = 0;
+	void *_cqRing = nullptr;
+	size_t _cqRingSize = 0;
+	void *_sqes = nullptr;
+	size_t _sqesSize = 0;
+
+	// Submission ring, shared with the kernel
+	unsigned *_sqHead = nullptr;
+	unsigned *_sqTail = nullptr;
+	unsigned *_sqMask = nullptr;
+	unsigned *_sqArray = nullptr;
+	// Completion ring, shared with the kernel
+	unsigned *_cqHead = nullptr;
+	unsigned *_cqTail = nullptr;
+	unsigned *_cqMask = nullptr;
+	void *_cqes = nullptr;
+
+	/// Registered buffer, null if none
+	const uint8_t *_buffer = nullptr;
+	size_t _bufferSize = 0;
+};
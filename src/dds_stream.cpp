@@ -1,7 +1,5 @@
 #include "dds_stream.hpp"
 
-#include "gl_util.hpp"
-
 #include <SHAUN/sweeper.hpp>
 #include <SHAUN/parser.hpp>
 
@@ -13,109 +11,362 @@
 
 using namespace std;
 
-void DDSStreamer::init(bool asynchronous, int pageSize, int numPages, int maxSize)
+/// Largest number of tile reads in flight on the read thread
+static const unsigned readQueueDepth = 64;
+/// Tile files kept mapped in memory mapped mode, the OS limits mappings
+static const size_t maxMappedFiles = 64;
+/// Texels per pixel above which a level is worth less
+static const float texelsPerPixel = 4.0;
+/// Number of mip levels of a texture down to 1x1
+static int mipmapCount(const int size)
+{
+	return 1+(int)floor(log2(size));
+}
+
+/// Prefetch hints due sooner than this (in seconds) get more urgent
+static const float prefetchUrgentTime = 2.0;
+/// Priority factor of prefetch hints at their deadline
+static const float prefetchMaxUrgency = 4.0;
+/// GPU timers of uploads kept waiting for their time, older ones are dropped
+static const size_t maxUploadTimers = 16;
+
+void DDSStreamer::init(unique_ptr<UploadBackend> backend, bool asynchronous,
+	int pageSize, int numPages, int maxSize, bool memoryMapped, int workers,
+	int cacheTiles, size_t budget)
 {
+	if (!backend) throw runtime_error("No upload backend for streaming");
+	_backend = std::move(backend);
 	_asynchronous = asynchronous;
+	_memoryMapped = memoryMapped;
+	// Tiles are read whole, front to back
+	if (_memoryMapped) _mappings = make_shared<MappedFileCache>(maxMappedFiles,
+		MappedFile::Advice::Sequential);
+	_cacheTiles = min(cacheTiles, 256);
 	_maxSize = (maxSize>0)?maxSize:numeric_limits<int>::max();
+	_budget = budget;
 
 	_pageSize = pageSize;
 	_numPages = numPages;
 	int pboSize = pageSize*numPages;
-	glCreateBuffers(1, &_pbo);
-	GLbitfield storageFlags = GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT;
-#ifdef USE_COHERENT_MAPPING
-	storageFlags = storageFlags | GL_MAP_COHERENT_BIT;
-#endif
-	glNamedBufferStorage(_pbo, pboSize, nullptr, storageFlags);
-	GLbitfield mapFlags = storageFlags;
-#ifndef USE_COHERENT_MAPPING
-	mapFlags = mapFlags | GL_MAP_FLUSH_EXPLICIT_BIT;
-#endif
-	_pboPtr = glMapNamedBufferRange(
-		_pbo, 0, pboSize, mapFlags);
-
-	_usedPages.resize(numPages, false);
-	_pageFences.resize(numPages);
+	_pboPtr = _backend->createBuffer(pboSize);
+
+	_pages.init(numPages);
 
 	// Don't need threading if synchronous
 	if (!_asynchronous) return;
 
-	_t = thread([this]{
-		while (true)
+	for (int i=0;i<max(1, workers);++i)
+	{
+		_workerOutputs.emplace_back(new WorkerOutput());
+		_threads.emplace_back(&DDSStreamer::work, this, i);
+	}
+
+	// Archive tiles read with pread() go through a single asynchronous thread
+	if (!_memoryMapped && _reader.init(readQueueDepth))
+	{
+		// Kernel maps PBO pages once, optional
+		_reader.registerBuffer(_pboPtr, pboSize);
+		_asyncReads = true;
+		_workerOutputs.emplace_back(new WorkerOutput());
+		_threads.emplace_back(&DDSStreamer::readWork, this, (int)_workerOutputs.size()-1);
+	}
+}
+
+/// Finds the first tile a thread can take in a queue
+template<class T>
+static typename T::iterator findTile(T &queue, const bool asyncRead)
+{
+	return find_if(queue.begin(), queue.end(), [asyncRead](const typename T::value_type &info)
+	{
+		return info.asyncRead == asyncRead;
+	});
+}
+
+void DDSStreamer::work(const int worker)
+{
+	WorkerOutput &output = *_workerOutputs[worker];
+	while (true)
+	{
+		LoadInfo info{};
+		CreateInfo create{};
+		OpenInfo open{};
 		{
-			LoadInfo info{};
+			unique_lock<mutex> lk(_mtx);
+			_cond.wait(lk, [this]{
+				return _killThread || !_createQueue.empty() || !_openQueue.empty() ||
+					findTile(_loadInfoQueue, false) != _loadInfoQueue.end();});
+			if (_killThread) return;
+			// Textures first, their tiles can't load before
+			if (!_createQueue.empty())
 			{
-				unique_lock<mutex> lk(_mtx);
-				_cond.wait(lk, [this]{ return _killThread || !_loadInfoQueue.empty();});
-				if (_killThread) return;
-				info = _loadInfoQueue[0];
-				_loadInfoQueue.erase(_loadInfoQueue.begin());
+				create = std::move(_createQueue.front());
+				_createQueue.pop_front();
 			}
+			else if (!_openQueue.empty())
+			{
+				open = std::move(_openQueue.front());
+				_openQueue.pop_front();
+			}
+			else
+			{
+				auto it = findTile(_loadInfoQueue, false);
+				info = std::move(*it);
+				_loadInfoQueue.erase(it);
+			}
+		}
 
-			// Use this to simulate slow load times (debug purposes)
-			//this_thread::sleep_for(chrono::milliseconds(200));
-
-			LoadData data = load(info);
+		if (create.handle)
+		{
+			CreateData data{};
+			try
+			{
+				data = openTex(create);
+			}
+			catch (...)
+			{
+				data.info = create;
+				data.error = current_exception();
+			}
+			lock_guard<mutex> lk(output.mtx);
+			output.created.push_back(std::move(data));
+			continue;
+		}
 
+		if (open.handle)
+		{
+			OpenData data{};
+			try
+			{
+				data = openTiles(open);
+			}
+			catch (...)
 			{
-				lock_guard<mutex> lk(_dataMtx);
-				_loadData.push_back(data);
+				data.handle = open.handle;
+				data.error = current_exception();
 			}
+			lock_guard<mutex> lk(output.mtx);
+			output.opened.push_back(std::move(data));
+			continue;
 		}
-	});
+
+		// Use this to simulate slow load times (debug purposes)
+		//this_thread::sleep_for(chrono::milliseconds(200));
+
+		LoadData data{};
+		try
+		{
+			data = load(info);
+		}
+		catch (...)
+		{
+			lock_guard<mutex> lk(output.mtx);
+			if (!output.error) output.error = current_exception();
+			continue;
+		}
+
+		{
+			lock_guard<mutex> lk(output.mtx);
+			output.data.push_back(data);
+		}
+	}
 }
 
-DDSStreamer::~DDSStreamer()
+void DDSStreamer::readWork(const int worker)
 {
-	if (_pbo)
+	WorkerOutput &output = *_workerOutputs[worker];
+	// Tiles being read, by slot (user data of reads)
+	vector<LoadInfo> reading(_reader.getQueueDepth());
+	vector<bool> direct(reading.size(), false);
+	vector<uint64_t> freeSlots;
+	for (size_t i=0;i<reading.size();++i) freeSlots.push_back(i);
+	vector<AsyncReader::Completion> completions;
+	// Tiles read without the reader, failures are rethrown by update()
+	auto loadTile = [this, &output](const LoadInfo &info, vector<LoadData> &loaded)
+	{
+		try
+		{
+			loaded.push_back(load(info));
+		}
+		catch (...)
+		{
+			lock_guard<mutex> lk(output.mtx);
+			if (!output.error) output.error = current_exception();
+		}
+	};
+
+	while (true)
+	{
+		vector<LoadInfo> infos;
+		{
+			unique_lock<mutex> lk(_mtx);
+			if (_reader.getInFlight() == 0)
+			{
+				_cond.wait(lk, [this]{
+					return _killThread || findTile(_loadInfoQueue, true) != _loadInfoQueue.end();});
+			}
+			if (_killThread) break;
+			// Queue is sorted by priority, take as many as there are free slots
+			for (auto it=_loadInfoQueue.begin();
+				it != _loadInfoQueue.end() && infos.size() < freeSlots.size();)
+			{
+				if (!it->asyncRead) { ++it; continue; }
+				infos.push_back(std::move(*it));
+				it = _loadInfoQueue.erase(it);
+			}
+		}
+
+		vector<LoadData> loaded;
+		for (LoadInfo &info : infos)
+		{
+			const DDSLoader::FileRange range = info.loader.getFileRange(info.fileLevel);
+			char *ptr = (char*)_pboPtr+info.pageOffset*_pageSize;
+			// O_DIRECT needs aligned offsets, sizes and memory; pages are large
+			// enough for the size rounded up
+			const uint64_t alignment = TileArchive::alignment;
+			const bool useDirect = _directReads && range.directFd != -1 &&
+				range.offset%alignment == 0 && (uintptr_t)ptr%alignment == 0 &&
+				_pageSize%alignment == 0;
+			const uint64_t slot = freeSlots.back();
+			info.times.loadStart = StreamTelemetry::now();
+			if (_reader.submit(useDirect?range.directFd:range.fd, range.offset, ptr,
+				useDirect?TileArchive::align(info.imageSize):info.imageSize, slot))
+			{
+				freeSlots.pop_back();
+				direct[slot] = useDirect;
+				reading[slot] = std::move(info);
+			}
+			else
+			{
+				loadTile(info, loaded);
+			}
+		}
+
+		// Wait for a read only if there was nothing new to submit
+		completions.clear();
+		const bool failed = _reader.reap(completions, infos.empty()) < 0;
+		for (const AsyncReader::Completion &c : completions)
+		{
+			const LoadInfo &info = reading[c.userData];
+			if (c.result >= info.imageSize)
+			{
+				LoadData data = getLoadData(info);
+				data.times.loadEnd = StreamTelemetry::now();
+				loaded.push_back(data);
+			}
+			else
+			{
+				// Failed or short read, O_DIRECT isn't supported everywhere
+				if (direct[c.userData]) _directReads = false;
+				loadTile(info, loaded);
+			}
+			reading[c.userData] = LoadInfo{};
+			freeSlots.push_back(c.userData);
+		}
+
+		if (failed)
+		{
+			// Reads in flight are lost, tiles being read are loaded with blocking
+			// reads and the loading threads take queued ones
+			for (size_t slot=0;slot<reading.size();++slot)
+			{
+				if (reading[slot].pageOffset == -1) continue;
+				loadTile(reading[slot], loaded);
+				reading[slot] = LoadInfo{};
+			}
+			{
+				lock_guard<mutex> lk(_mtx);
+				_asyncReads = false;
+				for (LoadInfo &info : _loadInfoQueue) info.asyncRead = false;
+			}
+			_cond.notify_all();
+		}
+
+		if (!loaded.empty())
+		{
+			lock_guard<mutex> lk(output.mtx);
+			output.data.insert(output.data.end(), loaded.begin(), loaded.end());
+		}
+		if (failed) return;
+	}
+
+	// Reads in flight still write to the PBO
+	while (_reader.getInFlight() > 0)
 	{
-		glUnmapNamedBuffer(_pbo);
-		glDeleteBuffers(1, &_pbo);
+		completions.clear();
+		_reader.reap(completions, true);
 	}
+}
 
-	if (_t.joinable())
+DDSStreamer::~DDSStreamer()
+{
+	// Threads first, they write to the PBO
+	if (!_threads.empty())
 	{
 		{
 			lock_guard<mutex> lk(_mtx);
 			_killThread = true;
 		}
-		_cond.notify_one();
-		_t.join();
+		_cond.notify_all();
+		for (thread &t : _threads) t.join();
 	}
+
+	// Stream textures are deleted with their members, the backend last
+	if (!_backend) return;
+	for (const ReleasedPages &r : _releasedPages) _backend->deleteFence(r.fence);
+	for (const auto &t : _uploadTimers) _backend->deleteTimer(t.first);
+	for (auto &p : _virtualTexs) _backend->deleteTexture(p.second.indirection);
+	for (auto &p : _tileCaches) _backend->deleteTexture(p.second.tex);
 }
 
-struct TexInfo
+/// Clamps the number of levels to what fits in the largest texture size
+static int clampLevels(const int levels, const int size, const int maxSize)
 {
-	int size = 0;
-	int levels = 0;
-	string prefix = "";
-	string separator = "";
-	string suffix = "";
-	bool rowColumnOrder = false;
-};
+	int maxRows = maxSize/(size*2);
+	int maxLevel = (int)floor(log2(maxRows))+1;
+	return max(1,min(levels, maxLevel));
+}
 
-TexInfo parseInfoFile(const string &filename, int maxSize)
+DDSStreamer::TileSource DDSStreamer::openSource(const string &filename) const
 {
+	TileSource source{};
+	source.filename = filename;
+
+	// Archive next to the folder
+	string archiveFilename = filename;
+	while (!archiveFilename.empty() && archiveFilename.back() == '/')
+		archiveFilename.pop_back();
+	archiveFilename += ".tiles";
+	if (ifstream(archiveFilename.c_str()))
+	{
+		try
+		{
+			source.archive = make_shared<const TileArchive>(archiveFilename, _memoryMapped);
+			source.size = source.archive->getTileSize();
+			source.levels = clampLevels(source.archive->getLevels(), source.size, _maxSize);
+			return source;
+		}
+		catch (const runtime_error &e)
+		{
+			cout << e.what() << endl;
+			return {};
+		}
+	}
+
 	try
 	{
-		shaun::object obj = shaun::parse_file(filename);
+		shaun::object obj = shaun::parse_file(filename + "/info.sn");
 		shaun::sweeper swp(obj);
 
-		TexInfo info{};
-		info.size = swp("size").value<shaun::number>();
-		info.levels = swp("levels").value<shaun::number>();
+		source.size = swp("size").value<shaun::number>();
 		string prefix = swp("prefix").value<shaun::string>();
 		string separator = swp("separator").value<shaun::string>();
 		string suffix = swp("suffix").value<shaun::string>();
-		info.prefix = prefix;
-		info.separator = separator;
-		info.suffix = suffix;
-		info.rowColumnOrder = swp("row_column_order").value<shaun::boolean>();
-
-		int maxRows = maxSize/(info.size*2);
-		int maxLevel = (int)floor(log2(maxRows))+1;
-		info.levels = max(1,min(info.levels, maxLevel));
-		return info;
+		source.prefix = prefix;
+		source.separator = separator;
+		source.suffix = suffix;
+		source.rowColumnOrder = swp("row_column_order").value<shaun::boolean>();
+		source.levels = clampLevels(swp("levels").value<shaun::number>(), source.size, _maxSize);
+		return source;
 	} 
 	catch (shaun::parse_error &e)
 	{
@@ -124,130 +375,345 @@ TexInfo parseInfoFile(const string &filename, int maxSize)
 	}
 }
 
+DDSLoader DDSStreamer::openTile(const TileSource &source, const int level,
+	const int x, const int y) const
+{
+	if (source.archive) return DDSLoader(source.archive, level, x, y);
+
+	const string ddsFile =
+		source.prefix+
+		to_string(source.rowColumnOrder?y:x)+
+		source.separator+
+		to_string(source.rowColumnOrder?x:y)+
+		source.suffix;
+	return DDSLoader(source.filename + "/level" + to_string(level) + "/" + ddsFile,
+		_mappings);
+}
+
 int DDSStreamer::getPageSpan(int size)
 {
 	return ((size-1)/_pageSize)+1;
 }
 
-DDSStreamer::Handle DDSStreamer::createTex(const string &filename)
+DDSStreamer::Handle DDSStreamer::createTex(const string &filename,
+	const bool virtualTexture)
 {
-	// Get info file
-	TexInfo info = parseInfoFile(filename + "/info.sn", _maxSize);
+	CreateInfo info{};
+	info.handle = genHandle();
+	info.filename = filename;
+	info.virtualTexture = virtualTexture;
+	info.requested = StreamTelemetry::now();
 
-	// Check if file exists or is valid
-	if (info.levels == 0) return 0;
+	if (!_asynchronous)
+	{
+		CreateData data = openTex(info);
+		// Check if file exists or is valid
+		if (data.source.levels == 0) return 0;
+		addTex(data);
+		return info.handle;
+	}
+
+	// Tiles are opened by loading threads, the texture is added in update()
+	_creating.insert(info.handle);
+	{
+		lock_guard<mutex> lk(_mtx);
+		_createQueue.push_back(info);
+	}
+	// The read thread doesn't open textures
+	_cond.notify_all();
+	return info.handle;
+}
+
+DDSStreamer::CreateData DDSStreamer::openTex(const CreateInfo &info) const
+{
+	CreateData data{};
+	data.info = info;
+
+	// Get archive or info file
+	data.source = openSource(info.filename);
 
-	const string tailFile = "/level0/" + info.prefix + "0" + info.separator + "0" + info.suffix;
+	// Check if file exists or is valid
+	if (data.source.levels == 0) return data;
+	const TileSource &source = data.source;
 
 	// Tail loader
-	DDSLoader tailLoader = DDSLoader(filename+tailFile);
+	DDSLoader tailLoader = openTile(source, 0, 0, 0);
+
+	// Virtual textures only have the tail in storage
+	data.isVirtual = info.virtualTexture && _asynchronous && _cacheTiles > 0
+		&& source.levels > 1;
+	data.format = tailLoader.getFormat();
+	data.width = min(_maxSize,source.size<<(data.isVirtual?0:source.levels-1));
+
+	// Tail mipmaps (level0)
+	addTailJobs(info.handle, source, tailLoader, data.isVirtual?0:source.levels-1,
+		data.width, data.nextTileId, data.jobs);
+
+	// With a budget, storage starts with the tail and growTex() opens finer
+	// levels when updateResidency() makes room for them
+	if (data.isVirtual || (_asynchronous && _budget > 0)) return data;
+	for (int i=1;i<source.levels;++i)
+	{
+		addLevelJobs(info.handle, source, i, data.width, data.nextTileId, data.jobs);
+	}
+	return data;
+}
+
+void DDSStreamer::addTex(CreateData &data)
+{
+	const Handle h = data.info.handle;
+	const TileSource &info = data.source;
+	const bool isVirtual = data.isVirtual;
+	vector<LoadInfo> &jobs = data.jobs;
 
 	// Storage params
-	const int width = min(_maxSize,info.size<<(info.levels-1));
+	const int width = data.width;
 	const int height = width/2;
-	const GLenum format = DDSFormatToGL(tailLoader.getFormat());
+	const DDSLoader::Format format = data.format;
 	const int mipNumber = mipmapCount(width);
+	const int tailLevel = info.levels-1;
 
-	// Gen jobs
-	vector<LoadInfo> jobs;
+	// With a budget, storage starts with the tail (the only jobs opened) and
+	// updateResidency() grows it by priority; evicted if the tail doesn't fit
+	int baseLevel = 0;
+	if (_asynchronous && !isVirtual && _budget > 0)
+	{
+		const bool fits = getResidentSize()+
+			getStorageSize(format, width, tailLevel, mipNumber) <= _budget;
+		baseLevel = fits?tailLevel:mipNumber;
+		jobs.erase(remove_if(jobs.begin(), jobs.end(), [baseLevel](const LoadInfo &job)
+		{
+			return job.level < baseLevel;
+		}), jobs.end());
+	}
 
 	// Gen texture & sampler
-	const Handle h = genHandle();
-	GLuint texId;
-	glCreateTextures(GL_TEXTURE_2D, 1, &texId);
-	glTextureStorage2D(texId, mipNumber, format, width, height);
+	const size_t size = getStorageSize(format, width, baseLevel, mipNumber);
+	if (baseLevel < mipNumber)
+	{
+		const UploadBackend::TexId texId = _backend->createTexture(format,
+			mipNumber-baseLevel, max(1, width>>baseLevel), max(1, height>>baseLevel));
+		_texs.insert(make_pair(h, StreamTexture(_backend.get(), texId, size)));
+	}
+	else
+	{
+		_texs.insert(make_pair(h, StreamTexture()));
+	}
 
-	_texs.insert(make_pair(h, StreamTexture(texId)));
+	if (isVirtual)
+	{
+		VirtualTexture vt{};
+		vt.source = info;
+		vt.tileSize = info.size;
+		vt.maxLevel = info.levels-1;
+		vt.cacheKey = make_pair(format, info.size);
+
+		// One mip per level, from the finest
+		vt.indirection = _backend->createIndirection(vt.maxLevel,
+			1<<vt.maxLevel, 1<<(vt.maxLevel-1));
+		for (int level=1;level<=vt.maxLevel;++level)
+		{
+			vt.entries.emplace_back((size_t)1<<(2*level-1), 0);
+		}
+		vt.dirty.resize(vt.maxLevel, true);
 
-	// Unique for each tile
-	int tileId = 0;
+		TileCache &cache = _tileCaches[vt.cacheKey];
+		if (!cache.tex)
+		{
+			const int cacheSize = _cacheTiles*info.size;
+			cache.tex = _backend->createTexture(format, 1, cacheSize, cacheSize);
+			cache.owners.resize(_cacheTiles*_cacheTiles, make_pair(0, 0));
+			cache.lastUsed.resize(_cacheTiles*_cacheTiles, 0);
+			cache.size = DDSLoader::getImageSize(format, cacheSize, cacheSize);
+		}
+		_virtualTexs.insert(make_pair(h, std::move(vt)));
+	}
 
-	// Tail mipmaps (level0)
-	const int tailMipsFile = mipmapCount(info.size);
-	const int tailMips = mipmapCount(min(_maxSize, info.size));
+	if (_asynchronous && !isVirtual)
+	{
+		Residency res{};
+		res.source = info;
+		res.format = format;
+		res.width = width;
+		res.levels = mipNumber;
+		res.tailLevel = tailLevel;
+		res.baseLevel = baseLevel;
+		res.minLevel = baseLevel;
+		res.tilesLeft.resize(mipNumber, 0);
+		for (const LoadInfo &job : jobs) res.tilesLeft[job.level] += 1;
+		res.lastVisible = _updateCount;
+		res.nextTileId = data.nextTileId;
+		_residency.insert(make_pair(h, std::move(res)));
+	}
+
+	StreamTelemetry::Texture record{};
+	record.handle = h;
+	record.filename = data.info.filename;
+	record.size = size;
+	record.tiles = jobs.size();
+	record.created = data.info.requested;
+	_telemetry.addTexture(record);
+
+	if (_asynchronous)
+	{
+		if (!jobs.empty()) _tilesLeft[h] = jobs.size();
+		_loadInfoWaiting.insert(_loadInfoWaiting.end(),
+			make_move_iterator(jobs.begin()), make_move_iterator(jobs.end()));
+	}
+	else
+	{
+		// Synchronous mode : load whole texture now
+		_backend->beginUploads();
+		for (auto info : jobs)
+		{
+			retirePages();
+			while ((info.pageOffset = acquirePages(getPageSpan(info.imageSize))) == -1)
+			{
+				retirePages(true);
+			}
+			info.times.assigned = StreamTelemetry::now();
+			LoadData d =  load(info);
+			updateTile(d);
+		}
+		_backend->endUploads();
+		_texs[h].setComplete();
+		_telemetry.setComplete(h, StreamTelemetry::now());
+	}
+}
+
+void DDSStreamer::addTailJobs(const Handle handle, const TileSource &source,
+	const DDSLoader &loader, const int firstLevel, const int width, int &tileId,
+	vector<LoadInfo> &jobs) const
+{
+	const int tailMipsFile = mipmapCount(source.size);
+	const int tailMips = mipmapCount(min(_maxSize, source.size));
 	const int skipMips = tailMipsFile-tailMips;
 	for (int i=tailMips-1;i>=0;--i)
 	{
 		LoadInfo tailInfo{};
-		tailInfo.handle = h;
-		tailInfo.loader = tailLoader;
+		tailInfo.handle = handle;
+		tailInfo.loader = loader;
 		tailInfo.fileLevel = i+skipMips;
 		tailInfo.offsetX = 0;
 		tailInfo.offsetY = 0;
-		tailInfo.level = info.levels-1+i;
-		tailInfo.imageSize = tailLoader.getImageSize(tailInfo.fileLevel);
+		tailInfo.level = firstLevel+i;
+		tailInfo.imageSize = loader.getImageSize(tailInfo.fileLevel);
 		tailInfo.tileId = tileId;
+		tailInfo.levelWidth = max(1, width>>tailInfo.level);
+		tailInfo.tail = true;
+		tailInfo.times.created = StreamTelemetry::now();
 		jobs.push_back(tailInfo);
 		tileId += 1;
 	}
+}
 
-	for (int i=1;i<info.levels;++i)
-	{
-		const string levelFolder = filename + "/level" + to_string(i) + "/";
-		const int rows = 1<<(i-1);
-		const int columns = 2*rows;
-		const int level = info.levels-i-1;
+void DDSStreamer::addLevelJobs(const Handle handle, const TileSource &source,
+	const int fileLevel, const int width, int &tileId, vector<LoadInfo> &jobs) const
+{
+	const int rows = 1<<(fileLevel-1);
+	const int columns = 2*rows;
+	const int level = source.levels-fileLevel-1;
 
-		for (int x=0;x<columns;++x)
+	for (int x=0;x<columns;++x)
+	{
+		for (int y=0;y<rows;++y)
 		{
-			for (int y=0;y<rows;++y)
-			{
-				const string ddsFile = 
-					info.prefix+
-					to_string(info.rowColumnOrder?y:x)+
-					info.separator+
-					to_string(info.rowColumnOrder?x:y)+
-					info.suffix;
-				const string fullFilename = levelFolder+ddsFile;
-				const DDSLoader loader(fullFilename);
-				const int fileLevel = 0;
-				const int imageSize = loader.getImageSize(fileLevel);
-
-				LoadInfo loadInfo{};
-				loadInfo.handle = h;
-				loadInfo.loader = std::move(loader);
-				loadInfo.fileLevel = fileLevel;
-				loadInfo.offsetX = x*info.size;
-				loadInfo.offsetY = y*info.size;
-				loadInfo.level = level;
-				loadInfo.imageSize = imageSize;
-				loadInfo.tileId = tileId;
-				jobs.push_back(loadInfo);
-				tileId += 1;
-			}
+			const DDSLoader loader = openTile(source, fileLevel, x, y);
+			const int imageSize = loader.getImageSize(0);
+
+			LoadInfo loadInfo{};
+			loadInfo.handle = handle;
+			loadInfo.loader = std::move(loader);
+			loadInfo.fileLevel = 0;
+			loadInfo.offsetX = x*source.size;
+			loadInfo.offsetY = y*source.size;
+			loadInfo.level = level;
+			loadInfo.imageSize = imageSize;
+			loadInfo.tileId = tileId;
+			loadInfo.levelWidth = max(1, width>>level);
+			loadInfo.tail = false;
+			loadInfo.times.created = StreamTelemetry::now();
+			jobs.push_back(loadInfo);
+			tileId += 1;
 		}
 	}
+}
+
+void DDSStreamer::queueTiles(OpenInfo info)
+{
+	{
+		lock_guard<mutex> lk(_mtx);
+		_openQueue.push_back(std::move(info));
+	}
+	// The read thread doesn't open tiles
+	_cond.notify_all();
+}
 
-	_tileUpdated.insert(make_pair(h, vector<bool>(tileId, false)));
+DDSStreamer::OpenData DDSStreamer::openTiles(const OpenInfo &info) const
+{
+	OpenData data{};
+	data.handle = info.handle;
 
-	if (_asynchronous)
+	int tileId = 0;
+	if (info.tailLevel != -1)
 	{
-		_loadInfoWaiting.insert(_loadInfoWaiting.end(), jobs.begin(), jobs.end());
+		addTailJobs(info.handle, info.source, openTile(info.source, 0, 0, 0),
+			info.tailLevel, info.width, tileId, data.jobs);
 	}
-	else
+	for (const int fileLevel : info.fileLevels)
 	{
-		// Synchronous mode : load whole texture now
-		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbo);
-		for (auto info : jobs)
+		addLevelJobs(info.handle, info.source, fileLevel, info.width, tileId, data.jobs);
+	}
+
+	for (const uint32_t key : info.tiles)
+	{
+		const int level = key>>26;
+		const int y = (key>>13)&0x1FFF;
+		const int x = key&0x1FFF;
+
+		LoadInfo loadInfo{};
+		loadInfo.handle = info.handle;
+		loadInfo.loader = openTile(info.source, level, x, y);
+		loadInfo.fileLevel = 0;
+		loadInfo.level = level;
+		loadInfo.imageSize = loadInfo.loader.getImageSize(0);
+		loadInfo.tileId = key;
+		loadInfo.levelWidth = info.source.size<<level;
+		loadInfo.tail = false;
+		loadInfo.virtualTile = true;
+		data.jobs.push_back(std::move(loadInfo));
+	}
+
+	for (LoadInfo &job : data.jobs) job.times.created = info.requested;
+	return data;
+}
+
+void DDSStreamer::addOpenedTiles(OpenData &data)
+{
+	auto vt = _virtualTexs.find(data.handle);
+	auto res = _residency.find(data.handle);
+	for (LoadInfo &job : data.jobs)
+	{
+		if (job.virtualTile)
 		{
-			while (info.pageOffset == -1)
+			// Deleted while its tiles were opened
+			if (vt == _virtualTexs.end()) continue;
+		}
+		else
+		{
+			if (res == _residency.end()) continue;
+			// Level dropped while its tiles were opened (see shrinkTex())
+			if (job.level < res->second.baseLevel)
 			{
-				auto fencesSignaled = areFencesSignaled();
-				info.pageOffset = acquirePages(getPageSpan(info.imageSize), fencesSignaled);
+				res->second.staleTiles -= 1;
+				continue;
 			}
-			LoadData d =  load(info);
-			updateTile(d);
-			releasePages(info.pageOffset, getPageSpan(info.imageSize));
+			job.tileId = res->second.nextTileId++;
 		}
-		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
-		_texs[h].setComplete();
+		_loadInfoWaiting.push_back(std::move(job));
 	}
-
-	return h;
 }
 
-
-
 const StreamTexture &DDSStreamer::getTex(Handle handle)
 {
 	if (!handle) return _nullTex;
@@ -261,22 +727,552 @@ void DDSStreamer::deleteTex(Handle handle)
 	if (handle)
 	{
 		_texDeleted.push_back(handle);
-		_tileUpdated.erase(handle);
+		_creating.erase(handle);
+		_tilesLeft.erase(handle);
 		_texs.erase(handle);
+		_priorities.erase(handle);
+		_prefetches.erase(handle);
+		_residency.erase(handle);
+
+		auto it = _virtualTexs.find(handle);
+		if (it != _virtualTexs.end())
+		{
+			// Free cache slots, tiles still loading are dropped in updateTile()
+			TileCache &cache = _tileCaches[it->second.cacheKey];
+			for (const auto &r : it->second.resident)
+			{
+				cache.owners[r.second] = make_pair(0, 0);
+				cache.lastUsed[r.second] = 0;
+			}
+			_backend->deleteTexture(it->second.indirection);
+			_virtualTexs.erase(it);
+		}
 	}
 }
 
-vector<bool> DDSStreamer::areFencesSignaled()
+DDSStreamer::VirtualTexInfo DDSStreamer::getVirtualTex(Handle handle) const
 {
-	vector<bool> fencesAvailable(_pageFences.size());
-	transform(_pageFences.begin(), _pageFences.end(), 
-		fencesAvailable.begin(), [](Fence &fence){return fence.waitClient(0);});
-	return fencesAvailable;
+	VirtualTexInfo info{};
+	auto it = _virtualTexs.find(handle);
+	if (it != _virtualTexs.end())
+	{
+		const VirtualTexture &vt = it->second;
+		info.indirection = vt.indirection;
+		info.cache = _tileCaches.at(vt.cacheKey).tex;
+		info.maxLevel = vt.maxLevel;
+		info.tileSize = vt.tileSize;
+		info.cacheTiles = _cacheTiles;
+	}
+	return info;
+}
+
+uint32_t DDSStreamer::getTileKey(const int level, const int x, const int y)
+{
+	return ((uint32_t)level<<26) | ((uint32_t)y<<13) | (uint32_t)x;
+}
+
+void DDSStreamer::requestTiles(Handle handle, const vector<FeedbackSample> &samples,
+	const float uOffset)
+{
+	auto it = _virtualTexs.find(handle);
+	if (it == _virtualTexs.end()) return;
+	VirtualTexture &vt = it->second;
+
+	vt.requested.clear();
+	const float log2TileSize = log2((float)vt.tileSize);
+	for (const FeedbackSample &s : samples)
+	{
+		// Level with about one texel per pixel, the tail is enough below level 1
+		const int level = min(vt.maxLevel, (int)floor(s.log2Width-log2TileSize+0.5f));
+		if (level < 1) continue;
+		const float u = s.u+uOffset-floor(s.u+uOffset);
+		const float v = std::max(0.f, std::min(1.f, s.v));
+		int x = min((1<<level)-1, (int)(u*(1<<level)));
+		int y = min((1<<(level-1))-1, (int)(v*(1<<(level-1))));
+		// Coarser tiles are needed first to fill in for finer ones
+		for (int l=level;l>=1;--l)
+		{
+			vt.requested[getTileKey(l, x, y)] += 1;
+			x /= 2;
+			y /= 2;
+		}
+	}
+}
+
+void DDSStreamer::addTileJobs(const Handle handle, VirtualTexture &vt, int &slots)
+{
+	OpenInfo open{};
+	open.handle = handle;
+	open.source = vt.source;
+	open.requested = StreamTelemetry::now();
+
+	// Keys sort by level
+	vector<uint32_t> keys;
+	keys.reserve(vt.requested.size());
+	for (const auto &r : vt.requested) keys.push_back(r.first);
+	sort(keys.begin(), keys.end());
+
+	for (const uint32_t key : keys)
+	{
+		// Finer tiles would replace each other at every update
+		if (slots <= 0) break;
+		slots -= 1;
+		if (vt.resident.count(key) || vt.pending.count(key)) continue;
+		open.tiles.push_back(key);
+		vt.pending.insert(key);
+	}
+	if (!open.tiles.empty()) queueTiles(std::move(open));
+}
+
+void DDSStreamer::setPriority(Handle handle, float priority)
+{
+	// Textures being opened keep their hints
+	if (_texs.count(handle) || _creating.count(handle)) _priorities[handle] = priority;
+}
+
+void DDSStreamer::prefetch(Handle handle, float priority, float deadline)
+{
+	if (priority <= 0.0)
+	{
+		_prefetches.erase(handle);
+		return;
+	}
+	if (!_texs.count(handle) && !_creating.count(handle)) return;
+	Prefetch &p = _prefetches[handle];
+	p.priority = priority;
+	p.background = deadline < 0.0;
+	p.deadline = chrono::steady_clock::now()+chrono::duration_cast<chrono::steady_clock::duration>(
+		chrono::duration<float>(std::max(0.f, deadline)));
+}
+
+size_t DDSStreamer::getResidentSize() const
+{
+	size_t size = 0;
+	for (const auto &p : _texs) size += p.second.getSize();
+	for (const auto &p : _tileCaches) size += p.second.size;
+	return size;
+}
+
+const StreamTelemetry &DDSStreamer::getTelemetry() const
+{
+	return _telemetry;
+}
+
+void DDSStreamer::setUploadBudget(const double milliseconds)
+{
+	_uploadBudget.setBudget(milliseconds);
+}
+
+void DDSStreamer::setCatchUp(const bool catchUp)
+{
+	_catchUp = catchUp;
+}
+
+size_t DDSStreamer::getStorageSize(const DDSLoader::Format format, const int width,
+	const int baseLevel, const int levels)
+{
+	size_t size = 0;
+	for (int level=baseLevel;level<levels;++level)
+	{
+		size += DDSLoader::getImageSize(format,
+			max(1, width>>level), max(1, (width/2)>>level));
+	}
+	return size;
+}
+
+float DDSStreamer::getPriority(const LoadInfo &info) const
+{
+	if (info.virtualTile)
+	{
+		// Tiles covering more samples first, tiles not requested are dropped
+		auto vt = _virtualTexs.find(info.handle);
+		if (vt == _virtualTexs.end()) return 0.0;
+		auto r = vt->second.requested.find(info.tileId);
+		return (r == vt->second.requested.end())?0.0:r->second;
+	}
+	auto it = _priorities.find(info.handle);
+	if (it == _priorities.end()) return numeric_limits<float>::infinity();
+	const float tex = it->second;
+	// Not visible: mip tail only, behind every visible texture
+	const float minPriority = 1e-3;
+	float priority = info.tail?minPriority:0.0;
+	// Levels with more texels than a few per pixel are worth less
+	if (tex > 0.0) priority = max(minPriority, tex*min(1.f, texelsPerPixel*tex/info.levelWidth));
+
+	auto p = _prefetches.find(info.handle);
+	if (p != _prefetches.end())
+	{
+		const Prefetch &hint = p->second;
+		const float levelFactor = min(1.f, texelsPerPixel*hint.priority/info.levelWidth);
+		if (!hint.background)
+		{
+			priority = max(priority, max(minPriority, hint.priority*levelFactor*hint.urgency));
+		}
+		else if (levelFactor >= 1.0)
+		{
+			// Behind visible textures and mip tails
+			priority = max(priority, minPriority*0.5f);
+		}
+	}
+	return priority;
+}
+
+void DDSStreamer::retirePages(const bool wait)
+{
+	if (wait)
+	{
+		if (_releasedPages.empty()) throw runtime_error("Not enough pages");
+		_backend->isSignaled(_releasedPages.front().fence, true);
+	}
+	// Later fences can't be signaled before the first unsignaled one
+	while (!_releasedPages.empty() &&
+		_backend->isSignaled(_releasedPages.front().fence, false))
+	{
+		const ReleasedPages &r = _releasedPages.front();
+		_backend->deleteFence(r.fence);
+		_pages.free(r.pageOffset);
+		auto it = _tilesLeft.find(r.handle);
+		if (it != _tilesLeft.end() && --it->second == 0)
+		{
+			_texs[r.handle].setComplete();
+			_telemetry.setComplete(r.handle, StreamTelemetry::now());
+			_tilesLeft.erase(it);
+		}
+		_releasedPages.pop_front();
+	}
+}
+
+void DDSStreamer::shrinkTex(const Handle handle, Residency &res, const int baseLevel)
+{
+	// Waiting and queued tiles of dropped levels are cancelled, their pages
+	// are still unused
+	vector<int> cancelled(res.levels, 0);
+	auto isDropped = [&](const LoadInfo &info)
+	{
+		if (info.handle != handle || info.level >= baseLevel) return false;
+		if (info.pageOffset != -1) _pages.free(info.pageOffset);
+		cancelled[info.level] += 1;
+		return true;
+	};
+	_loadInfoWaiting.erase(
+		remove_if(_loadInfoWaiting.begin(), _loadInfoWaiting.end(), isDropped),
+		_loadInfoWaiting.end());
+	{
+		lock_guard<mutex> lk(_mtx);
+		_loadInfoQueue.erase(
+			remove_if(_loadInfoQueue.begin(), _loadInfoQueue.end(), isDropped),
+			_loadInfoQueue.end());
+	}
+
+	// Tiles being loaded are ignored when they arrive
+	int dropped = 0;
+	for (int level=res.baseLevel;level<baseLevel && level<res.levels;++level)
+	{
+		dropped += res.tilesLeft[level];
+		res.staleTiles += res.tilesLeft[level]-cancelled[level];
+		res.tilesLeft[level] = 0;
+	}
+	const bool evicted = baseLevel >= res.levels;
+	auto left = _tilesLeft.find(handle);
+	if (left != _tilesLeft.end() && dropped > 0)
+	{
+		left->second -= dropped;
+		if (left->second == 0)
+		{
+			if (!evicted)
+			{
+				_texs[handle].setComplete();
+				_telemetry.setComplete(handle, StreamTelemetry::now());
+			}
+			_tilesLeft.erase(left);
+		}
+	}
+
+	StreamTexture &tex = _texs[handle];
+	if (evicted)
+	{
+		tex = StreamTexture();
+	}
+	else
+	{
+		// Levels left are copied on the GPU, after their uploads
+		const UploadBackend::TexId texId = _backend->createTexture(res.format,
+			res.levels-baseLevel,
+			max(1, res.width>>baseLevel), max(1, (res.width/2)>>baseLevel));
+		for (int level=baseLevel;level<res.levels;++level)
+		{
+			_backend->copyLevel(tex.getTextureId(), level-res.baseLevel,
+				texId, level-baseLevel,
+				max(1, res.width>>level), max(1, (res.width/2)>>level));
+		}
+		const bool complete = tex.isComplete();
+		tex = StreamTexture(_backend.get(), texId,
+			getStorageSize(res.format, res.width, baseLevel, res.levels));
+		if (complete) tex.setComplete();
+	}
+	res.baseLevel = min(baseLevel, res.levels);
+	res.minLevel = res.baseLevel;
+	if (!evicted) updateMinLevel(handle, res);
+}
+
+void DDSStreamer::growTex(const Handle handle, Residency &res, const int baseLevel)
+{
+	const bool evicted = res.baseLevel >= res.levels;
+	StreamTexture &tex = _texs[handle];
+	const UploadBackend::TexId texId = _backend->createTexture(res.format,
+		res.levels-baseLevel,
+		max(1, res.width>>baseLevel), max(1, (res.width/2)>>baseLevel));
+	for (int level=res.baseLevel;level<res.levels;++level)
+	{
+		_backend->copyLevel(tex.getTextureId(), level-res.baseLevel,
+			texId, level-baseLevel,
+			max(1, res.width>>level), max(1, (res.width/2)>>level));
+	}
+	const bool complete = tex.isComplete() && !evicted;
+	tex = StreamTexture(_backend.get(), texId,
+		getStorageSize(res.format, res.width, baseLevel, res.levels));
+	if (complete) tex.setComplete();
+
+	// Same tiles as in createTex(), new levels only, counted now so that
+	// they aren't sampled before they are opened and loaded
+	OpenInfo open{};
+	open.handle = handle;
+	open.source = res.source;
+	open.width = res.width;
+	open.requested = StreamTelemetry::now();
+	int tiles = 0;
+	if (evicted)
+	{
+		open.tailLevel = res.tailLevel;
+		const int tailMips = mipmapCount(min(_maxSize, res.source.size));
+		for (int i=0;i<tailMips;++i) res.tilesLeft[res.tailLevel+i] += 1;
+		tiles += tailMips;
+	}
+	for (int level=min(res.baseLevel, res.tailLevel)-1;level>=baseLevel;--level)
+	{
+		const int fileLevel = res.tailLevel-level;
+		const int rows = 1<<(fileLevel-1);
+		open.fileLevels.push_back(fileLevel);
+		res.tilesLeft[level] += 2*rows*rows;
+		tiles += 2*rows*rows;
+	}
+	_tilesLeft[handle] += tiles;
+	queueTiles(std::move(open));
+
+	res.baseLevel = baseLevel;
+	res.minLevel = baseLevel;
+	updateMinLevel(handle, res);
+}
+
+void DDSStreamer::updateMinLevel(const Handle handle, Residency &res)
+{
+	// Sampled levels must all be uploaded, from the coarsest
+	int minLevel = res.baseLevel;
+	bool resident = true;
+	for (int level=res.levels-1;level>=res.baseLevel;--level)
+	{
+		if (res.tilesLeft[level] > 0)
+		{
+			minLevel = min(level+1, res.levels-1);
+			resident = level < res.levels-1;
+			break;
+		}
+	}
+
+	// Uploads are done before later draws, no need to wait for fences
+	StreamTexture &tex = _texs[handle];
+	if (resident && tex.getResidentLevel() == -1)
+	{
+		_telemetry.setResident(handle, StreamTelemetry::now());
+	}
+	tex.setResidentLevel(resident?minLevel-res.baseLevel:-1);
+
+	if (minLevel == res.minLevel) return;
+	res.minLevel = minLevel;
+	_backend->setBaseLevel(_texs[handle].getTextureId(), minLevel-res.baseLevel);
+}
+
+void DDSStreamer::updateResidency()
+{
+	if (_budget == 0) return;
+
+	struct Candidate
+	{
+		Handle handle;
+		Residency *res;
+		float priority;
+	};
+	vector<Candidate> hidden;
+	vector<Candidate> visible;
+	for (auto &p : _residency)
+	{
+		auto it = _priorities.find(p.first);
+		float priority = (it == _priorities.end())?
+			numeric_limits<float>::infinity():it->second;
+		// Hinted textures are needed soon, warmed up ones are dropped last
+		auto hint = _prefetches.find(p.first);
+		if (hint != _prefetches.end())
+		{
+			if (!hint->second.background) priority = max(priority, hint->second.priority);
+			else p.second.lastVisible = _updateCount;
+		}
+		if (priority > 0.0)
+		{
+			p.second.lastVisible = _updateCount;
+			visible.push_back({p.first, &p.second, priority});
+		}
+		else
+		{
+			hidden.push_back({p.first, &p.second, priority});
+		}
+	}
+	// Least recently visible first
+	sort(hidden.begin(), hidden.end(), [](const Candidate &a, const Candidate &b)
+	{
+		if (a.res->lastVisible != b.res->lastVisible)
+			return a.res->lastVisible < b.res->lastVisible;
+		return a.handle < b.handle;
+	});
+	// Least important first
+	sort(visible.begin(), visible.end(), [](const Candidate &a, const Candidate &b)
+	{
+		if (a.priority != b.priority) return a.priority < b.priority;
+		return a.handle < b.handle;
+	});
+
+	auto storage = [](const Residency &res, const int baseLevel)
+	{
+		return getStorageSize(res.format, res.width, baseLevel, res.levels);
+	};
+	size_t used = getResidentSize();
+	// Drops top levels of a texture, as few as needed to get to a size
+	auto dropLevels = [&](const Candidate &c, const size_t target)
+	{
+		Residency &res = *c.res;
+		if (used <= target || res.baseLevel >= res.tailLevel) return;
+		const size_t size = storage(res, res.baseLevel);
+		int level = res.baseLevel+1;
+		while (level < res.tailLevel && used-size+storage(res, level) > target) ++level;
+		// Levels left are copied before the old storage is deleted
+		if (used <= _budget && used+storage(res, level) > _budget) return;
+		used = used-size+storage(res, level);
+		shrinkTex(c.handle, res, level);
+	};
+	// Top levels of hidden textures, then whole hidden textures, then top
+	// levels of visible textures less important than a priority
+	auto fit = [&](const size_t target, const float priority)
+	{
+		for (const Candidate &c : hidden) dropLevels(c, target);
+		for (const Candidate &c : hidden)
+		{
+			if (used <= target) break;
+			if (c.res->baseLevel >= c.res->levels) continue;
+			used -= storage(*c.res, c.res->baseLevel);
+			shrinkTex(c.handle, *c.res, c.res->levels);
+		}
+		for (const Candidate &c : visible)
+		{
+			if (c.priority < priority) dropLevels(c, target);
+		}
+	};
+
+	const size_t before = used;
+	fit(_budget, numeric_limits<float>::max());
+	// Don't grow back what was just dropped
+	if (used < before) return;
+
+	// Most important visible texture that needs a level more, one per update
+	for (auto c=visible.rbegin();c!=visible.rend();++c)
+	{
+		Residency &res = *c->res;
+		// After loading work and dropped tiles still loading
+		if (res.baseLevel == 0 || res.staleTiles > 0 || _tilesLeft.count(c->handle))
+			continue;
+		const int level = (res.baseLevel >= res.levels)?res.tailLevel:res.baseLevel-1;
+		// Levels with more texels than a few per pixel aren't needed
+		if (level < res.tailLevel && c->priority*texelsPerPixel < (res.width>>level))
+			continue;
+		// Old storage is copied to the new one before it is deleted
+		const size_t growth = storage(res, level);
+		if (growth > _budget) continue;
+
+		// Room can be made by dropping less important textures
+		size_t reclaimable = 0;
+		for (const Candidate &h : hidden) reclaimable += storage(*h.res, h.res->baseLevel);
+		for (const Candidate &v : visible)
+		{
+			if (v.priority >= c->priority || v.res->baseLevel >= v.res->tailLevel) continue;
+			reclaimable += storage(*v.res, v.res->baseLevel)-storage(*v.res, v.res->tailLevel);
+		}
+		if (used+growth > _budget+reclaimable) continue;
+		if (used+growth > _budget) fit(_budget-growth, c->priority);
+		if (used+growth > _budget) continue;
+
+		growTex(c->handle, res, level);
+		return;
+	}
 }
 
 void DDSStreamer::update()
 {
 	if (!_asynchronous) return;
+	_updateCount += 1;
+
+	// Textures and tiles opened by loading threads
+	vector<CreateData> created;
+	vector<OpenData> opened;
+	for (auto &output : _workerOutputs)
+	{
+		lock_guard<mutex> lk(output->mtx);
+		created.insert(created.end(), make_move_iterator(output->created.begin()),
+			make_move_iterator(output->created.end()));
+		output->created.clear();
+		opened.insert(opened.end(), make_move_iterator(output->opened.begin()),
+			make_move_iterator(output->opened.end()));
+		output->opened.clear();
+	}
+	exception_ptr openError;
+	for (CreateData &data : created)
+	{
+		// Deleted before it was opened
+		if (!_creating.erase(data.info.handle)) continue;
+		if (data.error) openError = data.error;
+		else if (data.source.levels > 0) addTex(data);
+	}
+	for (OpenData &data : opened)
+	{
+		if (data.error) openError = data.error;
+		else addOpenedTiles(data);
+	}
+	// Missing tiles throw as in synchronous mode, once other textures are added
+	if (openError) rethrow_exception(openError);
+
+	// Prefetch hints get more urgent as their deadline gets close
+	const auto now = chrono::steady_clock::now();
+	for (auto &p : _prefetches)
+	{
+		Prefetch &hint = p.second;
+		if (hint.background) continue;
+		const float remaining = chrono::duration<float>(hint.deadline-now).count();
+		const float t = std::max(0.f, std::min(1.f, 1.f-remaining/prefetchUrgentTime));
+		hint.urgency = 1.f+(prefetchMaxUrgency-1.f)*t;
+	}
+
+	// Requested tiles of virtual textures, as many as their caches hold
+	map<pair<DDSLoader::Format, int>, int> cacheSlots;
+	for (const auto &p : _tileCaches) cacheSlots[p.first] = p.second.owners.size();
+	for (auto &p : _virtualTexs)
+	{
+		VirtualTexture &vt = p.second;
+		addTileJobs(p.first, vt, cacheSlots[vt.cacheKey]);
+		// Slots of requested tiles can't be replaced
+		TileCache &cache = _tileCaches[vt.cacheKey];
+		for (const auto &r : vt.resident)
+		{
+			if (vt.requested.count(r.first)) cache.lastUsed[r.second] = _updateCount;
+		}
+	}
+
 	// Invalidate deleted textures from pre-queue
 	auto isDeleted = [this](const LoadInfo &info)
 	{
@@ -284,38 +1280,78 @@ void DDSStreamer::update()
 		{
 			if (h == info.handle)
 			{
-				if (info.pageOffset != -1) 
-					releasePages(info.pageOffset, getPageSpan(info.imageSize));
+				// Never read by the GL, can be reused now
+				if (info.pageOffset != -1) _pages.free(info.pageOffset);
 				return true;
 			}
 		}
 		return false;
 	};
+	// Most important first, then coarser levels, then creation order
+	auto morePriority = [](const LoadInfo &a, const LoadInfo &b)
+	{
+		if (a.priority != b.priority) return a.priority > b.priority;
+		if (a.levelWidth != b.levelWidth) return a.levelWidth < b.levelWidth;
+		if (a.handle != b.handle) return a.handle < b.handle;
+		return a.tileId < b.tileId;
+	};
 	// Invalidate deleted textures from pre-queue
 	_loadInfoWaiting.erase(
 		remove_if(_loadInfoWaiting.begin(), _loadInfoWaiting.end(), isDeleted),
 		_loadInfoWaiting.end());
+	for (LoadInfo &info : _loadInfoWaiting) info.priority = getPriority(info);
 	{
 		// Invalidate deleted textures from currently processing queue
 		lock_guard<mutex> lk(_mtx);
 		_loadInfoQueue.erase(
 			remove_if(_loadInfoQueue.begin(), _loadInfoQueue.end(), isDeleted),
 			_loadInfoQueue.end());
+
+		// Cancel tiles that aren't needed anymore, their pages are still unused
+		for (LoadInfo &info : _loadInfoQueue)
+		{
+			info.priority = getPriority(info);
+			if (info.priority <= 0.0)
+			{
+				_pages.free(info.pageOffset);
+				info.pageOffset = -1;
+				_loadInfoWaiting.push_back(info);
+			}
+		}
+		_loadInfoQueue.erase(
+			remove_if(_loadInfoQueue.begin(), _loadInfoQueue.end(),
+				[](const LoadInfo &info){ return info.pageOffset == -1; }),
+			_loadInfoQueue.end());
+		sort(_loadInfoQueue.begin(), _loadInfoQueue.end(), morePriority);
 	}
 
-	// Get fence state
-	auto fencesSignaled = areFencesSignaled();
-	// Mark textures as complete if fences are signaled
-	setTexturesAsComplete(fencesSignaled);
+	// Virtual tiles not requested anymore wait for the next request
+	_loadInfoWaiting.erase(
+		remove_if(_loadInfoWaiting.begin(), _loadInfoWaiting.end(),
+			[this](const LoadInfo &info)
+			{
+				if (!info.virtualTile || info.priority > 0.0) return false;
+				auto it = _virtualTexs.find(info.handle);
+				if (it != _virtualTexs.end()) it->second.pending.erase(info.tileId);
+				return true;
+			}),
+		_loadInfoWaiting.end());
+
+	// Free pages and mark textures as complete if fences are signaled
+	retirePages();
 
-	// Assign offsets
+	// Keep stream textures in the memory budget
+	updateResidency();
+
+	// Assign offsets by priority
+	sort(_loadInfoWaiting.begin(), _loadInfoWaiting.end(), morePriority);
 	std::vector<LoadInfo> assigned;
 	std::vector<LoadInfo> nonAssigned;
 
 	for_each(_loadInfoWaiting.begin(), _loadInfoWaiting.end(), 
-		[&assigned, &nonAssigned, &fencesSignaled, this](const LoadInfo &info) {
-			const int pages = getPageSpan(info.imageSize);
-			const int pageOffset = acquirePages(pages, fencesSignaled);
+		[&assigned, &nonAssigned, this](const LoadInfo &info) {
+			const int pageOffset = (info.priority > 0.0)?
+				acquirePages(getPageSpan(info.imageSize)):-1;
 			if (pageOffset == -1)
 			{
 				nonAssigned.push_back(info);
@@ -324,158 +1360,294 @@ void DDSStreamer::update()
 			{
 				LoadInfo s = info;
 				s.pageOffset = pageOffset;
+				s.times.assigned = StreamTelemetry::now();
+				s.asyncRead = _asyncReads &&
+					s.loader.getFileRange(s.fileLevel).fd != -1;
+				// Disk reads start before the loading thread gets to the tile
+				if (!s.asyncRead) s.loader.prefetch(s.fileLevel);
 				assigned.push_back(s);
-				_tileRanges[make_pair(info.handle, info.tileId)] = 
-					make_pair(pageOffset, pages);
 			}
 		});
 
+	size_t queuedTiles = 0;
 	{
 		lock_guard<mutex> lk(_mtx);
-		// Submit created textures
+		// The read thread may have stopped since tiles were assigned
+		if (!_asyncReads)
+		{
+			for (LoadInfo &info : assigned) info.asyncRead = false;
+		}
+		// Submit created textures, loading threads take the front first
+		const size_t queued = _loadInfoQueue.size();
 		_loadInfoQueue.insert(
 			_loadInfoQueue.end(),
 			assigned.begin(),
 			assigned.end());
+		inplace_merge(_loadInfoQueue.begin(), _loadInfoQueue.begin()+queued,
+			_loadInfoQueue.end(), morePriority);
+		queuedTiles = _loadInfoQueue.size();
 	}
 
-	_cond.notify_one();
+	// The read thread and loading threads don't take the same tiles
+	if (assigned.size() == 1 && !_asyncReads) _cond.notify_one();
+	else if (!assigned.empty()) _cond.notify_all();
 	_loadInfoWaiting = nonAssigned;
 	_texDeleted.clear();
 
 	// Get loaded tiles
-	const int maxCost = 20000000;
-	vector<LoadData> data;
+	exception_ptr loadError;
+	for (auto &output : _workerOutputs)
 	{
-		lock_guard<mutex> lk(_dataMtx);
-		if (!_loadData.empty())
-		{
-			// Always accept first element
-			auto first = _loadData.begin();
-			data.push_back(*first);
-			int currentCost = getCost(*first);
-			_loadData.erase(first);
-			// Choose next elements with cost
-			_loadData.erase(std::remove_if(_loadData.begin(), _loadData.end(), [&](LoadData &d){
-				currentCost += getCost(d);
-				if (currentCost < maxCost)
-				{
-					data.push_back(d);
-					return true;
-				}
-				return false;
-			}), _loadData.end());
-		}
+		lock_guard<mutex> lk(output->mtx);
+		_loadData.insert(_loadData.end(), output->data.begin(), output->data.end());
+		output->data.clear();
+		if (output->error) loadError = output->error;
+		output->error = nullptr;
 	}
+	// Unreadable tiles throw as in synchronous mode
+	if (loadError) rethrow_exception(loadError);
+
+	// GPU times of earlier uploads, available in submission order
+	double gpuTime = -1.0;
+	while (!_uploadTimers.empty() &&
+		_backend->getTimer(_uploadTimers.front().first, gpuTime))
+	{
+		_uploadBudget.addGpuTime(_uploadTimers.front().second, gpuTime);
+		_uploadTimers.pop_front();
+	}
+	// Don't pile up timers that never become available
+	while (_uploadTimers.size() > maxUploadTimers)
+	{
+		_backend->deleteTimer(_uploadTimers.front().first);
+		_uploadTimers.pop_front();
+	}
+
+	// Oldest tiles first, as many as fit in the budget
+	UploadBudget::Batch batch;
+	vector<LoadData> data;
+	_loadData.erase(std::remove_if(_loadData.begin(), _loadData.end(), [&](LoadData &d){
+		if (!_catchUp && !_uploadBudget.fits(batch, d.format, d.imageSize)) return false;
+		_uploadBudget.add(batch, d.format, d.imageSize);
+		data.push_back(d);
+		return true;
+	}), _loadData.end());
+
 	// Update
-	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbo);
+	const auto uploadStart = chrono::steady_clock::now();
+	const UploadBackend::TimerId timer = data.empty()?0:_backend->beginTimer();
+	_backend->beginUploads();
 	for (LoadData d : data)
 	{
 		updateTile(d);
 	}
-	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
-}
+	_backend->endUploads();
+	if (timer)
+	{
+		_backend->endTimer(timer);
+		_uploadTimers.emplace_back(timer, batch);
+	}
+	const double uploadTime = data.empty()?0.0:
+		chrono::duration<double>(chrono::steady_clock::now()-uploadStart).count();
+	_uploadBudget.addCpuTime(batch, uploadTime);
 
-void DDSStreamer::setTexturesAsComplete(const vector<bool> &fencesSignaled)
-{
-	for (auto p : _tileUpdated)
+	// Indirection textures, after tiles they point to
+	for (auto &p : _virtualTexs)
 	{
-		if (!_texs[p.first].isComplete())
+		VirtualTexture &vt = p.second;
+		for (int level=1;level<=vt.maxLevel;++level)
 		{
-			// Get if all tiles have been set in the process of updating
-			if (all_of(p.second.begin(), p.second.end(), [](bool b){return b;}))
-			{
-				// Get if all fences have been signaled
-				bool signaled = true;
-				for (int i=0;(i<(int)p.second.size()) && signaled;++i)
-				{
-					auto range = _tileRanges[make_pair(p.first, i)];
-					for (int j=range.first; j<range.second && signaled; ++j)
-					{
-						if (!fencesSignaled[j]) signaled = false;
-					}
-				}
-				if (signaled)
-				{
-					_texs[p.first].setComplete();
-					for (int i=0;i<(int)p.second.size();++i)
-					{
-						_tileRanges.erase(make_pair(p.first, i));
-					}
-				}
-			}
+			if (!vt.dirty[level-1]) continue;
+			_backend->uploadIndirection(vt.indirection, vt.maxLevel-level,
+				1<<level, 1<<(level-1), vt.entries[level-1].data());
+			vt.dirty[level-1] = false;
 		}
 	}
-}
 
-int DDSStreamer::getCost(const LoadData &data)
-{
-	const int overheadCost = 2000;
-	return overheadCost + data.imageSize;
+	StreamTelemetry::Sample sample{};
+	sample.time = StreamTelemetry::now();
+	sample.waiting = _loadInfoWaiting.size();
+	sample.queued = queuedTiles;
+	sample.loaded = _loadData.size();
+	sample.usedPages = _numPages-_pages.getFreePages();
+	sample.totalPages = _numPages;
+	sample.uploadedTiles = _uploadedTiles;
+	sample.uploadedBytes = _uploadedBytes;
+	sample.residentSize = getResidentSize();
+	sample.uploadCpuTime = uploadTime;
+	sample.uploadGpuTime = gpuTime;
+	_telemetry.addSample(sample);
+	_uploadedTiles = 0;
+	_uploadedBytes = 0;
 }
 
 void DDSStreamer::updateTile(const LoadData &d)
 {
-#ifndef USE_COHERENT_MAPPING
-	glFlushMappedNamedBufferRange(_pbo, d.pageOffset*_pageSize, d.imageSize);
-#endif
+	_backend->flushBuffer(d.pageOffset*_pageSize, d.imageSize);
+	if (d.virtualTile)
+	{
+		updateVirtualTile(d);
+		releasePages(d.pageOffset);
+		return;
+	}
+	auto res = _residency.find(d.handle);
+	if (res != _residency.end() && d.level < res->second.baseLevel)
+	{
+		// Level dropped while the tile was loading
+		res->second.staleTiles -= 1;
+		releasePages(d.pageOffset);
+		return;
+	}
 	auto it = _texs.find(d.handle);
 	if (it != _texs.end())
 	{
 		auto &tex = it->second;
-		glCompressedTextureSubImage2D(tex.getTextureId(),
-			d.level,
+		const int baseLevel = (res != _residency.end())?res->second.baseLevel:0;
+		_backend->uploadTile(tex.getTextureId(),
+			d.level-baseLevel,
 			d.offsetX,
 			d.offsetY,
 			d.width,
 			d.height,
 			d.format,
 			d.imageSize,
-			(void*)(intptr_t)(d.pageOffset*_pageSize));
+			d.pageOffset*_pageSize);
+		recordTile(d);
 
-		_tileUpdated[d.handle][d.tileId] = true;
+		releasePages(d.pageOffset, d.handle);
+		if (res != _residency.end())
+		{
+			res->second.tilesLeft[d.level] -= 1;
+			updateMinLevel(d.handle, res->second);
+		}
+	}
+	else
+	{
+		releasePages(d.pageOffset);
 	}
-	releasePages(d.pageOffset, getPageSpan(d.imageSize));
 }
 
-int DDSStreamer::acquirePages(int pages, const vector<bool> &fencesAvailable)
+void DDSStreamer::recordTile(const LoadData &d)
 {
-	if (pages > (int)_numPages)
-	{
-		throw runtime_error("Not enough pages");
-	}
+	StreamTelemetry::Tile tile{};
+	tile.handle = d.handle;
+	tile.level = d.level;
+	tile.tileId = d.tileId;
+	tile.size = d.imageSize;
+	tile.virtualTile = d.virtualTile;
+	tile.times = d.times;
+	tile.uploaded = StreamTelemetry::now();
+	_telemetry.addTile(tile);
+	_uploadedTiles += 1;
+	_uploadedBytes += d.imageSize;
+}
 
-	int start = 0;
-	for (int i=0;i<(int)_usedPages.size();++i)
+void DDSStreamer::updateVirtualTile(const LoadData &d)
+{
+	auto it = _virtualTexs.find(d.handle);
+	if (it == _virtualTexs.end()) return;
+	VirtualTexture &vt = it->second;
+	vt.pending.erase(d.tileId);
+
+	// Free slot or least recently requested one
+	TileCache &cache = _tileCaches[vt.cacheKey];
+	int slot = -1;
+	for (int i=0;i<(int)cache.owners.size();++i)
 	{
-		if (_usedPages[i] || !fencesAvailable[i])
+		if (cache.owners[i].first == 0)
 		{
-			start = i+1;
+			slot = i;
+			break;
 		}
-		else
+		if (cache.lastUsed[i] < _updateCount &&
+			(slot == -1 || cache.lastUsed[i] < cache.lastUsed[slot])) slot = i;
+	}
+	// All tiles in the cache are needed, try again at next request
+	if (slot == -1) return;
+
+	const pair<Handle, uint32_t> owner = cache.owners[slot];
+	auto evicted = _virtualTexs.find(owner.first);
+	if (evicted != _virtualTexs.end())
+	{
+		evicted->second.resident.erase(owner.second);
+		updateIndirection(evicted->second, owner.second>>26,
+			owner.second&0x1FFF, (owner.second>>13)&0x1FFF);
+	}
+
+	_backend->uploadTile(cache.tex, 0,
+		(slot%_cacheTiles)*vt.tileSize,
+		(slot/_cacheTiles)*vt.tileSize,
+		d.width,
+		d.height,
+		d.format,
+		d.imageSize,
+		d.pageOffset*_pageSize);
+	recordTile(d);
+
+	cache.owners[slot] = make_pair(d.handle, (uint32_t)d.tileId);
+	// Tiles no longer requested don't keep the slot from requested ones
+	cache.lastUsed[slot] = vt.requested.count(d.tileId)?_updateCount:_updateCount-1;
+	vt.resident[d.tileId] = slot;
+	updateIndirection(vt, d.level, d.tileId&0x1FFF, (d.tileId>>13)&0x1FFF);
+}
+
+void DDSStreamer::updateIndirection(VirtualTexture &vt, const int level,
+	const int x, const int y)
+{
+	uint32_t entry = 0;
+	auto r = vt.resident.find(getTileKey(level, x, y));
+	if (r != vt.resident.end())
+	{
+		entry = (r->second%_cacheTiles) | ((r->second/_cacheTiles)<<8) | (level<<16);
+	}
+	else if (level > 1)
+	{
+		// Same as the tile above
+		entry = vt.entries[level-2][(y/2)*(1<<(level-1)) + x/2];
+	}
+	vt.entries[level-1][y*(1<<level) + x] = entry;
+	vt.dirty[level-1] = true;
+
+	if (level == vt.maxLevel) return;
+	for (int cy=2*y;cy<2*y+2;++cy)
+	{
+		for (int cx=2*x;cx<2*x+2;++cx)
 		{
-			if (i-start+1 == pages)
-			{
-				for (int j=start;j<start+pages;++j)
-				{
-					_usedPages[j] = true;
-				}
-				return start;
-			}
+			// Loaded tiles keep pointing to themselves
+			if (!vt.resident.count(getTileKey(level+1, cx, cy)))
+				updateIndirection(vt, level+1, cx, cy);
 		}
 	}
-	return -1;
 }
-void DDSStreamer::releasePages(int pageStart, int pages)
+
+int DDSStreamer::acquirePages(int pages)
 {
-	for (int i=pageStart;i<pageStart+pages;++i)
+	if (pages > _pages.getMaxPages())
 	{
-		_pageFences[i].lock();
-		_usedPages[i] = false;
+		throw runtime_error("Not enough pages");
 	}
+	return _pages.allocate(pages);
+}
+
+void DDSStreamer::releasePages(int pageOffset, Handle handle)
+{
+	ReleasedPages r{};
+	r.fence = _backend->insertFence();
+	r.pageOffset = pageOffset;
+	r.handle = handle;
+	_releasedPages.push_back(std::move(r));
 }
 
 DDSStreamer::LoadData DDSStreamer::load(const LoadInfo &info)
+{
+	LoadData s = getLoadData(info);
+	// Already set if an asynchronous read failed before
+	if (s.times.loadStart < 0.0) s.times.loadStart = StreamTelemetry::now();
+	info.loader.writeImageData(info.fileLevel, (char*)_pboPtr+info.pageOffset*_pageSize);
+	s.times.loadEnd = StreamTelemetry::now();
+	return s;
+}
+
+DDSStreamer::LoadData DDSStreamer::getLoadData(const LoadInfo &info) const
 {
 	LoadData s{};
 	int level = info.fileLevel;
@@ -486,13 +1658,12 @@ DDSStreamer::LoadData DDSStreamer::load(const LoadInfo &info)
 	s.offsetY = info.offsetY;
 	s.width = info.loader.getWidth(level);
 	s.height = info.loader.getHeight(level);
-	s.format  = DDSFormatToGL(info.loader.getFormat());
+	s.format  = info.loader.getFormat();
 	s.imageSize = info.imageSize;
 	s.pageOffset = pageOffset;
 	s.tileId = info.tileId;
-
-	info.loader.writeImageData(level, (char*)_pboPtr+pageOffset*_pageSize);
-
+	s.virtualTile = info.virtualTile;
+	s.times = info.times;
 	return s;
 }
 
@@ -504,37 +1675,56 @@ DDSStreamer::Handle DDSStreamer::genHandle()
 	return h;
 }
 
-StreamTexture::StreamTexture(GLuint id) :
-	_texId{id}
+StreamTexture::StreamTexture(UploadBackend *backend, UploadBackend::TexId id,
+	size_t size) :
+	_backend{backend},
+	_texId{id},
+	_size{size}
 {
 
 }
 
 StreamTexture::StreamTexture(StreamTexture &&tex) : 
-	_texId{tex._texId}
+	_backend{tex._backend},
+	_texId{tex._texId},
+	_complete{tex._complete},
+	_residentLevel{tex._residentLevel},
+	_size{tex._size}
 {
 	tex._texId = 0;
+	tex._size = 0;
 }
 
 StreamTexture &StreamTexture::operator=(StreamTexture &&tex)
 {
-	if (_texId && tex._texId != _texId) glDeleteTextures(1, &_texId);
+	if (_texId && tex._texId != _texId) _backend->deleteTexture(_texId);
+	_backend = tex._backend;
 	_texId = tex._texId;
+	_complete = tex._complete;
+	_residentLevel = tex._residentLevel;
+	_size = tex._size;
 	tex._texId = 0;
+	tex._size = 0;
 	return *this;
 }
 
 StreamTexture::~StreamTexture()
 {
-	if (_texId) glDeleteTextures(1, &_texId);
+	if (_texId) _backend->deleteTexture(_texId);
 }
 
 void StreamTexture::setComplete()
 {
 	_complete = true;
+	_residentLevel = 0;
+}
+
+void StreamTexture::setResidentLevel(const int level)
+{
+	_residentLevel = level;
 }
 
-GLuint StreamTexture::getTextureId(GLuint def) const
+UploadBackend::TexId StreamTexture::getTextureId(UploadBackend::TexId def) const
 {
 	if (_texId) return _texId;
 	return def;
@@ -545,8 +1735,24 @@ bool StreamTexture::isComplete() const
 	return _complete;
 }
 
-GLuint StreamTexture::getCompleteTextureId(GLuint def) const
+UploadBackend::TexId StreamTexture::getCompleteTextureId(UploadBackend::TexId def) const
 {
 	if (isComplete()) return getTextureId(def);
 	return def;
+}
+
+int StreamTexture::getResidentLevel() const
+{
+	return _residentLevel;
+}
+
+UploadBackend::TexId StreamTexture::getResidentTextureId(UploadBackend::TexId def) const
+{
+	if (_residentLevel >= 0) return getTextureId(def);
+	return def;
+}
+
+size_t StreamTexture::getSize() const
+{
+	return _size;
 }
\ No newline at end of file
@@ -6,11 +6,21 @@
 #include <mutex>
 #include <condition_variable>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <exception>
+#include <atomic>
 
 #include "ddsloader.hpp"
-#include "graphics_api.hpp"
-#include "fence.hpp"
-#include "gl_util.hpp"
+#include "upload_backend.hpp"
+#include "page_allocator.hpp"
+#include "tile_archive.hpp"
+#include "async_reader.hpp"
+#include "stream_telemetry.hpp"
+#include "upload_budget.hpp"
 
 /**
  * Texture streamed from the DDSStreamer class
@@ -20,9 +30,11 @@ class StreamTexture
 public:
 	StreamTexture() = default;
 	/** 
-	 * @param id GL texture id
+	 * @param backend backend the texture was created with, to delete it
+	 * @param id texture id
+	 * @param size size in bytes of the texture storage
 	 */
-	StreamTexture(GLuint id);
+	StreamTexture(UploadBackend *backend, UploadBackend::TexId id, size_t size=0);
 	StreamTexture(const StreamTexture &) = delete;
 	StreamTexture &operator=(const StreamTexture &) = delete;
 	StreamTexture(StreamTexture &&tex);
@@ -30,41 +42,84 @@ public:
 	~StreamTexture();
 
 	/**
-	 * Set to be usable in rendering
+	 * Set to be usable in rendering, with all its levels
 	 */
 	void setComplete();
 	/**
-	 * Returns the GL texture id\n
-	 * WARNING: returns the GL texture id even if the texture isn't complete
+	 * Sets the finest level that is fully uploaded, along with all coarser
+	 * levels, and that sampling starts at
+	 * @param level level from the first level in storage, -1 if none
+	 */
+	void setResidentLevel(int level);
+	/**
+	 * Returns the texture id\n
+	 * WARNING: returns the texture id even if the texture isn't complete
 	 * @param def default value to return if the texture does not exist
-	 * @return GL texture id
+	 * @return texture id (GL texture name with UploadBackendGL)
 	 */
-	GLuint getTextureId(GLuint def=0) const;
+	UploadBackend::TexId getTextureId(UploadBackend::TexId def=0) const;
 	/**
 	 * Indicates whether the texture is usable for rendering
 	 */
 	bool isComplete() const;
 	/**
-	 * Returns the texture GL id if it is usable for rendering
+	 * Returns the texture id if it is usable for rendering
 	 * @param def default value to return if the texture does not exist or
 	 * it is incomplete
-	 * @return GL texture id
+	 * @return texture id
+	 */
+	UploadBackend::TexId getCompleteTextureId(UploadBackend::TexId def=0) const;
+	/**
+	 * Returns the finest level that can be sampled, from the first level in
+	 * storage, -1 if no level is fully uploaded yet
+	 */
+	int getResidentLevel() const;
+	/**
+	 * Returns the texture id as soon as its coarsest levels are uploaded, the
+	 * finer ones aren't sampled until they are
+	 * @param def default value to return if the texture does not exist or
+	 * no level is fully uploaded yet
+	 * @return texture id
+	 */
+	UploadBackend::TexId getResidentTextureId(UploadBackend::TexId def=0) const;
+	/**
+	 * Returns the size in bytes of the texture storage, 0 if the texture
+	 * does not exist
 	 */
-	GLuint getCompleteTextureId(GLuint def=0) const;
+	size_t getSize() const;
 
 private:
-	/// GL texture id
-	GLuint _texId = 0;
+	/// Backend to delete the texture with
+	UploadBackend *_backend = nullptr;
+	/// Texture id
+	UploadBackend::TexId _texId = 0;
 	/// Usable texture
 	bool _complete = false;
+	/// Finest level that can be sampled, -1 if none
+	int _residentLevel = -1;
+	/// Size in bytes of the storage
+	size_t _size = 0;
 };
 
 /**
  * Asynchronously streams textures from file system to GL
  *
- * Keeps a large GL buffer of several pages of a given size which are assigned
+ * Keeps a large buffer of several pages of a given size which are assigned
  * to streaming texture data and then freed after the corresponding texture is
- * updated.
+ * updated. The buffer, textures and fences come from an upload backend (see
+ * UploadBackend), so that scheduling, paging and cancellation don't depend
+ * on a GL context.
+ *
+ * Virtual textures only keep their mip tail in their own texture. Tiles of
+ * other levels are loaded when a feedback pass requests them, into a tile
+ * cache shared by all virtual textures of the same format, and an indirection
+ * texture tells shaders where the finest loaded tile of each area is.
+ *
+ * With a memory budget, storage of textures that aren't virtual shrinks when
+ * stream textures take more than the budget: top levels of textures that
+ * weren't visible for the longest time go first, then these textures as a
+ * whole, then top levels of the least important visible textures. Visible
+ * textures grow back one level at a time when the budget allows it.
  */
 class DDSStreamer
 {
@@ -74,23 +129,42 @@ public:
 
 	DDSStreamer() = default;
 	/**
+	 * @param backend graphics API uploads go through, owned by the streamer
 	 * @param asynchronous If set, textures won't be immediately complete after
 	 * createTexture() returns
 	 * @param anisotropy Available anisotropy
 	 * @param pageSize Size of a page in bytes
 	 * @param numPages Number of pages in the buffer
 	 * @param maxSize maximum texture width/height to load
+	 * @param memoryMapped if set, tile files are memory mapped instead of read
+	 * through streams (see DDSLoader)
+	 * @param workers number of loading threads in asynchronous mode, tiles of
+	 * archives are read by an extra thread instead if not memory mapped and
+	 * asynchronous reads are supported (see AsyncReader)
+	 * @param cacheTiles number of tiles per side of virtual texture caches,
+	 * 0 to disable virtual textures
+	 * @param budget memory budget in bytes of stream textures and tile caches
+	 * in asynchronous mode, 0 for none
 	 */
-	void init(bool asynchronous, int pageSize, int numPages, int maxSize=0);
+	void init(std::unique_ptr<UploadBackend> backend, bool asynchronous,
+		int pageSize, int numPages, int maxSize=0,
+		bool memoryMapped=false, int workers=1, int cacheTiles=0, size_t budget=0);
 	~DDSStreamer();
 
 	/**
 	 * Creates a stream texture, setups streaming of its data and returns its 
-	 * matching handle
+	 * matching handle\n
+	 * In asynchronous mode, the handle is returned immediately: tiles are
+	 * opened by loading threads and the texture exists from the update() call
+	 * after that, getTex() returns an inexistent texture until then (or
+	 * forever if it can't be opened)
 	 * @param filename filename to load the texture from
-	 * @return handle of newly created texture
+	 * @param virtualTexture if set, create a virtual texture (only in
+	 * asynchronous mode with tile caches, and if there are tiles)
+	 * @return handle of newly created texture, 0 if it can't be opened in
+	 * synchronous mode
 	 */
-	Handle createTex(const std::string &filename);
+	Handle createTex(const std::string &filename, bool virtualTexture=false);
 	/**
 	 * Returns a stream texture from its matching handle created with createTex()
 	 * @param handle handle of texture to return
@@ -103,6 +177,95 @@ public:
 	 */
 	void deleteTex(Handle handle);
 
+	/**
+	 * Sets how important a texture is, its tiles are loaded in order of
+	 * priority. Textures without priority come first at all levels
+	 * @param handle handle of texture
+	 * @param priority radius in pixels of what the texture is applied on,
+	 * 0 if not visible (only its mip tail is loaded then)
+	 */
+	void setPriority(Handle handle, float priority);
+	/**
+	 * Hints that a texture will soon be needed, its tiles are loaded as if it
+	 * had at least a priority, and sooner as the deadline gets close. Holds
+	 * until replaced, cancelled or the texture is deleted
+	 * @param handle handle of texture
+	 * @param priority expected priority when needed (see setPriority()), 0 to
+	 * cancel the hint
+	 * @param deadline seconds until the texture is needed, negative if not
+	 * known: only levels needed at that priority are loaded then, after the
+	 * tiles of visible textures
+	 */
+	void prefetch(Handle handle, float priority, float deadline=-1.0);
+
+	/**
+	 * Returns the size in bytes of the storage of all stream textures and
+	 * tile caches, what the memory budget applies to
+	 */
+	size_t getResidentSize() const;
+
+	/**
+	 * Sets the time update() spends uploading tiles, on each of the CPU and
+	 * GPU (see UploadBudget)
+	 * @param milliseconds time budget, 0 for one tile per update
+	 */
+	void setUploadBudget(double milliseconds);
+	/**
+	 * Uploads all loaded tiles at each update() instead of keeping to the
+	 * upload budget, for when frame time doesn't matter
+	 * @param catchUp whether to catch up
+	 */
+	void setCatchUp(bool catchUp);
+
+	/**
+	 * Returns what was recorded about tiles, textures and the streamer state:
+	 * tile latencies at each stage, throughput, queue depths, page occupancy
+	 * and time until textures are complete
+	 */
+	const StreamTelemetry &getTelemetry() const;
+
+	/// Where shaders find the tiles of a virtual texture
+	struct VirtualTexInfo
+	{
+		/// Indirection texture (RGBA8UI), mip 0 for the finest level: each
+		/// texel has the cache slot (xy) and level (z) of the finest loaded tile
+		/// covering it, level 0 for the mip tail
+		UploadBackend::TexId indirection = 0;
+		/// Tile cache texture
+		UploadBackend::TexId cache = 0;
+		/// Finest level of tiles, 0 if the texture isn't virtual
+		int maxLevel = 0;
+		/// Width and height of tiles in texels
+		int tileSize = 0;
+		/// Number of tiles per side of the cache
+		int cacheTiles = 0;
+	};
+	/**
+	 * Returns how to sample a virtual texture
+	 * @param handle handle of texture
+	 * @return virtual texture info, with a maxLevel of 0 if not virtual
+	 */
+	VirtualTexInfo getVirtualTex(Handle handle) const;
+
+	/// Texture sample recorded by a feedback pass
+	struct FeedbackSample
+	{
+		/// Texture coordinates
+		float u, v;
+		/// Log2 of the width in pixels the whole texture covers around the sample
+		float log2Width;
+	};
+	/**
+	 * Sets the tiles of a virtual texture needed for rendering, replacing the
+	 * last request. Each sample requests the tile of the level with about one
+	 * texel per pixel and all tiles above it.
+	 * @param handle handle of virtual texture
+	 * @param samples samples from a feedback pass
+	 * @param uOffset offset added to the u coordinate of all samples
+	 */
+	void requestTiles(Handle handle, const std::vector<FeedbackSample> &samples,
+		float uOffset=0.0);
+
 	/**
 	 * Updates GL textures with streamed data
 	 */
@@ -127,8 +290,20 @@ private:
 		int imageSize;
 		/// Unique id for this tile of this level
 		int tileId;
+		/// Width of the whole texture at this level
+		int levelWidth;
+		/// Part of the mip tail, loaded even if not visible
+		bool tail;
+		/// Scheduling priority, re-evaluated at each update()
+		float priority = 0.0;
+		/// Tile of a virtual texture, tileId is its key
+		bool virtualTile = false;
 		/// Index of assigned page
 		int pageOffset = -1;
+		/// Read by the asynchronous read thread instead of a loading thread
+		bool asyncRead = false;
+		/// Stages the tile went through so far
+		StreamTelemetry::TileTimes times;
 	};
 
 	struct LoadData
@@ -146,50 +321,371 @@ private:
 		/// Height of tile
 		int height;
 		/// Format of incoming pixel data
-		GLenum format;
+		DDSLoader::Format format;
 		/// Size in bytes of incoming pixel data
 		int imageSize;
 		/// Index of assigned page
 		int pageOffset;
 		/// Unique id for this tile of this level
 		int tileId;
+		/// Tile of a virtual texture, tileId is its key
+		bool virtualTile;
+		/// Stages the tile went through before upload
+		StreamTelemetry::TileTimes times;
 	};
 
-	/** Returns an approximation of the time cost of a texture update 
-	 * @param info loading info
-	 * @return arbitrary cost for the texture update operation */
-	int getCost(const LoadData &data);
+	/**
+	 * Computes the priority of a tile from its texture's priority and level
+	 * @param info tile to load
+	 * @return priority, higher is loaded first, 0 is not loaded
+	 */
+	float getPriority(const LoadInfo &info) const;
 
 	int getPageSpan(int size);
 
-	std::vector<bool> areFencesSignaled();
+	/// Where the tiles of a texture are stored
+	struct TileSource
+	{
+		/// Texture folder
+		std::string filename;
+		// Tile filenames (see info.sn)
+		std::string prefix;
+		std::string separator;
+		std::string suffix;
+		bool rowColumnOrder = false;
+		/// Width and height of tiles in texels
+		int size = 0;
+		/// Number of levels to load, level0 included
+		int levels = 0;
+		/// Packed archive of all tiles if there is one, replaces the folder
+		std::shared_ptr<const TileArchive> archive;
+	};
 
-	void setTexturesAsComplete(const std::vector<bool> &fencesSignaled);
+	/**
+	 * Opens the tile archive of a texture if there is one (folder name
+	 * with a .tiles extension), its info.sn file otherwise
+	 * @param filename texture folder
+	 * @return tile source, 0 levels if neither can be opened
+	 */
+	TileSource openSource(const std::string &filename) const;
+	/**
+	 * Opens a tile of a texture
+	 * @param source texture tiles
+	 * @param level level folder (0 is the mip tail)
+	 * @param x column
+	 * @param y row
+	 */
+	DDSLoader openTile(const TileSource &source, int level, int x, int y) const;
+
+	/**
+	 * Frees pages the GL is done with, oldest first, and marks textures as
+	 * complete when all their tiles are
+	 * @param wait whether to wait on the oldest pages if the GL isn't done
+	 * with them yet
+	 */
+	void retirePages(bool wait=false);
 
 	/**
-	 * Acquires one or several free pages
-	 * @param size in bytes to acquire
-	 * @return index of first page acquired
+	 * Acquires contiguous free pages
+	 * @param pages number of pages to acquire
+	 * @return index of first page acquired, -1 if none are free
 	 */
-	int acquirePages(int pages, const std::vector<bool> &fencesAvailable);
+	int acquirePages(int pages);
 	/**
-	 * Releases one or several pages corresponding to buffer range
-	 * @param offset offset in bytes of buffer range
-	 * @param size size in bytes of buffer range
+	 * Releases pages once GL commands submitted so far are finished
+	 * @param pageOffset index of first page, as returned by acquirePages()
+	 * @param handle texture the pages were uploaded to, 0 if none
 	 */
-	void releasePages(int pageStart, int pages);
+	void releasePages(int pageOffset, Handle handle=0);
 	/**
 	 * Loads an image from disk
 	 * @param info input loading information
 	 * @return output loading data
 	 */
 	LoadData load(const LoadInfo &info);
+	/**
+	 * Fills output loading data without reading the image
+	 * @param info input loading information
+	 * @return output loading data
+	 */
+	LoadData getLoadData(const LoadInfo &info) const;
 
 	/**
 	 * Updates texture data
 	 * @param data data that has been loaded
 	 */
 	void updateTile(const LoadData &data);
+	/**
+	 * Records an uploaded tile in telemetry
+	 * @param data data that has been uploaded
+	 */
+	void recordTile(const LoadData &data);
+
+	/// Tile cache shared by virtual textures of the same format and tile size
+	struct TileCache
+	{
+		/// Texture of tileSize*cacheTiles texels per side
+		UploadBackend::TexId tex = 0;
+		/// Virtual texture and tile key in each slot, handle 0 if free
+		std::vector<std::pair<Handle, uint32_t>> owners;
+		/// Last update() each slot was requested in
+		std::vector<uint64_t> lastUsed;
+		/// Size in bytes of the texture
+		size_t size = 0;
+	};
+
+	/// Tiles of a virtual texture
+	struct VirtualTexture
+	{
+		/// Folder or archive of tiles
+		TileSource source;
+		/// Width and height of tiles in texels
+		int tileSize;
+		/// Finest level folder
+		int maxLevel;
+		/// Format and tile size, key of the tile cache
+		std::pair<DDSLoader::Format, int> cacheKey;
+		/// Indirection texture
+		UploadBackend::TexId indirection = 0;
+		/// Indirection texels of each level, level 1 first
+		std::vector<std::vector<uint32_t>> entries;
+		/// Levels of the indirection texture to upload
+		std::vector<bool> dirty;
+		/// Cache slot of each loaded tile, by tile key
+		std::unordered_map<uint32_t, int> resident;
+		/// Keys of tiles waiting for or being loaded
+		std::unordered_set<uint32_t> pending;
+		/// Keys of requested tiles, with their number of samples
+		std::unordered_map<uint32_t, int> requested;
+	};
+
+	/// Returns a key unique to a tile of a virtual texture
+	static uint32_t getTileKey(int level, int x, int y);
+	/**
+	 * Queues requested tiles that aren't loaded or loading to be opened,
+	 * coarser levels first, as long as the tiles fit in the cache
+	 * @param handle handle of virtual texture
+	 * @param vt virtual texture
+	 * @param slots cache slots left this update, decreased by requested tiles
+	 */
+	void addTileJobs(Handle handle, VirtualTexture &vt, int &slots);
+	/**
+	 * Puts a loaded tile in a cache slot, replacing the least recently
+	 * requested tile if the cache is full
+	 * @param data data that has been loaded
+	 */
+	void updateVirtualTile(const LoadData &data);
+	/**
+	 * Recomputes indirection texels of a tile and of tiles below it that
+	 * aren't loaded
+	 * @param vt virtual texture
+	 * @param level level of the tile
+	 * @param x column of the tile
+	 * @param y row of the tile
+	 */
+	void updateIndirection(VirtualTexture &vt, int level, int x, int y);
+
+	/// Storage of a texture that isn't virtual, for the memory budget
+	struct Residency
+	{
+		/// Folder or archive of tiles, to load dropped levels again
+		TileSource source;
+		/// Block compression format
+		DDSLoader::Format format;
+		/// Width of the whole texture
+		int width;
+		/// Number of levels of the whole texture
+		int levels;
+		/// First level of the mip tail
+		int tailLevel;
+		/// First level in storage, levels above it were dropped; levels if
+		/// the whole texture was
+		int baseLevel = 0;
+		/// Finest level that can be sampled (GL_TEXTURE_BASE_LEVEL), below
+		/// levels that grew back and aren't fully uploaded yet
+		int minLevel = 0;
+		/// Tiles of each level not uploaded yet
+		std::vector<int> tilesLeft;
+		/// Tiles of dropped levels that were loading, ignored when they arrive
+		int staleTiles = 0;
+		/// Last update() the texture was visible in
+		uint64_t lastVisible = 0;
+		/// Unique id for the next tile loaded again
+		int nextTileId = 0;
+	};
+
+	/// Texture waiting to be opened by a loading thread
+	struct CreateInfo
+	{
+		/// Handle returned by createTex()
+		Handle handle = 0;
+		/// Texture folder
+		std::string filename;
+		/// Virtual texture requested
+		bool virtualTexture = false;
+		/// When createTex() was called, for telemetry
+		double requested = -1.0;
+	};
+
+	/// Texture opened by a loading thread, waiting to be added by update()
+	struct CreateData
+	{
+		CreateInfo info;
+		/// Texture tiles, 0 levels if they can't be opened
+		TileSource source;
+		/// Format of the tail
+		DDSLoader::Format format = DDSLoader::Format::Undefined;
+		/// Width of the texture storage
+		int width = 0;
+		/// Virtual texture (see createTex())
+		bool isVirtual = false;
+		/// Loading work of all tiles in storage
+		std::vector<LoadInfo> jobs;
+		/// Unique id of the next tile
+		int nextTileId = 0;
+		/// Error thrown while opening, rethrown by update()
+		std::exception_ptr error;
+	};
+
+	/**
+	 * Opens the tiles of a texture and generates their loading work, without
+	 * touching the streamer state (called by loading threads)
+	 * @param info texture to open
+	 * @return opened texture, 0 levels in its source if it can't be opened
+	 */
+	CreateData openTex(const CreateInfo &info) const;
+	/**
+	 * Creates the storage of an opened texture and queues its loading work,
+	 * or loads it whole in synchronous mode
+	 * @param data opened texture, its loading work is moved
+	 */
+	void addTex(CreateData &data);
+
+	/// Tiles of an existing texture waiting to be opened by a loading thread
+	struct OpenInfo
+	{
+		/// Texture handle
+		Handle handle = 0;
+		/// Texture tiles
+		TileSource source;
+		/// Width of the whole texture
+		int width = 0;
+		/// Level of the texture the mip tail starts at, -1 if not needed
+		int tailLevel = -1;
+		/// Level folders to open whole (1 or more)
+		std::vector<int> fileLevels;
+		/// Keys of virtual texture tiles to open
+		std::vector<uint32_t> tiles;
+		/// When the tiles were needed, for telemetry
+		double requested = -1.0;
+	};
+
+	/// Tiles opened by a loading thread, waiting to be added by update()
+	struct OpenData
+	{
+		/// Texture handle
+		Handle handle = 0;
+		/// Loading work of the tiles, ids of non virtual tiles are set by
+		/// update()
+		std::vector<LoadInfo> jobs;
+		/// Error thrown while opening, rethrown by update()
+		std::exception_ptr error;
+	};
+
+	/**
+	 * Queues tiles of an existing texture to be opened by a loading thread
+	 * @param info tiles to open
+	 */
+	void queueTiles(OpenInfo info);
+	/**
+	 * Opens tiles of a texture and generates their loading work, without
+	 * touching the streamer state (called by loading threads)
+	 * @param info tiles to open
+	 * @return opened tiles
+	 */
+	OpenData openTiles(const OpenInfo &info) const;
+	/**
+	 * Queues the loading work of opened tiles still needed by their texture
+	 * @param data opened tiles, their loading work is moved
+	 */
+	void addOpenedTiles(OpenData &data);
+
+	/**
+	 * Adds loading work for the mip tail of a texture
+	 * @param handle handle of texture
+	 * @param source texture tiles
+	 * @param loader tail loader
+	 * @param firstLevel level of the texture the tail starts at
+	 * @param width width of the texture
+	 * @param tileId unique id of the first tile, incremented for each tile
+	 * @param jobs output, loading work is appended to it
+	 */
+	void addTailJobs(Handle handle, const TileSource &source,
+		const DDSLoader &loader, int firstLevel, int width, int &tileId,
+		std::vector<LoadInfo> &jobs) const;
+	/**
+	 * Adds loading work for all tiles of a level folder of a texture
+	 * @param handle handle of texture
+	 * @param source texture tiles
+	 * @param fileLevel level folder (1 or more)
+	 * @param width width of the texture
+	 * @param tileId unique id of the first tile, incremented for each tile
+	 * @param jobs output, loading work is appended to it
+	 */
+	void addLevelJobs(Handle handle, const TileSource &source, int fileLevel,
+		int width, int &tileId, std::vector<LoadInfo> &jobs) const;
+
+	/**
+	 * Returns the size in bytes of the storage of a stream texture
+	 * @param format block compression format
+	 * @param width width of the whole texture (twice its height)
+	 * @param baseLevel first level in storage
+	 * @param levels number of levels of the whole texture
+	 */
+	static size_t getStorageSize(DDSLoader::Format format, int width,
+		int baseLevel, int levels);
+	/**
+	 * Drops the top levels of a texture: copies the levels left to smaller
+	 * storage and cancels loading work of the dropped levels
+	 * @param handle handle of texture
+	 * @param res texture
+	 * @param baseLevel new first level in storage, levels to drop the whole
+	 * texture
+	 */
+	void shrinkTex(Handle handle, Residency &res, int baseLevel);
+	/**
+	 * Loads top levels of a texture again: copies the levels in storage to
+	 * larger storage and queues the tiles of the new levels to be opened
+	 * @param handle handle of texture
+	 * @param res texture
+	 * @param baseLevel new first level in storage
+	 */
+	void growTex(Handle handle, Residency &res, int baseLevel);
+	/**
+	 * Sets the finest level of a texture that can be sampled past levels
+	 * that aren't fully uploaded, and whether it can be sampled at all
+	 * @param handle handle of texture
+	 * @param res texture
+	 */
+	void updateMinLevel(Handle handle, Residency &res);
+	/**
+	 * Shrinks textures that are the least recently visible, then the least
+	 * important, until stream textures fit in the memory budget, and grows
+	 * back a visible texture if there's room for it
+	 */
+	void updateResidency();
+
+	/**
+	 * Loading thread loop
+	 * @param worker index of the worker, for its output queue
+	 */
+	void work(int worker);
+	/**
+	 * Asynchronous read thread loop, keeps many reads of archive tiles in
+	 * flight and falls back to blocking reads for the ones that fail
+	 * @param worker index of the output queue
+	 */
+	void readWork(int worker);
 
 	/**
 	 * Generates an unique handle
@@ -203,32 +699,113 @@ private:
 
 	/// Maximum width/height of textures
 	int _maxSize = 0;
+	/// Tile files are memory mapped
+	bool _memoryMapped = false;
+	/// Mappings of tile files shared by their loaders, if memory mapped
+	std::shared_ptr<MappedFileCache> _mappings;
 	/// Size of pages in bytes
 	int _pageSize = 0;
 	/// Number of pages
 	size_t _numPages = 0;
 
-	/// GL id of Pixel Buffer
-	GLuint _pbo = 0;
+	/// Graphics API uploads go through, outlives textures
+	std::unique_ptr<UploadBackend> _backend;
 	/// Persistent map of pixel buffer
 	void *_pboPtr = nullptr;
-	/// Indicates whether a page is in use
-	std::vector<bool> _usedPages;
-	/// Fences to synchronize each page
-	std::vector<Fence> _pageFences;
+	/// Free pages of the pixel buffer
+	PageAllocator _pages;
+
+	/// Pages released but maybe still read by the GL
+	struct ReleasedPages
+	{
+		/// Set after the commands reading the pages
+		UploadBackend::FenceId fence;
+		/// Index of first page
+		int pageOffset;
+		/// Texture the pages were uploaded to, 0 if none
+		Handle handle;
+	};
+	/// Released pages in submission order, fences signal in that order too
+	std::deque<ReleasedPages> _releasedPages;
+
+	/// Textures waiting to be opened by the loading threads
+	std::deque<CreateInfo> _createQueue;
+	/// Textures being opened, not deleted since createTex()
+	std::unordered_set<Handle> _creating;
+	/// Tiles of existing textures waiting to be opened, after textures
+	std::deque<OpenInfo> _openQueue;
 
 	/// Tile info waiting to be put in the streaming queue
 	std::vector<LoadInfo> _loadInfoWaiting;
-	/// Tile info queue in use by the loading thread
-	std::vector<LoadInfo> _loadInfoQueue;
-	/// Tile data that finished loading
+	/// Tile info queue in use by the loading threads
+	std::deque<LoadInfo> _loadInfoQueue;
+	/// Tile data that finished loading, waiting to be updated
 	std::vector<LoadData> _loadData;
 
+	/// Output of a loading thread
+	struct WorkerOutput
+	{
+		std::mutex mtx;
+		/// Tile data that finished loading, merged into _loadData by update()
+		std::vector<LoadData> data;
+		/// Textures opened, added by update()
+		std::vector<CreateData> created;
+		/// Tiles opened, added by update()
+		std::vector<OpenData> opened;
+		/// First error thrown while loading a tile, rethrown by update()
+		std::exception_ptr error;
+	};
+	/// One output per loading thread, so that they don't contend on output
+	std::vector<std::unique_ptr<WorkerOutput>> _workerOutputs;
+
 	/// Map of Handle->Stream Texture
 	std::map<Handle, StreamTexture> _texs;
+	/// Priorities set with setPriority()
+	std::map<Handle, float> _priorities;
+	/// Hint given with prefetch()
+	struct Prefetch
+	{
+		/// Expected priority
+		float priority;
+		/// When the texture is needed, unless in the background
+		std::chrono::steady_clock::time_point deadline;
+		/// No deadline, warm up only
+		bool background;
+		/// Factor of the priority, raised as the deadline gets close
+		float urgency = 1.0;
+	};
+	/// Hints given with prefetch()
+	std::map<Handle, Prefetch> _prefetches;
+	/// Virtual textures, their tail is in _texs
+	std::map<Handle, VirtualTexture> _virtualTexs;
+	/// Tile caches of virtual textures by format and tile size
+	std::map<std::pair<DDSLoader::Format, int>, TileCache> _tileCaches;
+	/// Number of tiles per side of tile caches
+	int _cacheTiles = 0;
+	/// Number of calls to update(), to know which cache slots are in use
+	uint64_t _updateCount = 0;
+
+	/// Number of tiles of each incomplete texture not uploaded yet
+	std::map<Handle, int> _tilesLeft;
+
+	/// Storage of textures that aren't virtual, in asynchronous mode
+	std::map<Handle, Residency> _residency;
+	/// Memory budget in bytes, 0 if none
+	size_t _budget = 0;
+
+	/// Estimated time of uploads, tiles of each update fit in it
+	UploadBudget _uploadBudget;
+	/// Upload all loaded tiles at each update()
+	bool _catchUp = false;
+	/// GPU timers of tile uploads not available yet, in submission order
+	std::deque<std::pair<UploadBackend::TimerId, UploadBudget::Batch>> _uploadTimers;
 
-	std::map<Handle, std::vector<bool>> _tileUpdated;
-	std::map<std::pair<Handle,int>, std::pair<int, int>> _tileRanges;
+	/// Tile, texture and streamer state records
+	StreamTelemetry _telemetry;
+	/// Tiles uploaded since the last telemetry sample
+	int _uploadedTiles = 0;
+	/// Bytes uploaded since the last telemetry sample
+	size_t _uploadedBytes = 0;
 
 	/// Textures to be deleted in next update() call
 	std::vector<Handle> _texDeleted;
@@ -237,13 +814,18 @@ private:
 
 	/// Synchronizes input
 	std::mutex _mtx;
-	/// Synchronizes output
-	std::mutex _dataMtx;
-	/// Streaming thread
-	std::thread _t;
-	/// Signals thread for it to terminate itself
+	/// Loading threads, and the asynchronous read thread last if running
+	std::vector<std::thread> _threads;
+	/// Reads of archive tiles in flight, driven by the read thread
+	AsyncReader _reader;
+	/// Whether the read thread takes tiles, set at init, unset under _mtx if
+	/// the reader fails
+	std::atomic<bool> _asyncReads{false};
+	/// Whether the read thread uses O_DIRECT, unset after the first failure
+	bool _directReads = true;
+	/// Signals threads for them to terminate themselves
 	bool _killThread = false;
-	/// Waits on tiles to load or thread to kill
+	/// Waits on tiles to load or threads to kill
 	std::condition_variable _cond;
 	
 };
\ No newline at end of file
@@ -1,10 +1,12 @@
 #include "ddsloader.hpp"
+#include "tile_archive.hpp"
 
 #include <string>
 #include <fstream>
 #include <cstring>
 #include <string>
 #include <algorithm>
+#include <stdexcept>
 
 using namespace std;
 
@@ -300,16 +302,57 @@ DDSLoader::Format getDDSFormat(const DXGI_FORMAT format)
 	}
 }
 
-DDSLoader::DDSLoader(const string &filename) : _filename(filename)
+/// Largest header: magic number, DDS header and DX10 header
+static const size_t maxHeaderSize = 4+sizeof(DDS_HEADER)+sizeof(DDS_HEADER_DXT10);
+
+DDSLoader::DDSLoader(const string &filename, shared_ptr<MappedFileCache> mappings) :
+	_filename(filename), _mappings(std::move(mappings))
 {
-	ifstream in(_filename.c_str(), ios::in | ios::binary);
-	if (!in) throw runtime_error("File not found : " + _filename);
+	if (_mappings)
+	{
+		const shared_ptr<const MappedFile> file = _mappings->get(_filename);
+		parseHeader(file->data(), file->size());
+	}
+	else
+	{
+		ifstream in(_filename.c_str(), ios::in | ios::binary);
+		if (!in) throw runtime_error("File not found : " + _filename);
+		uint8_t header[maxHeaderSize];
+		in.read((char*)header, maxHeaderSize);
+		parseHeader(header, in.gcount());
+	}
+}
+
+DDSLoader::DDSLoader(shared_ptr<const TileArchive> archive, const int level,
+	const int x, const int y) :
+	_filename(archive->getFilename()), _archive(std::move(archive))
+{
+	_archiveEntry = _archive->getEntryIndex(level, x, y);
+	const TileArchive::Entry &entry = _archive->getEntry(_archiveEntry);
+	_format = _archive->getFormat();
+	_width = entry.width;
+	_height = entry.height;
+	_mipmapCount = entry.mipmapCount;
+	if (_mipmapCount <= 0) throw runtime_error("Invalid tile in " + _filename);
+	computeOffsets(entry.offset);
+
+	// Compressed levels are packed one after the other
+	const uint32_t *storedSizes = _archive->getStoredSizes(_archiveEntry);
+	uint64_t offset = entry.offset;
+	for (int i=0;i<_mipmapCount;++i)
+	{
+		if (storedSizes[i] > (uint32_t)_sizes[i])
+			throw runtime_error("Invalid tile in " + _filename);
+		_offsets[i] = offset;
+		_storedSizes[i] = storedSizes[i];
+		offset += storedSizes[i];
+	}
+}
 
+void DDSLoader::parseHeader(const uint8_t *data, const size_t size)
+{
 	// Magic number
-	in.seekg(0, ios::beg);
-	char buf[4];
-	in.read(buf, 4);
-	if (strncmp(buf, "DDS ", 4))
+	if (size < 4+sizeof(DDS_HEADER) || strncmp((const char*)data, "DDS ", 4))
 	{
 		throw runtime_error("Not a DDS file : " + _filename);
 	}
@@ -317,13 +360,14 @@ DDSLoader::DDSLoader(const string &filename) : _filename(filename)
 	// DDS header
 	bool hasDX10Header = false;
 	DDS_HEADER header;
-	in.read((char*)&header, sizeof(DDS_HEADER));
+	memcpy(&header, data+4, sizeof(DDS_HEADER));
 	DXGI_FORMAT format;
 	if (!strncmp((const char*)&header.ddspf.dwFourCC, "DX10", 4))
 	{
+		if (size < maxHeaderSize) throw runtime_error("Not a DDS file : " + _filename);
 		hasDX10Header = true;
 		DDS_HEADER_DXT10 dx10Header;
-		in.read((char*)&dx10Header, sizeof(DDS_HEADER_DXT10));
+		memcpy(&dx10Header, data+4+sizeof(DDS_HEADER), sizeof(DDS_HEADER_DXT10));
 		format = dx10Header.dxgiFormat;
 	}
 	else
@@ -338,8 +382,14 @@ DDSLoader::DDSLoader(const string &filename) : _filename(filename)
 	_height = header.dwHeight;
 	_mipmapCount = (header.dwFlags&0x20000)?header.dwMipMapCount:1;
 
-	size_t offset = 128+(hasDX10Header?sizeof(DDS_HEADER_DXT10):0);
-	// Compute mipmap offsets & sizes
+	computeOffsets(128+(hasDX10Header?sizeof(DDS_HEADER_DXT10):0));
+}
+
+void DDSLoader::computeOffsets(uint64_t offset)
+{
+	_offsets.clear();
+	_sizes.clear();
+	_storedSizes.clear();
 	for (int i=0;i<_mipmapCount;++i)
 	{
 		int size = getSize(
@@ -348,6 +398,7 @@ DDSLoader::DDSLoader(const string &filename) : _filename(filename)
 			_format);
 		_offsets.push_back(offset);
 		_sizes.push_back(size);
+		_storedSizes.push_back(size);
 		offset += size;
 	}
 }
@@ -383,6 +434,28 @@ size_t DDSLoader::getImageSize(const int mipmapLevel) const
 	return _sizes[mipmapLevel];
 }
 
+size_t DDSLoader::getImageSize(const Format format, const int width,
+	const int height)
+{
+	return getSize(width, height, format);
+}
+
+size_t DDSLoader::getCompressedSize(const int mipmapLevel) const
+{
+	if (mipmapLevel >= getMipmapCount() ||
+		mipmapLevel<0)
+	{
+		throw runtime_error("Mipmap level out of range");
+	}
+
+	return _storedSizes[mipmapLevel];
+}
+
+bool DDSLoader::isCompressed(const int mipmapLevel) const
+{
+	return getCompressedSize(mipmapLevel) != getImageSize(mipmapLevel);
+}
+
 vector<uint8_t> DDSLoader::getImageData(const int mipmapLevel) const
 {
 	vector<uint8_t> data(getImageSize(mipmapLevel));
@@ -392,8 +465,52 @@ vector<uint8_t> DDSLoader::getImageData(const int mipmapLevel) const
 
 void DDSLoader::writeImageData(const int mipmapLevel, void* ptr) const
 {
+	if (_archive)
+	{
+		_archive->readMipmap(_archiveEntry, _offsets[mipmapLevel],
+			getCompressedSize(mipmapLevel), ptr, getImageSize(mipmapLevel));
+		return;
+	}
+	if (_mappings)
+	{
+		// Straight from the page cache, mapped again if it was dropped
+		const shared_ptr<const MappedFile> file = _mappings->get(_filename);
+		const size_t size = getImageSize(mipmapLevel);
+		if (_offsets[mipmapLevel]+size > file->size())
+			throw runtime_error("Truncated DDS file : " + _filename);
+		memcpy(ptr, file->data()+_offsets[mipmapLevel], size);
+		return;
+	}
 	ifstream in(_filename.c_str(), ios::in | ios::binary);
 	if (!in) throw runtime_error(string("Can't open file ") + _filename);
 	in.seekg(_offsets[mipmapLevel], ios::beg);
 	in.read((char*)ptr, getImageSize(mipmapLevel));
-}
\ No newline at end of file
+}
+
+void DDSLoader::prefetch(const int mipmapLevel) const
+{
+	if (_archive)
+	{
+		_archive->advise(_offsets[mipmapLevel], getCompressedSize(mipmapLevel),
+			MappedFile::Advice::WillNeed);
+	}
+	else if (_mappings)
+	{
+		const shared_ptr<const MappedFile> file = _mappings->find(_filename);
+		if (file) file->advise(_offsets[mipmapLevel], getImageSize(mipmapLevel),
+			MappedFile::Advice::WillNeed);
+	}
+}
+
+DDSLoader::FileRange DDSLoader::getFileRange(const int mipmapLevel) const
+{
+	FileRange range{};
+	// Compressed levels need a loading thread to decompress them
+	if (_archive && !isCompressed(mipmapLevel))
+	{
+		range.fd = _archive->getDescriptor();
+		range.directFd = _archive->getDirectDescriptor();
+		range.offset = _offsets.at(mipmapLevel);
+	}
+	return range;
+}
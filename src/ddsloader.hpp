@@ -2,6 +2,12 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "mapped_file.hpp"
+
+class TileArchive;
 
 /**
  * Loads DDS files from file system
@@ -28,8 +34,20 @@ public:
 	/** 
 	 * Opens a DDS file and extracts header data for subsequent reads
 	 * @param filename DDS file path
+	 * @param mappings if set, header and image data are copied from the
+	 * mapping of the file in this cache, shared by all copies of this loader,
+	 * instead of read with a stream
+	 */
+	explicit DDSLoader(const std::string &filename,
+		std::shared_ptr<MappedFileCache> mappings=nullptr);
+	/**
+	 * Reads a tile of a tile archive, header data comes from the archive index
+	 * @param archive opened archive, shared by all loaders of its tiles
+	 * @param level level of the tile (0 is the mip tail)
+	 * @param x column of the tile
+	 * @param y row of the tile
 	 */
-	explicit DDSLoader(const std::string &filename);
+	DDSLoader(std::shared_ptr<const TileArchive> archive, int level, int x, int y);
 	/**
 	 * Returns the number of mipmaps in this file
 	 */
@@ -52,6 +70,19 @@ public:
 	 * @return size in bytes of the mipmap level
 	 */
 	size_t getImageSize(int mipmapLevel) const;
+	/**
+	 * Returns the size in bytes of a mipmap level as stored on disk, smaller
+	 * than getImageSize() for compressed tiles of an archive
+	 * @param mipmapLevel mipmap level to read from
+	 * @return size in bytes read from disk
+	 */
+	size_t getCompressedSize(int mipmapLevel) const;
+	/**
+	 * Returns whether a mipmap level is stored compressed (supercompressed
+	 * tiles of an archive), reads decompress it then
+	 * @param mipmapLevel mipmap level to read from
+	 */
+	bool isCompressed(int mipmapLevel) const;
 	/**
 	 * Returns the image data of a mipmap level
 	 * @param mipmapLevel mipmap level to read from
@@ -64,8 +95,54 @@ public:
 	 * @param ptr to write to
 	 */
 	void writeImageData(int mipmapLevel, void* ptr) const;
+	/**
+	 * Starts reading a mipmap level in the background so that a later
+	 * writeImageData() doesn't wait on disk (archive loaders, and memory
+	 * mapped loaders whose file is still mapped, never maps the file)
+	 * @param mipmapLevel mipmap level that will be read
+	 */
+	void prefetch(int mipmapLevel) const;
+
+	/// Location of a mipmap level in a file kept open by the loader
+	struct FileRange
+	{
+		/// File descriptor, -1 if the file isn't kept open
+		int fd = -1;
+		/// Descriptor of the same file opened with O_DIRECT, -1 if none
+		int directFd = -1;
+		/// Offset in bytes of the mipmap level in the file
+		uint64_t offset = 0;
+	};
+	/**
+	 * Returns where to read a mipmap level without this loader, for
+	 * asynchronous reads (uncompressed levels of archive loaders that aren't
+	 * memory mapped only)
+	 * @param mipmapLevel mipmap level that will be read
+	 */
+	FileRange getFileRange(int mipmapLevel) const;
+
+	/**
+	 * Returns the size in bytes of an image in a block compression format
+	 * @param format block compression format
+	 * @param width width in texels
+	 * @param height height in texels
+	 * @return size in bytes, 0 if the format is undefined
+	 */
+	static size_t getImageSize(Format format, int width, int height);
 
 private:
+	/**
+	 * Extracts header data
+	 * @param data start of the file
+	 * @param size number of bytes available from data
+	 */
+	void parseHeader(const uint8_t *data, size_t size);
+	/**
+	 * Computes offsets and sizes of mipmap levels from the header data
+	 * @param offset offset in bytes of the largest mipmap level
+	 */
+	void computeOffsets(uint64_t offset);
+
 	/// Filename
 	std::string _filename = "";
 	/// Number of mipmap levels
@@ -77,7 +154,15 @@ private:
 	/// BC Format
 	Format _format = Format::Undefined;
 	/// Offsets in bytes of each mipmap level
-	std::vector<int> _offsets;
+	std::vector<uint64_t> _offsets;
 	/// Size in bytes of each mipmap level
 	std::vector<int> _sizes;
+	/// Size in bytes of each mipmap level on disk
+	std::vector<int> _storedSizes;
+	/// Mappings image data is copied from if memory mapped
+	std::shared_ptr<MappedFileCache> _mappings;
+	/// Archive holding the tile if opened from one
+	std::shared_ptr<const TileArchive> _archive;
+	/// Index of the tile in the archive
+	size_t _archiveEntry = 0;
 };
\ No newline at end of file
@@ -30,43 +30,75 @@ Orbit::Orbit(
 	_lan{lan},
 	_arg{arg},
 	_pr{pr},
-	_m0{m0}
+	_m0{m0},
+	_solver{KeplerSolver::Method::DANBY, ecc}
 {
-
+	_meanMotion = two_pi<double>()/_pr;
+	// Plane changes, done once so positions only need two dot products
+	const dquat q =
+		  rotate(dquat(), _lan, dvec3(0,0,1))
+		* rotate(dquat(), _inc, dvec3(0,1,0))
+		* rotate(dquat(), _arg, dvec3(0,0,1));
+	_periapsisDir = q*dvec3(0,1,0);
+	_perpendicularDir = q*dvec3(-1,0,0);
 }
 
-static double meanToEccentric(const double mean, const double ecc)
+dvec3 Orbit::computePosition(
+	const double epoch) const
 {
-	// Newton to find eccentric anomaly (En)
-	double En = (ecc<0.8)?mean:pi<float>(); // Starting value of En
-	const int it = 20; // Number of iterations
-	for (int i=0;i<it;++i)
-		En -= (En - ecc*sin(En)-mean)/(1-ecc*cos(En));
-	return En;
+	// Mean anomaly to Eccentric
+	const double En = _solver.solve(epoch*_meanMotion + _m0);
+	// Position in perifocal frame straight from eccentric anomaly
+	const double x = _sma*(cos(En)-_ecc);
+	const double y = _sma*sqrt(1-_ecc*_ecc)*sin(En);
+	return x*_periapsisDir + y*_perpendicularDir;
 }
 
-dvec3 Orbit::computePosition(
+dvec3 Orbit::computeVelocity(
 	const double epoch) const
 {
-	// Mean Anomaly compute
-	const double meanMotion = 2*pi<float>()/_pr;
-	const double meanAnomaly = fmod(epoch*meanMotion + _m0, 2*pi<float>());
-	// Mean anomaly to Eccentric
-	const double En = meanToEccentric(meanAnomaly, _ecc);
-	// Eccentric anomaly to True anomaly
-	const double trueAnomaly = 2*atan2(sqrt(1+_ecc)*sin(En/2), sqrt(1-_ecc)*cos(En/2));
-	// Distance from parent body
-	const double dist = _sma*((1-_ecc*_ecc)/(1+_ecc*cos(trueAnomaly)));
-	// Plane changes
-	const dvec3 posInPlane = dvec3(
-		-sin(trueAnomaly)*dist,
-		cos(trueAnomaly)*dist,
-		0.0);
-	const dquat q =
-		  rotate(dquat(), _lan, dvec3(0,0,1))
-		* rotate(dquat(), _inc, dvec3(0,1,0))
-		* rotate(dquat(), _arg, dvec3(0,0,1));
-	return q*posInPlane;
+	if (_sma == 0.0) return dvec3(0.0);
+	const double En = _solver.solve(epoch*_meanMotion + _m0);
+	// Derivative of the perifocal position, dE/dt = n/(1-e*cos(E))
+	const double dEdt = _meanMotion/(1-_ecc*cos(En));
+	const double vx = -_sma*sin(En)*dEdt;
+	const double vy = _sma*sqrt(1-_ecc*_ecc)*cos(En)*dEdt;
+	return vx*_periapsisDir + vy*_perpendicularDir;
+}
+
+double Orbit::getEccentricity() const
+{
+	return _ecc;
+}
+
+double Orbit::getSemiMajorAxis() const
+{
+	return _sma;
+}
+
+double Orbit::getPeriod() const
+{
+	return _pr;
+}
+
+double Orbit::getMeanAnomalyAtEpoch() const
+{
+	return _m0;
+}
+
+double Orbit::getMeanMotion() const
+{
+	return _meanMotion;
+}
+
+dvec3 Orbit::getPeriapsisDirection() const
+{
+	return _periapsisDir;
+}
+
+dvec3 Orbit::getPerpendicularDirection() const
+{
+	return _perpendicularDir;
 }
 
 Atmo::Atmo(
@@ -630,51 +662,171 @@ bool EntityHandle::operator==(const EntityHandle &h) const
 
 void EntityCollection::init(const vector<EntityParam> &param)
 {
-	_param = param;
-	_state.clear();
-	_parents.resize(_param.size());
-	// Assign parents
-	for (size_t i=0;i<_param.size();++i)
+	const int n = param.size();
+
+	// Parent index in input order, the first entity of a name is its parent
+	unordered_map<string, int> inputIndex;
+	inputIndex.reserve(n);
+	for (int i=0;i<n;++i) inputIndex.emplace(param[i].getName(), i);
+	vector<int> inputParents(n, -1);
+	for (int i=0;i<n;++i)
+	{
+		const string parent = param[i].getParentName();
+		if (parent == "") continue;
+		auto it = inputIndex.find(parent);
+		if (it == inputIndex.end()) continue;
+		if (it->second == i)
+			throw runtime_error("Entity " + parent + " Can be its own parent");
+		inputParents[i] = it->second;
+	}
+
+	// Parent-before-child order, entities already in order don't move
+	vector<int> order;
+	order.reserve(n);
+	// 0: not visited, 1: ancestors being visited, 2: placed
+	vector<int> visit(n, 0);
+	for (int i=0;i<n;++i)
 	{
-		const string parent = _param[i].getParentName();
-		if (parent != "")
+		// Place ancestors that were not placed yet, oldest first
+		vector<int> chain;
+		int c = i;
+		while (c != -1 && visit[c] != 2)
 		{
-			for (size_t j=0;j<_param.size();++j)
-			{
-				if (_param[j].getName() == parent)
-				{
-					if (i==j) 
-						throw runtime_error("Entity " + parent + " Can be its own parent");
-					_parents[i] = j;
-					break;
-				}
-			}
+			if (visit[c] == 1)
+				throw runtime_error("Entity " + param[c].getName() + " is its own ancestor");
+			visit[c] = 1;
+			chain.push_back(c);
+			c = inputParents[c];
 		}
-		else _parents[i] = -1;
+		for (auto it=chain.rbegin();it!=chain.rend();++it)
+		{
+			visit[*it] = 2;
+			order.push_back(*it);
+		}
+	}
+
+	vector<int> newIndex(n);
+	for (int i=0;i<n;++i) newIndex[order[i]] = i;
+
+	_param.clear();
+	_parents.clear();
+	for (int i=0;i<n;++i)
+	{
+		_param.push_back(param[order[i]]);
+		const int parent = inputParents[order[i]];
+		_parents.push_back((parent==-1)?-1:newIndex[parent]);
 	}
+	_state.assign(n, EntityState());
 
 	_all.clear();
 	_bodies.clear();
 	// Categorization
-	for (int i=0;i<(int)_param.size();++i)
+	for (int i=0;i<n;++i)
 	{
 		const EntityHandle h = createHandle(i);
 		_all.push_back(h);
 		if (_param.at(i).isBody())
 			_bodies.push_back(h);
 	}
+
+	_nameIndex.clear();
+	_nameIndex.reserve(n);
+	for (int i=0;i<n;++i) _nameIndex.emplace(_param[i].getName(), i);
+
+	buildHierarchy();
+}
+
+void EntityCollection::buildHierarchy()
+{
+	const int n = _parents.size();
+
+	// Children, grouped by parent in entity order
+	_childOffsets.assign(n+1, 0);
+	for (int i=0;i<n;++i)
+	{
+		if (_parents[i] != -1) _childOffsets[_parents[i]+1]++;
+	}
+	for (int i=0;i<n;++i) _childOffsets[i+1] += _childOffsets[i];
+	_children.resize(_childOffsets[n]);
+	vector<int> fill(_childOffsets.begin(), _childOffsets.end()-1);
+	for (int i=0;i<n;++i)
+	{
+		if (_parents[i] != -1) _children[fill[_parents[i]]++] = createHandle(i);
+	}
+
+	// Depth-first order: every subtree is contiguous
+	_depthFirst.clear();
+	_depthFirst.reserve(n);
+	_subtreeOffsets.assign(n, 0);
+	_subtreeEnds.assign(n, 0);
+	_roots.clear();
+	vector<int> stack;
+	for (int root=0;root<n;++root)
+	{
+		if (_parents[root] != -1) continue;
+		_roots.push_back(createHandle(root));
+		stack.push_back(root);
+		while (!stack.empty())
+		{
+			const int i = stack.back();
+			stack.pop_back();
+			_subtreeOffsets[i] = _depthFirst.size();
+			_depthFirst.push_back(createHandle(i));
+			// Reversed so children come out in entity order
+			for (int c=_childOffsets[i+1]-1;c>=_childOffsets[i];--c)
+				stack.push_back(_children[c]._id);
+		}
+	}
+	// Parents come before children, so subtree sizes accumulate backwards
+	vector<int> subtreeSize(n, 1);
+	for (int i=n-1;i>=0;--i)
+	{
+		if (_parents[i] != -1) subtreeSize[_parents[i]] += subtreeSize[i];
+	}
+	for (int i=0;i<n;++i) _subtreeEnds[i] = _subtreeOffsets[i] + subtreeSize[i];
+
+	// Ancestor chains
+	_ancestorOffsets.assign(n+1, 0);
+	_ancestors.clear();
+	for (int i=0;i<n;++i)
+	{
+		for (int p=_parents[i];p!=-1;p=_parents[p])
+			_ancestors.push_back(createHandle(p));
+		_ancestorOffsets[i+1] = _ancestors.size();
+	}
 }
 
-void EntityCollection::setState(const std::map<EntityHandle, EntityState> &state)
+void EntityCollection::setState(const vector<EntityState> &relativeState)
 {
-	_state.clear();
-	_state.resize(_param.size());
-	for (auto &p : state)
+	// Parents are always before their children so their state is already set
+	for (size_t i=0;i<_state.size();++i)
 	{
-		_state[p.first._id] = p.second;
+		const EntityState &rel = relativeState[i];
+		const int parent = _parents[i];
+		const dvec3 parentPos = (parent==-1)?dvec3(0.0):_state[parent].getPosition();
+		_state[i] = EntityState(
+			parentPos + rel.getPosition(),
+			rel.getRotationAngle(),
+			rel.getCloudDisp());
 	}
 }
 
+vector<Orbit> EntityCollection::getOrbits() const
+{
+	vector<Orbit> orbits(_param.size());
+	for (size_t i=0;i<_param.size();++i)
+	{
+		if (_parents[i] != -1 && _param[i].hasOrbit())
+			orbits[i] = _param[i].getOrbit();
+	}
+	return orbits;
+}
+
+const vector<int> &EntityCollection::getParentIndices() const
+{
+	return _parents;
+}
+
 const vector<EntityHandle> &EntityCollection::getAll() const
 {
 	return _all;
@@ -691,44 +843,47 @@ EntityHandle EntityHandle::getParent() const
 	return _collec->createHandle(_collec->_parents[_id]);
 }
 
-vector<EntityHandle> EntityHandle::getAllParents() const
+EntityRange EntityHandle::getAllParents() const
 {
 	if (!exists()) return {};
-	vector<EntityHandle> allParents = {};
-	int temp = _id;
-	int tempParent = -1;
-	while ((tempParent = _collec->_parents[temp]) != -1)
-	{
-		allParents.push_back(_collec->createHandle(tempParent));
-		temp = tempParent;
-	}
-	return allParents;
+	const auto &c = *_collec;
+	return EntityRange(
+		c._ancestors.data()+c._ancestorOffsets[_id],
+		c._ancestors.data()+c._ancestorOffsets[_id+1]);
 }
 
-vector<EntityHandle> EntityHandle::getChildren() const
+EntityRange EntityHandle::getChildren() const
 {
 	if (!exists()) return {};
-	vector<EntityHandle> children = {};
-	for (size_t i=0;i<_collec->_parents.size();++i)
-	{
-		if (_collec->_parents[i] == _id) 
-			children.push_back(_collec->createHandle(i));
-	}
-	return children;
+	const auto &c = *_collec;
+	return EntityRange(
+		c._children.data()+c._childOffsets[_id],
+		c._children.data()+c._childOffsets[_id+1]);
 }
 
-vector<EntityHandle> EntityHandle::getAllChildren() const
+EntityRange EntityHandle::getAllChildren() const
 {
 	if (!exists()) return {};
-	auto c = getChildren();
-	vector<EntityHandle> accum = {};
-	for (auto i : c)
-	{
-		auto cc = i.getAllChildren();
-		accum.insert(accum.end(), cc.begin(), cc.end());
-	}
-	c.insert(c.end(), accum.begin(), accum.end());
-	return c;
+	const auto &c = *_collec;
+	return EntityRange(
+		c._depthFirst.data()+c._subtreeOffsets[_id]+1,
+		c._depthFirst.data()+c._subtreeEnds[_id]);
+}
+
+EntityRange EntityHandle::getSiblings() const
+{
+	if (!exists()) return {};
+	const EntityHandle parent = getParent();
+	if (!parent.exists())
+		return EntityRange(_collec->_roots.data(), _collec->_roots.data()+_collec->_roots.size());
+	return parent.getChildren();
+}
+
+EntityHandle EntityCollection::find(const string &name) const
+{
+	auto it = _nameIndex.find(name);
+	if (it == _nameIndex.end()) return {};
+	return _all[it->second];
 }
 
 EntityHandle EntityCollection::createHandle(int id) const
@@ -5,9 +5,12 @@
 #include <limits>
 #include <utility>
 #include <map>
+#include <unordered_map>
 
 #include <glm/glm.hpp>
 
+#include "kepler.hpp"
+
 class Orbit
 {
 public:
@@ -30,6 +33,27 @@ public:
 	 * @return cartesian coordinates around parent entity
 	 */
 	glm::dvec3 computePosition(double epoch) const;
+	/**
+	 * Computes velocity of entity relative to parent entity
+	 * @param epoch epoch in seconds
+	 * @return velocity relative to parent entity (per second)
+	 */
+	glm::dvec3 computeVelocity(double epoch) const;
+
+	/// Returns the eccentricity
+	double getEccentricity() const;
+	/// Returns the semi-major axis (meters)
+	double getSemiMajorAxis() const;
+	/// Returns the period of the orbit (seconds)
+	double getPeriod() const;
+	/// Returns the mean anomaly at epoch (radians)
+	double getMeanAnomalyAtEpoch() const;
+	/// Returns the mean motion (radians per second)
+	double getMeanMotion() const;
+	/// Returns the unit vector pointing from the parent to the periapsis
+	glm::dvec3 getPeriapsisDirection() const;
+	/// Returns the unit vector in the orbit plane 90 degrees ahead of periapsis
+	glm::dvec3 getPerpendicularDirection() const;
 private:
 	// Kepler orbital parameters (Meters & radians)
 	/// Eccentricity
@@ -46,6 +70,16 @@ private:
 	double _pr = 1.0;
 	/// Mean anomaly at epoch (radians)
 	double _m0 = 0.0; 
+
+	// Precomputed from the parameters above
+	/// Solver of Kepler's equation for this eccentricity
+	KeplerSolver _solver;
+	/// Mean motion (radians per second)
+	double _meanMotion = 0.0;
+	/// Perifocal basis: direction of periapsis
+	glm::dvec3 _periapsisDir = glm::dvec3(0.0,1.0,0.0);
+	/// Perifocal basis: direction 90 degrees ahead of periapsis
+	glm::dvec3 _perpendicularDir = glm::dvec3(-1.0,0.0,0.0);
 };
 
 class Atmo
@@ -385,6 +419,7 @@ private:
 };
 
 class EntityCollection;
+class EntityRange;
 
 class EntityHandle
 {
@@ -397,27 +432,81 @@ public:
 	const EntityParam &getParam() const;
 	const EntityState &getState() const;
 	EntityHandle getParent() const;
-	std::vector<EntityHandle> getAllParents() const;
-	std::vector<EntityHandle> getChildren() const;
-	std::vector<EntityHandle> getAllChildren() const;
+	/// Returns the parent, grandparent and so on up to the root
+	EntityRange getAllParents() const;
+	EntityRange getChildren() const;
+	/// Returns all descendants, each child followed by its own descendants
+	EntityRange getAllChildren() const;
+	/// Returns the children of the parent, this entity included
+	EntityRange getSiblings() const;
 	bool operator<(const EntityHandle &h) const;
 	bool operator==(const EntityHandle &h) const;
 	friend class EntityCollection;
 };
 
+/**
+ * View of contiguous handles stored in an EntityCollection, valid as long as
+ * the collection isn't initialized again
+ */
+class EntityRange
+{
+public:
+	EntityRange() = default;
+	EntityRange(const EntityHandle *begin, const EntityHandle *end) :
+		_begin{begin}, _end{end} {}
+	const EntityHandle *begin() const { return _begin; }
+	const EntityHandle *end() const { return _end; }
+	size_t size() const { return _end-_begin; }
+	bool empty() const { return _begin == _end; }
+	const EntityHandle &operator[](size_t i) const { return _begin[i]; }
+private:
+	const EntityHandle *_begin = nullptr;
+	const EntityHandle *_end = nullptr;
+};
+
+/**
+ * All entities, stored in parent-before-child order so that every entity's
+ * parent index is smaller than its own
+ */
 class EntityCollection
 {
 public:
 	EntityCollection() = default;
+	/**
+	 * Sorts entities so parents come before their children (keeping the given
+	 * order otherwise) and resolves parent indices
+	 * @param param fixed parameters of all entities
+	 */
 	void init(const std::vector<EntityParam> &param);
-	void setState(const std::map<EntityHandle, EntityState> &state);
+	/**
+	 * Sets the state of all entities in a single pass, accumulating positions
+	 * from parents to children
+	 * @param relativeState states with positions relative to the parent entity,
+	 * in the order of getAll()
+	 */
+	void setState(const std::vector<EntityState> &relativeState);
+	/**
+	 * Returns the orbit of every entity around its parent in the order of
+	 * getAll(), or a null orbit for entities fixed in place
+	 */
+	std::vector<Orbit> getOrbits() const;
+	/// Returns the parent index of every entity in the order of getAll() (-1 if none)
+	const std::vector<int> &getParentIndices() const;
 	const std::vector<EntityHandle> &getAll() const;
 	const std::vector<EntityHandle> &getBodies() const;
+	/**
+	 * Finds an entity by name
+	 * @param name name of the entity
+	 * @return handle of the entity, or a handle that doesn't exist if not found
+	 */
+	EntityHandle find(const std::string &name) const;
 	friend class EntityHandle;
 private:
 	EntityHandle createHandle(int id) const;
 	const EntityParam &getParam(const EntityHandle &handle) const;
 	const EntityState &getState(const EntityHandle &handle) const;
+	/// Builds the hierarchy ranges from _parents
+	void buildHierarchy();
 
 	std::vector<EntityParam> _param;
 	std::vector<EntityState> _state;
@@ -425,5 +514,22 @@ private:
 	std::vector<EntityHandle> _all;
 	std::vector<EntityHandle> _bodies;
 
+	/// Index of the parent of each entity (-1 if none), always smaller than the entity's
 	std::vector<int> _parents;
+	/// Entity index of each name
+	std::unordered_map<std::string, int> _nameIndex;
+
+	// Hierarchy, as ranges of the arrays below indexed by entity
+	/// Children of entity i are _children[_childOffsets[i]] to _children[_childOffsets[i+1]-1]
+	std::vector<int> _childOffsets;
+	std::vector<EntityHandle> _children;
+	/// Entities without parent
+	std::vector<EntityHandle> _roots;
+	/// Depth-first order, the subtree of entity i spans _subtreeOffsets[i] to _subtreeEnds[i]-1
+	std::vector<int> _subtreeOffsets;
+	std::vector<int> _subtreeEnds;
+	std::vector<EntityHandle> _depthFirst;
+	/// Ancestors of entity i, closest first, from _ancestorOffsets[i] to _ancestorOffsets[i+1]-1
+	std::vector<int> _ancestorOffsets;
+	std::vector<EntityHandle> _ancestors;
 };
\ No newline at end of file
@@ -0,0 +1,247 @@
+#include "entity_file.hpp"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <stdexcept>
+
+#include <SHAUN/sweeper.hpp>
+#include <SHAUN/parser.hpp>
+
+using namespace glm;
+using namespace std;
+
+template<class T>
+T get(shaun::sweeper swp);
+
+template <>
+double get(shaun::sweeper swp)
+{
+	if (swp.is_null()) return 0.0; else return swp.value<shaun::number>();
+}
+
+template <>
+string get(shaun::sweeper swp)
+{
+	if (swp.is_null()) return ""; else return swp.value<shaun::string>();
+}
+
+template <>
+bool get(shaun::sweeper swp)
+{
+	if (swp.is_null()) return false; else return swp.value<shaun::boolean>();
+}
+
+template<>
+vec3 get(shaun::sweeper swp)
+{
+	vec3 ret;
+	if (swp.is_null()) return ret;
+	for (int i=0;i<3;++i)
+		ret[i] = swp[i].value<shaun::number>();
+	return ret;
+}
+
+template<>
+vec4 get(shaun::sweeper swp)
+{
+	vec4 ret;
+	if (swp.is_null()) return ret;
+	for (int i=0;i<4;++i)
+		ret[i] = swp[i].value<shaun::number>();
+	return ret;
+}
+
+static vec3 axis(const float rightAscension, const float declination)
+{
+	return vec3(
+		-sin(rightAscension)*cos(declination),
+		 cos(rightAscension)*cos(declination),
+		 sin(declination));
+}
+
+static Orbit parseOrbit(shaun::sweeper &swp)
+{
+	return Orbit(
+		get<double>(swp("ecc")),
+		get<double>(swp("sma")),
+		radians(get<double>(swp("inc"))),
+		radians(get<double>(swp("lan"))),
+		radians(get<double>(swp("arg"))),
+		get<double>(swp("pr")),
+		radians(get<double>(swp("m0"))));
+}
+
+static Model parseModel(shaun::sweeper &modelsw, const mat3 &axialMat)
+{
+	return Model(
+		get<double>(modelsw("radius")),
+		get<double>(modelsw("GM")),
+		axialMat*
+		axis(
+			radians(get<double>(modelsw("rightAscension"))),
+			radians(get<double>(modelsw("declination")))),
+		get<double>(modelsw("rotPeriod")),
+		get<vec3>(modelsw("meanColor"))*
+		(float)get<double>(modelsw("albedo")),
+		get<string>(modelsw("diffuse")));
+}
+
+static Atmo parseAtmo(shaun::sweeper &atmosw)
+{
+	return Atmo(
+		get<vec4>(atmosw("K")),
+		get<double>(atmosw("density")),
+		get<double>(atmosw("maxHeight")),
+		get<double>(atmosw("scaleHeight")));
+}
+
+static Ring parseRing(shaun::sweeper &ringsw, const mat3 &axialMat)
+{
+	return Ring(
+		get<double>(ringsw("inner")),
+		get<double>(ringsw("outer")),
+		axialMat*
+		axis(
+			radians(get<double>(ringsw("rightAscension"))),
+			radians(get<double>(ringsw("declination")))),
+		get<string>(ringsw("backscat")),
+		get<string>(ringsw("forwardscat")),
+		get<string>(ringsw("unlit")),
+		get<string>(ringsw("transparency")),
+		get<string>(ringsw("color")));
+}
+
+static Star parseStar(shaun::sweeper &starsw)
+{
+	return Star(
+		get<double>(starsw("brightness")),
+		get<double>(starsw("flareFadeInStart")),
+		get<double>(starsw("flareFadeInEnd")),
+		get<double>(starsw("flareAttenuation")),
+		get<double>(starsw("flareMinSize")),
+		get<double>(starsw("flareMaxSize")));
+}
+
+static Clouds parseClouds(shaun::sweeper &cloudssw)
+{
+	return Clouds(
+		get<string>(cloudssw("filename")),
+		get<double>(cloudssw("period")));
+}
+
+static Night parseNight(shaun::sweeper &nightsw)
+{
+	return Night(
+		get<string>(nightsw("filename")),
+		get<double>(nightsw("intensity")));
+}
+
+static Specular parseSpecular(shaun::sweeper &specsw)
+{
+	shaun::sweeper mask0(specsw("mask0"));
+	shaun::sweeper mask1(specsw("mask1"));
+	return Specular(
+		get<string>(specsw("filename")),
+		{get<vec3>(mask0("color")), 
+		 (float)get<double>(mask0("hardness"))},
+		{get<vec3>(mask1("color")),
+		 (float)get<double>(mask1("hardness"))});
+}
+
+EntityFile loadEntityFile(const string &filename)
+{
+	EntityFile file;
+	try
+	{
+		shaun::object obj = shaun::parse_file(filename);
+		shaun::sweeper swp(obj);
+
+		file.ambientColor = (float)get<double>(swp("ambientColor"));
+		file.startingBody = get<string>(swp("startingBody"));
+
+		shaun::sweeper starMap(swp("starMap"));
+		file.starMapFilename = get<string>(starMap("diffuse"));
+		file.starMapIntensity = (float)get<double>(starMap("intensity"));
+
+		const float axialTilt = radians(get<double>(swp("axialTilt")));
+		const mat3 axialMat = mat3(rotate(mat4(), axialTilt, vec3(0,-1,0)));
+
+		shaun::sweeper barycenterSw(swp("barycenters"));
+		for (int i=0;i<(int)barycenterSw.size();++i)
+		{
+			shaun::sweeper bc(barycenterSw[i]);
+			EntityParam entity;
+			entity.setName(bc("name").value<shaun::string>());
+			entity.setParentName(get<string>(bc("parent")));
+
+			shaun::sweeper orbitsw(bc("orbit"));
+			if (!orbitsw.is_null())
+			{
+				entity.setOrbit(parseOrbit(orbitsw));
+			}
+			file.entities.push_back(entity);
+		}
+
+		shaun::sweeper bodySweeper(swp("bodies"));
+
+		for (int i=0;i<(int)bodySweeper.size();++i)
+		{
+			shaun::sweeper bd(bodySweeper[i]);
+			string name = bd("name").value<shaun::string>();
+			// Create entity
+			EntityParam entity;
+			entity.setName(name);
+			const string displayName = get<string>(bd("displayName"));
+			entity.setDisplayName(displayName==""?name:displayName);
+			entity.setParentName(get<string>(bd("parent")));
+
+			shaun::sweeper orbitsw(bd("orbit"));
+			if (!orbitsw.is_null())
+			{
+				entity.setOrbit(parseOrbit(orbitsw));
+			}
+			shaun::sweeper modelsw(bd("model"));
+			if (!modelsw.is_null())
+			{
+				entity.setModel(parseModel(modelsw, axialMat));
+			}
+			shaun::sweeper atmosw(bd("atmo"));
+			if (!atmosw.is_null())
+			{
+				entity.setAtmo(parseAtmo(atmosw));
+			}
+			shaun::sweeper ringsw(bd("ring"));
+			if (!ringsw.is_null())
+			{
+				entity.setRing(parseRing(ringsw, axialMat));
+			}
+			shaun::sweeper starsw(bd("star"));
+			if (!starsw.is_null())
+			{
+				entity.setStar(parseStar(starsw));
+			}
+			shaun::sweeper cloudssw(bd("clouds"));
+			if (!cloudssw.is_null())
+			{
+				entity.setClouds(parseClouds(cloudssw));
+			}
+			shaun::sweeper nightsw(bd("night"));
+			if (!nightsw.is_null())
+			{
+				entity.setNight(parseNight(nightsw));
+			}
+			shaun::sweeper specsw(bd("specular"));
+			if (!specsw.is_null())
+			{
+				entity.setSpecular(parseSpecular(specsw));
+			}
+			file.entities.push_back(entity);
+		}
+	}
+	catch (const shaun::exception &e)
+	{
+		throw runtime_error("Error when parsing entity file :\n" + e.to_string());
+	}
+	return file;
+}
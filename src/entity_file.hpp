@@ -0,0 +1,31 @@
+#pragma once
+
+#include "entity.hpp"
+
+#include <string>
+#include <vector>
+
+/**
+ * Contents of an entity file (config/entities.sn)
+ */
+struct EntityFile
+{
+	/// All barycenters and bodies, in file order
+	std::vector<EntityParam> entities;
+	/// Name of the body focused at startup
+	std::string startingBody = "";
+	/// Light intensity on the dark side of bodies
+	float ambientColor = 0.0;
+	/// Diffuse texture of the star map
+	std::string starMapFilename = "";
+	/// Brightness of the star map
+	float starMapIntensity = 1.0;
+};
+
+/**
+ * Parses an entity file, independent of any graphics API
+ * Throws runtime_error if the file can't be parsed
+ * @param filename file to parse
+ * @return parsed entities and scene settings
+ */
+EntityFile loadEntityFile(const std::string &filename);
@@ -0,0 +1,260 @@
+#include "ephemeris.hpp"
+
+#include <fstream>
+#include <stdexcept>
+#include <cmath>
+#include <cstring>
+#include <array>
+#include <algorithm>
+
+#include <glm/gtc/constants.hpp>
+
+using namespace glm;
+using namespace std;
+
+/// File identifier
+static const char ephemerisMagic[4] = {'R','E','P','H'};
+/// Incremented at each change of the file layout
+static const uint32_t ephemerisVersion = 1;
+
+/// Number of initial segments per orbit period
+static const double segmentsPerPeriod = 8.0;
+/// Segments are not split below this fraction of the period
+static const double minSegmentFraction = 1e-6;
+
+void EphemerisCache::init(const vector<Orbit> &orbits,
+	const double tolerance, const int degree, const int maxSegments)
+{
+	_tolerance = tolerance;
+	_degree = degree;
+	_maxSegments = maxSegments;
+	_lastEpoch = 0.0;
+
+	_bodies.clear();
+	_bodies.resize(orbits.size());
+	for (size_t i=0;i<orbits.size();++i)
+	{
+		Body &b = _bodies[i];
+		b.orbit = orbits[i];
+		b.fixed = orbits[i].getSemiMajorAxis() == 0.0;
+		b.segmentLength = orbits[i].getPeriod()/segmentsPerPeriod;
+	}
+	_batch.init(orbits);
+	_batchPositions.resize(orbits.size());
+}
+
+size_t EphemerisCache::size() const
+{
+	return _bodies.size();
+}
+
+void EphemerisCache::computePositions(const double epoch, dvec3 *positions)
+{
+	const double step = abs(epoch-_lastEpoch);
+	_lastEpoch = epoch;
+
+	bool batched = false;
+	for (size_t i=0;i<_bodies.size();++i)
+	{
+		const Body &b = _bodies[i];
+		// A segment skipped over in one step would never be used again
+		if (!b.fixed && step > b.segmentLength &&
+			!b.segments.count((int64_t)floor(epoch/b.segmentLength)))
+		{
+			if (!batched) _batch.computePositions(epoch, _batchPositions.data());
+			batched = true;
+			positions[i] = _batchPositions[i];
+		}
+		else
+		{
+			positions[i] = computePosition(i, epoch);
+		}
+	}
+}
+
+dvec3 EphemerisCache::computePosition(const size_t id, const double epoch)
+{
+	Body &b = _bodies.at(id);
+	if (b.fixed) return dvec3(0.0);
+
+	const double minLength = b.orbit.getPeriod()*minSegmentFraction;
+	while (true)
+	{
+		const int64_t index = (int64_t)floor(epoch/b.segmentLength);
+		auto it = b.segments.find(index);
+		if (it == b.segments.end())
+		{
+			Segment s = fit(b, index);
+			// Too coarse: split all segments of this body
+			if (s.error > _tolerance && b.segmentLength*0.5 > minLength)
+			{
+				b.segmentLength *= 0.5;
+				b.segments.clear();
+				continue;
+			}
+			if (!b.segments.empty() && (int)b.segments.size() >= _maxSegments)
+			{
+				auto lru = min_element(b.segments.begin(), b.segments.end(),
+					[](const pair<const int64_t, Segment> &x, const pair<const int64_t, Segment> &y)
+					{ return x.second.lastUse < y.second.lastUse; });
+				b.segments.erase(lru);
+			}
+			it = b.segments.insert(make_pair(index, std::move(s))).first;
+		}
+		it->second.lastUse = ++b.uses;
+		const double x = 2.0*(epoch/b.segmentLength - index) - 1.0;
+		return evaluate(it->second, x);
+	}
+}
+
+EphemerisCache::Segment EphemerisCache::fit(const Body &body, const int64_t index) const
+{
+	const int n = _degree+1;
+	const double half = body.segmentLength*0.5;
+	const double mid = (index+0.5)*body.segmentLength;
+
+	// Samples at Chebyshev nodes
+	vector<dvec3> samples(n);
+	for (int j=0;j<n;++j)
+	{
+		const double x = cos(pi<double>()*(j+0.5)/n);
+		samples[j] = body.orbit.computePosition(mid + half*x);
+	}
+
+	Segment s{};
+	s.coefs.resize(n*3);
+	for (int k=0;k<n;++k)
+	{
+		dvec3 c(0.0);
+		for (int j=0;j<n;++j)
+			c += samples[j]*cos(pi<double>()*k*(j+0.5)/n);
+		c *= ((k==0)?1.0:2.0)/n;
+		for (int a=0;a<3;++a) s.coefs[a*n+k] = c[a];
+	}
+
+	// Error checked halfway between nodes and at both ends, where it peaks
+	for (int j=0;j<=n;++j)
+	{
+		const double x = (j==0)?1.0:(j==n)?-1.0:cos(pi<double>()*j/n);
+		const dvec3 exact = body.orbit.computePosition(mid + half*x);
+		s.error = glm::max(s.error, length(evaluate(s, x) - exact));
+	}
+	return s;
+}
+
+dvec3 EphemerisCache::evaluate(const Segment &segment, const double x) const
+{
+	// Clenshaw recurrence
+	const int n = _degree+1;
+	dvec3 result;
+	for (int a=0;a<3;++a)
+	{
+		const double *c = &segment.coefs[a*n];
+		double b1 = 0.0;
+		double b2 = 0.0;
+		for (int k=n-1;k>=1;--k)
+		{
+			const double b = c[k] + 2.0*x*b1 - b2;
+			b2 = b1;
+			b1 = b;
+		}
+		result[a] = c[0] + x*b1 - b2;
+	}
+	return result;
+}
+
+/// Values identifying an orbit, to detect stale files
+static array<double, 10> fingerprint(const Orbit &orbit)
+{
+	const dvec3 p = orbit.getPeriapsisDirection();
+	const dvec3 q = orbit.getPerpendicularDirection();
+	return {{
+		orbit.getEccentricity(), orbit.getSemiMajorAxis(),
+		orbit.getPeriod(), orbit.getMeanAnomalyAtEpoch(),
+		p.x, p.y, p.z, q.x, q.y, q.z}};
+}
+
+template<class T>
+static void writeValue(ofstream &out, const T &value)
+{
+	out.write((const char*)&value, sizeof(T));
+}
+
+template<class T>
+static T readValue(ifstream &in)
+{
+	T value{};
+	in.read((char*)&value, sizeof(T));
+	if (!in) throw runtime_error("Truncated ephemeris file");
+	return value;
+}
+
+void EphemerisCache::save(const string &filename) const
+{
+	ofstream out(filename.c_str(), ios::out | ios::binary);
+	if (!out) throw runtime_error("Can't open file " + filename);
+
+	out.write(ephemerisMagic, 4);
+	writeValue(out, ephemerisVersion);
+	writeValue(out, (int32_t)_degree);
+	writeValue(out, _tolerance);
+	writeValue(out, (uint64_t)_bodies.size());
+	for (const Body &b : _bodies)
+	{
+		writeValue(out, fingerprint(b.orbit));
+		writeValue(out, b.segmentLength);
+		writeValue(out, (uint64_t)b.segments.size());
+		for (const auto &p : b.segments)
+		{
+			writeValue(out, p.first);
+			writeValue(out, p.second.error);
+			out.write((const char*)p.second.coefs.data(),
+				p.second.coefs.size()*sizeof(double));
+		}
+	}
+}
+
+void EphemerisCache::load(const string &filename)
+{
+	ifstream in(filename.c_str(), ios::in | ios::binary);
+	if (!in) throw runtime_error("Can't open file " + filename);
+
+	char magic[4];
+	in.read(magic, 4);
+	if (!in || strncmp(magic, ephemerisMagic, 4))
+		throw runtime_error("Not an ephemeris file : " + filename);
+	if (readValue<uint32_t>(in) != ephemerisVersion)
+		throw runtime_error("Unsupported ephemeris file version : " + filename);
+	if (readValue<int32_t>(in) != _degree || readValue<double>(in) != _tolerance)
+		throw runtime_error("Ephemeris file fitted with other settings : " + filename);
+	if (readValue<uint64_t>(in) != _bodies.size())
+		throw runtime_error("Ephemeris file doesn't match entities : " + filename);
+
+	// Read everything before replacing anything
+	vector<Body> bodies = _bodies;
+	for (Body &b : bodies)
+	{
+		if (readValue<array<double, 10>>(in) != fingerprint(b.orbit))
+			throw runtime_error("Ephemeris file doesn't match entities : " + filename);
+		b.segmentLength = readValue<double>(in);
+		// Fixed bodies have no period, nor segments
+		if (!b.fixed && !(std::isfinite(b.segmentLength) && b.segmentLength > 0.0))
+			throw runtime_error("Invalid ephemeris file : " + filename);
+		b.segments.clear();
+		b.uses = 0;
+		const uint64_t count = readValue<uint64_t>(in);
+		if (count > (uint64_t)_maxSegments)
+			throw runtime_error("Invalid ephemeris file : " + filename);
+		for (uint64_t i=0;i<count;++i)
+		{
+			const int64_t index = readValue<int64_t>(in);
+			Segment s{};
+			s.error = readValue<double>(in);
+			s.coefs.resize((_degree+1)*3);
+			in.read((char*)s.coefs.data(), s.coefs.size()*sizeof(double));
+			if (!in) throw runtime_error("Truncated ephemeris file");
+			b.segments.insert(make_pair(index, std::move(s)));
+		}
+	}
+	_bodies = std::move(bodies);
+}
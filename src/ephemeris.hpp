@@ -0,0 +1,113 @@
+#pragma once
+
+#include "entity.hpp"
+#include "orbit_batch.hpp"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+/**
+ * Caches orbit positions as piecewise Chebyshev polynomials
+ *
+ * Time is cut in fixed-length segments per orbit. The first lookup inside a
+ * segment fits a polynomial to Orbit::computePosition() at Chebyshev nodes;
+ * later lookups in the same segment are a Clenshaw evaluation. The segment
+ * length of each orbit is halved until the fit error, checked against the
+ * orbit between the nodes, is below the tolerance. Fitted segments can be
+ * saved to and loaded from a binary file.
+ *
+ * Steps longer than a segment would fit segments used only once, orbits
+ * without a fitted segment at such steps are propagated by an OrbitBatch.
+ * At high warp this covers every orbit whose period is shorter than a few
+ * steps (moons at years per second), the cache only helps slower orbits.
+ */
+class EphemerisCache
+{
+public:
+	EphemerisCache() = default;
+	/**
+	 * @param orbits orbits to cache, indices are kept in computePositions()
+	 * @param tolerance maximum position error (same unit as semi-major axes)
+	 * @param degree degree of the fitted polynomials
+	 * @param maxSegments number of segments kept per orbit, the least recently
+	 * used one is evicted beyond
+	 */
+	void init(const std::vector<Orbit> &orbits,
+		double tolerance=0.1, int degree=12, int maxSegments=4096);
+	/// Returns the number of orbits in the cache
+	size_t size() const;
+	/**
+	 * Computes cartesian coordinates of all orbits around their parent entity
+	 * @param epoch epoch in seconds
+	 * @param positions output array of size() coordinates
+	 */
+	void computePositions(double epoch, glm::dvec3 *positions);
+	/**
+	 * Computes cartesian coordinates of an orbit around its parent entity
+	 * @param id index of the orbit
+	 * @param epoch epoch in seconds
+	 * @return cartesian coordinates around parent entity
+	 */
+	glm::dvec3 computePosition(size_t id, double epoch);
+	/**
+	 * Writes all fitted segments to a file
+	 * @param filename file to write to
+	 */
+	void save(const std::string &filename) const;
+	/**
+	 * Replaces fitted segments with the ones of a file written by save()
+	 * Throws if the file doesn't match the cached orbits
+	 * @param filename file to read from
+	 */
+	void load(const std::string &filename);
+
+private:
+	/// Polynomial covering [index*length, (index+1)*length)
+	struct Segment
+	{
+		/// Largest error of the fit at the checked points
+		double error = 0.0;
+		/// Value of Body::uses at the last lookup
+		uint64_t lastUse = 0;
+		/// Chebyshev coefficients, degree+1 per axis (x then y then z)
+		std::vector<double> coefs;
+	};
+
+	struct Body
+	{
+		/// Orbit to sample
+		Orbit orbit;
+		/// Length of a segment in seconds
+		double segmentLength = 0.0;
+		/// Whether the body never moves (no orbit)
+		bool fixed = false;
+		/// Fitted segments by index
+		std::map<int64_t, Segment> segments;
+		/// Lookup counter, orders segments by last use
+		uint64_t uses = 0;
+	};
+
+	/// Fits the polynomial of a segment
+	Segment fit(const Body &body, int64_t index) const;
+	/// Evaluates a segment at a normalized time in [-1,1]
+	glm::dvec3 evaluate(const Segment &segment, double x) const;
+
+	/// Maximum position error
+	double _tolerance = 0.1;
+	/// Degree of polynomials
+	int _degree = 12;
+	/// Segments kept per body
+	int _maxSegments = 4096;
+	/// Epoch of last computePositions() call
+	double _lastEpoch = 0.0;
+
+	std::vector<Body> _bodies;
+	/// Propagator of orbits skipping segments
+	OrbitBatch _batch;
+	/// Positions computed by _batch, reused between calls
+	std::vector<glm::dvec3> _batchPositions;
+};
@@ -20,6 +20,8 @@
 
 #include "renderer.hpp"
 #include "renderer_gl.hpp"
+#include "entity_file.hpp"
+#include "snapshot.hpp"
 
 #include <SHAUN/sweeper.hpp>
 #include <SHAUN/parser.hpp>
@@ -38,6 +40,20 @@ Game::Game()
 
 Game::~Game()
 {
+	_clock.stop();
+
+	if (_useEphemerisCache && _ephemerisFile != "")
+	{
+		try
+		{
+			_ephemeris.save(_ephemerisFile);
+		}
+		catch (const runtime_error &e)
+		{
+			cout << e.what() << endl;
+		}
+	}
+
 	_renderer->destroy();
 
 	glfwTerminate();
@@ -64,9 +80,53 @@ void Game::loadSettingsFile()
 		_maxTexSize = graphics("maxTexSize").value<shaun::number>();
 		_msaaSamples = graphics("msaaSamples").value<shaun::number>();
 		_syncTexLoading = graphics("syncTexLoading").value<shaun::boolean>();
+		auto mapped = graphics("mappedTexLoading");
+		_mappedTexLoading = (mapped.is_null())?true:(bool)mapped.value<shaun::boolean>();
+		auto loadingThreads = graphics("texLoadingThreads");
+		if (!loadingThreads.is_null()) _texLoadingThreads = loadingThreads.value<shaun::number>();
+		auto virtualTex = graphics("virtualTexturing");
+		if (!virtualTex.is_null()) _virtualTexturing = virtualTex.value<shaun::boolean>();
+		auto textureBudget = graphics("textureBudget");
+		if (!textureBudget.is_null()) _textureBudget = textureBudget.value<shaun::number>();
+		auto uploadBudget = graphics("uploadBudget");
+		if (!uploadBudget.is_null()) _uploadBudget = uploadBudget.value<shaun::number>();
 
 		shaun::sweeper controls(swp("controls"));
 		_sensitivity = controls("sensitivity").value<shaun::number>();
+
+		shaun::sweeper simulation(swp("simulation"));
+		auto cache = simulation("ephemerisCache");
+		_useEphemerisCache = (cache.is_null())?false:(bool)cache.value<shaun::boolean>();
+		auto cacheFile = simulation("ephemerisFile");
+		if (!cacheFile.is_null())
+		{
+			string file = cacheFile.value<shaun::string>();
+			_ephemerisFile = file;
+		}
+		auto nbody = simulation("nbody");
+		_useNBody = (nbody.is_null())?false:(bool)nbody.value<shaun::boolean>();
+		auto nbodyBudget = simulation("nbodyBudget");
+		if (!nbodyBudget.is_null()) _nbodyBudget = nbodyBudget.value<shaun::number>();
+		auto tickRate = simulation("tickRate");
+		if (!tickRate.is_null()) _tickRate = tickRate.value<shaun::number>();
+		auto snapshotFile = simulation("snapshotFile");
+		if (!snapshotFile.is_null())
+		{
+			string file = snapshotFile.value<shaun::string>();
+			_snapshotFile = file;
+		}
+		auto catalog = simulation("smallBodies");
+		if (!catalog.is_null())
+		{
+			string file = catalog.value<shaun::string>();
+			_smallBodyCatalog = file;
+		}
+		auto catalogParent = simulation("smallBodyParent");
+		if (!catalogParent.is_null())
+		{
+			string parent = catalogParent.value<shaun::string>();
+			_smallBodyParent = parent;
+		}
 	} 
 	catch (const shaun::exception &e)
 	{
@@ -153,6 +213,13 @@ void Game::init()
 	// Set _epoch as current time (get time since 1970 + adjust for 2017)
 	_epoch = (long)time(NULL) - 1483228800;
 
+	// N-body state vectors start from the orbits at the current epoch
+	if (_useNBody)
+	{
+		_nbody.init(_entityCollection, _epoch);
+		_nbody.setTimeBudget(_nbodyBudget);
+	}
+
 	// Renderer init
 	_renderer->init({
 		&_entityCollection, 
@@ -161,252 +228,145 @@ void Game::init()
 		_msaaSamples, 
 		_maxTexSize, 
 		_syncTexLoading, 
-		_width, _height});
-}
-
-template<class T>
-T get(shaun::sweeper swp);
-
-template <>
-double get(shaun::sweeper swp)
-{
-	if (swp.is_null()) return 0.0; else return swp.value<shaun::number>();
-}
-
-template <>
-string get(shaun::sweeper swp)
-{
-	if (swp.is_null()) return ""; else return swp.value<shaun::string>();
+		_mappedTexLoading,
+		_texLoadingThreads,
+		_virtualTexturing,
+		_textureBudget,
+		_uploadBudget,
+		_width, _height,
+		&_smallBodies});
+
+	// Entity positions are computed on the simulation thread from now on
+	stepSimulation(_epoch, 0.0, _relativePositions.data());
+	startSimulation();
 }
 
-template <>
-bool get(shaun::sweeper swp)
+void Game::startSimulation()
 {
-	if (swp.is_null()) return false; else return swp.value<shaun::boolean>();
-}
-
-template<>
-vec3 get(shaun::sweeper swp)
-{
-	vec3 ret;
-	if (swp.is_null()) return ret;
-	for (int i=0;i<3;++i)
-		ret[i] = swp[i].value<shaun::number>();
-	return ret;
-}
-
-template<>
-vec4 get(shaun::sweeper swp)
-{
-	vec4 ret;
-	if (swp.is_null()) return ret;
-	for (int i=0;i<4;++i)
-		ret[i] = swp[i].value<shaun::number>();
-	return ret;
-}
-
-vec3 axis(const float rightAscension, const float declination)
-{
-	return vec3(
-		-sin(rightAscension)*cos(declination),
-		 cos(rightAscension)*cos(declination),
-		 sin(declination));
-}
-
-Orbit parseOrbit(shaun::sweeper &swp)
-{
-	return Orbit(
-		get<double>(swp("ecc")),
-		get<double>(swp("sma")),
-		radians(get<double>(swp("inc"))),
-		radians(get<double>(swp("lan"))),
-		radians(get<double>(swp("arg"))),
-		get<double>(swp("pr")),
-		radians(get<double>(swp("m0"))));
-}
-
-Model parseModel(shaun::sweeper &modelsw, const mat3 &axialMat)
-{
-	return Model(
-		get<double>(modelsw("radius")),
-		get<double>(modelsw("GM")),
-		axialMat*
-		axis(
-			radians(get<double>(modelsw("rightAscension"))),
-			radians(get<double>(modelsw("declination")))),
-		get<double>(modelsw("rotPeriod")),
-		get<vec3>(modelsw("meanColor"))*
-		(float)get<double>(modelsw("albedo")),
-		get<string>(modelsw("diffuse")));
-}
-
-Atmo parseAtmo(shaun::sweeper &atmosw)
-{
-	return Atmo(
-		get<vec4>(atmosw("K")),
-		get<double>(atmosw("density")),
-		get<double>(atmosw("maxHeight")),
-		get<double>(atmosw("scaleHeight")));
+	_clock.start(_epoch, _relativePositions, 1.0/_tickRate,
+		[this](double epoch, double dt, dvec3 *positions)
+		{
+			stepSimulation(epoch, dt, positions);
+		});
 }
 
-Ring parseRing(shaun::sweeper &ringsw, const mat3 &axialMat)
+void Game::saveSnapshot(const string &filename)
 {
-	return Ring(
-		get<double>(ringsw("inner")),
-		get<double>(ringsw("outer")),
-		axialMat*
-		axis(
-			radians(get<double>(ringsw("rightAscension"))),
-			radians(get<double>(ringsw("declination")))),
-		get<string>(ringsw("backscat")),
-		get<string>(ringsw("forwardscat")),
-		get<string>(ringsw("unlit")),
-		get<string>(ringsw("transparency")),
-		get<string>(ringsw("color")));
+	// Taken at the last tick so that N-body state vectors match the epoch
+	_clock.stop();
+	_epoch = _clock.getLastTick(_relativePositions.data());
+	updateEntityStates();
+
+	Snapshot snapshot;
+	snapshot.epoch = _epoch;
+	snapshot.timeWarpIndex = _timeWarpIndex;
+	snapshot.focusedBodyId = _focusedBodyId;
+	snapshot.viewPolar = _viewPolar;
+	snapshot.panPolar = _panPolar;
+	snapshot.viewDir = _viewDir;
+	for (const EntityHandle &h : _entityCollection.getAll())
+		snapshot.states.push_back(h.getState());
+	if (_useNBody) snapshot.stateVectors = _nbody.getStateVectors();
+
+	startSimulation();
+	::saveSnapshot(filename, snapshot, _entityCollection);
 }
 
-Star parseStar(shaun::sweeper &starsw)
+void Game::loadSnapshot(const string &filename)
 {
-	return Star(
-		get<double>(starsw("brightness")),
-		get<double>(starsw("flareFadeInStart")),
-		get<double>(starsw("flareFadeInEnd")),
-		get<double>(starsw("flareAttenuation")),
-		get<double>(starsw("flareMinSize")),
-		get<double>(starsw("flareMaxSize")));
-}
+	const Snapshot snapshot = ::loadSnapshot(filename, _entityCollection);
+	if (snapshot.timeWarpIndex < 0 || snapshot.timeWarpIndex >= (int)_timeWarpValues.size() ||
+		snapshot.focusedBodyId < 0 || snapshot.focusedBodyId >= (int)_entityCollection.getBodies().size())
+		throw runtime_error("Invalid snapshot file : " + filename);
 
-Clouds parseClouds(shaun::sweeper &cloudssw)
-{
-	return Clouds(
-		get<string>(cloudssw("filename")),
-		get<double>(cloudssw("period")));
-}
+	_clock.stop();
+	if (_useNBody)
+	{
+		try
+		{
+			// Snapshots saved without N-body start from the orbits
+			if (snapshot.stateVectors.empty()) _nbody.reset(_entityCollection, snapshot.epoch);
+			else _nbody.setStateVectors(snapshot.stateVectors, snapshot.epoch);
+		}
+		catch (const runtime_error &)
+		{
+			startSimulation();
+			throw;
+		}
+	}
+	_epoch = snapshot.epoch;
 
-Night parseNight(shaun::sweeper &nightsw)
-{
-	return Night(
-		get<string>(nightsw("filename")),
-		get<double>(nightsw("intensity")));
-}
+	// Saved positions are used as they are, nothing is recomputed
+	const vector<int> &parents = _entityCollection.getParentIndices();
+	for (size_t i=0;i<snapshot.states.size();++i)
+	{
+		const int parent = parents[i];
+		_relativePositions[i] = snapshot.states[i].getPosition() -
+			((parent==-1)?dvec3(0.0):snapshot.states[parent].getPosition());
+	}
+	startSimulation();
+	updateEntityStates();
 
-Specular parseSpecular(shaun::sweeper &specsw)
-{
-	shaun::sweeper mask0(specsw("mask0"));
-	shaun::sweeper mask1(specsw("mask1"));
-	return Specular(
-		get<string>(specsw("filename")),
-		{get<vec3>(mask0("color")), 
-		 (float)get<double>(mask0("hardness"))},
-		{get<vec3>(mask1("color")),
-		 (float)get<double>(mask1("hardness"))});
+	_timeWarpIndex = snapshot.timeWarpIndex;
+	_focusedBodyId = snapshot.focusedBodyId;
+	_bodyNameId = _focusedBodyId;
+	_viewPolar = snapshot.viewPolar;
+	_panPolar = snapshot.panPolar;
+	_viewDir = snapshot.viewDir;
+	_viewSpeed = vec3(0);
+	_switchPhase = SwitchPhase::IDLE;
 }
 
 void Game::loadEntityFiles()
 {
-	try
-	{
-		shaun::object obj = shaun::parse_file("config/entities.sn");
-		shaun::sweeper swp(obj);
+	const EntityFile file = loadEntityFile("config/entities.sn");
 
-		_ambientColor = (float)get<double>(swp("ambientColor"));
-		string startingBody = swp("startingBody").value<shaun::string>();
+	_ambientColor = file.ambientColor;
+	_starMapFilename = file.starMapFilename;
+	_starMapIntensity = file.starMapIntensity;
 
-		shaun::sweeper starMap(swp("starMap"));
-		_starMapFilename = get<string>(starMap("diffuse"));
-		_starMapIntensity = (float)get<double>(starMap("intensity"));
+	_entityCollection.init(file.entities);
 
-		const float axialTilt = radians(get<double>(swp("axialTilt")));
-		const mat3 axialMat = mat3(rotate(mat4(), axialTilt, vec3(0,-1,0)));
+	// Batch propagation of all orbits (fixed entities get a null orbit)
+	const vector<Orbit> orbits = _entityCollection.getOrbits();
+	_orbitBatch.init(orbits);
+	_relativePositions.resize(orbits.size());
+	_relativeStates.resize(orbits.size());
 
-		vector<EntityParam> entities;
-
-		shaun::sweeper barycenterSw(swp("barycenters"));
-		for (int i=0;i<(int)barycenterSw.size();++i)
-		{
-			shaun::sweeper bc(barycenterSw[i]);
-			EntityParam entity;
-			entity.setName(bc("name").value<shaun::string>());
-			entity.setParentName(get<string>(bc("parent")));
-
-			shaun::sweeper orbitsw(bc("orbit"));
-			if (!orbitsw.is_null())
-			{
-				entity.setOrbit(parseOrbit(orbitsw));
-			}
-			entities.push_back(entity);
-		}
-
-		shaun::sweeper bodySweeper(swp("bodies"));
-
-		for (int i=0;i<(int)bodySweeper.size();++i)
+	if (_useEphemerisCache)
+	{
+		_ephemeris.init(orbits);
+		if (_ephemerisFile != "" && ifstream(_ephemerisFile).good())
 		{
-			shaun::sweeper bd(bodySweeper[i]);
-			string name = bd("name").value<shaun::string>();
-			// Create entity
-			EntityParam entity;
-			entity.setName(name);
-			const string displayName = get<string>(bd("displayName"));
-			entity.setDisplayName(displayName==""?name:displayName);
-			entity.setParentName(get<string>(bd("parent")));
-
-			shaun::sweeper orbitsw(bd("orbit"));
-			if (!orbitsw.is_null())
-			{
-				entity.setOrbit(parseOrbit(orbitsw));
-			}
-			shaun::sweeper modelsw(bd("model"));
-			if (!modelsw.is_null())
-			{
-				entity.setModel(parseModel(modelsw, axialMat));
-			}
-			shaun::sweeper atmosw(bd("atmo"));
-			if (!atmosw.is_null())
-			{
-				entity.setAtmo(parseAtmo(atmosw));
-			}
-			shaun::sweeper ringsw(bd("ring"));
-			if (!ringsw.is_null())
-			{
-				entity.setRing(parseRing(ringsw, axialMat));
-			}
-			shaun::sweeper starsw(bd("star"));
-			if (!starsw.is_null())
-			{
-				entity.setStar(parseStar(starsw));
-			}
-			shaun::sweeper cloudssw(bd("clouds"));
-			if (!cloudssw.is_null())
-			{
-				entity.setClouds(parseClouds(cloudssw));
-			}
-			shaun::sweeper nightsw(bd("night"));
-			if (!nightsw.is_null())
+			// Stale or invalid files are refitted
+			try
 			{
-				entity.setNight(parseNight(nightsw));
+				_ephemeris.load(_ephemerisFile);
 			}
-			shaun::sweeper specsw(bd("specular"));
-			if (!specsw.is_null())
+			catch (const runtime_error &e)
 			{
-				entity.setSpecular(parseSpecular(specsw));
+				cout << e.what() << endl;
 			}
-			entities.push_back(entity);
 		}
-		_entityCollection.init(entities);
+	}
 
-		// Set focused body
-		for (int i=0;i<(int)_entityCollection.getBodies().size();++i)
-		{
-			if (_entityCollection.getBodies()[i].getParam().getName() == startingBody)
-			{
-				_focusedBodyId = i;
-				break;
-			}
-		}
+	if (_smallBodyCatalog != "")
+	{
+		const EntityHandle parent = _entityCollection.find(_smallBodyParent);
+		if (!parent.exists())
+			throw runtime_error("Unknown small body parent " + _smallBodyParent);
+		_smallBodies.init(_smallBodyParent, parent.getParam().getModel().getGM(),
+			SmallBodyCollection::loadCatalog(_smallBodyCatalog));
 	}
-	catch (const shaun::exception &e)
+
+	// Set focused body
+	for (int i=0;i<(int)_entityCollection.getBodies().size();++i)
 	{
-		throw runtime_error("Error when parsing entity file :\n" + e.to_string());
+		if (_entityCollection.getBodies()[i].getParam().getName() == file.startingBody)
+		{
+			_focusedBodyId = i;
+			break;
+		}
 	}
 }
 
@@ -497,48 +457,54 @@ string getFormattedTime(long _epochInSeconds)
 		format(seconds) + " UTC";
 }
 
-void Game::update(const double dt)
+void Game::stepSimulation(const double epoch, const double dt, dvec3 *positions)
 {
-	_epoch += _timeWarpValues[_timeWarpIndex]*dt;
-
-	map<EntityHandle, dvec3> relativePositions;
-	// Entity state update
-	for (const auto &h : _entityCollection.getAll())
+	if (_useNBody)
 	{
-		relativePositions[h] = (!h.getParent().exists() || !h.getParam().hasOrbit())?
-			dvec3(0.0):
-			h.getParam().getOrbit().computePosition(_epoch);
+		_nbody.advance(dt);
+		_nbody.computeRelativePositions(positions);
 	}
+	else if (_useEphemerisCache)
+		_ephemeris.computePositions(epoch, positions);
+	else
+		_orbitBatch.computePositions(epoch, positions);
+}
 
-	map<EntityHandle, EntityState> state;
-
-	// Entity absolute position update
-	for (auto h : _entityCollection.getAll())
+void Game::updateEntityStates()
+{
+	const auto &all = _entityCollection.getAll();
+	for (size_t i=0;i<all.size();++i)
 	{
-		dvec3 absPosition = relativePositions[h];
-		auto parent = h.getParent();
-		while (parent.exists())
-		{
-			absPosition += relativePositions[parent];
-			parent = parent.getParent();
-		}
+		const EntityParam &param = all[i].getParam();
 
 		// Entity Angle
 		const float rotationAngle = 
 			(2.0*pi<float>())*
-			fmod(_epoch/h.getParam().getModel().getRotationPeriod(),1.f);
+			fmod(_epoch/param.getModel().getRotationPeriod(),1.f);
 
 		// Cloud Displacement
 		const float cloudDisp = [&]{
-			if (h.getParam().hasClouds()) return 0.0;
-			const float period = h.getParam().getClouds().getPeriod();
+			if (param.hasClouds()) return 0.0;
+			const float period = param.getClouds().getPeriod();
 			return (period)?fmod(-_epoch/period, 1.f):0.f;
 		}();
 
-		state[h] = EntityState(absPosition, rotationAngle, cloudDisp);
+		_relativeStates[i] = EntityState(_relativePositions[i], rotationAngle, cloudDisp);
 	}
 
-	_entityCollection.setState(state);
+	// Absolute positions in a single parent-before-child pass
+	_entityCollection.setState(_relativeStates);
+}
+
+void Game::update(const double dt)
+{
+	// Entity state update, interpolated from the simulation thread
+	_clock.setTimeWarp(_timeWarpValues[_timeWarpIndex]);
+	_epoch = _clock.getState(_relativePositions.data());
+	updateEntityStates();
+
+	// Small bodies
+	if (_smallBodies.size()) _smallBodies.computePositions(_epoch);
 	
 	// Wireframe on/off
 	if (isPressedOnce(GLFW_KEY_W))
@@ -573,6 +539,33 @@ void Game::update(const double dt)
 	_preMousePosX = posX;
 	_preMousePosY = posY;
 
+	// Snapshot save/restore
+	const bool saveKey = isPressedOnce(GLFW_KEY_F6);
+	const bool loadKey = isPressedOnce(GLFW_KEY_F7);
+	try
+	{
+		if (saveKey) saveSnapshot(_snapshotFile);
+		else if (loadKey) loadSnapshot(_snapshotFile);
+	}
+	catch (const runtime_error &e)
+	{
+		cout << e.what() << endl;
+	}
+
+	// Texture streaming telemetry
+	if (isPressedOnce(GLFW_KEY_F8))
+	{
+		try
+		{
+			_renderer->saveStreamTelemetry("stream_telemetry");
+			cout << "Stream telemetry saved to stream_telemetry.json" << endl;
+		}
+		catch (const runtime_error &e)
+		{
+			cout << e.what() << endl;
+		}
+	}
+
 	// Screenshot
 	if (isPressedOnce(GLFW_KEY_F12))
 	{
@@ -582,6 +575,9 @@ void Game::update(const double dt)
 	// Focused entities
 	const vector<EntityHandle> texLoadBodies = 
 		getTexLoadBodies(getFocusedBody());
+	const vector<Renderer::TexPrefetch> texPrefetch = getTexPrefetch();
+	// Nothing is seen while minimized, textures can catch up
+	const bool texCatchUp = glfwGetWindowAttrib(_win, GLFW_ICONIFIED);
 
 	// Time formatting
 	const long _epochInSeconds = floor(_epoch);
@@ -590,7 +586,8 @@ void Game::update(const double dt)
 	// Scene rendering
 	_renderer->render({
 		_viewPos, _viewFovy, _viewDir,
-		_exposure, _ambientColor, _wireframe, _bloom, texLoadBodies, 
+		_exposure, _ambientColor, _wireframe, _bloom, texLoadBodies, texPrefetch,
+		texCatchUp,
 		getDisplayedBody().getParam().getDisplayName(),
 		_bodyNameFade, formattedTime});
 
@@ -783,6 +780,11 @@ void Game::updateIdle(float dt, double posX, double posY)
 	}
 }
 
+/// Duration in seconds of the switch phase aiming at the next body
+static const float switchTrackTime = 1.0;
+/// Duration in seconds of the switch phase moving to the next body
+static const float switchMoveTime = 1.0;
+
 float ease(float t)
 {
 	return 6*t*t*t*t*t-15*t*t*t*t+10*t*t*t;
@@ -796,7 +798,7 @@ float ease2(float t, float alpha)
 
 void Game::updateTrack(float dt)
 {
-	const float totalTime = 1.0;
+	const float totalTime = switchTrackTime;
 	const float t = glm::min(1.f, _switchTime/totalTime);
 	const float f = ease(t);
 
@@ -851,7 +853,7 @@ void Game::updateTrack(float dt)
 
 void Game::updateMove(float dt)
 {
-	const float totalTime = 1.0;
+	const float totalTime = switchMoveTime;
 	const float t = glm::min(1.f, _switchTime/totalTime);
 	const double f = ease2(t, 4);
 
@@ -864,8 +866,7 @@ void Game::updateMove(float dt)
 		dvec3(polarToCartesian(vec2(_viewPolar))*_viewPolar.z);
 
 	// Distance from entity at arrival
-	const float targetDist = glm::max(
-		4*getFocusedBody().getParam().getModel().getRadius(), 1000.f);
+	const float targetDist = getArrivalDistance(getFocusedBody());
 	// Direction from old position to new entity
 	const vec3 direction = 
 		normalize(getFocusedBody().getState().getPosition()-sourcePos);
@@ -890,19 +891,48 @@ void Game::updateMove(float dt)
 	}
 }
 
+float Game::getArrivalDistance(const EntityHandle &body)
+{
+	return glm::max(4*body.getParam().getModel().getRadius(), 1000.f);
+}
+
+vector<Renderer::TexPrefetch> Game::getTexPrefetch()
+{
+	vector<Renderer::TexPrefetch> v;
+
+	// Target of the switch, needed when the view gets there
+	if (_switchPhase != SwitchPhase::IDLE)
+	{
+		float remaining = switchMoveTime-_switchTime;
+		if (_switchPhase == SwitchPhase::TRACK) remaining += switchTrackTime;
+		v.push_back({getFocusedBody(), getArrivalDistance(getFocusedBody()),
+			glm::max(0.f, remaining)});
+	}
+
+	// Next and previous targets, in the background
+	for (const bool direction : {true, false})
+	{
+		const EntityHandle body = _entityCollection.getBodies()[chooseNextBody(direction)];
+		if (body == getFocusedBody() || !body.getParam().isBody()) continue;
+		v.push_back({body, getArrivalDistance(body), -1.f});
+	}
+
+	return v;
+}
+
 vector<EntityHandle> Game::getTexLoadBodies(const EntityHandle &focusedEntity)
 {
 	// Itself visible
 	vector<EntityHandle> v = {focusedEntity};
 
 	// All parents visible
-	auto parents = focusedEntity.getAllParents();
+	const EntityRange parents = focusedEntity.getAllParents();
 	v.insert(v.end(), parents.begin(), parents.end());
 
-	// All siblings visible (exclude level 1)
-	if (focusedEntity.getParent().getParent().exists())
+	// All siblings and their children visible (exclude level 1)
+	if (parents.size() >= 2)
 	{
-		auto siblings = focusedEntity.getParent().getAllChildren();
+		const EntityRange siblings = parents[0].getAllChildren();
 		v.insert(v.end(), siblings.begin(), siblings.end());
 	}
 
@@ -3,6 +3,11 @@
 #include "graphics_api.hpp"
 
 #include "entity.hpp"
+#include "orbit_batch.hpp"
+#include "ephemeris.hpp"
+#include "small_body.hpp"
+#include "nbody.hpp"
+#include "sim_clock.hpp"
 #include "renderer.hpp"
 #include <glm/glm.hpp>
 
@@ -31,6 +36,18 @@ public:
 	 * Indicates whether the application has been requested to stop
 	 */
 	bool isRunning();
+	/**
+	 * Saves the simulation state and view to a snapshot file. Throws
+	 * runtime_error on failure
+	 * @param filename file to write
+	 */
+	void saveSnapshot(const std::string &filename);
+	/**
+	 * Resumes from a snapshot file saved with the same entities. Throws
+	 * runtime_error on failure, leaving the current state unchanged
+	 * @param filename file to read
+	 */
+	void loadSnapshot(const std::string &filename);
 
 private:
 	/**
@@ -44,6 +61,17 @@ private:
 	void loadEntityFiles();
 	/// Loads settings file
 	void loadSettingsFile();
+	/**
+	 * Computes entity positions relative to parent, on the simulation thread
+	 * @param epoch epoch in seconds
+	 * @param dt simulated time since the last step in seconds
+	 * @param positions output array in the order of EntityCollection::getAll()
+	 */
+	void stepSimulation(double epoch, double dt, glm::dvec3 *positions);
+	/// Starts the simulation clock from _epoch and _relativePositions
+	void startSimulation();
+	/// Sets entity states from _epoch and _relativePositions
+	void updateEntityStates();
 
 	enum class SwitchPhase
 	{
@@ -55,6 +83,11 @@ private:
 
 	/// Returns bodies that need to have their texture loaded when the focus is on 'focusedEntity'
 	std::vector<EntityHandle> getTexLoadBodies(const EntityHandle &focusedEntity);
+	/// Returns the distance of the view from a body at the end of a switch to it
+	float getArrivalDistance(const EntityHandle &body);
+	/// Returns bodies whose textures will soon be needed: the target of the
+	/// switch in progress, and the next and previous targets
+	std::vector<Renderer::TexPrefetch> getTexPrefetch();
 
 	void displayProfiling(const std::vector<std::pair<std::string, uint64_t>> &a);
 	void updateProfiling(const std::vector<std::pair<std::string, uint64_t>> &a);
@@ -70,10 +103,40 @@ private:
 
 	// Main entity collection
 	EntityCollection _entityCollection;
+	/// Orbits of all entities in the order of EntityCollection::getAll()
+	OrbitBatch _orbitBatch;
+	/// Positions relative to parent computed by _orbitBatch
+	std::vector<glm::dvec3> _relativePositions;
+	/// Entity states relative to parent, reused every update
+	std::vector<EntityState> _relativeStates;
+	/// Polynomial cache of orbits, used instead of _orbitBatch if enabled
+	EphemerisCache _ephemeris;
+	/// Whether positions come from _ephemeris
+	bool _useEphemerisCache = false;
+	/// File to load fitted ephemeris segments from and save them to
+	std::string _ephemerisFile = "";
+	/// Newtonian integration of entities, used instead of orbits if enabled
+	NBodySystem _nbody;
+	/// Whether positions come from _nbody
+	bool _useNBody = false;
+	/// Wall time spent integrating per update in milliseconds
+	double _nbodyBudget = 4.0;
+	/// Fixed timestep simulation of entity positions on its own thread
+	SimulationClock _clock;
+	/// Simulation ticks per second
+	double _tickRate = 60.0;
+	/// File saved to and restored from with F6/F7
+	std::string _snapshotFile = "snapshot.bin";
+	/// Asteroids and comets, propagated every update
+	SmallBodyCollection _smallBodies;
+	/// Catalog file of small bodies (empty for none)
+	std::string _smallBodyCatalog = "";
+	/// Name of the entity small bodies orbit
+	std::string _smallBodyParent = "Sun";
 
 	/// Index in the  the view follows
 	int _focusedBodyId = 0; 
-	/// Seconds since January 1st 2017 00:00:00 UTC
+	/// Seconds since January 1st 2017 00:00:00 UTC, of the displayed state
 	double _epoch = 0.0;
 	/// Index in the timeWarpValues collection which indicates the current timewarp factor
 	int _timeWarpIndex = 0;
@@ -103,6 +166,16 @@ private:
 	bool _bloom = true;
 	/// Wait for whole texture to load before displaying (no pop-ins)
 	bool _syncTexLoading = false;
+	/// Memory map texture files instead of reading them through streams
+	bool _mappedTexLoading = true;
+	/// Number of texture loading threads
+	int _texLoadingThreads = 4;
+	/// Only stream the texture tiles that are visible
+	bool _virtualTexturing = false;
+	/// Memory budget of stream textures in MiB, 0 for none
+	int _textureBudget = 0;
+	/// Time budget of texture uploads per frame in milliseconds
+	float _uploadBudget = 2.0;
 
 	std::string _starMapFilename = "";
 	float _starMapIntensity = 1.0;
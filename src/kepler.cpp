@@ -0,0 +1,108 @@
+#include "kepler.hpp"
+
+#include <cmath>
+#include <stdexcept>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+using namespace glm;
+using namespace std;
+
+KeplerSolver::KeplerSolver(
+	const Method method,
+	const double ecc,
+	const double tolerance,
+	const int maxIterations,
+	const int tableSize) :
+	_method{method},
+	_ecc{ecc},
+	_tolerance{tolerance},
+	_maxIterations{maxIterations}
+{
+	if (ecc < 0.0 || ecc >= 1.0)
+		throw runtime_error("Kepler solver only handles elliptic orbits");
+
+	if (_method == Method::TABLE)
+	{
+		if (tableSize < 2) throw runtime_error("Kepler table is too small");
+		// Pairs of (E, dE/dM), last sample closes the [0,2pi] interval
+		auto table = make_shared<vector<double>>((tableSize+1)*2);
+		const KeplerSolver exact(Method::DANBY, ecc, 1e-15, 64);
+		for (int i=0;i<=tableSize;++i)
+		{
+			const double mean = two_pi<double>()*i/(double)tableSize;
+			const double En = (i==tableSize)?two_pi<double>():exact.solve(mean);
+			(*table)[i*2+0] = En;
+			(*table)[i*2+1] = 1.0/(1.0-ecc*cos(En));
+		}
+		_table = table;
+	}
+}
+
+double KeplerSolver::tableStarter(const double mean) const
+{
+	// Cubic Hermite interpolation between the two closest samples
+	const vector<double> &table = *_table;
+	const int size = (int)table.size()/2 - 1;
+	const double h = two_pi<double>()/size;
+	const double x = mean/h;
+	const int i = glm::min(size-1, (int)x);
+	const double t = x - i;
+	const double t2 = t*t;
+	const double t3 = t2*t;
+	return
+		( 2*t3 - 3*t2 + 1)*table[i*2+0] +
+		(   t3 - 2*t2 + t)*h*table[i*2+1] +
+		(-2*t3 + 3*t2    )*table[i*2+2] +
+		(   t3 -   t2    )*h*table[i*2+3];
+}
+
+double KeplerSolver::solve(const double mean, int *iterations) const
+{
+	const double m = wrapAngle(mean);
+	double En = (_method==Method::TABLE)?tableStarter(m):starter(m, _ecc);
+
+	int it = 0;
+	while (it < _maxIterations)
+	{
+		const double s = _ecc*sin(En);
+		const double c = _ecc*cos(En);
+		const double f = En - s - m;
+		const double f1 = 1.0 - c;
+		double delta;
+		switch (_method)
+		{
+			case Method::HALLEY:
+				delta = -2.0*f*f1/(2.0*f1*f1 - f*s);
+				break;
+			case Method::DANBY:
+				delta = danbyCorrection(f, f1, s, c);
+				break;
+			default:
+				delta = -f/f1;
+				break;
+		}
+		En += delta;
+		++it;
+		if (abs(delta) < _tolerance) break;
+	}
+
+	if (iterations) *iterations = it;
+	return En;
+}
+
+KeplerSolver::Method KeplerSolver::getMethod() const
+{
+	return _method;
+}
+
+double KeplerSolver::getEccentricity() const
+{
+	return _ecc;
+}
+
+double KeplerSolver::getTolerance() const
+{
+	return _tolerance;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cmath>
+
+/**
+ * Solves Kepler's equation M = E - e*sin(E) for the eccentric anomaly E
+ *
+ * Every method starts from a good initial guess and iterates until the
+ * correction falls below a tolerance, so low eccentricity orbits usually exit
+ * after one or two iterations.
+ */
+class KeplerSolver
+{
+public:
+	/// Iteration schemes
+	enum class Method
+	{
+		/// Newton-Raphson (quadratic convergence)
+		NEWTON,
+		/// Halley (cubic convergence)
+		HALLEY,
+		/// Danby's quartic (quartic convergence)
+		DANBY,
+		/// Precomputed table for the eccentricity + Newton refinement
+		TABLE
+	};
+
+	KeplerSolver() = default;
+	/**
+	 * @param method iteration scheme
+	 * @param ecc eccentricity of the orbit (0 <= ecc < 1)
+	 * @param tolerance iterations stop when the correction is smaller (radians)
+	 * @param maxIterations hard iteration limit
+	 * @param tableSize number of table samples over [0,2pi] (TABLE method only)
+	 */
+	KeplerSolver(Method method, double ecc,
+		double tolerance=1e-12, int maxIterations=32, int tableSize=256);
+
+	/**
+	 * Computes the eccentric anomaly
+	 * @param mean mean anomaly in radians
+	 * @param iterations if not null, receives the number of iterations used
+	 * @return eccentric anomaly in radians
+	 */
+	double solve(double mean, int *iterations=nullptr) const;
+
+	Method getMethod() const;
+	double getEccentricity() const;
+	double getTolerance() const;
+
+	/**
+	 * Starting value of the eccentric anomaly (Danby 1987)
+	 * @param mean mean anomaly in radians
+	 * @param ecc eccentricity
+	 */
+	static double starter(double mean, double ecc);
+	/**
+	 * One step of Danby's quartic iteration
+	 * @param En current estimate of the eccentric anomaly
+	 * @param mean mean anomaly in radians
+	 * @param ecc eccentricity
+	 * @return correction to add to En
+	 */
+	static double danbyStep(double En, double mean, double ecc);
+	/**
+	 * Wraps an angle to [0,2pi)
+	 * @param angle angle in radians
+	 */
+	static double wrapAngle(double angle);
+	/**
+	 * Danby's quartic correction from Kepler's equation and its derivatives
+	 * @param f E - e*sin(E) - M
+	 * @param f1 first derivative (1 - e*cos(E))
+	 * @param f2 second derivative (e*sin(E))
+	 * @param f3 third derivative (e*cos(E))
+	 * @return correction to add to E
+	 */
+	static double danbyCorrection(double f, double f1, double f2, double f3);
+
+private:
+	/// Initial guess from the table
+	double tableStarter(double mean) const;
+
+	/// Iteration scheme
+	Method _method = Method::DANBY;
+	/// Eccentricity
+	double _ecc = 0.0;
+	/// Convergence threshold on the correction
+	double _tolerance = 1e-12;
+	/// Hard iteration limit
+	int _maxIterations = 32;
+	/// Eccentric anomaly sampled at regular mean anomaly steps over [0,2pi]
+	std::shared_ptr<const std::vector<double>> _table;
+};
+
+// Per-lane helpers are inline so batched loops over them can be vectorized
+
+inline double KeplerSolver::wrapAngle(const double angle)
+{
+	const double twoPi = 6.283185307179586476925;
+	return angle - twoPi*std::floor(angle/twoPi);
+}
+
+inline double KeplerSolver::starter(const double mean, const double ecc)
+{
+	return mean + ((std::sin(mean)<0.0)?-0.85:0.85)*ecc;
+}
+
+inline double KeplerSolver::danbyCorrection(
+	const double f, const double f1, const double f2, const double f3)
+{
+	const double d1 = -f/f1;
+	const double d2 = -f/(f1 + 0.5*d1*f2);
+	return -f/(f1 + 0.5*d2*f2 + d2*d2*f3/6.0);
+}
+
+inline double KeplerSolver::danbyStep(const double En, const double mean, const double ecc)
+{
+	const double s = ecc*std::sin(En);
+	const double c = ecc*std::cos(En);
+	return danbyCorrection(En - s - mean, 1.0 - c, s, c);
+}
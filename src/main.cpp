@@ -1,5 +1,6 @@
 #include "game.hpp"
 
+#include <iostream>
 #include <thread>
 #include <chrono>
 
@@ -14,6 +15,19 @@ int main(int argc, char **argv)
 	Game game;
 	game.init();
 
+	// Optional snapshot to start from
+	if (argc > 1)
+	{
+		try
+		{
+			game.loadSnapshot(argv[1]);
+		}
+		catch (const std::exception &e)
+		{
+			std::cout << e.what() << std::endl;
+		}
+	}
+
 	double dt{0.0};
 
 	while (game.isRunning())
@@ -0,0 +1,174 @@
+#include "mapped_file.hpp"
+
+#include <stdexcept>
+#include <utility>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+MappedFile::MappedFile(const string &filename)
+{
+#ifdef _WIN32
+	_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (_file == INVALID_HANDLE_VALUE)
+	{
+		_file = nullptr;
+		throw runtime_error("Can't open file " + filename);
+	}
+	LARGE_INTEGER size;
+	GetFileSizeEx(_file, &size);
+	_size = size.QuadPart;
+	if (_size == 0) return;
+	_mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (_mapping) _data = (const uint8_t*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!_data)
+	{
+		close();
+		throw runtime_error("Can't map file " + filename);
+	}
+#else
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1) throw runtime_error("Can't open file " + filename);
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		::close(fd);
+		throw runtime_error("Can't open file " + filename);
+	}
+	_size = st.st_size;
+	if (_size == 0)
+	{
+		::close(fd);
+		return;
+	}
+	void *data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping stays valid without the descriptor
+	::close(fd);
+	if (data == MAP_FAILED)
+	{
+		_size = 0;
+		throw runtime_error("Can't map file " + filename);
+	}
+	_data = (const uint8_t*)data;
+#endif
+}
+
+MappedFile::MappedFile(MappedFile &&other)
+{
+	*this = std::move(other);
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other)
+{
+	if (this != &other)
+	{
+		close();
+		swap(_data, other._data);
+		swap(_size, other._size);
+#ifdef _WIN32
+		swap(_file, other._file);
+		swap(_mapping, other._mapping);
+#endif
+	}
+	return *this;
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+const uint8_t *MappedFile::data() const
+{
+	return _data;
+}
+
+size_t MappedFile::size() const
+{
+	return _size;
+}
+
+void MappedFile::advise(const size_t offset, const size_t size, const Advice advice) const
+{
+#ifndef _WIN32
+	if (!_data || offset >= _size) return;
+	// Ranges must start on a page boundary
+	static const size_t pageSize = sysconf(_SC_PAGESIZE);
+	const size_t start = offset - offset%pageSize;
+	const size_t end = std::min(_size, offset+size);
+	const int flag =
+		(advice == Advice::Sequential)?MADV_SEQUENTIAL:
+		(advice == Advice::WillNeed)?MADV_WILLNEED:
+		MADV_NORMAL;
+	madvise((void*)(_data+start), end-start, flag);
+#else
+	(void)offset; (void)size; (void)advice;
+#endif
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if (_data) UnmapViewOfFile(_data);
+	if (_mapping) CloseHandle(_mapping);
+	if (_file) CloseHandle(_file);
+	_mapping = nullptr;
+	_file = nullptr;
+#else
+	if (_data) munmap((void*)_data, _size);
+#endif
+	_data = nullptr;
+	_size = 0;
+}
+
+MappedFileCache::MappedFileCache(const size_t capacity, const MappedFile::Advice advice) :
+	_capacity(std::max<size_t>(1, capacity)), _advice(advice)
+{
+}
+
+shared_ptr<const MappedFile> MappedFileCache::get(const string &filename)
+{
+	{
+		lock_guard<mutex> lk(_mtx);
+		auto it = _index.find(filename);
+		if (it != _index.end())
+		{
+			_files.splice(_files.begin(), _files, it->second);
+			return it->second->second;
+		}
+	}
+
+	// Other threads keep reading while this one maps
+	shared_ptr<const MappedFile> file = make_shared<const MappedFile>(filename);
+	if (_advice != MappedFile::Advice::Normal) file->advise(0, file->size(), _advice);
+
+	lock_guard<mutex> lk(_mtx);
+	auto it = _index.find(filename);
+	// Mapped by another thread meanwhile
+	if (it != _index.end()) return it->second->second;
+	_files.emplace_front(filename, file);
+	_index[filename] = _files.begin();
+	while (_files.size() > _capacity)
+	{
+		_index.erase(_files.back().first);
+		_files.pop_back();
+	}
+	return file;
+}
+
+shared_ptr<const MappedFile> MappedFileCache::find(const string &filename) const
+{
+	lock_guard<mutex> lk(_mtx);
+	auto it = _index.find(filename);
+	return (it == _index.end())?nullptr:it->second->second;
+}
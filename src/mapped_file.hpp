@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+
+/**
+ * Read-only memory mapping of a whole file
+ */
+class MappedFile
+{
+public:
+	/// Expected access pattern of a range, hint for the OS page cache
+	enum class Advice
+	{
+		Normal,
+		/// Read once from start to end, aggressive readahead
+		Sequential,
+		/// Read soon, start reading ahead now
+		WillNeed
+	};
+
+	MappedFile() = default;
+	/**
+	 * Maps a file, throws runtime_error if it can't be opened or mapped
+	 * @param filename file to map
+	 */
+	explicit MappedFile(const std::string &filename);
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+	MappedFile(MappedFile &&other);
+	MappedFile &operator=(MappedFile &&other);
+	~MappedFile();
+	/// Returns the first byte of the file, null if nothing is mapped
+	const uint8_t *data() const;
+	/// Returns the size of the file in bytes
+	size_t size() const;
+	/**
+	 * Hints the expected access pattern of a range (no-op if unsupported)
+	 * @param offset start of the range in bytes
+	 * @param size size of the range in bytes
+	 * @param advice access pattern
+	 */
+	void advise(size_t offset, size_t size, Advice advice) const;
+
+private:
+	/// Unmaps the file
+	void close();
+
+	const uint8_t *_data = nullptr;
+	size_t _size = 0;
+#ifdef _WIN32
+	void *_file = nullptr;
+	void *_mapping = nullptr;
+#endif
+};
+
+/**
+ * Mappings of files shared by all their readers, only the most recently used
+ * files stay mapped (thread safe)
+ */
+class MappedFileCache
+{
+public:
+	/**
+	 * @param capacity number of files kept mapped
+	 * @param advice access pattern hinted for each new mapping
+	 */
+	explicit MappedFileCache(size_t capacity,
+		MappedFile::Advice advice=MappedFile::Advice::Normal);
+	/**
+	 * Returns the mapping of a file, maps it if it isn't mapped and unmaps the
+	 * least recently used files over capacity, throws runtime_error if it
+	 * can't be mapped (readers keep the mappings they got until they drop them)
+	 * @param filename file to map
+	 * @return mapping of the whole file
+	 */
+	std::shared_ptr<const MappedFile> get(const std::string &filename);
+	/**
+	 * Returns the mapping of a file only if it is already mapped
+	 * @param filename mapped file
+	 * @return mapping of the whole file, null if it isn't mapped
+	 */
+	std::shared_ptr<const MappedFile> find(const std::string &filename) const;
+
+private:
+	typedef std::list<std::pair<std::string, std::shared_ptr<const MappedFile>>> FileList;
+
+	/// Number of files kept mapped
+	size_t _capacity;
+	/// Access pattern of new mappings
+	MappedFile::Advice _advice;
+	/// Mapped files, most recently used first
+	FileList _files;
+	/// Position of each mapped file in _files
+	std::unordered_map<std::string, FileList::iterator> _index;
+	/// Synchronizes lookups, files are mapped without it
+	mutable std::mutex _mtx;
+};
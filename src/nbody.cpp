@@ -0,0 +1,433 @@
+#include "nbody.hpp"
+
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include <glm/gtc/constants.hpp>
+
+using namespace glm;
+using namespace std;
+
+/// Steps per period of the fastest orbit for accuracy
+static const double stepsPerOrbit = 64.0;
+/// Steps of the first advance(), before the cost of a step is known
+static const int firstAdvanceSteps = 16;
+/// Particles per force evaluation chunk
+static const size_t forceChunkSize = 64;
+/// Octree depth limit, deeper particles are merged in a single leaf
+static const int maxTreeDepth = 32;
+/// Independent accumulators of direct sums (vectorized lanes)
+static const int sumLanes = 4;
+
+void NBodySystem::init(const EntityCollection &collection, const double epoch,
+	const int threads)
+{
+	reset(collection, epoch);
+	_pool.init(threads);
+}
+
+void NBodySystem::reset(const EntityCollection &collection, const double epoch)
+{
+	const auto &all = collection.getAll();
+	const vector<Orbit> orbits = collection.getOrbits();
+	const size_t n = all.size();
+	_parents = collection.getParentIndices();
+	_epoch = epoch;
+
+	// Absolute Kepler state vectors, parents first
+	vector<dvec3> pos(n), vel(n);
+	vector<double> gm(n, 0.0), subtreeGM(n, 0.0);
+	for (size_t i=0;i<n;++i)
+	{
+		const int parent = _parents[i];
+		pos[i] = orbits[i].computePosition(epoch) + ((parent!=-1)?pos[parent]:dvec3(0.0));
+		vel[i] = orbits[i].computeVelocity(epoch) + ((parent!=-1)?vel[parent]:dvec3(0.0));
+		const EntityParam &param = all[i].getParam();
+		gm[i] = param.isBody()?param.getModel().getGM():0.0;
+		subtreeGM[i] = gm[i];
+	}
+	for (size_t i=n;i-->0;)
+	{
+		if (_parents[i] != -1) subtreeGM[_parents[i]] += subtreeGM[i];
+	}
+
+	// Bodies and barycenters without massive descendants are integrated
+	_x.clear(); _y.clear(); _z.clear();
+	_vx.clear(); _vy.clear(); _vz.clear();
+	_gm.clear();
+	_entity.clear();
+	_massive.clear();
+	_sourceOf.clear();
+	_particleOf.assign(n, -1);
+	_absolute.resize(n);
+	_weighted.resize(n);
+	_subtreeGM.resize(n);
+	for (size_t i=0;i<n;++i)
+	{
+		if (!all[i].getParam().isBody() && subtreeGM[i] > 0.0) continue;
+		_particleOf[i] = _x.size();
+		if (gm[i] > 0.0) _massive.push_back(_x.size());
+		_sourceOf.push_back((gm[i] > 0.0)?(int)_massive.size()-1:-1);
+		_x.push_back(pos[i].x); _y.push_back(pos[i].y); _z.push_back(pos[i].z);
+		_vx.push_back(vel[i].x); _vy.push_back(vel[i].y); _vz.push_back(vel[i].z);
+		_gm.push_back(gm[i]);
+		_entity.push_back(i);
+	}
+
+	// Steps follow the shortest two-body period between particles, as orbits
+	// of bodies around their own barycenter are not physical
+	_maxStep = numeric_limits<double>::infinity();
+	for (size_t i=0;i<_x.size();++i)
+	{
+		for (int j : _massive)
+		{
+			if (j == (int)i) continue;
+			const dvec3 d(_x[j]-_x[i], _y[j]-_y[i], _z[j]-_z[i]);
+			const double r = length(d);
+			const double period = two_pi<double>()*sqrt(r*r*r/(_gm[i]+_gm[j]));
+			_maxStep = std::min(_maxStep, period/stepsPerOrbit);
+		}
+	}
+	if (!std::isfinite(_maxStep)) _maxStep = 3600.0;
+
+	const size_t count = _x.size();
+	_ax.assign(count, 0.0); _ay.assign(count, 0.0); _az.assign(count, 0.0);
+	const size_t sources = _massive.size();
+	_sx.resize(sources); _sy.resize(sources); _sz.resize(sources); _sgm.resize(sources);
+	for (size_t k=0;k<sources;++k) _sgm[k] = _gm[_massive[k]];
+
+	_stepCost = 0.0;
+	_lastStepSize = 0.0;
+}
+
+void NBodySystem::advance(const double dt)
+{
+	if (dt == 0.0 || _x.empty()) return;
+
+	const auto start = chrono::steady_clock::now();
+
+	// Enough steps for accuracy, as long as they fit in the time budget
+	int steps = (int)std::min(1e9, ceil(abs(dt)/_maxStep));
+	const int affordable = (_stepCost > 0.0)?
+		(int)std::min(1e9, _timeBudget/_stepCost):firstAdvanceSteps;
+	steps = std::max(1, std::min(steps, affordable));
+	const double h = dt/steps;
+
+	// Fourth order Yoshida coefficients
+	const double w1 = 1.0/(2.0 - cbrt(2.0));
+	const double w0 = 1.0 - 2.0*w1;
+	for (int i=0;i<steps;++i)
+	{
+		drift(0.5*w1*h);
+		computeAccelerations();
+		kick(w1*h);
+		drift(0.5*(w0+w1)*h);
+		computeAccelerations();
+		kick(w0*h);
+		drift(0.5*(w0+w1)*h);
+		computeAccelerations();
+		kick(w1*h);
+		drift(0.5*w1*h);
+	}
+	_epoch += dt;
+	_lastStepSize = h;
+
+	const double cost = chrono::duration<double>(
+		chrono::steady_clock::now()-start).count()/steps;
+	_stepCost = (_stepCost > 0.0)?0.8*_stepCost + 0.2*cost:cost;
+}
+
+double NBodySystem::getEpoch() const
+{
+	return _epoch;
+}
+
+void NBodySystem::computeRelativePositions(dvec3 *positions)
+{
+	const size_t n = _particleOf.size();
+	vector<dvec3> &absolute = _absolute;
+	vector<dvec3> &weighted = _weighted;
+	vector<double> &subtreeGM = _subtreeGM;
+	fill(weighted.begin(), weighted.end(), dvec3(0.0));
+	fill(subtreeGM.begin(), subtreeGM.end(), 0.0);
+
+	// GM-weighted sums of descendants, children first
+	for (size_t i=n;i-->0;)
+	{
+		const int p = _particleOf[i];
+		if (p != -1)
+		{
+			absolute[i] = dvec3(_x[p], _y[p], _z[p]);
+			weighted[i] += _gm[p]*absolute[i];
+			subtreeGM[i] += _gm[p];
+		}
+		else
+		{
+			absolute[i] = weighted[i]/subtreeGM[i];
+		}
+		if (_parents[i] != -1)
+		{
+			weighted[_parents[i]] += weighted[i];
+			subtreeGM[_parents[i]] += subtreeGM[i];
+		}
+	}
+
+	for (size_t i=0;i<n;++i)
+	{
+		const int parent = _parents[i];
+		positions[i] = absolute[i] - ((parent!=-1)?absolute[parent]:dvec3(0.0));
+	}
+}
+
+void NBodySystem::setTimeBudget(const double milliseconds)
+{
+	_timeBudget = milliseconds*0.001;
+}
+
+double NBodySystem::getLastStepSize() const
+{
+	return _lastStepSize;
+}
+
+vector<double> NBodySystem::getStateVectors() const
+{
+	vector<double> state;
+	state.reserve(_x.size()*6);
+	for (size_t i=0;i<_x.size();++i)
+	{
+		const double s[6] = {_x[i], _y[i], _z[i], _vx[i], _vy[i], _vz[i]};
+		state.insert(state.end(), s, s+6);
+	}
+	return state;
+}
+
+void NBodySystem::setStateVectors(const vector<double> &stateVectors, const double epoch)
+{
+	if (stateVectors.size() != _x.size()*6)
+		throw runtime_error("State vectors don't match N-body particles");
+	for (size_t i=0;i<_x.size();++i)
+	{
+		const double *s = &stateVectors[i*6];
+		_x[i] = s[0]; _y[i] = s[1]; _z[i] = s[2];
+		_vx[i] = s[3]; _vy[i] = s[4]; _vz[i] = s[5];
+	}
+	_epoch = epoch;
+}
+
+void NBodySystem::computeAccelerations()
+{
+	// Gather massive particles
+	for (size_t k=0;k<_massive.size();++k)
+	{
+		const int p = _massive[k];
+		_sx[k] = _x[p];
+		_sy[k] = _y[p];
+		_sz[k] = _z[p];
+	}
+
+	if (_massive.size() >= _treeThreshold)
+	{
+		buildTree();
+		_pool.parallelFor(_x.size(), forceChunkSize, [&](size_t begin, size_t end)
+		{
+			treeSum(begin, end);
+		});
+	}
+	else
+	{
+		_pool.parallelFor(_x.size(), forceChunkSize, [&](size_t begin, size_t end)
+		{
+			directSum(begin, end);
+		});
+	}
+}
+
+void NBodySystem::directSum(const size_t begin, const size_t end)
+{
+	const size_t sources = _sx.size();
+	const double *sx = _sx.data();
+	const double *sy = _sy.data();
+	const double *sz = _sz.data();
+	const double *sgm = _sgm.data();
+
+	for (size_t i=begin;i<end;++i)
+	{
+		const double x = _x[i];
+		const double y = _y[i];
+		const double z = _z[i];
+		// One accumulator per lane so the inner loop is vectorized
+		double ax[sumLanes] = {};
+		double ay[sumLanes] = {};
+		double az[sumLanes] = {};
+		size_t j = 0;
+		for (;j+sumLanes<=sources;j+=sumLanes)
+		{
+			for (int l=0;l<sumLanes;++l)
+			{
+				const double dx = sx[j+l]-x;
+				const double dy = sy[j+l]-y;
+				const double dz = sz[j+l]-z;
+				const double r2 = dx*dx + dy*dy + dz*dz;
+				// The particle itself is at distance 0
+				const double f = (r2 > 0.0)?sgm[j+l]/(r2*sqrt(r2)):0.0;
+				ax[l] += dx*f;
+				ay[l] += dy*f;
+				az[l] += dz*f;
+			}
+		}
+		for (;j<sources;++j)
+		{
+			const double dx = sx[j]-x;
+			const double dy = sy[j]-y;
+			const double dz = sz[j]-z;
+			const double r2 = dx*dx + dy*dy + dz*dz;
+			const double f = (r2 > 0.0)?sgm[j]/(r2*sqrt(r2)):0.0;
+			ax[0] += dx*f;
+			ay[0] += dy*f;
+			az[0] += dz*f;
+		}
+		double sumX = 0.0, sumY = 0.0, sumZ = 0.0;
+		for (int l=0;l<sumLanes;++l)
+		{
+			sumX += ax[l];
+			sumY += ay[l];
+			sumZ += az[l];
+		}
+		_ax[i] = sumX;
+		_ay[i] = sumY;
+		_az[i] = sumZ;
+	}
+}
+
+void NBodySystem::buildTree()
+{
+	// Bounding cube of massive particles
+	dvec3 minPos(numeric_limits<double>::max());
+	dvec3 maxPos(-numeric_limits<double>::max());
+	for (size_t k=0;k<_sx.size();++k)
+	{
+		minPos = glm::min(minPos, dvec3(_sx[k], _sy[k], _sz[k]));
+		maxPos = glm::max(maxPos, dvec3(_sx[k], _sy[k], _sz[k]));
+	}
+	const dvec3 extent = maxPos-minPos;
+
+	_tree.clear();
+	Node root;
+	root.center = (minPos+maxPos)*0.5;
+	root.halfSize = std::max(extent.x, std::max(extent.y, extent.z))*0.5001 + 1.0;
+	_tree.push_back(root);
+
+	for (size_t k=0;k<_sx.size();++k) insert(0, k, 0);
+
+	// Mass sums to centers of mass
+	for (Node &node : _tree)
+	{
+		if (node.gm > 0.0) node.centerOfMass /= node.gm;
+	}
+}
+
+void NBodySystem::insert(const int node, const int source, const int depth)
+{
+	const dvec3 pos(_sx[source], _sy[source], _sz[source]);
+	// Sums until the tree is complete
+	_tree[node].centerOfMass += _sgm[source]*pos;
+	_tree[node].gm += _sgm[source];
+
+	if (_tree[node].children == -1)
+	{
+		if (_tree[node].source == -1)
+		{
+			_tree[node].source = source;
+			return;
+		}
+		// Coincident particles share a leaf
+		if (depth >= maxTreeDepth) return;
+
+		// Split the leaf and move its particle down
+		const int children = _tree.size();
+		const double half = _tree[node].halfSize*0.5;
+		for (int c=0;c<8;++c)
+		{
+			Node child;
+			child.center = _tree[node].center + half*dvec3(
+				(c&1)?1.0:-1.0, (c&2)?1.0:-1.0, (c&4)?1.0:-1.0);
+			child.halfSize = half;
+			_tree.push_back(child);
+		}
+		_tree[node].children = children;
+		const int previous = _tree[node].source;
+		_tree[node].source = -1;
+		insert(children + octant(_tree[node].center, previous), previous, depth+1);
+	}
+
+	insert(_tree[node].children + octant(_tree[node].center, source), source, depth+1);
+}
+
+int NBodySystem::octant(const dvec3 &center, const int source) const
+{
+	return ((_sx[source]>=center.x)?1:0) |
+		((_sy[source]>=center.y)?2:0) |
+		((_sz[source]>=center.z)?4:0);
+}
+
+void NBodySystem::treeSum(const size_t begin, const size_t end)
+{
+	const double theta2 = _theta*_theta;
+	vector<int> stack;
+	stack.reserve(8*maxTreeDepth);
+	for (size_t i=begin;i<end;++i)
+	{
+		const dvec3 pos(_x[i], _y[i], _z[i]);
+		const int self = _sourceOf[i];
+		dvec3 acc(0.0);
+		stack.clear();
+		stack.push_back(0);
+		while (!stack.empty())
+		{
+			const Node &node = _tree[stack.back()];
+			stack.pop_back();
+			if (node.gm <= 0.0) continue;
+			// A leaf holding only this particle
+			if (node.children == -1 && node.source == self && node.gm == _sgm[self])
+				continue;
+
+			const dvec3 d = node.centerOfMass - pos;
+			const double r2 = dot(d, d);
+			const double size = 2.0*node.halfSize;
+			if (node.children == -1 || size*size < theta2*r2)
+			{
+				if (r2 > 0.0) acc += d*(node.gm/(r2*sqrt(r2)));
+			}
+			else
+			{
+				for (int c=0;c<8;++c) stack.push_back(node.children+c);
+			}
+		}
+		_ax[i] = acc.x;
+		_ay[i] = acc.y;
+		_az[i] = acc.z;
+	}
+}
+
+void NBodySystem::drift(const double h)
+{
+	for (size_t i=0;i<_x.size();++i)
+	{
+		_x[i] += _vx[i]*h;
+		_y[i] += _vy[i]*h;
+		_z[i] += _vz[i]*h;
+	}
+}
+
+void NBodySystem::kick(const double h)
+{
+	for (size_t i=0;i<_x.size();++i)
+	{
+		_vx[i] += _ax[i]*h;
+		_vy[i] += _ay[i]*h;
+		_vz[i] += _az[i]*h;
+	}
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "entity.hpp"
+#include "worker_pool.hpp"
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+/**
+ * Newtonian N-body integration of entities, alternative to Kepler orbits
+ *
+ * State vectors are seeded from the Kepler orbits at an epoch, then advanced
+ * with a fourth order Yoshida composition of leapfrog steps (symplectic, so
+ * energy errors stay bounded over long runs). Bodies are particles with
+ * their model's GM (bodies without GM are massless test particles);
+ * barycenters are not integrated but placed at the GM-weighted center of
+ * their descendants.
+ *
+ * Accelerations are summed directly over structure-of-arrays sources on a
+ * worker pool, or approximated with a Barnes-Hut octree when there are many
+ * massive particles.
+ */
+class NBodySystem
+{
+public:
+	NBodySystem() = default;
+	/**
+	 * Seeds state vectors from the Kepler orbits of entities
+	 * @param collection entities, already initialized
+	 * @param epoch epoch of the state vectors in seconds
+	 * @param threads number of force evaluation threads (0 for one per core)
+	 */
+	void init(const EntityCollection &collection, double epoch, int threads=0);
+	/**
+	 * Seeds state vectors from the Kepler orbits of entities again, keeping
+	 * the force evaluation threads
+	 * @param collection entities, the same as in init()
+	 * @param epoch epoch of the state vectors in seconds
+	 */
+	void reset(const EntityCollection &collection, double epoch);
+	/**
+	 * Advances the simulation, in as many substeps as the time budget allows
+	 * @param dt simulated time in seconds (can be negative)
+	 */
+	void advance(double dt);
+	/// Returns the epoch of the current state in seconds
+	double getEpoch() const;
+	/**
+	 * Computes positions of all entities relative to their parent
+	 * @param positions output array, in the order of EntityCollection::getAll()
+	 */
+	void computeRelativePositions(glm::dvec3 *positions);
+	/**
+	 * Sets the wall time spent integrating per advance() call
+	 * @param milliseconds time budget, the step size grows past this budget
+	 */
+	void setTimeBudget(double milliseconds);
+	/// Returns the step size of the last advance() in seconds
+	double getLastStepSize() const;
+	/// Returns positions then velocities of all particles (x,y,z,vx,vy,vz each)
+	std::vector<double> getStateVectors() const;
+	/**
+	 * Restores particles saved with getStateVectors(), throws runtime_error
+	 * if the number of particles doesn't match
+	 * @param stateVectors saved state vectors
+	 * @param epoch epoch of the state vectors in seconds
+	 */
+	void setStateVectors(const std::vector<double> &stateVectors, double epoch);
+
+private:
+	/// Computes accelerations of all particles from their current positions
+	void computeAccelerations();
+	/// Direct summation for particles [begin,end)
+	void directSum(size_t begin, size_t end);
+	/// Builds the Barnes-Hut octree of massive particles
+	void buildTree();
+	/// Octree approximation for particles [begin,end)
+	void treeSum(size_t begin, size_t end);
+	/// Moves positions along velocities
+	void drift(double h);
+	/// Moves velocities along accelerations
+	void kick(double h);
+
+	/// Octree node
+	struct Node
+	{
+		/// Center of the cube
+		glm::dvec3 center;
+		/// Half of the side of the cube
+		double halfSize = 0.0;
+		/// GM-weighted center of particles inside
+		glm::dvec3 centerOfMass = glm::dvec3(0.0);
+		/// Sum of GM of particles inside
+		double gm = 0.0;
+		/// Index of the first of 8 children, -1 for leaves
+		int children = -1;
+		/// Massive particle of a leaf, -1 if empty
+		int source = -1;
+	};
+
+	/**
+	 * Adds a massive particle to a node and places it in a leaf below
+	 * @param node index of the node
+	 * @param source index of the massive particle
+	 * @param depth depth of the node
+	 */
+	void insert(int node, int source, int depth);
+	/// Returns the child (0-7) of a node center where a massive particle lies
+	int octant(const glm::dvec3 &center, int source) const;
+
+	/// Simulated epoch in seconds
+	double _epoch = 0.0;
+	/// Largest step for accuracy (fraction of the shortest orbit)
+	double _maxStep = 0.0;
+	/// Step size used in last advance()
+	double _lastStepSize = 0.0;
+	/// Wall time budget per advance() in seconds
+	double _timeBudget = 0.004;
+	/// Smoothed wall time of a single step in seconds
+	double _stepCost = 0.0;
+
+	// Particles (structure of arrays)
+	std::vector<double> _x, _y, _z;
+	std::vector<double> _vx, _vy, _vz;
+	std::vector<double> _ax, _ay, _az;
+	std::vector<double> _gm;
+	/// Entity index of each particle
+	std::vector<int> _entity;
+
+	/// Indices of particles with a positive GM
+	std::vector<int> _massive;
+	/// Index in _massive of each particle, -1 if massless
+	std::vector<int> _sourceOf;
+	// Positions and GM of massive particles, gathered for force loops
+	std::vector<double> _sx, _sy, _sz, _sgm;
+
+	/// Particle of each entity, -1 for barycenters
+	std::vector<int> _particleOf;
+	/// Parent index of each entity (-1 if none)
+	std::vector<int> _parents;
+	// Scratch of computeRelativePositions(), sized per entity
+	std::vector<glm::dvec3> _absolute, _weighted;
+	std::vector<double> _subtreeGM;
+
+	/// Barnes-Hut octree, root first
+	std::vector<Node> _tree;
+	/// Opening angle criterion (node size / distance)
+	double _theta = 0.5;
+	/// Massive particle count from which Barnes-Hut replaces direct sums
+	size_t _treeThreshold = 2048;
+
+	WorkerPool _pool;
+};
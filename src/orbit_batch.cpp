@@ -0,0 +1,80 @@
+#include "orbit_batch.hpp"
+
+#include <cmath>
+
+#include <glm/gtc/constants.hpp>
+
+using namespace glm;
+using namespace std;
+
+void OrbitBatch::init(const vector<Orbit> &orbits)
+{
+	const size_t n = orbits.size();
+	for (auto v : {&_ecc, &_meanMotion, &_m0, &_sma, &_smi,
+		&_px, &_py, &_pz, &_qx, &_qy, &_qz, &_mean, &_anomaly})
+	{
+		v->assign(n, 0.0);
+	}
+
+	for (size_t i=0;i<n;++i)
+	{
+		const Orbit &o = orbits[i];
+		const double ecc = o.getEccentricity();
+		const dvec3 p = o.getPeriapsisDirection();
+		const dvec3 q = o.getPerpendicularDirection();
+		_ecc[i] = ecc;
+		_meanMotion[i] = o.getMeanMotion();
+		_m0[i] = o.getMeanAnomalyAtEpoch();
+		_sma[i] = o.getSemiMajorAxis();
+		_smi[i] = o.getSemiMajorAxis()*sqrt(1-ecc*ecc);
+		_px[i] = p.x; _py[i] = p.y; _pz[i] = p.z;
+		_qx[i] = q.x; _qy[i] = q.y; _qz[i] = q.z;
+	}
+}
+
+size_t OrbitBatch::size() const
+{
+	return _ecc.size();
+}
+
+void OrbitBatch::computePositions(const double epoch, dvec3 *positions)
+{
+	const size_t n = size();
+
+	const double *ecc = _ecc.data();
+	const double *meanMotion = _meanMotion.data();
+	const double *m0 = _m0.data();
+	double *mean = _mean.data();
+	double *anomaly = _anomaly.data();
+
+	// Mean anomaly and starting value of eccentric anomaly
+	for (size_t i=0;i<n;++i)
+	{
+		mean[i] = KeplerSolver::wrapAngle(epoch*meanMotion[i] + m0[i]);
+		anomaly[i] = KeplerSolver::starter(mean[i], ecc[i]);
+	}
+
+	// Danby iterations over every lane, until the largest correction is small
+	for (int it=0;it<_maxIterations;++it)
+	{
+		double maxDelta = 0.0;
+		for (size_t i=0;i<n;++i)
+		{
+			const double delta = KeplerSolver::danbyStep(anomaly[i], mean[i], ecc[i]);
+			anomaly[i] += delta;
+			maxDelta = glm::max(maxDelta, abs(delta));
+		}
+		if (maxDelta < _tolerance) break;
+	}
+
+	// Perifocal to parent frame
+	for (size_t i=0;i<n;++i)
+	{
+		const double x = _sma[i]*(cos(anomaly[i]) - ecc[i]);
+		const double y = _smi[i]*sin(anomaly[i]);
+		positions[i] = dvec3(
+			x*_px[i] + y*_qx[i],
+			x*_py[i] + y*_qy[i],
+			x*_pz[i] + y*_qz[i]);
+	}
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "entity.hpp"
+#include "kepler.hpp"
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+/**
+ * Propagates many Kepler orbits at once
+ *
+ * Orbital elements are stored as structure-of-arrays with each orbit's
+ * perifocal basis precomputed, and every stage of the propagation (mean
+ * anomaly, Kepler's equation, perifocal to world) is a branch-free loop over
+ * contiguous arrays so the compiler can vectorize it. Kepler's equation is
+ * solved with Danby's iteration until the largest correction of the whole
+ * batch is below tolerance.
+ */
+class OrbitBatch
+{
+public:
+	OrbitBatch() = default;
+	/**
+	 * Copies the orbital elements of a set of orbits
+	 * @param orbits orbits to propagate, indices are kept in computePositions()
+	 */
+	void init(const std::vector<Orbit> &orbits);
+	/// Returns the number of orbits in the batch
+	size_t size() const;
+	/**
+	 * Computes cartesian coordinates of all orbits around their parent entity
+	 * @param epoch epoch in seconds
+	 * @param positions output array of size() coordinates
+	 */
+	void computePositions(double epoch, glm::dvec3 *positions);
+
+private:
+	// Orbital elements
+	/// Eccentricity
+	std::vector<double> _ecc;
+	/// Mean motion (radians per second)
+	std::vector<double> _meanMotion;
+	/// Mean anomaly at epoch (radians)
+	std::vector<double> _m0;
+	/// Semi-major axis (meters)
+	std::vector<double> _sma;
+	/// Semi-minor axis (meters)
+	std::vector<double> _smi;
+
+	// Perifocal basis
+	/// Direction of periapsis (x, y and z components)
+	std::vector<double> _px, _py, _pz;
+	/// Direction 90 degrees ahead of periapsis (x, y and z components)
+	std::vector<double> _qx, _qy, _qz;
+
+	/// Convergence threshold of Kepler's equation (radians)
+	double _tolerance = 1e-12;
+	/// Hard limit of Kepler iterations
+	int _maxIterations = 16;
+
+	/// Scratch mean anomaly array, reused between calls
+	std::vector<double> _mean;
+	/// Scratch eccentric anomaly array, reused between calls
+	std::vector<double> _anomaly;
+};
@@ -0,0 +1,111 @@
+#include "page_allocator.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+void PageAllocator::init(const int pages)
+{
+	if (pages <= 0) throw runtime_error("Page allocator needs at least one page");
+	_pageCount = pages;
+	_freePages = pages;
+	_maxOrder = getOrder(pages+1)-1;
+	_freeHeads.assign(_maxOrder+1, -1);
+	_next.assign(pages, -1);
+	_prev.assign(pages, -1);
+	_freeOrder.assign(pages, -1);
+	_usedOrder.assign(pages, -1);
+
+	// Root blocks, each aligned on its size
+	int offset = 0;
+	for (int order=_maxOrder;order>=0;--order)
+	{
+		if (pages & (1<<order))
+		{
+			pushFree(offset, order);
+			offset += 1<<order;
+		}
+	}
+}
+
+int PageAllocator::allocate(const int pages)
+{
+	const int order = getOrder(pages);
+	if (order > _maxOrder) return -1;
+
+	int found = order;
+	while (found <= _maxOrder && _freeHeads[found] == -1) ++found;
+	if (found > _maxOrder) return -1;
+
+	const int offset = _freeHeads[found];
+	removeFree(offset, found);
+	// Second halves go back to the free lists until the block fits
+	while (found > order)
+	{
+		--found;
+		pushFree(offset+(1<<found), found);
+	}
+	_usedOrder[offset] = order;
+	_freePages -= 1<<order;
+	return offset;
+}
+
+void PageAllocator::free(int offset)
+{
+	if (offset < 0 || offset >= _pageCount || _usedOrder[offset] == -1)
+		throw runtime_error("Freeing pages that aren't allocated");
+
+	int order = _usedOrder[offset];
+	_usedOrder[offset] = -1;
+	_freePages += 1<<order;
+
+	// Roots are aligned on their size, so a buddy of the same order can't be
+	// in another root
+	while (order < _maxOrder)
+	{
+		const int buddy = offset^(1<<order);
+		if (buddy >= _pageCount || _freeOrder[buddy] != order) break;
+		removeFree(buddy, order);
+		offset = std::min(offset, buddy);
+		++order;
+	}
+	pushFree(offset, order);
+}
+
+int PageAllocator::getMaxPages() const
+{
+	return (_maxOrder >= 0)?(1<<_maxOrder):0;
+}
+
+int PageAllocator::getFreePages() const
+{
+	return _freePages;
+}
+
+int PageAllocator::getOrder(const int pages)
+{
+	int order = 0;
+	while ((1<<order) < pages) ++order;
+	return order;
+}
+
+void PageAllocator::pushFree(const int offset, const int order)
+{
+	const int head = _freeHeads[order];
+	_next[offset] = head;
+	_prev[offset] = -1;
+	if (head != -1) _prev[head] = offset;
+	_freeHeads[order] = offset;
+	_freeOrder[offset] = order;
+}
+
+void PageAllocator::removeFree(const int offset, const int order)
+{
+	const int next = _next[offset];
+	const int prev = _prev[offset];
+	if (prev != -1) _next[prev] = next;
+	else _freeHeads[order] = next;
+	if (next != -1) _prev[next] = prev;
+	_freeOrder[offset] = -1;
+}
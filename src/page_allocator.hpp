@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+/**
+ * Buddy allocator of contiguous page ranges
+ *
+ * Pages are handed out in blocks of a power of two pages, aligned on their
+ * size. Free blocks of each size are kept in intrusive linked lists, so an
+ * allocation splits the smallest free block that is large enough and freeing
+ * merges a block back with its buddy when it is free too. Both cost at most
+ * one step per order (log2 of the page count), independently of the number
+ * of pages or of allocations.
+ *
+ * Page counts that aren't a power of two are split in one root block per
+ * set bit, largest first.
+ */
+class PageAllocator
+{
+public:
+	PageAllocator() = default;
+	/**
+	 * Makes all pages free
+	 * @param pages number of pages to allocate from
+	 */
+	void init(int pages);
+	/**
+	 * Allocates a block of contiguous pages
+	 * @param pages number of pages, rounded up to a power of two
+	 * @return index of the first page of the block, -1 if no block is free
+	 */
+	int allocate(int pages);
+	/**
+	 * Frees a block returned by allocate()
+	 * @param offset index of the first page of the block
+	 */
+	void free(int offset);
+	/// Returns the largest number of pages a single allocation can get
+	int getMaxPages() const;
+	/// Returns the number of pages not in any allocated block
+	int getFreePages() const;
+
+private:
+	/// Order of the smallest block holding a number of pages
+	static int getOrder(int pages);
+	/// Adds a block to the free list of its order
+	void pushFree(int offset, int order);
+	/// Takes a block out of the free list of its order
+	void removeFree(int offset, int order);
+
+	/// Number of pages
+	int _pageCount = 0;
+	/// Number of free pages
+	int _freePages = 0;
+	/// Order of the largest root block
+	int _maxOrder = -1;
+	/// First free block of each order, -1 if none
+	std::vector<int> _freeHeads;
+	/// Next and previous free blocks of the same order, by first page
+	std::vector<int> _next, _prev;
+	/// Order of the free block starting at a page, -1 if none
+	std::vector<int8_t> _freeOrder;
+	/// Order of the allocated block starting at a page, -1 if none
+	std::vector<int8_t> _usedOrder;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "entity.hpp"
+#include "small_body.hpp"
 #include <glm/glm.hpp>
 #include <string>
 
@@ -28,10 +29,33 @@ public:
 		int maxTexSize;
 		/// Wait for whole texture to load before displaying
 		int syncTexLoading;
+		/// Memory map texture files instead of reading them through streams
+		bool mappedTexLoading;
+		/// Number of texture loading threads
+		int texLoadingThreads;
+		/// Only stream the tiles of body textures a feedback pass asks for
+		bool virtualTexturing;
+		/// Memory budget of stream textures in MiB, 0 for none
+		int textureBudget;
+		/// Time budget of texture uploads per frame in milliseconds
+		float uploadBudget;
 		/// Window width in pixels
 		unsigned windowWidth;
 		/// Window height in pixels
 		unsigned windowHeight;
+		/// Asteroids and comets rendered as points
+		const SmallBodyCollection * smallBodies;
+	};
+
+	/// Body whose textures will soon be needed
+	struct TexPrefetch
+	{
+		/// Body to load the textures of
+		EntityHandle body;
+		/// Expected distance of the view when needed
+		float distance;
+		/// Seconds until needed, negative to only warm textures up
+		float deadline;
 	};
 
 	struct RenderInfo
@@ -52,6 +76,10 @@ public:
 		bool bloom;
 		/// Ids of entities currently in focus
 		std::vector<EntityHandle> focusedEntitiesId;
+		/// Bodies whose textures will soon be needed
+		std::vector<TexPrefetch> texPrefetch;
+		/// Frame time doesn't matter, textures upload as fast as possible
+		bool texCatchUp;
 		/// Name of focused body
 		std::string focusedEntityName;
 		/// Fade in/out of focused body name
@@ -75,6 +103,13 @@ public:
 	 */
 	virtual void takeScreenshot(const std::string &filename) {}
 
+	/** Saves texture streaming telemetry, throws runtime_error if a file
+	 * can't be written
+	 * @param filename prefix of the files: .json for everything, _tiles.csv,
+	 * _textures.csv and _samples.csv for each table
+	 */
+	virtual void saveStreamTelemetry(const std::string &filename) {}
+
 	/** 
 	 * Deletes resources
 	 */
@@ -17,6 +17,9 @@
 using namespace glm;
 using namespace std;
 
+/// Intensity of a magnitude 0 small body point, before exposure
+static const float smallBodyBrightness = 1000.0;
+
 void RendererGL::windowHints()
 {
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
@@ -136,9 +139,29 @@ void RendererGL::createUBO()
 		{
 			data.bodyUBOs[h] = _uboBuffer.assignUBO(sizeof(BodyUBO));
 		}
+		// Small body UBO
+		data.smallBodyUBO = _uboBuffer.assignUBO(sizeof(SmallBodyUBO));
 	}
 
 	_uboBuffer.validate();
+
+	// Small body points, rewritten every frame
+	const size_t pointCount = _smallBodies?_smallBodies->size():0;
+	if (pointCount)
+	{
+		_pointBuffer = Buffer(
+			Buffer::Usage::DYNAMIC,
+			Buffer::Access::WRITE_ONLY);
+
+		for (auto &data : _dynamicData)
+		{
+			data.smallBodyPoints = _pointBuffer.assignVertices(pointCount, sizeof(vec4));
+			data.smallBodyDraw = DrawCommand(_pointVertexArray, GL_POINTS, pointCount,
+				{{0, _pointBuffer.getId(), data.smallBodyPoints, sizeof(vec4)}});
+		}
+
+		_pointBuffer.validate();
+	}
 }
 
 void RendererGL::init(const InitInfo &info)
@@ -148,6 +171,8 @@ void RendererGL::init(const InitInfo &info)
 	this->_maxTexSize = info.maxTexSize;
 	this->_windowWidth = info.windowWidth;
 	this->_windowHeight = info.windowHeight;
+	this->_smallBodies = info.smallBodies;
+	this->_virtualTexturing = info.virtualTexturing && !info.syncTexLoading;
 
 	// Find the sun
 	for (const auto &h : _entityCollection->getBodies())
@@ -155,10 +180,18 @@ void RendererGL::init(const InitInfo &info)
 		if (h.getParam().isStar()) _sun = h;
 	}
 
+	// Find the parent of small bodies
+	if (_smallBodies)
+		_smallBodyParent = _entityCollection->find(_smallBodies->getParentName());
+
 	this->_bufferFrames = 3; // triple-buffering
 
 	for (const auto &h : _entityCollection->getBodies())
+	{
 		this->_bodyData[h] = BodyData();
+		_feedbackBodies.push_back(h);
+		_bodyData[h].feedbackId = _feedbackBodies.size();
+	}
 
 	this->_fences.resize(_bufferFrames);
 
@@ -180,7 +213,12 @@ void RendererGL::init(const InitInfo &info)
 	_gui.init();
 
 	// Streamer init
-	_streamer.init(!info.syncTexLoading, 512*512, 200, _maxTexSize);
+	_streamer.init(unique_ptr<UploadBackend>(new UploadBackendGL()),
+		!info.syncTexLoading, 64*1024, 1024, _maxTexSize,
+		info.mappedTexLoading, info.texLoadingThreads,
+		_virtualTexturing?_virtualCacheTiles:0,
+		(size_t)std::max(0, info.textureBudget)*1024*1024);
+	_streamer.setUploadBudget(info.uploadBudget);
 
 	// Create starMap texture
 	_starMapTexHandle = _streamer.createTex(info.starMapFilename);
@@ -259,6 +297,13 @@ void RendererGL::createTextures()
 	glSamplerParameteri(_ringSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glSamplerParameteri(_ringSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glSamplerParameteri(_ringSampler, GL_TEXTURE_WRAP_S, GL_CLAMP);
+
+	// Tile caches have no mipmaps, tiles are sampled away from their edges
+	glCreateSamplers(1, &_virtualCacheSampler);
+	glSamplerParameteri(_virtualCacheSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glSamplerParameteri(_virtualCacheSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glSamplerParameteri(_virtualCacheSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glSamplerParameteri(_virtualCacheSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 }
 
 void RendererGL::createFlare()
@@ -307,6 +352,12 @@ void RendererGL::createVertexArray()
 	glEnableVertexArrayAttrib(_vertexArray, VERTEX_ATTRIB_NORMAL);
 	glVertexArrayAttribBinding(_vertexArray, VERTEX_ATTRIB_NORMAL, VERTEX_BINDING);
 	glVertexArrayAttribFormat(_vertexArray, VERTEX_ATTRIB_NORMAL, 3, GL_FLOAT, false, offsetof(Vertex, normal));
+
+	// Small body points (xyz position, w magnitude)
+	glCreateVertexArrays(1, &_pointVertexArray);
+	glEnableVertexArrayAttrib(_pointVertexArray, VERTEX_ATTRIB_POS);
+	glVertexArrayAttribBinding(_pointVertexArray, VERTEX_ATTRIB_POS, VERTEX_BINDING);
+	glVertexArrayAttribFormat(_pointVertexArray, VERTEX_ATTRIB_POS, 4, GL_FLOAT, false, 0);
 }
 
 void RendererGL::createRendertargets()
@@ -373,6 +424,34 @@ void RendererGL::createRendertargets()
 	for (size_t i=0;i<_bloomFBOs.size();++i)
 		glNamedFramebufferTexture(_bloomFBOs[i], GL_COLOR_ATTACHMENT0, _bloomViews[i], 0);
 
+	// Virtual texture feedback
+	if (_virtualTexturing)
+	{
+		_feedbackWidth = std::max(1, _windowWidth/_feedbackDivisor);
+		_feedbackHeight = std::max(1, _windowHeight/_feedbackDivisor);
+
+		glCreateTextures(GL_TEXTURE_2D, 1, &_feedbackRendertarget);
+		glTextureStorage2D(_feedbackRendertarget, 1, GL_RGBA16UI,
+			_feedbackWidth, _feedbackHeight);
+		glCreateTextures(GL_TEXTURE_2D, 1, &_feedbackDepth);
+		glTextureStorage2D(_feedbackDepth, 1, GL_DEPTH_COMPONENT24,
+			_feedbackWidth, _feedbackHeight);
+
+		glCreateFramebuffers(1, &_feedbackFBO);
+		glNamedFramebufferTexture(_feedbackFBO, GL_COLOR_ATTACHMENT0, _feedbackRendertarget, 0);
+		glNamedFramebufferTexture(_feedbackFBO, GL_DEPTH_ATTACHMENT, _feedbackDepth, 0);
+
+		// Read back a few frames later, when the frame fence is signaled
+		_feedbackBuffers.resize(_bufferFrames);
+		_feedbackPending.resize(_bufferFrames, false);
+		glCreateBuffers(_feedbackBuffers.size(), _feedbackBuffers.data());
+		for (GLuint buffer : _feedbackBuffers)
+		{
+			glNamedBufferStorage(buffer, _feedbackWidth*_feedbackHeight*4*sizeof(uint16_t),
+				nullptr, GL_CLIENT_STORAGE_BIT);
+		}
+	}
+
 	// Enable SRGB output
 	glEnable(GL_FRAMEBUFFER_SRGB);
 }
@@ -390,6 +469,7 @@ void RendererGL::createShaders()
 	const shader bodyVert = {GL_VERTEX_SHADER, "body.vert"};
 	const shader starMapVert = {GL_VERTEX_SHADER, "starmap.vert"};
 	const shader flareVert = {GL_VERTEX_SHADER, "flare.vert"};
+	const shader smallBodyVert = {GL_VERTEX_SHADER, "small_body.vert"};
 	const shader deferred = {GL_VERTEX_SHADER, "deferred.vert"};
 
 	// Tesc shaders
@@ -409,7 +489,9 @@ void RendererGL::createShaders()
 	const shader blur = {GL_FRAGMENT_SHADER, "blur.frag"};
 	const shader bloomAdd = {GL_FRAGMENT_SHADER, "bloom_add.frag"};
 	const shader flareFrag = {GL_FRAGMENT_SHADER, "flare.frag"};
+	const shader smallBodyFrag = {GL_FRAGMENT_SHADER, "small_body.frag"};
 	const shader tonemap = {GL_FRAGMENT_SHADER, "tonemap.frag"};
+	const shader feedback = {GL_FRAGMENT_SHADER, "feedback.frag"};
 
 	// Defines
 	const string isStar = "IS_STAR";
@@ -424,6 +506,8 @@ void RendererGL::createShaders()
 
 	const string bloom = "USE_BLOOM";
 
+	const string feedbackScale = "FEEDBACK_SCALE " + to_string(_feedbackDivisor);
+
 	const vector<shader> entityFilenames = {
 		bodyVert, bodyTesc, bodyTese, bodyFrag
 	};
@@ -482,12 +566,19 @@ void RendererGL::createShaders()
 	_pipelineFlare = factory.createPipeline(
 		{flareVert, flareFrag});
 
+	_pipelineSmallBody = factory.createPipeline(
+		{smallBodyVert, smallBodyFrag});
+
 	_pipelineTonemapBloom = factory.createPipeline(
 		{deferred, tonemap},
 		{bloom});
 
 	_pipelineTonemapNoBloom = factory.createPipeline(
 		{deferred, tonemap});
+
+	_pipelineFeedback = factory.createPipeline(
+		{bodyVert, bodyTesc, bodyTese, feedback},
+		{feedbackScale});
 }
 
 void RendererGL::createScreenshot()
@@ -597,6 +688,22 @@ void RendererGL::takeScreenshot(const string &filename)
 	_screenFilename = filename;
 }
 
+void RendererGL::saveStreamTelemetry(const string &filename)
+{
+	const StreamTelemetry &telemetry = _streamer.getTelemetry();
+	auto save = [](const string &name, function<void(ostream&)> write)
+	{
+		ofstream out(name.c_str());
+		if (!out) throw runtime_error("Can't open file " + name);
+		write(out);
+		if (!out) throw runtime_error("Can't write to file " + name);
+	};
+	save(filename + ".json", [&](ostream &out){ telemetry.writeJson(out); });
+	save(filename + "_tiles.csv", [&](ostream &out){ telemetry.writeTilesCsv(out); });
+	save(filename + "_textures.csv", [&](ostream &out){ telemetry.writeTexturesCsv(out); });
+	save(filename + "_samples.csv", [&](ostream &out){ telemetry.writeSamplesCsv(out); });
+}
+
 bool testSpherePlane(const vec3 &sphereCenter, float radius, const vec4 &plane)
 {
 	return dot(sphereCenter, vec3(plane))+plane.w < radius;
@@ -661,11 +768,24 @@ void RendererGL::render(const RenderInfo &info)
 			info.focusedEntitiesId.begin(), 
 			info.focusedEntitiesId.end(), h)>0;
 
-		if ((focused || dist < _texLoadDistance) && !data.texLoaded)
+		// Textures needed soon are loaded ahead, with the priority they'll have
+		const float focusBoost = 4.0;
+		data.texPrefetch = 0.0;
+		data.texDeadline = -1.0;
+		for (const auto &p : info.texPrefetch)
+		{
+			if (!(p.body == h)) continue;
+			data.texPrefetch = (_windowHeight*0.5/(f*std::max(1.0, p.distance/(double)radius)))*
+				focusBoost;
+			data.texDeadline = p.deadline;
+		}
+		const bool prefetched = data.texPrefetch > 0.0;
+
+		if ((focused || prefetched || dist < _texLoadDistance) && !data.texLoaded)
 		{
 			texLoadEntities.push_back(h);
 		}
-		else if (!focused && data.texLoaded && dist > _texUnloadDistance)
+		else if (!focused && !prefetched && data.texLoaded && dist > _texUnloadDistance)
 		{
 			// Textures need to be unloaded
 			texUnloadEntities.push_back(h);
@@ -679,6 +799,12 @@ void RendererGL::render(const RenderInfo &info)
 			visible = visible && testSpherePlane(viewSpacePos, maxRadius, plane);
 		}
 
+		// Texture priority from radius in pixels, focused body first
+		const bool isFocus = !info.focusedEntitiesId.empty() &&
+			info.focusedEntitiesId.front() == h;
+		data.texPriority = visible?
+			(_windowHeight*0.5/(f*std::max(1.0, dist)))*(isFocus?focusBoost:1.0):0.0;
+
 		// Render entities inside the frustum
 		if (visible)
 		{
@@ -704,8 +830,19 @@ void RendererGL::render(const RenderInfo &info)
 	_profiler.begin("Texture creation/deletion");
 	loadTextures(texLoadEntities);
 	unloadTextures(texUnloadEntities);
+	for (const auto &h : _entityCollection->getBodies())
+	{
+		const auto &data = _bodyData[h];
+		if (!data.texLoaded) continue;
+		for (auto handle : {data.diffuse, data.cloud, data.night, data.specular})
+		{
+			_streamer.setPriority(handle, data.texPriority);
+			_streamer.prefetch(handle, data.texPrefetch, data.texDeadline);
+		}
+	}
 	_profiler.end();
 	_profiler.begin("Texture updating");
+	_streamer.setCatchUp(info.texCatchUp);
 	uploadLoadedTextures();
 	_profiler.end();
 
@@ -742,6 +879,20 @@ void RendererGL::render(const RenderInfo &info)
 		_uboBuffer.write(currentData.bodyUBOs[h], &bodyUBOs[h]);
 	}
 
+	if (_smallBodies && _smallBodies->size())
+	{
+		const dvec3 parentPos = _smallBodyParent.exists()?
+			_smallBodyParent.getState().getPosition():dvec3(0.0);
+		const dvec3 starPos = _sun.exists()?
+			_sun.getState().getPosition():dvec3(0.0);
+		SmallBodyUBO smallBodyUBO{};
+		smallBodyUBO.parentPos = vec4(vec3(parentPos - info.viewPos), 0.0);
+		smallBodyUBO.starPos = vec4(vec3(starPos - parentPos), 0.0);
+		smallBodyUBO.brightness = smallBodyBrightness;
+		_uboBuffer.write(currentData.smallBodyUBO, &smallBodyUBO);
+		_pointBuffer.write(currentData.smallBodyPoints, _smallBodies->getPoints().data());
+	}
+
 	auto closerFun = [&](const EntityHandle &i, const EntityHandle &j)
 	{
 		const float distI = distance(i.getState().getPosition(), info.viewPos);
@@ -760,6 +911,14 @@ void RendererGL::render(const RenderInfo &info)
 	// Atmosphere sorting from back to front
 	sort(translucentEntities.begin(), translucentEntities.end(), fartherFun);
 
+	if (_virtualTexturing)
+	{
+		_profiler.begin("Feedback");
+		readFeedback();
+		renderFeedback(closeEntities, currentData);
+		_profiler.end();
+	}
+
 	if (info.wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 	_profiler.begin("Bodies");
 	renderHdr(closeEntities, currentData);
@@ -767,6 +926,9 @@ void RendererGL::render(const RenderInfo &info)
 	_profiler.begin("Flares");
 	renderEntityFlares(flares, currentData);
 	_profiler.end();
+	_profiler.begin("Small bodies");
+	renderSmallBodies(currentData);
+	_profiler.end();
 	_profiler.begin("Translucent objects");
 	renderTranslucent(translucentEntities, currentData);
 	_profiler.end();
@@ -897,10 +1059,10 @@ void RendererGL::renderHdr(
 		};
 		// Bind textures
 		const vector<GLuint> texs = {
-			_streamer.getTex(data.diffuse).getCompleteTextureId(_diffuseTexDefault),
-			_streamer.getTex(data.cloud).getCompleteTextureId(_cloudTexDefault),
-			_streamer.getTex(data.night).getCompleteTextureId(_nightTexDefault),
-			_streamer.getTex(data.specular).getCompleteTextureId(_specularTexDefault),
+			_streamer.getTex(data.diffuse).getResidentTextureId(_diffuseTexDefault),
+			_streamer.getTex(data.cloud).getResidentTextureId(_cloudTexDefault),
+			_streamer.getTex(data.night).getResidentTextureId(_nightTexDefault),
+			_streamer.getTex(data.specular).getResidentTextureId(_specularTexDefault),
 			data.atmoLookupTable,
 			data.ringTex2,
 		};
@@ -908,6 +1070,22 @@ void RendererGL::renderHdr(
 		glBindSamplers(2, samplers.size(), samplers.data());
 		glBindTextures(2, texs.size(), texs.data());
 
+		// Virtual textures: indirections then tile caches
+		vector<GLuint> virtualSamplers(8, 0);
+		vector<GLuint> virtualTexs(8, 0);
+		const auto handles = {data.diffuse, data.cloud, data.night, data.specular};
+		int i = 0;
+		for (auto handle : handles)
+		{
+			const DDSStreamer::VirtualTexInfo vt = _streamer.getVirtualTex(handle);
+			virtualTexs[i] = vt.indirection;
+			virtualTexs[4+i] = vt.cache;
+			virtualSamplers[4+i] = _virtualCacheSampler;
+			++i;
+		}
+		glBindSamplers(8, virtualSamplers.size(), virtualSamplers.data());
+		glBindTextures(8, virtualTexs.size(), virtualTexs.data());
+
 		if (star) glBeginQuery(GL_SAMPLES_PASSED, _sunOcclusionQueries[0]);
 		data.bodyDraw.draw(true);
 		if (star)
@@ -942,6 +1120,80 @@ void RendererGL::renderHdr(
 	}
 }
 
+void RendererGL::renderFeedback(
+	const vector<EntityHandle> &closeEntities,
+	const DynamicData &ddata)
+{
+	glViewport(0, 0, _feedbackWidth, _feedbackHeight);
+	glDepthMask(GL_TRUE);
+	glDepthFunc(GL_LESS);
+
+	// Id 0 for no body
+	const vector<GLuint> clearId = {0,0,0,0};
+	const vector<float> clearDepth = {1.f};
+	glClearNamedFramebufferuiv(_feedbackFBO, GL_COLOR, 0, clearId.data());
+	glClearNamedFramebufferfv(_feedbackFBO, GL_DEPTH, 0, clearDepth.data());
+	glBindFramebuffer(GL_FRAMEBUFFER, _feedbackFBO);
+
+	_pipelineFeedback.bind();
+	glBindBufferRange(GL_UNIFORM_BUFFER, 0, _uboBuffer.getId(),
+		ddata.sceneUBO.getOffset(),
+		sizeof(SceneUBO));
+
+	for (const auto &h : closeEntities)
+	{
+		const auto &data = _bodyData[h];
+		if (!data.texLoaded) continue;
+		glBindBufferRange(GL_UNIFORM_BUFFER, 1, _uboBuffer.getId(),
+			ddata.bodyUBOs.at(h).getOffset(),
+			sizeof(BodyUBO));
+		data.bodyDraw.draw(true);
+	}
+
+	// Read when this frame's fence is signaled
+	glNamedFramebufferReadBuffer(_feedbackFBO, GL_COLOR_ATTACHMENT0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, _feedbackBuffers[_frameId]);
+	glReadPixels(0, 0, _feedbackWidth, _feedbackHeight,
+		GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, nullptr);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	_feedbackPending[_frameId] = true;
+}
+
+void RendererGL::readFeedback()
+{
+	// Written bufferFrames frames ago, the frame fence has been waited on
+	if (!_feedbackPending[_frameId]) return;
+	_feedbackPending[_frameId] = false;
+
+	vector<uint16_t> pixels(_feedbackWidth*_feedbackHeight*4);
+	glGetNamedBufferSubData(_feedbackBuffers[_frameId], 0,
+		pixels.size()*sizeof(uint16_t), pixels.data());
+
+	vector<vector<DDSStreamer::FeedbackSample>> samples(_feedbackBodies.size());
+	for (size_t i=0;i<pixels.size();i+=4)
+	{
+		const size_t id = pixels[i];
+		if (id == 0 || id > samples.size()) continue;
+		DDSStreamer::FeedbackSample s{};
+		s.u = pixels[i+1]/65535.f;
+		s.v = pixels[i+2]/65535.f;
+		s.log2Width = pixels[i+3]/256.f;
+		samples[id-1].push_back(s);
+	}
+
+	// Bodies out of view request nothing, their tiles can be replaced
+	for (size_t i=0;i<_feedbackBodies.size();++i)
+	{
+		const EntityHandle &h = _feedbackBodies[i];
+		const auto &data = _bodyData[h];
+		if (!data.texLoaded) continue;
+		_streamer.requestTiles(data.diffuse, samples[i]);
+		_streamer.requestTiles(data.cloud, samples[i], h.getState().getCloudDisp());
+		_streamer.requestTiles(data.night, samples[i]);
+		_streamer.requestTiles(data.specular, samples[i]);
+	}
+}
+
 void RendererGL::renderEntityFlares(
 	const vector<EntityHandle> &flares,
 	const DynamicData &data)
@@ -971,6 +1223,34 @@ void RendererGL::renderEntityFlares(
 	}
 }
 
+void RendererGL::renderSmallBodies(const DynamicData &data)
+{
+	if (!_smallBodies || !_smallBodies->size()) return;
+
+	glViewport(0,0, _windowWidth, _windowHeight);
+	// Only depth test
+	glDepthMask(GL_FALSE);
+	glDepthFunc(GL_LESS);
+	// Blending
+	glBlendEquation(GL_FUNC_ADD);
+	glBlendFunc(GL_ONE, GL_ONE);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, _hdrFBO);
+
+	_pipelineSmallBody.bind();
+
+	// Bind Scene UBO
+	glBindBufferRange(GL_UNIFORM_BUFFER, 0, _uboBuffer.getId(),
+		data.sceneUBO.getOffset(),
+		sizeof(SceneUBO));
+	// Bind small body UBO
+	glBindBufferRange(GL_UNIFORM_BUFFER, 1, _uboBuffer.getId(),
+		data.smallBodyUBO.getOffset(),
+		sizeof(SmallBodyUBO));
+
+	data.smallBodyDraw.draw();
+}
+
 void RendererGL::renderTranslucent(
 	const vector<EntityHandle> &translucentEntities,
 	const DynamicData &data)
@@ -1215,13 +1495,17 @@ void RendererGL::loadTextures(const vector<EntityHandle> &texLoadEntities)
 		const EntityParam param = h.getParam();
 		auto &data = _bodyData[h];
 		// Textures & samplers
-		data.diffuse = _streamer.createTex(param.getModel().getDiffuseFilename());
+		data.diffuse = _streamer.createTex(param.getModel().getDiffuseFilename(),
+			_virtualTexturing);
 		if (param.hasClouds())
-			data.cloud = _streamer.createTex(param.getClouds().getFilename());
+			data.cloud = _streamer.createTex(param.getClouds().getFilename(),
+				_virtualTexturing);
 		if (param.hasNight())
-			data.night = _streamer.createTex(param.getNight().getFilename());
+			data.night = _streamer.createTex(param.getNight().getFilename(),
+				_virtualTexturing);
 		if (param.hasSpecular())
-			data.specular = _streamer.createTex(param.getSpecular().getFilename());
+			data.specular = _streamer.createTex(param.getSpecular().getFilename(),
+				_virtualTexturing);
 
 		data.texLoaded = true;
 	}
@@ -1401,6 +1685,15 @@ RendererGL::BodyUBO RendererGL::getBodyUBO(
 		?params.getStar().getBrightness():0.0;
 	ubo.radius = params.getModel().getRadius();
 	ubo.atmoHeight = params.hasAtmo()?params.getAtmo().getMaxHeight():0.0;
+	ubo.feedbackId = data.feedbackId;
+
+	const auto handles = {data.diffuse, data.cloud, data.night, data.specular};
+	int i = 0;
+	for (auto handle : handles)
+	{
+		const DDSStreamer::VirtualTexInfo vt = _streamer.getVirtualTex(handle);
+		ubo.virtualParams[i++] = vec4(vt.maxLevel, vt.tileSize, vt.cacheTiles, 0.0);
+	}
 
 	return ubo;
 }
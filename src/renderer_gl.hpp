@@ -7,6 +7,7 @@
 #include "gl_util.hpp"
 #include "gl_profiler.hpp"
 #include "dds_stream.hpp"
+#include "upload_backend_gl.hpp"
 #include "screenshot.hpp"
 #include "shader_pipeline.hpp"
 #include "gui_gl.hpp"
@@ -28,6 +29,7 @@ public:
 	void init(const InitInfo &info) override;
 	void render(const RenderInfo &info) override;
 	void takeScreenshot(const std::string &filename) override;
+	void saveStreamTelemetry(const std::string &filename) override;
 	void destroy() override;
 
 	std::vector<std::pair<std::string,uint64_t>> getProfilerTimes() override;
@@ -37,6 +39,11 @@ private:
 	{
 		BufferRange sceneUBO;
 		std::map<EntityHandle, BufferRange> bodyUBOs;
+		BufferRange smallBodyUBO;
+		/// Small body points
+		BufferRange smallBodyPoints;
+		/// Small body points draw command
+		DrawCommand smallBodyDraw;
 	};
 
 	/// Dynamic parameters for the scene to be loaded in a UBO
@@ -87,6 +94,9 @@ private:
 		glm::vec4 mask1ColorHardness;
 		/// Ring plane normal vector
 		glm::vec4 ringNormal;
+		/// Virtual texture parameters of diffuse, cloud, night and specular
+		/// textures (x max level, 0 if not virtual, y tile size, z cache tiles)
+		glm::vec4 virtualParams[4];
 		/// Ring inner edge distance from center of body
 		float ringInner;
 		/// Ring outer edge distance from center of body
@@ -101,6 +111,19 @@ private:
 		float radius;
 		/// Atmospheric height
 		float atmoHeight;
+		/// Id written by the feedback pass
+		float feedbackId;
+	};
+
+	/// Dynamic parameters shared by all small bodies to be loaded in a UBO
+	struct SmallBodyUBO
+	{
+		/// Position of the small bodies' parent entity relative to the view
+		glm::vec4 parentPos;
+		/// Star position relative to the small bodies' parent entity
+		glm::vec4 starPos;
+		/// Intensity of a magnitude 0 point
+		float brightness;
 	};
 
 	/// Generates the vertex and index data and fill the static VBOs
@@ -131,6 +154,16 @@ private:
 	void renderHdr(
 		const std::vector<EntityHandle> &closeEntities, 
 		const DynamicData &data);
+	/** Renders texture coordinates and footprint of bodies with virtual
+	 * textures to the feedback rendertarget, and starts reading it back
+	 * @param closeEntities id of entities to render
+	 * @param buffer ranges to use for rendering
+	 */
+	void renderFeedback(
+		const std::vector<EntityHandle> &closeEntities,
+		const DynamicData &data);
+	/// Requests tiles of virtual textures from the last feedback read back
+	void readFeedback();
 	/** Renders flares to HDR rendertarget
 	 * @param flares id of entities to render as flares
 	 * @param buffer ranges to use for rendering
@@ -138,6 +171,10 @@ private:
 	void renderEntityFlares(
 		const std::vector<EntityHandle> &flares,
 		const DynamicData &data);
+	/** Renders small bodies as points to HDR rendertarget
+	 * @param buffer ranges to use for rendering
+	 */
+	void renderSmallBodies(const DynamicData &data);
 	/** Renders translucent parts of detailed entities to HDR rendertarget
 	 * @param translucentEntities id of entities to render
 	 * @param buffer ranges to use for rendering
@@ -209,6 +246,16 @@ private:
 	float _logDepthFarPlane = 5e9;
 	/// Logarithmic depth balance coefficient
 	float _logDepthC = 1.0;
+	/// Body textures are virtual textures
+	bool _virtualTexturing = false;
+	/// Feedback rendertarget is this many times smaller than the window
+	int _feedbackDivisor = 8;
+	/// Feedback rendertarget width in pixels
+	int _feedbackWidth = 1;
+	/// Feedback rendertarget height in pixels
+	int _feedbackHeight = 1;
+	/// Tiles per side of virtual texture caches
+	int _virtualCacheTiles = 16;
 
 	// Constants for distance based loading
 	/// Max distance at which a body is considered 'close' (detailed render)
@@ -228,6 +275,8 @@ private:
 	Buffer _indexBuffer;
 	/// Buffer containing UBO data
 	Buffer _uboBuffer;
+	/// Buffer containing small body points
+	Buffer _pointBuffer;
 	
 	/// Buffer ranges of each frame (multiple buffering)
 	std::vector<DynamicData> _dynamicData;
@@ -236,6 +285,8 @@ private:
 
 	/// Vertex Array Object of entities, flares and deferred tris
 	GLuint _vertexArray;
+	/// Vertex Array Object of small body points
+	GLuint _pointVertexArray;
 
 	// Rendertargets : 
 	/// Depth stencil attachment of HDR rendertarget
@@ -265,6 +316,20 @@ private:
 	/// Bloom FBOs
 	std::vector<GLuint> _bloomFBOs;
 
+	// Virtual texture feedback
+	/// Feedback rendertarget (body id, uv, log2 of texture width in pixels)
+	GLuint _feedbackRendertarget = 0;
+	/// Depth attachment of feedback rendertarget
+	GLuint _feedbackDepth = 0;
+	/// Feedback FBO
+	GLuint _feedbackFBO = 0;
+	/// Buffers feedback is read back to (multiple buffering)
+	std::vector<GLuint> _feedbackBuffers;
+	/// Whether a feedback buffer has been written to and not read
+	std::vector<bool> _feedbackPending;
+	/// Bodies by feedback id (minus one)
+	std::vector<EntityHandle> _feedbackBodies;
+
 	// Pipelines
 	/// Body without atmo
 	ShaderPipeline _pipelineBodyBare;
@@ -294,10 +359,14 @@ private:
 	ShaderPipeline _pipelineBloomAdd;
 	/// Flares
 	ShaderPipeline _pipelineFlare;
+	/// Small body points
+	ShaderPipeline _pipelineSmallBody;
 	/// Tonemap and resolve with bloom
 	ShaderPipeline _pipelineTonemapBloom;
 	/// Tonemap and resolve without bloom
 	ShaderPipeline _pipelineTonemapNoBloom;
+	/// Virtual texture feedback
+	ShaderPipeline _pipelineFeedback;
 
 	// Multiple buffering
 	/// Number of frame modulo bufferFrames
@@ -306,6 +375,10 @@ private:
 	uint32_t _bufferFrames;
 
 	const EntityCollection* _entityCollection;
+	/// Asteroids and comets
+	const SmallBodyCollection* _smallBodies = nullptr;
+	/// Entity small bodies orbit
+	EntityHandle _smallBodyParent;
 
 	/// Entity data only for rendering
 	struct BodyData
@@ -316,6 +389,14 @@ private:
 		DrawCommand ringDraw;
 		/// Whether the textures have been loaded or onot
 		bool texLoaded = false;
+		/// Streaming priority of textures (0 if outside the frustum)
+		float texPriority = 0.0;
+		/// Expected streaming priority of textures needed soon, 0 if none
+		float texPrefetch = 0.0;
+		/// Seconds until textures are needed, negative if not known
+		float texDeadline = -1.0;
+		/// Id written by the feedback pass
+		int feedbackId = 0;
 
 		/// Diffuse texture
 		DDSStreamer::Handle diffuse{};
@@ -386,6 +467,8 @@ private:
 	GLuint _atmoSampler;
 	/// Sampler for ring textures
 	GLuint _ringSampler;
+	/// Sampler for virtual texture tile caches
+	GLuint _virtualCacheSampler;
 
 	/// Max anisotropy for texture sampling
 	float _textureAnisotropy;
@@ -0,0 +1,133 @@
+#include "sim_clock.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+
+using namespace glm;
+using namespace std;
+
+/// Angle in radians around the parent above which a tick isn't interpolated,
+/// the motion between ticks can't be told apart from several turns
+static const double maxInterpolatedAngle = radians(90.0);
+
+/// Interpolates a position relative to its parent in angle and distance
+static dvec3 interpolateOrbit(const dvec3 &a, const dvec3 &b, const double alpha)
+{
+	const double ra = length(a);
+	const double rb = length(b);
+	if (ra == 0.0 || rb == 0.0) return mix(a, b, alpha);
+	const dvec3 ua = a/ra;
+	const dvec3 ub = b/rb;
+	const double angle = acos(glm::clamp(dot(ua, ub), -1.0, 1.0));
+	if (angle > maxInterpolatedAngle) return b;
+	// Straight line is close enough, avoids dividing by a tiny sine
+	if (angle < 1e-6) return mix(a, b, alpha);
+	const dvec3 u = (sin((1.0-alpha)*angle)*ua + sin(alpha*angle)*ub)/sin(angle);
+	return u*mix(ra, rb, alpha);
+}
+
+SimulationClock::~SimulationClock()
+{
+	stop();
+}
+
+void SimulationClock::start(const double epoch, const vector<dvec3> &positions,
+	const double tickLength, const StepFunction &step)
+{
+	stop();
+	_step = step;
+	_tickLength = chrono::duration_cast<Clock::duration>(
+		chrono::duration<double>(tickLength));
+
+	// Both ticks hold the initial state until the first tick is done
+	_current.positions = positions;
+	_current.epoch = epoch;
+	_current.time = Clock::now();
+	_previous = _current;
+	_next = _current;
+	_error = nullptr;
+
+	_stop = false;
+	_thread = thread(&SimulationClock::run, this);
+}
+
+void SimulationClock::stop()
+{
+	if (!_thread.joinable()) return;
+	{
+		lock_guard<mutex> lk(_mtx);
+		_stop = true;
+	}
+	_stopCond.notify_all();
+	_thread.join();
+}
+
+void SimulationClock::setTimeWarp(const double warp)
+{
+	_warp = warp;
+}
+
+double SimulationClock::getState(dvec3 *positions)
+{
+	lock_guard<mutex> lk(_mtx);
+	if (_error)
+	{
+		exception_ptr error = _error;
+		_error = nullptr;
+		rethrow_exception(error);
+	}
+
+	// One tick in the past, between the two last ticks if on schedule
+	const Clock::time_point display = Clock::now() - _tickLength;
+	const double span = chrono::duration<double>(_current.time-_previous.time).count();
+	const double alpha = (span > 0.0)?
+		glm::clamp(chrono::duration<double>(display-_previous.time).count()/span, 0.0, 1.0):1.0;
+
+	for (size_t i=0;i<_current.positions.size();++i)
+		positions[i] = interpolateOrbit(_previous.positions[i], _current.positions[i], alpha);
+	return mix(_previous.epoch, _current.epoch, alpha);
+}
+
+double SimulationClock::getLastTick(dvec3 *positions)
+{
+	lock_guard<mutex> lk(_mtx);
+	copy(_current.positions.begin(), _current.positions.end(), positions);
+	return _current.epoch;
+}
+
+void SimulationClock::run()
+{
+	Clock::time_point target = _current.time;
+	while (true)
+	{
+		target += _tickLength;
+		{
+			unique_lock<mutex> lk(_mtx);
+			if (_stopCond.wait_until(lk, target, [&]{ return _stop; })) return;
+		}
+
+		// Too late to catch up: the schedule restarts from now
+		const Clock::time_point now = Clock::now();
+		if (now - target > _maxLag*_tickLength) target = now;
+
+		const double dt = _warp*chrono::duration<double>(_tickLength).count();
+		_next.epoch += dt;
+		_next.time = target;
+		try
+		{
+			_step(_next.epoch, dt, _next.positions.data());
+		}
+		catch (...)
+		{
+			// Partial positions aren't published, the last state stays
+			lock_guard<mutex> lk(_mtx);
+			_error = current_exception();
+			return;
+		}
+
+		lock_guard<mutex> lk(_mtx);
+		swap(_previous, _current);
+		swap(_current, _next);
+		_next.epoch = _current.epoch;
+	}
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <exception>
+
+#include <glm/glm.hpp>
+
+/**
+ * Fixed timestep simulation running on its own thread
+ *
+ * Each tick advances the epoch by the time warp times the tick length, no
+ * matter how fast frames are rendered, so the sequence of simulated states
+ * only depends on the tick length and the warp at each tick. Frames read
+ * the state one tick in the past, interpolated along the orbits between the
+ * last two ticks, and never wait for the simulation: a late tick only freezes
+ * the state. A step that throws stops the simulation, the error is rethrown
+ * by getState().
+ */
+class SimulationClock
+{
+public:
+	/**
+	 * Computes positions of entities relative to their parent
+	 * @param epoch epoch to compute positions at, in seconds
+	 * @param dt simulated time since the last call, in seconds
+	 * @param positions output array
+	 */
+	typedef std::function<void(double epoch, double dt, glm::dvec3 *positions)> StepFunction;
+
+	SimulationClock() = default;
+	SimulationClock(const SimulationClock &) = delete;
+	SimulationClock &operator=(const SimulationClock &) = delete;
+	~SimulationClock();
+	/**
+	 * Starts the simulation thread from a known state
+	 * @param epoch initial epoch in seconds
+	 * @param positions positions at the initial epoch
+	 * @param tickLength wall time between ticks in seconds
+	 * @param step function computing positions, only called on the
+	 * simulation thread
+	 */
+	void start(double epoch, const std::vector<glm::dvec3> &positions,
+		double tickLength, const StepFunction &step);
+	/// Stops the simulation thread, the last state stays readable
+	void stop();
+	/**
+	 * Sets simulated seconds per wall second, applied from the next tick
+	 * @param warp time warp factor
+	 */
+	void setTimeWarp(double warp);
+	/**
+	 * Interpolates the state to display now, bodies that turned too far
+	 * around their parent in a tick are shown at the last tick; throws the
+	 * error of the step that stopped the simulation, if any
+	 * @param positions output array of positions relative to parent
+	 * @return epoch of the interpolated state in seconds
+	 */
+	double getState(glm::dvec3 *positions);
+	/**
+	 * Returns the state of the last tick, not interpolated
+	 * @param positions output array of positions relative to parent
+	 * @return epoch of the last tick in seconds
+	 */
+	double getLastTick(glm::dvec3 *positions);
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	/// Simulated state at the end of a tick
+	struct Tick
+	{
+		/// Wall time the tick is displayed at
+		Clock::time_point time;
+		/// Simulated epoch in seconds
+		double epoch = 0.0;
+		/// Positions relative to parent
+		std::vector<glm::dvec3> positions;
+	};
+
+	/// Simulation thread loop
+	void run();
+
+	std::thread _thread;
+	std::mutex _mtx;
+	/// Wakes the simulation thread early when stopping
+	std::condition_variable _stopCond;
+	bool _stop = false;
+
+	StepFunction _step;
+	/// Wall time between ticks
+	Clock::duration _tickLength;
+	/// Ticks behind schedule after which the schedule is reset
+	int _maxLag = 8;
+	std::atomic<double> _warp{1.0};
+
+	/// Last two published ticks, guarded by _mtx
+	Tick _previous, _current;
+	/// Error thrown by the step, rethrown by getState(), guarded by _mtx
+	std::exception_ptr _error;
+	/// Tick being computed by the simulation thread
+	Tick _next;
+};
@@ -0,0 +1,216 @@
+#include "small_body.hpp"
+#include "kepler.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+using namespace glm;
+using namespace std;
+
+/// Largest eccentric anomaly step (radians) starting from the last anomaly
+static const double maxWarmStep = 0.5;
+
+void SmallBodyCollection::init(const string &parentName, const double GM,
+	const vector<Elements> &elements, const int threads)
+{
+	if (GM <= 0.0)
+		throw runtime_error("Small bodies need a parent entity with a positive GM");
+
+	_parentName = parentName;
+
+	const size_t n = elements.size();
+	_meanMotion.resize(n);
+	_m0.resize(n);
+	_ecc.resize(n);
+	_px.resize(n); _py.resize(n); _pz.resize(n);
+	_qx.resize(n); _qy.resize(n); _qz.resize(n);
+	_points.resize(n);
+	_selected.assign(n, false);
+	_anomaly.assign(n, 0.0);
+	_lastEpoch.assign(n, std::numeric_limits<double>::infinity());
+
+	for (size_t i=0;i<n;++i)
+	{
+		const Elements &e = elements[i];
+		if (e.ecc < 0.0 || e.ecc >= 1.0 || e.sma <= 0.0)
+			throw runtime_error("Small bodies must have elliptic orbits");
+
+		_meanMotion[i] = sqrt(GM/(e.sma*e.sma*e.sma));
+		_m0[i] = KeplerSolver::wrapAngle(e.m0);
+		_ecc[i] = e.ecc;
+
+		// Same orientation as Orbit
+		const dquat q =
+			  rotate(dquat(), e.lan, dvec3(0,0,1))
+			* rotate(dquat(), e.inc, dvec3(0,1,0))
+			* rotate(dquat(), e.arg, dvec3(0,0,1));
+		const dvec3 p = q*dvec3(0,1,0)*e.sma;
+		const dvec3 r = q*dvec3(-1,0,0)*(e.sma*sqrt(1.0-e.ecc*e.ecc));
+		_px[i] = p.x; _py[i] = p.y; _pz[i] = p.z;
+		_qx[i] = r.x; _qy[i] = r.y; _qz[i] = r.z;
+
+		_points[i] = vec4(0.0, 0.0, 0.0, e.magnitude);
+	}
+
+	_pool.init(threads);
+}
+
+vector<SmallBodyCollection::Elements> SmallBodyCollection::loadCatalog(
+	const string &filename)
+{
+	ifstream in(filename.c_str());
+	if (!in) throw runtime_error("Can't open file " + filename);
+
+	vector<Elements> elements;
+	string line;
+	int lineNumber = 0;
+	while (getline(in, line))
+	{
+		++lineNumber;
+		if (line.empty() || line[0] == '#' || line[0] == '\r') continue;
+
+		double values[7];
+		const char *c = line.c_str();
+		for (int i=0;i<7;++i)
+		{
+			char *end;
+			values[i] = strtod(c, &end);
+			if (end == c)
+			{
+				throw runtime_error("Invalid small body at line " +
+					to_string(lineNumber) + " of " + filename);
+			}
+			c = end;
+			while (*c == ',' || *c == ' ' || *c == '\t') ++c;
+		}
+
+		Elements e;
+		e.sma = values[0];
+		e.ecc = values[1];
+		e.inc = radians(values[2]);
+		e.lan = radians(values[3]);
+		e.arg = radians(values[4]);
+		e.m0 = radians(values[5]);
+		e.magnitude = values[6];
+		if (e.ecc >= 0.0 && e.ecc < 1.0 && e.sma > 0.0) elements.push_back(e);
+	}
+	return elements;
+}
+
+size_t SmallBodyCollection::size() const
+{
+	return _points.size();
+}
+
+const string &SmallBodyCollection::getParentName() const
+{
+	return _parentName;
+}
+
+void SmallBodyCollection::computePositions(const double epoch)
+{
+	_pool.parallelFor(_points.size(), chunkSize, [&](size_t begin, size_t end)
+	{
+		propagate(epoch, begin, end, nullptr);
+	});
+}
+
+void SmallBodyCollection::computePositions(const double epoch,
+	const vector<uint32_t> &ids)
+{
+	// Workers would write the same point for a repeated id
+	const char *error = nullptr;
+	size_t checked = 0;
+	for (;checked<ids.size() && !error;++checked)
+	{
+		const uint32_t id = ids[checked];
+		if (id >= _points.size()) error = "Invalid small body index";
+		else if (_selected[id]) error = "Duplicate small body index";
+		else _selected[id] = true;
+	}
+	for (size_t i=0;i<checked;++i)
+	{
+		if (ids[i] < _selected.size()) _selected[ids[i]] = false;
+	}
+	if (error) throw runtime_error(error);
+
+	_pool.parallelFor(ids.size(), chunkSize, [&](size_t begin, size_t end)
+	{
+		propagate(epoch, begin, end, ids.data());
+	});
+}
+
+const vector<vec4> &SmallBodyCollection::getPoints() const
+{
+	return _points;
+}
+
+void SmallBodyCollection::propagate(const double epoch,
+	const size_t begin, const size_t end, const uint32_t *ids)
+{
+	double mean[chunkSize];
+	double anomaly[chunkSize];
+	double ecc[chunkSize];
+	double sinE[chunkSize];
+	double cosE[chunkSize];
+	const size_t count = end-begin;
+
+	// Gather and starting values
+	for (size_t i=0;i<count;++i)
+	{
+		const size_t id = ids?ids[begin+i]:begin+i;
+		const double step = _meanMotion[id]*(epoch - _lastEpoch[id]);
+		const double m = KeplerSolver::wrapAngle(_meanMotion[id]*epoch + _m0[id]);
+		mean[i] = m;
+		ecc[i] = _ecc[id];
+		// Small steps start from the last anomaly moved along its derivative,
+		// brought to the same turn as the mean anomaly
+		const double last = _anomaly[id];
+		const double warmStep = step/(1.0 - ecc[i]*cos(last));
+		const double warm = last + warmStep;
+		anomaly[i] = (std::abs(warmStep) < maxWarmStep)?
+			warm + two_pi<double>()*floor((m-warm)/two_pi<double>() + 0.5):
+			KeplerSolver::starter(m, ecc[i]);
+	}
+
+	// Danby iterations over the whole chunk
+	for (int it=0;it<_maxIterations;++it)
+	{
+		double maxDelta = 0.0;
+		for (size_t i=0;i<count;++i)
+		{
+			const double En = anomaly[i];
+			const double s = sin(En);
+			const double c = cos(En);
+			const double delta = KeplerSolver::danbyCorrection(
+				En - ecc[i]*s - mean[i], 1.0 - ecc[i]*c, ecc[i]*s, ecc[i]*c);
+			anomaly[i] = En + delta;
+			// First order update, the last correction is below tolerance
+			sinE[i] = s + c*delta;
+			cosE[i] = c - s*delta;
+			maxDelta = std::max(maxDelta, std::abs(delta));
+		}
+		if (maxDelta < _tolerance) break;
+	}
+
+	// Perifocal to parent frame
+	for (size_t i=0;i<count;++i)
+	{
+		const size_t id = ids?ids[begin+i]:begin+i;
+		_anomaly[id] = anomaly[i];
+		_lastEpoch[id] = epoch;
+		const float x = cosE[i] - ecc[i];
+		const float y = sinE[i];
+		vec4 &p = _points[id];
+		p.x = x*_px[id] + y*_qx[id];
+		p.y = x*_py[id] + y*_qy[id];
+		p.z = x*_pz[id] + y*_qz[id];
+	}
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "worker_pool.hpp"
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+/**
+ * Catalog of small bodies (asteroids, comets) orbiting a single entity
+ *
+ * Unlike entities, small bodies only have compact orbital elements and an
+ * absolute magnitude, so catalogs of millions of objects fit in memory.
+ * Positions are propagated in parallel on a worker pool, in chunks of
+ * structure-of-arrays elements, into a flat point buffer for the renderer.
+ */
+class SmallBodyCollection
+{
+public:
+	/// Orbital elements of a small body
+	struct Elements
+	{
+		/// Semi-major axis (km)
+		double sma;
+		/// Eccentricity (elliptic orbits only)
+		double ecc;
+		/// Inclination (radians)
+		double inc;
+		/// Longitude of ascending node (radians)
+		double lan;
+		/// Argument of periapsis (radians)
+		double arg;
+		/// Mean anomaly at epoch (radians)
+		double m0;
+		/// Absolute magnitude
+		float magnitude;
+	};
+
+	SmallBodyCollection() = default;
+	/**
+	 * @param parentName name of the entity all small bodies orbit
+	 * @param GM gravitational parameter of the parent entity (km^3/s^2)
+	 * @param elements elements of all small bodies
+	 * @param threads number of propagation threads (0 for one per core)
+	 */
+	void init(const std::string &parentName, double GM,
+		const std::vector<Elements> &elements, int threads=0);
+	/**
+	 * Reads a catalog file, one small body per line in the form
+	 * "sma,ecc,inc,lan,arg,m0,magnitude" (km and degrees). Empty lines and
+	 * lines starting with '#' are ignored, as well as non-elliptic orbits.
+	 * Throws runtime_error if the file can't be read
+	 * @param filename catalog to read
+	 * @return elements of all small bodies in the file
+	 */
+	static std::vector<Elements> loadCatalog(const std::string &filename);
+
+	/// Returns the number of small bodies
+	size_t size() const;
+	/// Returns the name of the entity all small bodies orbit
+	const std::string &getParentName() const;
+	/**
+	 * Computes the positions of all small bodies
+	 * @param epoch epoch in seconds
+	 */
+	void computePositions(double epoch);
+	/**
+	 * Computes the positions of some small bodies only (e.g. the visible
+	 * ones), other points keep their last position
+	 * Throws if an index is out of range or appears twice
+	 * @param epoch epoch in seconds
+	 * @param ids indices of small bodies to update
+	 */
+	void computePositions(double epoch, const std::vector<uint32_t> &ids);
+	/**
+	 * Returns one point per small body: xyz is the position around the parent
+	 * entity (km), w the absolute magnitude
+	 */
+	const std::vector<glm::vec4> &getPoints() const;
+
+private:
+	/**
+	 * Propagates a chunk of small bodies
+	 * @param epoch epoch in seconds
+	 * @param begin first element of the chunk
+	 * @param end last element of the chunk (excluded)
+	 * @param ids if not null, indices of small bodies (ids[begin] to
+	 * ids[end-1]), else small bodies begin to end-1
+	 */
+	void propagate(double epoch, size_t begin, size_t end, const uint32_t *ids);
+
+	std::string _parentName = "";
+
+	/// Small bodies per chunk, also the size of scratch arrays
+	static const size_t chunkSize = 1024;
+	/// Iterations stop when all corrections of a chunk are smaller (radians)
+	double _tolerance = 1e-7;
+	/// Hard iteration limit
+	int _maxIterations = 16;
+
+	// Elements, one value per small body
+	/// Mean motion (radians per second)
+	std::vector<double> _meanMotion;
+	/// Mean anomaly at epoch (radians)
+	std::vector<float> _m0;
+	/// Eccentricity
+	std::vector<float> _ecc;
+	/// Periapsis direction scaled by the semi-major axis
+	std::vector<float> _px, _py, _pz;
+	/// Perpendicular direction scaled by the semi-minor axis
+	std::vector<float> _qx, _qy, _qz;
+
+	/// Eccentric anomaly of the last propagation, starting value of the next
+	std::vector<double> _anomaly;
+	/// Epoch of the last propagation
+	std::vector<double> _lastEpoch;
+
+	/// Positions and magnitudes
+	std::vector<glm::vec4> _points;
+	/// Ids seen while checking computePositions() input, all false between calls
+	std::vector<bool> _selected;
+
+	WorkerPool _pool;
+};
@@ -0,0 +1,143 @@
+#include "snapshot.hpp"
+#include "mapped_file.hpp"
+
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+
+using namespace glm;
+using namespace std;
+
+/// File identifier
+static const char snapshotMagic[4] = {'R','S','N','P'};
+/// Incremented at each change of the file layout
+static const uint32_t snapshotVersion = 1;
+
+/// Fixed size header, followed by entity records then state vectors
+struct SnapshotHeader
+{
+	char magic[4];
+	uint32_t version;
+	/// Hash of entity names in collection order
+	uint64_t entityHash;
+	uint32_t entityCount;
+	/// Number of doubles of N-body state vectors
+	uint32_t stateVectorCount;
+	double epoch;
+	int32_t timeWarpIndex;
+	int32_t focusedBodyId;
+	float viewPolar[3];
+	float panPolar[2];
+	float viewDir[9];
+};
+
+/// State of an entity in a file
+struct SnapshotEntity
+{
+	double position[3];
+	float rotationAngle;
+	float cloudDisp;
+};
+
+static_assert(sizeof(SnapshotHeader) == 96, "Unexpected snapshot header padding");
+static_assert(sizeof(SnapshotEntity) == 32, "Unexpected snapshot entity padding");
+
+/// FNV-1a of entity names, to detect snapshots of other entity files
+static uint64_t hashEntities(const EntityCollection &collection)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (const EntityHandle &h : collection.getAll())
+	{
+		const string name = h.getParam().getName();
+		// Null terminated so that name boundaries count
+		for (size_t i=0;i<=name.size();++i)
+		{
+			hash ^= (uint8_t)name.c_str()[i];
+			hash *= 1099511628211ull;
+		}
+	}
+	return hash;
+}
+
+void saveSnapshot(const string &filename, const Snapshot &snapshot,
+	const EntityCollection &collection)
+{
+	if (snapshot.states.size() != collection.getAll().size())
+		throw runtime_error("Snapshot doesn't match entities");
+
+	SnapshotHeader header{};
+	memcpy(header.magic, snapshotMagic, 4);
+	header.version = snapshotVersion;
+	header.entityHash = hashEntities(collection);
+	header.entityCount = snapshot.states.size();
+	header.stateVectorCount = snapshot.stateVectors.size();
+	header.epoch = snapshot.epoch;
+	header.timeWarpIndex = snapshot.timeWarpIndex;
+	header.focusedBodyId = snapshot.focusedBodyId;
+	for (int i=0;i<3;++i) header.viewPolar[i] = snapshot.viewPolar[i];
+	for (int i=0;i<2;++i) header.panPolar[i] = snapshot.panPolar[i];
+	for (int i=0;i<9;++i) header.viewDir[i] = snapshot.viewDir[i/3][i%3];
+
+	vector<SnapshotEntity> entities(snapshot.states.size());
+	for (size_t i=0;i<entities.size();++i)
+	{
+		const EntityState &s = snapshot.states[i];
+		const dvec3 pos = s.getPosition();
+		entities[i] = {{pos.x, pos.y, pos.z}, s.getRotationAngle(), s.getCloudDisp()};
+	}
+
+	ofstream out(filename.c_str(), ios::out | ios::binary);
+	if (!out) throw runtime_error("Can't open file " + filename);
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)entities.data(), entities.size()*sizeof(SnapshotEntity));
+	out.write((const char*)snapshot.stateVectors.data(),
+		snapshot.stateVectors.size()*sizeof(double));
+	if (!out) throw runtime_error("Can't write to file " + filename);
+}
+
+Snapshot loadSnapshot(const string &filename, const EntityCollection &collection)
+{
+	const MappedFile file(filename);
+	if (file.size() < sizeof(SnapshotHeader))
+		throw runtime_error("Not a snapshot file : " + filename);
+
+	SnapshotHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	if (strncmp(header.magic, snapshotMagic, 4))
+		throw runtime_error("Not a snapshot file : " + filename);
+	if (header.version != snapshotVersion)
+		throw runtime_error("Unsupported snapshot file version : " + filename);
+	if (header.entityCount != collection.getAll().size() ||
+		header.entityHash != hashEntities(collection))
+		throw runtime_error("Snapshot file doesn't match entities : " + filename);
+	const size_t expectedSize = sizeof(SnapshotHeader) +
+		header.entityCount*sizeof(SnapshotEntity) +
+		header.stateVectorCount*sizeof(double);
+	if (file.size() != expectedSize)
+		throw runtime_error("Truncated snapshot file : " + filename);
+
+	Snapshot snapshot;
+	snapshot.epoch = header.epoch;
+	snapshot.timeWarpIndex = header.timeWarpIndex;
+	snapshot.focusedBodyId = header.focusedBodyId;
+	for (int i=0;i<3;++i) snapshot.viewPolar[i] = header.viewPolar[i];
+	for (int i=0;i<2;++i) snapshot.panPolar[i] = header.panPolar[i];
+	for (int i=0;i<9;++i) snapshot.viewDir[i/3][i%3] = header.viewDir[i];
+
+	const uint8_t *entities = file.data() + sizeof(SnapshotHeader);
+	snapshot.states.reserve(header.entityCount);
+	for (size_t i=0;i<header.entityCount;++i)
+	{
+		SnapshotEntity e;
+		memcpy(&e, entities + i*sizeof(SnapshotEntity), sizeof(e));
+		snapshot.states.emplace_back(
+			dvec3(e.position[0], e.position[1], e.position[2]),
+			e.rotationAngle, e.cloudDisp);
+	}
+
+	snapshot.stateVectors.resize(header.stateVectorCount);
+	memcpy(snapshot.stateVectors.data(),
+		entities + header.entityCount*sizeof(SnapshotEntity),
+		header.stateVectorCount*sizeof(double));
+	return snapshot;
+}
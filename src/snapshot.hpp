@@ -0,0 +1,51 @@
+#pragma once
+
+#include "entity.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+/**
+ * Simulation state at an instant, enough to resume exactly from it without
+ * recomputing entity positions
+ */
+struct Snapshot
+{
+	/// Seconds since January 1st 2017 00:00:00 UTC
+	double epoch = 0.0;
+	/// Index of the time warp factor
+	int timeWarpIndex = 0;
+	/// Index in EntityCollection::getBodies() of the focused body
+	int focusedBodyId = 0;
+	/// View polar coordinates (theta, phi, distance)
+	glm::vec3 viewPolar;
+	/// View panning polar coordinates (theta, phi)
+	glm::vec2 panPolar;
+	/// View matrix
+	glm::mat3 viewDir;
+	/// State of every entity, in the order of EntityCollection::getAll()
+	std::vector<EntityState> states;
+	/// N-body state vectors (see NBodySystem::getStateVectors()), empty if unused
+	std::vector<double> stateVectors;
+};
+
+/**
+ * Writes a snapshot to a binary file. Throws runtime_error on failure
+ * @param filename file to write
+ * @param snapshot state to save
+ * @param collection entities the states belong to
+ */
+void saveSnapshot(const std::string &filename, const Snapshot &snapshot,
+	const EntityCollection &collection);
+
+/**
+ * Reads a snapshot from a binary file, mapped in memory. Throws
+ * runtime_error if the file can't be read or was saved with other entities
+ * @param filename file to read
+ * @param collection entities the states must belong to
+ * @return saved state
+ */
+Snapshot loadSnapshot(const std::string &filename, const EntityCollection &collection);
@@ -0,0 +1,215 @@
+#include "stream_telemetry.hpp"
+
+#include <chrono>
+
+using namespace std;
+
+StreamTelemetry::StreamTelemetry(const size_t maxTiles, const size_t maxTextures,
+	const size_t maxSamples) :
+	_maxTiles(maxTiles),
+	_maxTextures(maxTextures),
+	_maxSamples(maxSamples)
+{
+
+}
+
+double StreamTelemetry::now()
+{
+	// From the first call, so that times stay readable in dumps
+	static const chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+	return chrono::duration<double>(chrono::steady_clock::now()-origin).count();
+}
+
+void StreamTelemetry::addTile(const Tile &tile)
+{
+	_tiles.push_back(tile);
+	while (_tiles.size() > _maxTiles) _tiles.pop_front();
+}
+
+void StreamTelemetry::addTexture(const Texture &texture)
+{
+	_textures[texture.handle] = texture;
+	while (_textures.size() > _maxTextures) _textures.erase(_textures.begin());
+}
+
+void StreamTelemetry::setComplete(const uint32_t handle, const double time)
+{
+	auto it = _textures.find(handle);
+	if (it != _textures.end() && it->second.completed < 0.0) it->second.completed = time;
+	// Complete textures can be sampled too
+	setResident(handle, time);
+}
+
+void StreamTelemetry::setResident(const uint32_t handle, const double time)
+{
+	auto it = _textures.find(handle);
+	if (it != _textures.end() && it->second.resident < 0.0) it->second.resident = time;
+}
+
+void StreamTelemetry::addSample(const Sample &sample)
+{
+	_samples.push_back(sample);
+	while (_samples.size() > _maxSamples) _samples.pop_front();
+}
+
+const deque<StreamTelemetry::Tile> &StreamTelemetry::getTiles() const
+{
+	return _tiles;
+}
+
+const map<uint32_t, StreamTelemetry::Texture> &StreamTelemetry::getTextures() const
+{
+	return _textures;
+}
+
+const deque<StreamTelemetry::Sample> &StreamTelemetry::getSamples() const
+{
+	return _samples;
+}
+
+double StreamTelemetry::getUploadThroughput(const double window) const
+{
+	const double start = now()-window;
+	size_t bytes = 0;
+	// Tiles are in upload order
+	for (auto it=_tiles.rbegin();it!=_tiles.rend() && it->uploaded >= start;++it)
+	{
+		bytes += it->size;
+	}
+	return bytes/window;
+}
+
+double StreamTelemetry::getLoadThroughput(const double window) const
+{
+	const double start = now()-window;
+	size_t bytes = 0;
+	for (const Tile &t : _tiles)
+	{
+		if (t.times.loadEnd >= start) bytes += t.size;
+	}
+	return bytes/window;
+}
+
+/// Significant digits of times, for microseconds after hours of running
+static const int timePrecision = 10;
+
+/// Returns the duration between two timestamps, -1 if one wasn't reached
+static double getDuration(const double start, const double end)
+{
+	return (start >= 0.0 && end >= 0.0)?end-start:-1.0;
+}
+
+void StreamTelemetry::writeTilesCsv(ostream &out) const
+{
+	const streamsize precision = out.precision(timePrecision);
+	out << "handle,level,tile,size,virtual,created,assigned,load_start,load_end,uploaded,"
+		"wait_time,queue_time,load_time,upload_wait_time" << endl;
+	for (const Tile &t : _tiles)
+	{
+		out << t.handle << "," << t.level << "," << t.tileId << "," << t.size << ","
+			<< t.virtualTile << "," << t.times.created << "," << t.times.assigned << ","
+			<< t.times.loadStart << "," << t.times.loadEnd << "," << t.uploaded << ","
+			<< getDuration(t.times.created, t.times.assigned) << ","
+			<< getDuration(t.times.assigned, t.times.loadStart) << ","
+			<< getDuration(t.times.loadStart, t.times.loadEnd) << ","
+			<< getDuration(t.times.loadEnd, t.uploaded) << endl;
+	}
+	out.precision(precision);
+}
+
+/// Quotes a string for CSV and JSON, which escape quotes differently
+static string quote(const string &s, const bool json)
+{
+	string q = "\"";
+	for (const char c : s)
+	{
+		if (c == '"') q += json?"\\\"":"\"\"";
+		else if (c == '\\' && json) q += "\\\\";
+		else if ((unsigned char)c < 0x20 && json) q += ' ';
+		else q += c;
+	}
+	return q + "\"";
+}
+
+void StreamTelemetry::writeTexturesCsv(ostream &out) const
+{
+	const streamsize precision = out.precision(timePrecision);
+	out << "handle,filename,size,tiles,created,resident,completed,time_to_resident,"
+		"time_to_complete" << endl;
+	for (const auto &p : _textures)
+	{
+		const Texture &t = p.second;
+		out << t.handle << "," << quote(t.filename, false) << "," << t.size << ","
+			<< t.tiles << "," << t.created << "," << t.resident << "," << t.completed << ","
+			<< ((t.resident >= 0.0)?t.resident-t.created:-1.0) << ","
+			<< ((t.completed >= 0.0)?t.completed-t.created:-1.0) << endl;
+	}
+	out.precision(precision);
+}
+
+void StreamTelemetry::writeSamplesCsv(ostream &out) const
+{
+	const streamsize precision = out.precision(timePrecision);
+	out << "time,waiting,queued,loaded,used_pages,total_pages,uploaded_tiles,"
+		"uploaded_bytes,resident_size,upload_cpu_time,upload_gpu_time" << endl;
+	for (const Sample &s : _samples)
+	{
+		out << s.time << "," << s.waiting << "," << s.queued << "," << s.loaded << ","
+			<< s.usedPages << "," << s.totalPages << "," << s.uploadedTiles << ","
+			<< s.uploadedBytes << "," << s.residentSize << "," << s.uploadCpuTime << ","
+			<< s.uploadGpuTime << endl;
+	}
+	out.precision(precision);
+}
+
+void StreamTelemetry::writeJson(ostream &out) const
+{
+	const streamsize precision = out.precision(timePrecision);
+	out << "{" << endl;
+	out << "\"uploadThroughput\":" << getUploadThroughput() << "," << endl;
+	out << "\"loadThroughput\":" << getLoadThroughput() << "," << endl;
+
+	out << "\"tiles\":[";
+	for (auto it=_tiles.begin();it!=_tiles.end();++it)
+	{
+		const Tile &t = *it;
+		out << ((it==_tiles.begin())?"":",") << endl
+			<< "{\"handle\":" << t.handle << ",\"level\":" << t.level
+			<< ",\"tile\":" << t.tileId << ",\"size\":" << t.size
+			<< ",\"virtual\":" << (t.virtualTile?"true":"false")
+			<< ",\"created\":" << t.times.created << ",\"assigned\":" << t.times.assigned
+			<< ",\"loadStart\":" << t.times.loadStart << ",\"loadEnd\":" << t.times.loadEnd
+			<< ",\"uploaded\":" << t.uploaded << "}";
+	}
+	out << "]," << endl;
+
+	out << "\"textures\":[";
+	for (auto it=_textures.begin();it!=_textures.end();++it)
+	{
+		const Texture &t = it->second;
+		out << ((it==_textures.begin())?"":",") << endl
+			<< "{\"handle\":" << t.handle << ",\"filename\":" << quote(t.filename, true)
+			<< ",\"size\":" << t.size << ",\"tiles\":" << t.tiles
+			<< ",\"created\":" << t.created << ",\"resident\":" << t.resident
+			<< ",\"completed\":" << t.completed << "}";
+	}
+	out << "]," << endl;
+
+	out << "\"samples\":[";
+	for (auto it=_samples.begin();it!=_samples.end();++it)
+	{
+		const Sample &s = *it;
+		out << ((it==_samples.begin())?"":",") << endl
+			<< "{\"time\":" << s.time << ",\"waiting\":" << s.waiting
+			<< ",\"queued\":" << s.queued << ",\"loaded\":" << s.loaded
+			<< ",\"usedPages\":" << s.usedPages << ",\"totalPages\":" << s.totalPages
+			<< ",\"uploadedTiles\":" << s.uploadedTiles
+			<< ",\"uploadedBytes\":" << s.uploadedBytes
+			<< ",\"residentSize\":" << s.residentSize
+			<< ",\"uploadCpuTime\":" << s.uploadCpuTime
+			<< ",\"uploadGpuTime\":" << s.uploadGpuTime << "}";
+	}
+	out << "]" << endl;
+	out << "}" << endl;
+	out.precision(precision);
+}
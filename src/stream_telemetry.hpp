@@ -0,0 +1,180 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <ostream>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Records what happens to tiles and textures in the streamer, to tune page
+ * size, page count and upload budget from data
+ *
+ * Keeps the last tiles uploaded and the last samples taken (one per update),
+ * so memory stays bounded however long the streamer runs. All times are in
+ * seconds, from now().
+ *
+ * Not thread-safe : loading threads only stamp their own tiles, which are
+ * recorded by the thread calling update().
+ */
+class StreamTelemetry
+{
+public:
+	/// Timestamps of a tile going through the streamer, negative if not reached
+	struct TileTimes
+	{
+		/// Put in the waiting list
+		double created = -1.0;
+		/// Got pages of the buffer and queued for loading threads
+		double assigned = -1.0;
+		/// Taken by a loading thread or submitted as an asynchronous read
+		double loadStart = -1.0;
+		/// Data written to its pages
+		double loadEnd = -1.0;
+	};
+
+	/// Tile uploaded to a texture or tile cache
+	struct Tile
+	{
+		/// Texture handle
+		uint32_t handle;
+		/// Mip level of the texture
+		int level;
+		/// Unique id for this tile of this level
+		int tileId;
+		/// Size in bytes of the uploaded data
+		size_t size;
+		/// Tile of a virtual texture
+		bool virtualTile;
+		/// Stages before upload
+		TileTimes times;
+		/// Upload submitted to the GL
+		double uploaded;
+	};
+
+	/// Stream texture
+	struct Texture
+	{
+		/// Texture handle
+		uint32_t handle;
+		/// File or folder it is streamed from
+		std::string filename;
+		/// Size in bytes of its storage when created
+		size_t size;
+		/// Number of tiles to load when created
+		int tiles;
+		/// Creation time
+		double created;
+		/// Time its coarsest level was first uploaded and it could be
+		/// sampled, negative if not yet
+		double resident = -1.0;
+		/// Time it first became complete, negative if not yet
+		double completed = -1.0;
+	};
+
+	/// State of the streamer at the end of an update
+	struct Sample
+	{
+		double time;
+		/// Tiles without pages of the buffer
+		int waiting;
+		/// Tiles with pages, waiting for a loading thread or the read thread
+		int queued;
+		/// Tiles loaded, waiting for upload
+		int loaded;
+		/// Pages of the buffer in use
+		int usedPages;
+		/// Pages of the buffer
+		int totalPages;
+		/// Tiles uploaded during the update
+		int uploadedTiles;
+		/// Bytes uploaded during the update
+		size_t uploadedBytes;
+		/// Size in bytes of the storage of all stream textures
+		size_t residentSize;
+		/// Seconds the update spent uploading tiles on the CPU
+		double uploadCpuTime;
+		/// Seconds the GPU spent on the uploads of an earlier update,
+		/// measured during this one, negative if none
+		double uploadGpuTime;
+	};
+
+	/**
+	 * @param maxTiles number of most recent tiles kept
+	 * @param maxTextures number of most recent textures kept
+	 * @param maxSamples number of most recent samples kept
+	 */
+	explicit StreamTelemetry(size_t maxTiles=16384, size_t maxTextures=1024,
+		size_t maxSamples=4096);
+
+	/// Returns the time in seconds of a monotonic clock
+	static double now();
+
+	/**
+	 * Records an uploaded tile
+	 * @param tile tile with all its timestamps
+	 */
+	void addTile(const Tile &tile);
+	/**
+	 * Records a created texture
+	 * @param texture texture, not complete yet
+	 */
+	void addTexture(const Texture &texture);
+	/**
+	 * Records the time a texture became complete, if it is the first time
+	 * @param handle texture handle
+	 * @param time time it became complete
+	 */
+	void setComplete(uint32_t handle, double time);
+	/**
+	 * Records the time a texture could first be sampled, if it is the first time
+	 * @param handle texture handle
+	 * @param time time its coarsest level was uploaded
+	 */
+	void setResident(uint32_t handle, double time);
+	/**
+	 * Records the state of the streamer
+	 * @param sample state at the end of an update
+	 */
+	void addSample(const Sample &sample);
+
+	/// Returns the last tiles uploaded, oldest first
+	const std::deque<Tile> &getTiles() const;
+	/// Returns the last textures created, by handle
+	const std::map<uint32_t, Texture> &getTextures() const;
+	/// Returns the last samples, oldest first
+	const std::deque<Sample> &getSamples() const;
+	/**
+	 * Returns the bytes uploaded per second over a time window
+	 * @param window duration in seconds, ending now
+	 */
+	double getUploadThroughput(double window=1.0) const;
+	/**
+	 * Returns the bytes loaded into pages per second over a time window, by
+	 * tiles that were uploaded since
+	 * @param window duration in seconds, ending now
+	 */
+	double getLoadThroughput(double window=1.0) const;
+
+	/// Writes tiles as CSV, one line per tile with a header line
+	void writeTilesCsv(std::ostream &out) const;
+	/// Writes textures as CSV, one line per texture with a header line
+	void writeTexturesCsv(std::ostream &out) const;
+	/// Writes samples as CSV, one line per sample with a header line
+	void writeSamplesCsv(std::ostream &out) const;
+	/// Writes throughputs, tiles, textures and samples as a JSON object
+	void writeJson(std::ostream &out) const;
+
+private:
+	size_t _maxTiles;
+	size_t _maxTextures;
+	size_t _maxSamples;
+	/// Last tiles uploaded
+	std::deque<Tile> _tiles;
+	/// Last textures created, handles are increasing so the first is the oldest
+	std::map<uint32_t, Texture> _textures;
+	/// Last samples
+	std::deque<Sample> _samples;
+};
@@ -0,0 +1,389 @@
+#include "tile_archive.hpp"
+
+#include <stdexcept>
+#include <cstring>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+/// File identifier
+static const char archiveMagic[4] = {'R','T','A','R'};
+/// Incremented at each change of the file layout
+static const uint32_t archiveVersion = 2;
+/// Magic, version, format, tile size, levels, entry count
+static const uint64_t headerSize = 4+5*sizeof(uint32_t);
+const uint64_t TileArchive::alignment;
+const int TileArchive::maxLevels;
+/// Largest number of mipmap levels of a tile
+static const uint32_t maxMipmaps = 32;
+
+TileArchive::TileArchive(const string &filename, const bool memoryMapped) :
+	_filename(filename)
+{
+#ifndef _WIN32
+	if (!memoryMapped)
+	{
+		_fd = open(filename.c_str(), O_RDONLY);
+		if (_fd == -1) throw runtime_error("Can't open file " + filename);
+		struct stat st;
+		if (fstat(_fd, &st) == -1)
+		{
+			::close(_fd);
+			throw runtime_error("Can't open file " + filename);
+		}
+		_size = st.st_size;
+#ifdef O_DIRECT
+		// Some filesystems refuse it, the buffered descriptor is enough then
+		_directFd = open(filename.c_str(), O_RDONLY|O_DIRECT);
+#endif
+	}
+#endif
+	// No pread() on Windows, mapped there in both cases
+	if (_fd == -1)
+	{
+		_file.reset(new MappedFile(filename));
+		_size = _file->size();
+	}
+
+	try
+	{
+		uint8_t header[headerSize];
+		read(0, headerSize, header);
+		if (strncmp((const char*)header, archiveMagic, 4))
+			throw runtime_error("Not a tile archive : " + filename);
+		uint32_t values[5];
+		memcpy(values, header+4, sizeof(values));
+		if (values[0] != archiveVersion)
+			throw runtime_error("Unsupported tile archive version : " + filename);
+		_format = (DDSLoader::Format)values[1];
+		_tileSize = values[2];
+		_levels = values[3];
+		if (_tileSize <= 0 || _levels <= 0 || _levels > maxLevels ||
+			values[4] != getEntryCount(_levels))
+			throw runtime_error("Invalid tile archive index : " + filename);
+
+		_entries.resize(values[4]);
+		read(headerSize, _entries.size()*sizeof(Entry), _entries.data());
+		size_t mipmapCount = 0;
+		for (const Entry &e : _entries)
+		{
+			if (e.mipmapCount == 0 || e.mipmapCount > maxMipmaps || e.codec > Codec::LZ4)
+				throw runtime_error("Invalid tile archive index : " + filename);
+			if (!isSupported(e.codec))
+				throw runtime_error("Tile archive codec not supported by this build : " + filename);
+			if (e.offset+e.size > _size)
+				throw runtime_error("Truncated tile archive : " + filename);
+			_firstMipmaps.push_back(mipmapCount);
+			mipmapCount += e.mipmapCount;
+		}
+
+		_storedSizes.resize(mipmapCount);
+		read(headerSize+_entries.size()*sizeof(Entry), mipmapCount*sizeof(uint32_t),
+			_storedSizes.data());
+		for (size_t i=0;i<_entries.size();++i)
+		{
+			uint64_t size = 0;
+			for (uint32_t m=0;m<_entries[i].mipmapCount;++m)
+				size += _storedSizes[_firstMipmaps[i]+m];
+			if (size > _entries[i].size)
+				throw runtime_error("Invalid tile archive index : " + filename);
+		}
+	}
+	catch (...)
+	{
+#ifndef _WIN32
+		if (_fd != -1) ::close(_fd);
+		if (_directFd != -1) ::close(_directFd);
+#endif
+		throw;
+	}
+}
+
+TileArchive::~TileArchive()
+{
+#ifndef _WIN32
+	if (_fd != -1) ::close(_fd);
+	if (_directFd != -1) ::close(_directFd);
+#endif
+}
+
+const string &TileArchive::getFilename() const
+{
+	return _filename;
+}
+
+DDSLoader::Format TileArchive::getFormat() const
+{
+	return _format;
+}
+
+int TileArchive::getTileSize() const
+{
+	return _tileSize;
+}
+
+int TileArchive::getLevels() const
+{
+	return _levels;
+}
+
+size_t TileArchive::getEntryIndex(const int level, const int x, const int y) const
+{
+	if (level < 0 || level >= _levels)
+		throw runtime_error("Tile level out of range");
+	if (level == 0)
+	{
+		if (x != 0 || y != 0) throw runtime_error("Tile out of range");
+		return 0;
+	}
+	const int rows = 1<<(level-1);
+	const int columns = 2*rows;
+	if (x < 0 || x >= columns || y < 0 || y >= rows)
+		throw runtime_error("Tile out of range");
+	return getEntryCount(level) + (size_t)x*rows + y;
+}
+
+const TileArchive::Entry &TileArchive::getEntry(const size_t index) const
+{
+	return _entries.at(index);
+}
+
+const uint32_t *TileArchive::getStoredSizes(const size_t index) const
+{
+	return _storedSizes.data()+_firstMipmaps.at(index);
+}
+
+void TileArchive::readMipmap(const size_t index, const uint64_t offset,
+	const size_t storedSize, void *ptr, const size_t size) const
+{
+	if (storedSize == size)
+	{
+		read(offset, size, ptr);
+		return;
+	}
+
+	// Decompressors read back what they wrote for matches, which is slow on
+	// write-combined memory (the PBO), so they write to a cached buffer that
+	// is then copied in one sequential pass
+	thread_local vector<uint8_t> compressed;
+	thread_local vector<uint8_t> decompressed;
+	const uint8_t *src = nullptr;
+	if (_file)
+	{
+		if (offset+storedSize > _size)
+			throw runtime_error("Truncated tile archive : " + _filename);
+		src = _file->data()+offset;
+	}
+	else
+	{
+		compressed.resize(storedSize);
+		read(offset, storedSize, compressed.data());
+		src = compressed.data();
+	}
+	decompressed.resize(size);
+	decompress(getEntry(index).codec, src, storedSize, decompressed.data(), size);
+	memcpy(ptr, decompressed.data(), size);
+}
+
+void TileArchive::read(const uint64_t offset, const size_t size, void *ptr) const
+{
+	if (offset+size > _size)
+		throw runtime_error("Truncated tile archive : " + _filename);
+
+	if (_file)
+	{
+		memcpy(ptr, _file->data()+offset, size);
+		return;
+	}
+#ifndef _WIN32
+	// Positioned reads don't share a file offset, safe from all loading threads
+	size_t done = 0;
+	while (done < size)
+	{
+		const ssize_t r = pread(_fd, (uint8_t*)ptr+done, size-done, offset+done);
+		if (r <= 0) throw runtime_error("Can't read file " + _filename);
+		done += r;
+	}
+#endif
+}
+
+void TileArchive::advise(const uint64_t offset, const size_t size,
+	const MappedFile::Advice advice) const
+{
+	if (_file)
+	{
+		_file->advise(offset, size, advice);
+		return;
+	}
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+	int fileAdvice = POSIX_FADV_NORMAL;
+	if (advice == MappedFile::Advice::Sequential) fileAdvice = POSIX_FADV_SEQUENTIAL;
+	else if (advice == MappedFile::Advice::WillNeed) fileAdvice = POSIX_FADV_WILLNEED;
+	posix_fadvise(_fd, offset, size, fileAdvice);
+#endif
+}
+
+int TileArchive::getDescriptor() const
+{
+	return _fd;
+}
+
+int TileArchive::getDirectDescriptor() const
+{
+	return _directFd;
+}
+
+size_t TileArchive::getEntryCount(const int levels)
+{
+	// Level l has 2^(2l-1) tiles
+	size_t count = (levels>0)?1:0;
+	for (int l=1;l<levels;++l) count += (size_t)1<<(2*l-1);
+	return count;
+}
+
+uint64_t TileArchive::getPayloadStart(const size_t entryCount,
+	const size_t mipmapCount)
+{
+	return align(headerSize + entryCount*sizeof(Entry) + mipmapCount*sizeof(uint32_t));
+}
+
+uint64_t TileArchive::align(const uint64_t offset)
+{
+	return (offset+alignment-1)/alignment*alignment;
+}
+
+template<class T>
+static void writeValue(ostream &out, const T &value)
+{
+	out.write((const char*)&value, sizeof(T));
+}
+
+void TileArchive::writeIndex(ostream &out, const DDSLoader::Format format,
+	const int tileSize, const int levels, const vector<Entry> &entries,
+	const vector<uint32_t> &storedSizes)
+{
+	if (entries.size() != getEntryCount(levels))
+		throw runtime_error("Wrong number of tiles for tile archive");
+	size_t mipmapCount = 0;
+	for (const Entry &e : entries) mipmapCount += e.mipmapCount;
+	if (storedSizes.size() != mipmapCount)
+		throw runtime_error("Wrong number of mipmap sizes for tile archive");
+	out.write(archiveMagic, 4);
+	writeValue(out, archiveVersion);
+	writeValue(out, (uint32_t)format);
+	writeValue(out, (uint32_t)tileSize);
+	writeValue(out, (uint32_t)levels);
+	writeValue(out, (uint32_t)entries.size());
+	out.write((const char*)entries.data(), entries.size()*sizeof(Entry));
+	out.write((const char*)storedSizes.data(), storedSizes.size()*sizeof(uint32_t));
+}
+
+bool TileArchive::isSupported(const Codec codec)
+{
+	switch (codec)
+	{
+		case Codec::None:
+			return true;
+#ifdef USE_ZSTD
+		case Codec::Zstd:
+			return true;
+#endif
+#ifdef USE_LZ4
+		case Codec::LZ4:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+TileArchive::Codec TileArchive::getCodec(const string &name)
+{
+	if (name == "none") return Codec::None;
+	if (name == "zstd") return Codec::Zstd;
+	if (name == "lz4") return Codec::LZ4;
+	throw runtime_error("Unknown codec " + name);
+}
+
+vector<uint8_t> TileArchive::compress(const Codec codec, const int level,
+	const uint8_t *data, const size_t size)
+{
+	vector<uint8_t> out;
+	switch (codec)
+	{
+		case Codec::None:
+			out.assign(data, data+size);
+			return out;
+#ifdef USE_ZSTD
+		case Codec::Zstd:
+		{
+			out.resize(ZSTD_compressBound(size));
+			const size_t r = ZSTD_compress(out.data(), out.size(), data, size, level);
+			if (ZSTD_isError(r))
+				throw runtime_error(string("zstd compression failed : ") + ZSTD_getErrorName(r));
+			out.resize(r);
+			return out;
+		}
+#endif
+#ifdef USE_LZ4
+		case Codec::LZ4:
+		{
+			out.resize(LZ4_compressBound(size));
+			const int r = LZ4_compress_HC((const char*)data, (char*)out.data(),
+				size, out.size(), level);
+			if (r <= 0) throw runtime_error("LZ4 compression failed");
+			out.resize(r);
+			return out;
+		}
+#endif
+		default:
+			// Only codecs compiled in use the level
+			(void)level;
+			throw runtime_error("Codec not supported by this build");
+	}
+}
+
+void TileArchive::decompress(const Codec codec, const uint8_t *src,
+	const size_t srcSize, uint8_t *dst, const size_t dstSize)
+{
+	switch (codec)
+	{
+		case Codec::None:
+			if (srcSize != dstSize) break;
+			memcpy(dst, src, dstSize);
+			return;
+#ifdef USE_ZSTD
+		case Codec::Zstd:
+		{
+			const size_t r = ZSTD_decompress(dst, dstSize, src, srcSize);
+			if (ZSTD_isError(r) || r != dstSize) break;
+			return;
+		}
+#endif
+#ifdef USE_LZ4
+		case Codec::LZ4:
+		{
+			const int r = LZ4_decompress_safe((const char*)src, (char*)dst,
+				srcSize, dstSize);
+			if (r < 0 || (size_t)r != dstSize) break;
+			return;
+		}
+#endif
+		default:
+			throw runtime_error("Codec not supported by this build");
+	}
+	throw runtime_error("Corrupt compressed tile");
+}
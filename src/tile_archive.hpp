@@ -0,0 +1,200 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <ostream>
+#include <cstdint>
+
+#include "ddsloader.hpp"
+#include "mapped_file.hpp"
+
+/**
+ * Single file holding all tiles of a stream texture
+ *
+ * Replaces the folder layout (info.sn and one DDS file per tile) so that a
+ * texture is opened once instead of once per tile. Layout, in native byte
+ * order :
+ * - "RTAR" magic, uint32 version, uint32 format (DDSLoader::Format),
+ *   uint32 tile size, uint32 levels, uint32 entry count
+ * - one entry per tile : uint32 width, height and mipmap count, uint32 codec,
+ *   uint64 offset and size of its payload
+ * - stored size of each mipmap level of each tile, uint32, in entry order
+ * - payloads, each starting on a multiple of 4096 bytes : the mipmap levels
+ *   of a tile, largest first, as in a DDS file without its header
+ *
+ * Entries are sorted by level (level0 first, it holds the mip tail), then by
+ * column, then by row.
+ *
+ * Mipmap levels are compressed separately with the codec of their tile, so
+ * that each can be loaded on its own. A level whose stored size is its
+ * uncompressed size is stored as is (compression didn't make it smaller).
+ */
+class TileArchive
+{
+public:
+	/// Supercompression of the mipmap levels of a tile
+	enum class Codec : uint32_t
+	{
+		None,
+		Zstd,
+		LZ4
+	};
+
+	/// Index entry of a tile
+	struct Entry
+	{
+		uint32_t width;
+		uint32_t height;
+		uint32_t mipmapCount;
+		Codec codec;
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	/// Payload alignment in bytes, multiple of disk sectors and memory pages
+	static const uint64_t alignment = 4096;
+	/// Largest number of levels, finer levels have more columns than
+	/// virtual texture tile keys can address
+	static const int maxLevels = 14;
+
+	TileArchive() = default;
+	/**
+	 * Opens an archive and reads its index, throws runtime_error if it isn't
+	 * a valid archive
+	 * @param filename archive path
+	 * @param memoryMapped if set, payloads are copied from a mapping of the
+	 * whole file, otherwise they are read with pread() on a single descriptor
+	 */
+	explicit TileArchive(const std::string &filename, bool memoryMapped=false);
+	TileArchive(const TileArchive &) = delete;
+	TileArchive &operator=(const TileArchive &) = delete;
+	~TileArchive();
+
+	/// Returns the archive path
+	const std::string &getFilename() const;
+	/// Returns the block compression format of all tiles
+	DDSLoader::Format getFormat() const;
+	/// Returns the width and height of tiles in texels
+	int getTileSize() const;
+	/// Returns the number of levels, level0 included
+	int getLevels() const;
+	/**
+	 * Returns the index of the entry of a tile, throws runtime_error if out
+	 * of range
+	 * @param level level (0 is the mip tail)
+	 * @param x column
+	 * @param y row
+	 */
+	size_t getEntryIndex(int level, int x, int y) const;
+	/// Returns an index entry
+	const Entry &getEntry(size_t index) const;
+	/// Returns the stored size of each mipmap level of an entry
+	const uint32_t *getStoredSizes(size_t index) const;
+	/**
+	 * Copies a mipmap level of a tile, decompressing it if it is stored
+	 * compressed, throws runtime_error if it can't be read
+	 * @param index index of the tile entry
+	 * @param offset offset of the stored mipmap level in bytes
+	 * @param storedSize size of the stored mipmap level in bytes
+	 * @param ptr to write to
+	 * @param size uncompressed size in bytes
+	 */
+	void readMipmap(size_t index, uint64_t offset, size_t storedSize,
+		void *ptr, size_t size) const;
+	/**
+	 * Copies a range of the file, throws runtime_error if it can't be read
+	 * @param offset start of the range in bytes
+	 * @param size size of the range in bytes
+	 * @param ptr to write to
+	 */
+	void read(uint64_t offset, size_t size, void *ptr) const;
+	/**
+	 * Hints the expected access pattern of a range
+	 * @param offset start of the range in bytes
+	 * @param size size of the range in bytes
+	 * @param advice access pattern
+	 */
+	void advise(uint64_t offset, size_t size, MappedFile::Advice advice) const;
+	/// Returns the descriptor pread() uses, -1 if memory mapped
+	int getDescriptor() const;
+	/**
+	 * Returns a descriptor of the same file opened with O_DIRECT (reads skip
+	 * the page cache, offsets, sizes and memory must be aligned on
+	 * alignment), -1 if memory mapped or unsupported
+	 */
+	int getDirectDescriptor() const;
+
+	/// Returns the number of tiles of an archive with a number of levels
+	static size_t getEntryCount(int levels);
+	/**
+	 * Returns the offset of the first payload of an archive
+	 * @param entryCount number of tiles
+	 * @param mipmapCount number of mipmap levels of all tiles
+	 */
+	static uint64_t getPayloadStart(size_t entryCount, size_t mipmapCount);
+	/// Rounds an offset up to the payload alignment
+	static uint64_t align(uint64_t offset);
+	/**
+	 * Writes the header and index of an archive, payloads are expected at the
+	 * offsets of the entries
+	 * @param out stream at the start of the file
+	 * @param format block compression format of all tiles
+	 * @param tileSize width and height of tiles in texels
+	 * @param levels number of levels
+	 * @param entries one entry per tile, in index order
+	 * @param storedSizes stored size of each mipmap level, in entry order
+	 */
+	static void writeIndex(std::ostream &out, DDSLoader::Format format,
+		int tileSize, int levels, const std::vector<Entry> &entries,
+		const std::vector<uint32_t> &storedSizes);
+	/// Returns whether this build can decompress a codec
+	static bool isSupported(Codec codec);
+	/// Parses a codec name (none, zstd or lz4), throws runtime_error if unknown
+	static Codec getCodec(const std::string &name);
+	/**
+	 * Compresses data, throws runtime_error if the codec isn't supported
+	 * @param codec codec to use
+	 * @param level compression level of the codec
+	 * @param data data to compress
+	 * @param size size of data in bytes
+	 * @return compressed data
+	 */
+	static std::vector<uint8_t> compress(Codec codec, int level,
+		const uint8_t *data, size_t size);
+	/**
+	 * Decompresses data, throws runtime_error if it is corrupt or doesn't
+	 * have the expected size
+	 * @param codec codec data was compressed with
+	 * @param src compressed data
+	 * @param srcSize size of compressed data in bytes
+	 * @param dst to write to
+	 * @param dstSize uncompressed size in bytes
+	 */
+	static void decompress(Codec codec, const uint8_t *src, size_t srcSize,
+		uint8_t *dst, size_t dstSize);
+
+private:
+	/// Archive path
+	std::string _filename;
+	/// Format of all tiles
+	DDSLoader::Format _format = DDSLoader::Format::Undefined;
+	/// Tile size in texels
+	int _tileSize = 0;
+	/// Number of levels
+	int _levels = 0;
+	/// Tile entries
+	std::vector<Entry> _entries;
+	/// Stored size of each mipmap level of all tiles
+	std::vector<uint32_t> _storedSizes;
+	/// Index in _storedSizes of the first mipmap level of each tile
+	std::vector<size_t> _firstMipmaps;
+	/// Mapping of the whole file if memory mapped
+	std::unique_ptr<MappedFile> _file;
+	/// File descriptor for pread() if not memory mapped, -1 if none
+	int _fd = -1;
+	/// Same file opened with O_DIRECT, -1 if none
+	int _directFd = -1;
+	/// Size of the file in bytes
+	uint64_t _size = 0;
+};
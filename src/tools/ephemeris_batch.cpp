@@ -0,0 +1,257 @@
+#include "entity.hpp"
+#include "entity_file.hpp"
+#include "orbit_batch.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+using namespace glm;
+using namespace std;
+
+/**
+ * Headless ephemeris generator
+ *
+ * Loads an entity file and writes the absolute position of every entity for
+ * a range of epochs, without any window or graphics context. Epochs are
+ * split between all cores; each block of epochs is propagated and formatted
+ * in parallel, then written in order.
+ *
+ * CSV output has one "epoch,entity,x,y,z" line per entity and epoch.
+ * Binary output (any other extension) is, in native byte order :
+ * - "REPB" magic, uint32 version, uint32 entity count, uint64 epoch count
+ * - entity names, each null terminated
+ * - per epoch : double epoch, then x,y,z doubles of every entity
+ */
+
+/// Binary file identifier
+static const char batchMagic[4] = {'R','E','P','B'};
+/// Incremented at each change of the binary layout
+static const uint32_t batchVersion = 1;
+/// Epochs propagated by a thread before output is written
+static const size_t epochsPerBlock = 2048;
+
+struct Options
+{
+	double start = 0.0;
+	double end = 0.0;
+	double step = 0.0;
+	string output = "";
+	string entityFile = "config/entities.sn";
+	int threads = 0;
+};
+
+static void printUsage(const char *name)
+{
+	cout << "Usage : " << name << " start end step output [options]" << endl
+		<< "  start, end, step  epoch range in seconds (end included)" << endl
+		<< "  output            .csv file for text output, binary otherwise" << endl
+		<< "Options :" << endl
+		<< "  --entities file   entity file (default config/entities.sn)" << endl
+		<< "  --threads n       number of threads (default all cores)" << endl;
+}
+
+static Options parseOptions(int argc, char **argv)
+{
+	if (argc < 5) throw runtime_error("Missing arguments");
+	Options opt;
+	opt.start = stod(argv[1]);
+	opt.end = stod(argv[2]);
+	opt.step = stod(argv[3]);
+	opt.output = argv[4];
+	for (int i=5;i<argc;++i)
+	{
+		const string arg = argv[i];
+		if (i+1 >= argc) throw runtime_error("Missing value for " + arg);
+		if (arg == "--entities") opt.entityFile = argv[++i];
+		else if (arg == "--threads") opt.threads = stoi(argv[++i]);
+		else throw runtime_error("Unknown option " + arg);
+	}
+	if (opt.step <= 0.0) throw runtime_error("Step must be positive");
+	if (opt.end < opt.start) throw runtime_error("End epoch is before start epoch");
+	return opt;
+}
+
+static bool endsWith(const string &str, const string &suffix)
+{
+	return str.size() >= suffix.size() &&
+		str.compare(str.size()-suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/// Propagates a range of epochs and serializes it
+class Worker
+{
+public:
+	Worker(const OrbitBatch &batch, const vector<int> &parents,
+		const vector<string> &names, bool csv) :
+		_batch{batch}, _parents(parents), _names(names), _csv{csv},
+		_positions(parents.size()) {}
+
+	/**
+	 * Computes positions of all entities for some epochs
+	 * @param opt epoch range
+	 * @param first index of first epoch
+	 * @param count number of epochs
+	 */
+	void run(const Options &opt, const size_t first, const size_t count)
+	{
+		_output.clear();
+		_propagationTime = 0.0;
+
+		ostringstream text;
+		text << setprecision(17);
+		for (size_t e=first;e<first+count;++e)
+		{
+			const double epoch = opt.start + e*opt.step;
+
+			const auto start = chrono::steady_clock::now();
+			_batch.computePositions(epoch, _positions.data());
+			for (size_t i=0;i<_positions.size();++i)
+			{
+				if (_parents[i] != -1) _positions[i] += _positions[_parents[i]];
+			}
+			_propagationTime += chrono::duration<double>(chrono::steady_clock::now()-start).count();
+
+			if (_csv)
+			{
+				for (size_t i=0;i<_positions.size();++i)
+				{
+					text << epoch << "," << _names[i] << ","
+						<< _positions[i].x << "," << _positions[i].y << ","
+						<< _positions[i].z << "\n";
+				}
+			}
+			else
+			{
+				append(&epoch, sizeof(double));
+				for (const dvec3 &p : _positions)
+				{
+					const double xyz[3] = {p.x, p.y, p.z};
+					append(xyz, sizeof(xyz));
+				}
+			}
+		}
+		if (_csv) _output = text.str();
+	}
+
+	/// Serialized output of the last run()
+	const string &getOutput() const { return _output; }
+	/// Time spent computing positions in the last run(), in seconds
+	double getPropagationTime() const { return _propagationTime; }
+
+private:
+	void append(const void *data, size_t size)
+	{
+		_output.append((const char*)data, size);
+	}
+
+	OrbitBatch _batch;
+	const vector<int> &_parents;
+	const vector<string> &_names;
+	bool _csv;
+	vector<dvec3> _positions;
+	string _output;
+	double _propagationTime = 0.0;
+};
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	try
+	{
+		opt = parseOptions(argc, argv);
+	}
+	catch (const exception &e)
+	{
+		cout << e.what() << endl;
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	try
+	{
+		EntityCollection collection;
+		collection.init(loadEntityFile(opt.entityFile).entities);
+
+		OrbitBatch batch;
+		batch.init(collection.getOrbits());
+		const vector<int> &parents = collection.getParentIndices();
+		vector<string> names;
+		for (const auto &h : collection.getAll())
+			names.push_back(h.getParam().getName());
+
+		const size_t epochCount = (size_t)floor((opt.end-opt.start)/opt.step) + 1;
+		const bool csv = endsWith(opt.output, ".csv");
+		const int threadCount = (opt.threads>0)?opt.threads:
+			std::max(1, (int)thread::hardware_concurrency());
+
+		ofstream out(opt.output.c_str(), ios::out | ios::binary);
+		if (!out) throw runtime_error("Can't open file " + opt.output);
+		if (csv)
+		{
+			out << "epoch,entity,x,y,z\n";
+		}
+		else
+		{
+			const uint32_t entityCount = names.size();
+			const uint64_t epochs = epochCount;
+			out.write(batchMagic, 4);
+			out.write((const char*)&batchVersion, sizeof(batchVersion));
+			out.write((const char*)&entityCount, sizeof(entityCount));
+			out.write((const char*)&epochs, sizeof(epochs));
+			for (const string &name : names) out.write(name.c_str(), name.size()+1);
+		}
+
+		vector<Worker> workers;
+		for (int i=0;i<threadCount;++i)
+			workers.emplace_back(batch, parents, names, csv);
+
+		double propagationTime = 0.0;
+		const auto start = chrono::steady_clock::now();
+		for (size_t first=0;first<epochCount;first+=epochsPerBlock*threadCount)
+		{
+			vector<thread> threads;
+			for (int i=0;i<threadCount;++i)
+			{
+				const size_t begin = std::min(epochCount, first+i*epochsPerBlock);
+				const size_t count = std::min(epochCount-begin, epochsPerBlock);
+				threads.emplace_back(&Worker::run, &workers[i], cref(opt), begin, count);
+			}
+			for (auto &t : threads) t.join();
+
+			double slowest = 0.0;
+			for (const Worker &w : workers)
+			{
+				out.write(w.getOutput().data(), w.getOutput().size());
+				slowest = std::max(slowest, w.getPropagationTime());
+			}
+			propagationTime += slowest;
+			if (!out) throw runtime_error("Can't write to file " + opt.output);
+		}
+		const double totalTime = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+
+		const double positions = (double)epochCount*names.size();
+		cout << epochCount << " epochs x " << names.size() << " entities on "
+			<< threadCount << " threads" << endl
+			<< fixed << setprecision(0)
+			<< "Propagation : " << positions/std::max(propagationTime, 1e-9) << " positions/s" << endl
+			<< "Total (with output) : " << positions/std::max(totalTime, 1e-9) << " positions/s" << endl;
+	}
+	catch (const exception &e)
+	{
+		cout << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
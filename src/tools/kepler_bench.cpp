@@ -0,0 +1,143 @@
+#include "kepler.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * Microbenchmark of the Kepler solvers
+ *
+ * For each eccentricity band, solves Kepler's equation for random mean
+ * anomalies with every method and reports the time per solve, the average
+ * number of iterations and the largest residual |E - e*sin(E) - M|.
+ */
+
+/// Former solver: fixed number of Newton iterations, reference for speedups
+static double legacySolve(const double mean, const double ecc)
+{
+	double En = (ecc<0.8)?mean:3.14159265358979;
+	for (int i=0;i<20;++i)
+		En -= (En - ecc*sin(En)-mean)/(1-ecc*cos(En));
+	return En;
+}
+
+struct Band
+{
+	double minEcc;
+	double maxEcc;
+};
+
+struct Result
+{
+	double nsPerSolve = 0.0;
+	double avgIterations = 0.0;
+	double maxError = 0.0;
+};
+
+static double residual(const double En, const double mean, const double ecc)
+{
+	const double r = En - ecc*sin(En) - KeplerSolver::wrapAngle(mean);
+	// Compare modulo 2pi
+	return abs(remainder(r, 6.283185307179586476925));
+}
+
+int main(int argc, char **argv)
+{
+	const int eccSamples = 64;
+	const int meanSamples = (argc>1)?stoi(argv[1]):20000;
+
+	const vector<Band> bands = {
+		{0.0, 0.1}, {0.1, 0.3}, {0.3, 0.6}, {0.6, 0.8}, {0.8, 0.95}, {0.95, 0.99}};
+
+	const vector<pair<string, KeplerSolver::Method>> methods = {
+		{"Newton", KeplerSolver::Method::NEWTON},
+		{"Halley", KeplerSolver::Method::HALLEY},
+		{"Danby", KeplerSolver::Method::DANBY},
+		{"Table", KeplerSolver::Method::TABLE}};
+
+	mt19937_64 rng(42);
+	uniform_real_distribution<double> meanDist(-20.0, 20.0);
+	vector<double> means(meanSamples);
+	for (auto &m : means) m = meanDist(rng);
+
+	volatile double sink = 0.0;
+
+	cout << left << setw(14) << "ecc band" << setw(8) << "method"
+		<< right << setw(12) << "ns/solve" << setw(10) << "iters"
+		<< setw(14) << "max error" << endl;
+
+	for (const Band &band : bands)
+	{
+		vector<double> eccs(eccSamples);
+		for (int i=0;i<eccSamples;++i)
+			eccs[i] = band.minEcc + (band.maxEcc-band.minEcc)*(i+0.5)/eccSamples;
+
+		const string bandName = "[" + to_string(band.minEcc).substr(0,4) + "," +
+			to_string(band.maxEcc).substr(0,4) + ")";
+
+		auto print = [&](const string &name, const Result &r)
+		{
+			cout << left << setw(14) << bandName << setw(8) << name
+				<< right << fixed << setprecision(1) << setw(12) << r.nsPerSolve
+				<< setprecision(2) << setw(10) << r.avgIterations
+				<< scientific << setprecision(2) << setw(14) << r.maxError
+				<< defaultfloat << endl;
+		};
+
+		// Legacy reference
+		{
+			Result r{};
+			const auto start = chrono::high_resolution_clock::now();
+			for (double ecc : eccs)
+				for (double m : means)
+					sink = sink + legacySolve(KeplerSolver::wrapAngle(m), ecc);
+			const auto end = chrono::high_resolution_clock::now();
+			for (double ecc : eccs)
+				for (double m : means)
+					r.maxError = max(r.maxError,
+						residual(legacySolve(KeplerSolver::wrapAngle(m), ecc), m, ecc));
+			r.nsPerSolve = chrono::duration<double, nano>(end-start).count()/
+				(eccSamples*(double)meanSamples);
+			r.avgIterations = 20;
+			print("Legacy", r);
+		}
+
+		for (const auto &method : methods)
+		{
+			// Tables are built for fixed eccentricities ahead of time
+			vector<KeplerSolver> solvers;
+			for (double ecc : eccs) solvers.emplace_back(method.second, ecc);
+
+			Result r{};
+			const auto start = chrono::high_resolution_clock::now();
+			for (const auto &solver : solvers)
+				for (double m : means)
+					sink = sink + solver.solve(m);
+			const auto end = chrono::high_resolution_clock::now();
+
+			long totalIterations = 0;
+			for (const auto &solver : solvers)
+			{
+				for (double m : means)
+				{
+					int it = 0;
+					const double En = solver.solve(m, &it);
+					totalIterations += it;
+					r.maxError = max(r.maxError, residual(En, m, solver.getEccentricity()));
+				}
+			}
+			const double solves = eccSamples*(double)meanSamples;
+			r.nsPerSolve = chrono::duration<double, nano>(end-start).count()/solves;
+			r.avgIterations = totalIterations/solves;
+			print(method.first, r);
+		}
+	}
+	return 0;
+}
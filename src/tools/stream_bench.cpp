@@ -0,0 +1,413 @@
+#include "dds_stream.hpp"
+#include "upload_backend_mock.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <exception>
+#include <functional>
+#include <cstring>
+#include <cmath>
+
+#include <sys/stat.h>
+
+using namespace std;
+
+/**
+ * Headless benchmark of texture streaming
+ *
+ * Runs the DDSStreamer class on an in-memory upload backend (see
+ * UploadBackendMock) and replays focus switches like the game does with Tab:
+ * the camera aims at the next body for 1 second, then moves for 1 second to
+ * 4 radii of it, while the target's texture is prefetched with the priority
+ * it will have on arrival; the body after it is warmed up in the background.
+ * The camera stays a while at each body before the next switch.
+ *
+ * Textures are texture folders or tile archives (see spec.md); without any,
+ * synthetic BC1 textures with the same layout are written first. Reports
+ * tile throughput, latency at each stage, time until textures can be sampled
+ * and are complete, and time until switch targets are complete.
+ */
+
+/// Seconds the camera aims at the target, then moves to it (as in game.cpp)
+static const double switchTrackTime = 1.0;
+static const double switchMoveTime = 1.0;
+
+struct Options
+{
+	vector<string> textures;
+	string data = "stream_bench_data";
+	int bodies = 8;
+	int tileSize = 1024;
+	int levels = 3;
+	int switches = 8;
+	double hold = 2.0;
+	double fps = 60.0;
+	float priority = 1500.0;
+	int pageSize = 64*1024;
+	int pages = 1024;
+	int workers = 1;
+	bool mapped = false;
+	int budget = 0;
+	double uploadBudget = 2.0;
+	bool catchUp = false;
+	double bandwidth = 8.0;
+	double callTime = 20.0;
+	string telemetry = "";
+};
+
+static void printUsage(const char *name)
+{
+	cout << "Usage : " << name << " [texture...] [options]" << endl
+		<< "  texture          texture folder or .tiles archive, one per body" << endl
+		<< "Options :" << endl
+		<< "  --data dir       where synthetic textures are written without any texture" << endl
+		<< "                   (default stream_bench_data)" << endl
+		<< "  --bodies n       number of synthetic textures (default 8)" << endl
+		<< "  --tile-size n    tile size of synthetic textures (default 1024)" << endl
+		<< "  --levels n       levels of synthetic textures (default 3)" << endl
+		<< "  --switches n     number of focus switches (default 8)" << endl
+		<< "  --hold s         seconds at each body after a switch (default 2)" << endl
+		<< "  --fps n          frames per second, 0 to run as fast as possible (default 60)" << endl
+		<< "  --priority px    priority of the focused texture (default 1500)" << endl
+		<< "  --page-size n    page size in bytes (default 65536)" << endl
+		<< "  --pages n        number of pages (default 1024)" << endl
+		<< "  --workers n      loading threads (default 1)" << endl
+		<< "  --mapped         memory map tile files" << endl
+		<< "  --budget MiB     memory budget of stream textures (default none)" << endl
+		<< "  --upload-budget ms" << endl
+		<< "                   time budget of uploads per frame (default 2)" << endl
+		<< "  --catch-up       upload as fast as possible at the first body, like a" << endl
+		<< "                   loading screen" << endl
+		<< "  --bandwidth GB/s simulated upload bandwidth (default 8)" << endl
+		<< "  --call-time us   simulated time of each upload (default 20)" << endl
+		<< "  --telemetry name save telemetry to name.json and CSV files" << endl;
+}
+
+static Options parseOptions(int argc, char **argv)
+{
+	Options opt;
+	for (int i=1;i<argc;++i)
+	{
+		const string arg = argv[i];
+		if (arg.compare(0, 2, "--"))
+		{
+			// Textures are named by folder, archives by the folder name too
+			const string ext = ".tiles";
+			const bool archive = arg.size() > ext.size() &&
+				!arg.compare(arg.size()-ext.size(), ext.size(), ext);
+			opt.textures.push_back(archive?arg.substr(0, arg.size()-ext.size()):arg);
+			continue;
+		}
+		if (arg == "--mapped")
+		{
+			opt.mapped = true;
+			continue;
+		}
+		if (arg == "--catch-up")
+		{
+			opt.catchUp = true;
+			continue;
+		}
+		if (i+1 >= argc) throw runtime_error("Missing value for " + arg);
+		const string value = argv[++i];
+		if (arg == "--data") opt.data = value;
+		else if (arg == "--bodies") opt.bodies = stoi(value);
+		else if (arg == "--tile-size") opt.tileSize = stoi(value);
+		else if (arg == "--levels") opt.levels = stoi(value);
+		else if (arg == "--switches") opt.switches = stoi(value);
+		else if (arg == "--hold") opt.hold = stod(value);
+		else if (arg == "--fps") opt.fps = stod(value);
+		else if (arg == "--priority") opt.priority = stof(value);
+		else if (arg == "--page-size") opt.pageSize = stoi(value);
+		else if (arg == "--pages") opt.pages = stoi(value);
+		else if (arg == "--workers") opt.workers = stoi(value);
+		else if (arg == "--budget") opt.budget = stoi(value);
+		else if (arg == "--upload-budget") opt.uploadBudget = stod(value);
+		else if (arg == "--bandwidth") opt.bandwidth = stod(value);
+		else if (arg == "--call-time") opt.callTime = stod(value);
+		else if (arg == "--telemetry") opt.telemetry = value;
+		else throw runtime_error("Unknown option " + arg);
+	}
+	if (opt.bodies < 2 || opt.tileSize < 4 || opt.levels < 1 || opt.switches < 1)
+		throw runtime_error("Invalid options");
+	return opt;
+}
+
+/// Writes a BC1 DDS file with all mipmaps down to mipmaps levels
+static void writeDDS(const string &filename, const int width, const int height,
+	const int mipmaps, const uint8_t seed)
+{
+	uint32_t header[32] = {};
+	memcpy(header, "DDS ", 4);
+	header[1] = 124;
+	header[2] = 0x1|0x2|0x4|0x1000|0x20000;
+	header[3] = height;
+	header[4] = width;
+	header[7] = mipmaps;
+	// Pixel format
+	header[19] = 32;
+	header[20] = 0x4;
+	memcpy(&header[21], "DXT1", 4);
+	header[27] = 0x1000|0x400000|0x8;
+
+	ofstream out(filename.c_str(), ios::out | ios::binary);
+	if (!out) throw runtime_error("Can't open file " + filename);
+	out.write((const char*)header, sizeof(header));
+	for (int m=0;m<mipmaps;++m)
+	{
+		vector<uint8_t> data(DDSLoader::getImageSize(DDSLoader::Format::BC1,
+			max(1, width>>m), max(1, height>>m)));
+		for (size_t i=0;i<data.size();++i) data[i] = seed+i;
+		out.write((const char*)data.data(), data.size());
+	}
+	if (!out) throw runtime_error("Can't write to file " + filename);
+}
+
+/// Writes a texture folder with the layout of spec.md, unless there is one
+static void writeTexture(const string &folder, const int tileSize, const int levels)
+{
+	if (ifstream(folder + "/info.sn")) return;
+	mkdir(folder.c_str(), 0755);
+	for (int level=0;level<levels;++level)
+	{
+		const string levelFolder = folder + "/level" + to_string(level);
+		mkdir(levelFolder.c_str(), 0755);
+		if (level == 0)
+		{
+			writeDDS(levelFolder + "/0_0.DDS", tileSize, tileSize/2,
+				1+(int)floor(log2(tileSize)), 0);
+			continue;
+		}
+		const int rows = 1<<(level-1);
+		for (int x=0;x<2*rows;++x)
+		{
+			for (int y=0;y<rows;++y)
+			{
+				writeDDS(levelFolder + "/" + to_string(x) + "_" + to_string(y) + ".DDS",
+					tileSize, tileSize, 1, level+x+y);
+			}
+		}
+	}
+	ofstream info((folder + "/info.sn").c_str());
+	info << "size:" << tileSize << endl
+		<< "levels:" << levels << endl
+		<< "prefix:\"\"" << endl
+		<< "separator:\"_\"" << endl
+		<< "suffix:\".DDS\"" << endl
+		<< "row_column_order:false" << endl;
+	if (!info) throw runtime_error("Can't write to folder " + folder);
+}
+
+static double getSeconds(const chrono::steady_clock::time_point &start)
+{
+	return chrono::duration<double>(chrono::steady_clock::now()-start).count();
+}
+
+/// Returns a value at a fraction of sorted values
+static double getPercentile(vector<double> values, const double fraction)
+{
+	if (values.empty()) return 0.0;
+	sort(values.begin(), values.end());
+	return values[min(values.size()-1, (size_t)(fraction*values.size()))];
+}
+
+static void printTimes(const string &name, const vector<double> &times)
+{
+	double sum = 0.0;
+	for (double t : times) sum += t;
+	cout << left << setw(24) << name << right << fixed << setprecision(2)
+		<< setw(10) << 1000*(times.empty()?0.0:sum/times.size())
+		<< setw(10) << 1000*getPercentile(times, 0.5)
+		<< setw(10) << 1000*getPercentile(times, 0.95)
+		<< setw(10) << 1000*getPercentile(times, 1.0)
+		<< setw(8) << times.size() << defaultfloat << endl;
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	try
+	{
+		opt = parseOptions(argc, argv);
+	}
+	catch (const exception &e)
+	{
+		cout << e.what() << endl;
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	try
+	{
+		if (opt.textures.empty())
+		{
+			mkdir(opt.data.c_str(), 0755);
+			for (int i=0;i<opt.bodies;++i)
+			{
+				opt.textures.push_back(opt.data + "/body" + to_string(i));
+				writeTexture(opt.textures.back(), opt.tileSize, opt.levels);
+			}
+		}
+		if (opt.textures.size() < 2) throw runtime_error("At least two textures needed");
+
+		UploadBackendMock *backend = new UploadBackendMock(opt.bandwidth*1e9,
+			opt.callTime*1e-6);
+		DDSStreamer streamer;
+		streamer.init(unique_ptr<UploadBackend>(backend), true, opt.pageSize,
+			opt.pages, 0, opt.mapped, opt.workers, 0, (size_t)opt.budget*1024*1024);
+		streamer.setUploadBudget(opt.uploadBudget);
+
+		const auto start = chrono::steady_clock::now();
+		vector<DDSStreamer::Handle> texs;
+		for (const string &filename : opt.textures)
+		{
+			// Opened by loading threads, a missing texture never completes
+			const DDSStreamer::Handle h = streamer.createTex(filename);
+			texs.push_back(h);
+			streamer.setPriority(h, 0.0);
+		}
+		const double createTime = getSeconds(start);
+
+		// Focused body first, then the switch targets in order
+		const size_t count = texs.size();
+		streamer.setPriority(texs[0], opt.priority);
+		vector<double> updateTimes;
+		vector<double> switchTimes;
+		int completeOnArrival = 0;
+		auto frame = [&]()
+		{
+			const auto frameStart = chrono::steady_clock::now();
+			streamer.update();
+			updateTimes.push_back(getSeconds(frameStart));
+			if (opt.fps > 0.0)
+			{
+				this_thread::sleep_until(frameStart +
+					chrono::duration_cast<chrono::steady_clock::duration>(
+						chrono::duration<double>(1.0/opt.fps)));
+			}
+		};
+
+		// Let the first body load before switching away
+		const auto holdStart = chrono::steady_clock::now();
+		streamer.setCatchUp(opt.catchUp);
+		while (getSeconds(holdStart) < opt.hold) frame();
+		streamer.setCatchUp(false);
+
+		for (int i=0;i<opt.switches;++i)
+		{
+			const DDSStreamer::Handle from = texs[i%count];
+			const DDSStreamer::Handle target = texs[(i+1)%count];
+			const DDSStreamer::Handle next = texs[(i+2)%count];
+			streamer.prefetch(next, opt.priority);
+
+			const double switchTime = switchTrackTime+switchMoveTime;
+			const auto switchStart = chrono::steady_clock::now();
+			double completeTime = -1.0;
+			for (double t=0.0;t<switchTime+opt.hold;t=getSeconds(switchStart))
+			{
+				if (t < switchTime)
+				{
+					streamer.prefetch(target, opt.priority, switchTime-t);
+				}
+				else
+				{
+					// Arrived, the body left behind isn't visible anymore
+					streamer.prefetch(target, 0.0);
+					streamer.setPriority(target, opt.priority);
+					streamer.setPriority(from, 0.0);
+				}
+				if (completeTime < 0.0 && streamer.getTex(target).isComplete())
+				{
+					completeTime = t;
+					if (t < switchTime) completeOnArrival += 1;
+				}
+				frame();
+			}
+			if (completeTime >= 0.0) switchTimes.push_back(completeTime);
+			streamer.prefetch(next, 0.0);
+		}
+		const double totalTime = getSeconds(start);
+
+		const UploadBackendMock::Stats &stats = backend->getStats();
+		const StreamTelemetry &telemetry = streamer.getTelemetry();
+		cout << count << " textures created in " << fixed << setprecision(2)
+			<< 1000*createTime << " ms, " << opt.switches << " switches in "
+			<< totalTime << " s" << endl;
+		cout << stats.tileUploads << " tiles uploaded (" << stats.tileBytes/(1024.0*1024.0)
+			<< " MiB), " << stats.tileUploads/totalTime << " tiles/s, "
+			<< stats.tileBytes/(1024.0*1024.0*totalTime) << " MiB/s" << endl;
+		cout << "Simulated GPU busy " << 100*stats.gpuTime/totalTime << "%, "
+			<< stats.copies << " level copies, peak storage "
+			<< stats.maxTextureBytes/(1024.0*1024.0) << " MiB" << endl;
+		cout << completeOnArrival << "/" << opt.switches
+			<< " switch targets complete on arrival" << defaultfloat << endl;
+
+		vector<double> waiting, queued, loading, uploading, total;
+		for (const StreamTelemetry::Tile &t : telemetry.getTiles())
+		{
+			waiting.push_back(t.times.assigned-t.times.created);
+			queued.push_back(t.times.loadStart-t.times.assigned);
+			loading.push_back(t.times.loadEnd-t.times.loadStart);
+			uploading.push_back(t.uploaded-t.times.loadEnd);
+			total.push_back(t.uploaded-t.times.created);
+		}
+		vector<double> resident, complete;
+		for (const auto &p : telemetry.getTextures())
+		{
+			if (p.second.resident >= 0.0) resident.push_back(p.second.resident-p.second.created);
+			if (p.second.completed >= 0.0) complete.push_back(p.second.completed-p.second.created);
+		}
+		vector<double> waitingTiles, queuedTiles, uploadCpu, uploadGpu;
+		for (const StreamTelemetry::Sample &s : telemetry.getSamples())
+		{
+			waitingTiles.push_back(s.waiting);
+			queuedTiles.push_back(s.queued);
+			if (s.uploadedTiles > 0) uploadCpu.push_back(s.uploadCpuTime);
+			if (s.uploadGpuTime >= 0.0) uploadGpu.push_back(s.uploadGpuTime);
+		}
+
+		cout << endl << left << setw(24) << "(ms)" << right << setw(10) << "avg"
+			<< setw(10) << "p50" << setw(10) << "p95" << setw(10) << "max"
+			<< setw(8) << "count" << endl;
+		printTimes("Tile waiting for pages", waiting);
+		printTimes("Tile queued", queued);
+		printTimes("Tile loading", loading);
+		printTimes("Tile waiting for upload", uploading);
+		printTimes("Tile total", total);
+		printTimes("Texture first level", resident);
+		printTimes("Texture complete", complete);
+		printTimes("Switch target complete", switchTimes);
+		printTimes("update()", updateTimes);
+		printTimes("Upload CPU per update", uploadCpu);
+		printTimes("Upload GPU per update", uploadGpu);
+		cout << "Tiles waiting for pages p95 " << getPercentile(waitingTiles, 0.95)
+			<< ", queued p95 " << getPercentile(queuedTiles, 0.95) << endl;
+
+		if (!opt.telemetry.empty())
+		{
+			auto save = [](const string &name, function<void(ostream&)> write)
+			{
+				ofstream out(name.c_str());
+				if (!out) throw runtime_error("Can't open file " + name);
+				write(out);
+			};
+			save(opt.telemetry + ".json", [&](ostream &out){ telemetry.writeJson(out); });
+			save(opt.telemetry + "_tiles.csv", [&](ostream &out){ telemetry.writeTilesCsv(out); });
+			save(opt.telemetry + "_textures.csv", [&](ostream &out){ telemetry.writeTexturesCsv(out); });
+			save(opt.telemetry + "_samples.csv", [&](ostream &out){ telemetry.writeSamplesCsv(out); });
+		}
+	}
+	catch (const exception &e)
+	{
+		cout << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,244 @@
+#include "ddsloader.hpp"
+#include "tile_archive.hpp"
+#include "worker_pool.hpp"
+
+#include <SHAUN/sweeper.hpp>
+#include <SHAUN/parser.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <exception>
+
+using namespace std;
+
+/**
+ * Stream texture packer
+ *
+ * Converts a texture folder (info.sn and one DDS file per tile in each
+ * levelN folder) to a single tile archive (see tile_archive.hpp). The
+ * streamer uses the archive instead of the folder when both exist, so the
+ * archive is written next to the folder with a .tiles extension by default.
+ *
+ * Mipmap levels can be supercompressed with zstd or LZ4 (when built with
+ * them), each level on its own, on all cores. Levels that don't get smaller
+ * are stored as is.
+ */
+
+/// Tiles compressed by each thread before they are written in order
+static const size_t tilesPerThread = 4;
+
+struct Options
+{
+	string folder = "";
+	string output = "";
+	TileArchive::Codec codec = TileArchive::Codec::None;
+	int level = -1;
+	int threads = 0;
+};
+
+static void printUsage(const char *name)
+{
+	cout << "Usage : " << name << " folder [output] [options]" << endl
+		<< "  folder           texture folder with an info.sn file" << endl
+		<< "  output           archive to write (default folder name + .tiles)" << endl
+		<< "Options :" << endl
+		<< "  --codec name     none, zstd or lz4 (default none)" << endl
+		<< "  --level n        compression level (default 19 for zstd, 12 for lz4)" << endl
+		<< "  --threads n      number of threads (default all cores)" << endl;
+}
+
+static Options parseOptions(int argc, char **argv)
+{
+	if (argc < 2) throw runtime_error("Missing arguments");
+	Options opt;
+	opt.folder = argv[1];
+	while (!opt.folder.empty() && opt.folder.back() == '/') opt.folder.pop_back();
+	if (opt.folder.empty()) throw runtime_error("Empty folder name");
+	opt.output = opt.folder + ".tiles";
+	int i = 2;
+	if (i < argc && string(argv[i]).compare(0, 2, "--")) opt.output = argv[i++];
+	for (;i<argc;++i)
+	{
+		const string arg = argv[i];
+		if (i+1 >= argc) throw runtime_error("Missing value for " + arg);
+		if (arg == "--codec") opt.codec = TileArchive::getCodec(argv[++i]);
+		else if (arg == "--level") opt.level = stoi(argv[++i]);
+		else if (arg == "--threads") opt.threads = stoi(argv[++i]);
+		else throw runtime_error("Unknown option " + arg);
+	}
+	if (!TileArchive::isSupported(opt.codec))
+		throw runtime_error("Codec not supported by this build");
+	if (opt.level < 0) opt.level = (opt.codec == TileArchive::Codec::LZ4)?12:19;
+	return opt;
+}
+
+/// Returns the DDS files of a texture folder, in archive index order
+static vector<string> getTileFilenames(const string &folder, int &tileSize, int &levels)
+{
+	shaun::object obj = shaun::parse_file(folder + "/info.sn");
+	shaun::sweeper swp(obj);
+	tileSize = swp("size").value<shaun::number>();
+	levels = swp("levels").value<shaun::number>();
+	const string prefix = swp("prefix").value<shaun::string>();
+	const string separator = swp("separator").value<shaun::string>();
+	const string suffix = swp("suffix").value<shaun::string>();
+	const bool rowColumnOrder = swp("row_column_order").value<shaun::boolean>();
+	if (tileSize <= 0 || levels <= 0) throw runtime_error("Invalid info.sn in " + folder);
+	if (levels > TileArchive::maxLevels) throw runtime_error("Too many levels in " + folder);
+
+	vector<string> filenames;
+	filenames.push_back(folder + "/level0/" + prefix + "0" + separator + "0" + suffix);
+	for (int level=1;level<levels;++level)
+	{
+		const int rows = 1<<(level-1);
+		const int columns = 2*rows;
+		for (int x=0;x<columns;++x)
+		{
+			for (int y=0;y<rows;++y)
+			{
+				filenames.push_back(folder + "/level" + to_string(level) + "/" +
+					prefix+
+					to_string(rowColumnOrder?y:x)+
+					separator+
+					to_string(rowColumnOrder?x:y)+
+					suffix);
+			}
+		}
+	}
+	return filenames;
+}
+
+int main(int argc, char **argv)
+{
+	Options opt;
+	try
+	{
+		opt = parseOptions(argc, argv);
+	}
+	catch (const exception &e)
+	{
+		cout << e.what() << endl;
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	try
+	{
+		int tileSize = 0;
+		int levels = 0;
+		vector<string> filenames;
+		try
+		{
+			filenames = getTileFilenames(opt.folder, tileSize, levels);
+		}
+		catch (shaun::parse_error &e)
+		{
+			cout << e << endl;
+			throw runtime_error("Can't parse " + opt.folder + "/info.sn");
+		}
+		// Headers only, the index size depends on mipmap counts
+		vector<DDSLoader> loaders;
+		vector<TileArchive::Entry> entries;
+		size_t mipmapCount = 0;
+		for (const string &filename : filenames)
+		{
+			loaders.emplace_back(filename);
+			const DDSLoader &loader = loaders.back();
+			if (loader.getFormat() != loaders.front().getFormat())
+				throw runtime_error("Tile format differs from level0 : " + filename);
+			if (loader.getFormat() == DDSLoader::Format::Undefined)
+				throw runtime_error("Unsupported tile format : " + filename);
+
+			TileArchive::Entry entry{};
+			entry.width = loader.getWidth(0);
+			entry.height = loader.getHeight(0);
+			entry.mipmapCount = loader.getMipmapCount();
+			entry.codec = opt.codec;
+			entries.push_back(entry);
+			mipmapCount += entry.mipmapCount;
+		}
+
+		ofstream out(opt.output.c_str(), ios::out | ios::binary);
+		if (!out) throw runtime_error("Can't open file " + opt.output);
+
+		WorkerPool pool;
+		pool.init(opt.threads);
+
+		// Payloads first, the index is written last with their offsets
+		const size_t tilesPerBatch = tilesPerThread*pool.getThreadCount();
+		vector<uint32_t> storedSizes;
+		uint64_t written = 0;
+		uint64_t offset = TileArchive::getPayloadStart(entries.size(), mipmapCount);
+		uint64_t rawSize = 0;
+		for (size_t first=0;first<loaders.size();first+=tilesPerBatch)
+		{
+			const size_t count = std::min(tilesPerBatch, loaders.size()-first);
+			vector<vector<vector<uint8_t>>> mipmaps(count);
+			vector<exception_ptr> errors(count);
+			pool.parallelFor(count, 1, [&](size_t begin, size_t end)
+			{
+				for (size_t i=begin;i<end;++i)
+				{
+					try
+					{
+						const DDSLoader &loader = loaders[first+i];
+						for (int level=0;level<loader.getMipmapCount();++level)
+						{
+							vector<uint8_t> data = loader.getImageData(level);
+							vector<uint8_t> compressed = TileArchive::compress(
+								opt.codec, opt.level, data.data(), data.size());
+							mipmaps[i].push_back(
+								(compressed.size() < data.size())?std::move(compressed):std::move(data));
+						}
+					}
+					catch (...)
+					{
+						errors[i] = current_exception();
+					}
+				}
+			});
+
+			for (size_t i=0;i<count;++i)
+			{
+				if (errors[i]) rethrow_exception(errors[i]);
+				TileArchive::Entry &entry = entries[first+i];
+				// Gaps are filled with zeros
+				out.seekp(offset);
+				entry.offset = offset;
+				for (int level=0;level<(int)entry.mipmapCount;++level)
+				{
+					const vector<uint8_t> &data = mipmaps[i][level];
+					out.write((const char*)data.data(), data.size());
+					storedSizes.push_back(data.size());
+					entry.size += data.size();
+					rawSize += loaders[first+i].getImageSize(level);
+				}
+				written = entry.offset+entry.size;
+				offset = TileArchive::align(written);
+			}
+			if (!out) throw runtime_error("Can't write to file " + opt.output);
+		}
+
+		out.seekp(0);
+		TileArchive::writeIndex(out, loaders.front().getFormat(), tileSize, levels,
+			entries, storedSizes);
+		if (!out) throw runtime_error("Can't write to file " + opt.output);
+
+		cout << filenames.size() << " tiles, " << levels << " levels, "
+			<< written << " bytes written to " << opt.output << endl;
+		uint64_t storedSize = 0;
+		for (uint32_t size : storedSizes) storedSize += size;
+		cout << "Tile data : " << rawSize << " bytes, " << storedSize
+			<< " bytes stored (" << 100*storedSize/std::max<uint64_t>(rawSize, 1)
+			<< "%)" << endl;
+	}
+	catch (const exception &e)
+	{
+		cout << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "ddsloader.hpp"
+
+/**
+ * Where the DDSStreamer class uploads texture data to
+ *
+ * The streamer only schedules tiles, pages and fences; everything touching
+ * the graphics API goes through this interface. UploadBackendGL is the
+ * OpenGL implementation, UploadBackendMock simulates one in memory to run
+ * the streamer without a context.
+ *
+ * All functions are called from the thread calling DDSStreamer::update(),
+ * except that loading threads write to the staging buffer through its mapping.
+ */
+class UploadBackend
+{
+public:
+	/// Texture id, 0 is none
+	typedef uint32_t TexId;
+	/// Fence id, 0 is none
+	typedef uint64_t FenceId;
+	/// GPU timer id, 0 is none
+	typedef uint64_t TimerId;
+
+	virtual ~UploadBackend() = default;
+
+	/**
+	 * Creates the staging buffer tiles are loaded into, persistently mapped
+	 * @param size size in bytes
+	 * @return pointer to the mapping of the whole buffer
+	 */
+	virtual void *createBuffer(size_t size)=0;
+	/**
+	 * Makes writes to a range of the staging buffer visible to uploads
+	 * @param offset start of the range in bytes
+	 * @param size size of the range in bytes
+	 */
+	virtual void flushBuffer(size_t offset, size_t size)=0;
+	/// Called before uploads from the staging buffer
+	virtual void beginUploads()=0;
+	/// Called after uploads from the staging buffer
+	virtual void endUploads()=0;
+
+	/**
+	 * Creates a block compressed texture
+	 * @param format block compression format
+	 * @param levels number of mip levels
+	 * @param width width of level 0
+	 * @param height height of level 0
+	 * @return texture id
+	 */
+	virtual TexId createTexture(DDSLoader::Format format, int levels,
+		int width, int height)=0;
+	/**
+	 * Creates an indirection texture of virtual textures (RGBA8UI)
+	 * @param levels number of mip levels
+	 * @param width width of level 0
+	 * @param height height of level 0
+	 * @return texture id
+	 */
+	virtual TexId createIndirection(int levels, int width, int height)=0;
+	/// Deletes a texture created with createTexture() or createIndirection()
+	virtual void deleteTexture(TexId tex)=0;
+
+	/**
+	 * Uploads a block compressed tile from the staging buffer
+	 * @param tex texture to update
+	 * @param level mip level to update
+	 * @param x offset of the tile in texels
+	 * @param y offset of the tile in texels
+	 * @param width width of the tile in texels
+	 * @param height height of the tile in texels
+	 * @param format block compression format
+	 * @param size size of the tile data in bytes
+	 * @param bufferOffset offset of the tile data in the staging buffer
+	 */
+	virtual void uploadTile(TexId tex, int level, int x, int y, int width,
+		int height, DDSLoader::Format format, size_t size, size_t bufferOffset)=0;
+	/**
+	 * Uploads a whole level of an indirection texture from memory
+	 * @param tex indirection texture
+	 * @param level mip level to update
+	 * @param width width of the level in texels
+	 * @param height height of the level in texels
+	 * @param data one RGBA8UI texel per uint32_t
+	 */
+	virtual void uploadIndirection(TexId tex, int level, int width, int height,
+		const uint32_t *data)=0;
+	/**
+	 * Copies a whole mip level between textures of the same format, after
+	 * uploads submitted before
+	 * @param src texture to copy from
+	 * @param srcLevel level to copy from
+	 * @param dst texture to copy to
+	 * @param dstLevel level to copy to
+	 * @param width width of the level in texels
+	 * @param height height of the level in texels
+	 */
+	virtual void copyLevel(TexId src, int srcLevel, TexId dst, int dstLevel,
+		int width, int height)=0;
+	/**
+	 * Sets the finest level of a texture that can be sampled
+	 * @param tex texture
+	 * @param level level, from the first level in storage
+	 */
+	virtual void setBaseLevel(TexId tex, int level)=0;
+
+	/// Returns a fence signaled once commands submitted so far are done
+	virtual FenceId insertFence()=0;
+	/**
+	 * Returns whether a fence is signaled
+	 * @param fence fence returned by insertFence()
+	 * @param wait whether to wait for it to be signaled
+	 */
+	virtual bool isSignaled(FenceId fence, bool wait)=0;
+	/// Deletes a fence returned by insertFence()
+	virtual void deleteFence(FenceId fence)=0;
+
+	/**
+	 * Starts measuring the GPU time of commands submitted from now on
+	 * @return timer id, 0 if GPU times can't be measured
+	 */
+	virtual TimerId beginTimer()=0;
+	/// Stops measuring a timer returned by beginTimer() at commands submitted so far
+	virtual void endTimer(TimerId timer)=0;
+	/**
+	 * Returns the GPU time measured by an ended timer if it is available,
+	 * without waiting, and deletes the timer then
+	 * @param timer timer returned by beginTimer()
+	 * @param seconds output, measured time in seconds
+	 * @return whether the time was available
+	 */
+	virtual bool getTimer(TimerId timer, double &seconds)=0;
+	/// Deletes a timer returned by beginTimer() before its time is available
+	virtual void deleteTimer(TimerId timer)=0;
+};
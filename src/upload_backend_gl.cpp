@@ -0,0 +1,164 @@
+#include "upload_backend_gl.hpp"
+
+#include "gl_util.hpp"
+
+using namespace std;
+
+UploadBackendGL::~UploadBackendGL()
+{
+	for (auto &p : _timers)
+	{
+		glDeleteQueries(1, &p.second.first);
+		glDeleteQueries(1, &p.second.second);
+	}
+	if (_pbo)
+	{
+		glUnmapNamedBuffer(_pbo);
+		glDeleteBuffers(1, &_pbo);
+	}
+}
+
+void *UploadBackendGL::createBuffer(const size_t size)
+{
+	glCreateBuffers(1, &_pbo);
+	GLbitfield storageFlags = GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT;
+#ifdef USE_COHERENT_MAPPING
+	storageFlags = storageFlags | GL_MAP_COHERENT_BIT;
+#endif
+	glNamedBufferStorage(_pbo, size, nullptr, storageFlags);
+	GLbitfield mapFlags = storageFlags;
+#ifndef USE_COHERENT_MAPPING
+	mapFlags = mapFlags | GL_MAP_FLUSH_EXPLICIT_BIT;
+#endif
+	return glMapNamedBufferRange(_pbo, 0, size, mapFlags);
+}
+
+void UploadBackendGL::flushBuffer(const size_t offset, const size_t size)
+{
+#ifndef USE_COHERENT_MAPPING
+	glFlushMappedNamedBufferRange(_pbo, offset, size);
+#endif
+}
+
+void UploadBackendGL::beginUploads()
+{
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbo);
+}
+
+void UploadBackendGL::endUploads()
+{
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+UploadBackend::TexId UploadBackendGL::createTexture(const DDSLoader::Format format,
+	const int levels, const int width, const int height)
+{
+	GLuint tex;
+	glCreateTextures(GL_TEXTURE_2D, 1, &tex);
+	glTextureStorage2D(tex, levels, DDSFormatToGL(format), width, height);
+	return tex;
+}
+
+UploadBackend::TexId UploadBackendGL::createIndirection(const int levels,
+	const int width, const int height)
+{
+	GLuint tex;
+	glCreateTextures(GL_TEXTURE_2D, 1, &tex);
+	glTextureStorage2D(tex, levels, GL_RGBA8UI, width, height);
+	return tex;
+}
+
+void UploadBackendGL::deleteTexture(const TexId tex)
+{
+	const GLuint id = tex;
+	glDeleteTextures(1, &id);
+}
+
+void UploadBackendGL::uploadTile(const TexId tex, const int level, const int x,
+	const int y, const int width, const int height, const DDSLoader::Format format,
+	const size_t size, const size_t bufferOffset)
+{
+	glCompressedTextureSubImage2D(tex, level, x, y, width, height,
+		DDSFormatToGL(format), size, (void*)(intptr_t)bufferOffset);
+}
+
+void UploadBackendGL::uploadIndirection(const TexId tex, const int level,
+	const int width, const int height, const uint32_t *data)
+{
+	glTextureSubImage2D(tex, level, 0, 0, width, height,
+		GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, data);
+}
+
+void UploadBackendGL::copyLevel(const TexId src, const int srcLevel,
+	const TexId dst, const int dstLevel, const int width, const int height)
+{
+	glCopyImageSubData(
+		src, GL_TEXTURE_2D, srcLevel, 0, 0, 0,
+		dst, GL_TEXTURE_2D, dstLevel, 0, 0, 0,
+		width, height, 1);
+}
+
+void UploadBackendGL::setBaseLevel(const TexId tex, const int level)
+{
+	glTextureParameteri(tex, GL_TEXTURE_BASE_LEVEL, level);
+}
+
+UploadBackend::FenceId UploadBackendGL::insertFence()
+{
+	const FenceId id = _nextFence++;
+	_fences[id].lock();
+	return id;
+}
+
+bool UploadBackendGL::isSignaled(const FenceId fence, const bool wait)
+{
+	auto it = _fences.find(fence);
+	if (it == _fences.end()) return true;
+	return it->second.waitClient(wait?-1:0);
+}
+
+void UploadBackendGL::deleteFence(const FenceId fence)
+{
+	_fences.erase(fence);
+}
+
+UploadBackend::TimerId UploadBackendGL::beginTimer()
+{
+	// Timestamps like GPUProfilerGL, elapsed time queries can't be nested
+	const TimerId id = _nextTimer++;
+	pair<GLuint, GLuint> &queries = _timers[id];
+	glCreateQueries(GL_TIMESTAMP, 1, &queries.first);
+	glCreateQueries(GL_TIMESTAMP, 1, &queries.second);
+	glQueryCounter(queries.first, GL_TIMESTAMP);
+	return id;
+}
+
+void UploadBackendGL::endTimer(const TimerId timer)
+{
+	auto it = _timers.find(timer);
+	if (it != _timers.end()) glQueryCounter(it->second.second, GL_TIMESTAMP);
+}
+
+bool UploadBackendGL::getTimer(const TimerId timer, double &seconds)
+{
+	auto it = _timers.find(timer);
+	if (it == _timers.end()) return false;
+	GLint available = 0;
+	glGetQueryObjectiv(it->second.second, GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) return false;
+	GLuint64 start, end;
+	glGetQueryObjectui64v(it->second.first, GL_QUERY_RESULT, &start);
+	glGetQueryObjectui64v(it->second.second, GL_QUERY_RESULT, &end);
+	seconds = (end-start)*1e-9;
+	deleteTimer(timer);
+	return true;
+}
+
+void UploadBackendGL::deleteTimer(const TimerId timer)
+{
+	auto it = _timers.find(timer);
+	if (it == _timers.end()) return;
+	glDeleteQueries(1, &it->second.first);
+	glDeleteQueries(1, &it->second.second);
+	_timers.erase(it);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "upload_backend.hpp"
+
+#include "graphics_api.hpp"
+#include "fence.hpp"
+
+#include <map>
+
+/**
+ * OpenGL 4.5 implementation of UploadBackend: the staging buffer is a
+ * persistently mapped pixel buffer, tiles are uploaded from it with
+ * glCompressedTextureSubImage2D()
+ * @see UploadBackend
+ */
+class UploadBackendGL : public UploadBackend
+{
+public:
+	UploadBackendGL() = default;
+	UploadBackendGL(const UploadBackendGL &) = delete;
+	UploadBackendGL &operator=(const UploadBackendGL &) = delete;
+	~UploadBackendGL();
+
+	void *createBuffer(size_t size) override;
+	void flushBuffer(size_t offset, size_t size) override;
+	void beginUploads() override;
+	void endUploads() override;
+
+	TexId createTexture(DDSLoader::Format format, int levels,
+		int width, int height) override;
+	TexId createIndirection(int levels, int width, int height) override;
+	void deleteTexture(TexId tex) override;
+
+	void uploadTile(TexId tex, int level, int x, int y, int width, int height,
+		DDSLoader::Format format, size_t size, size_t bufferOffset) override;
+	void uploadIndirection(TexId tex, int level, int width, int height,
+		const uint32_t *data) override;
+	void copyLevel(TexId src, int srcLevel, TexId dst, int dstLevel,
+		int width, int height) override;
+	void setBaseLevel(TexId tex, int level) override;
+
+	FenceId insertFence() override;
+	bool isSignaled(FenceId fence, bool wait) override;
+	void deleteFence(FenceId fence) override;
+
+	TimerId beginTimer() override;
+	void endTimer(TimerId timer) override;
+	bool getTimer(TimerId timer, double &seconds) override;
+	void deleteTimer(TimerId timer) override;
+
+private:
+	/// GL id of Pixel Buffer
+	GLuint _pbo = 0;
+	/// Fences in flight
+	std::map<FenceId, Fence> _fences;
+	/// Id of the next fence
+	FenceId _nextFence = 1;
+	/// Timestamp queries at the start and end of each timer
+	std::map<TimerId, std::pair<GLuint, GLuint>> _timers;
+	/// Id of the next timer
+	TimerId _nextTimer = 1;
+};
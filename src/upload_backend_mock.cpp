@@ -0,0 +1,212 @@
+#include "upload_backend_mock.hpp"
+
+#include "tile_archive.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <thread>
+
+using namespace std;
+
+UploadBackendMock::UploadBackendMock(const double bytesPerSecond,
+	const double callTime) :
+	_bytesPerSecond(bytesPerSecond),
+	_callTime(callTime),
+	_gpuDone(chrono::steady_clock::now())
+{
+
+}
+
+void *UploadBackendMock::createBuffer(const size_t size)
+{
+	// Aligned like mapped GL buffers, so that O_DIRECT reads work too
+	const size_t alignment = TileArchive::alignment;
+	_buffer.resize(size+alignment);
+	const uintptr_t start = (uintptr_t)_buffer.data();
+	_bufferPtr = _buffer.data() + (alignment-start%alignment)%alignment;
+	_bufferSize = size;
+	return _bufferPtr;
+}
+
+void UploadBackendMock::flushBuffer(const size_t offset, const size_t size)
+{
+	if (offset+size > _bufferSize)
+		throw runtime_error("Mock upload : flush out of the staging buffer");
+}
+
+void UploadBackendMock::beginUploads()
+{
+	_uploading = true;
+}
+
+void UploadBackendMock::endUploads()
+{
+	_uploading = false;
+}
+
+UploadBackend::TexId UploadBackendMock::createTexture(const DDSLoader::Format format,
+	const int levels, const int width, const int height)
+{
+	Texture texture{format, levels, width, height, 0};
+	for (int level=0;level<levels;++level)
+	{
+		texture.size += DDSLoader::getImageSize(format,
+			max(1, width>>level), max(1, height>>level));
+	}
+	return addTexture(texture);
+}
+
+UploadBackend::TexId UploadBackendMock::createIndirection(const int levels,
+	const int width, const int height)
+{
+	Texture texture{DDSLoader::Format::Undefined, levels, width, height, 0};
+	for (int level=0;level<levels;++level)
+	{
+		texture.size += sizeof(uint32_t)*max(1, width>>level)*max(1, height>>level);
+	}
+	return addTexture(texture);
+}
+
+UploadBackend::TexId UploadBackendMock::addTexture(const Texture &texture)
+{
+	if (texture.levels <= 0 || texture.width <= 0 || texture.height <= 0)
+		throw runtime_error("Mock upload : invalid texture storage");
+	const TexId tex = _nextTex++;
+	_textures[tex] = texture;
+	_stats.textures += 1;
+	_stats.textureBytes += texture.size;
+	_stats.maxTextures = max(_stats.maxTextures, _stats.textures);
+	_stats.maxTextureBytes = max(_stats.maxTextureBytes, _stats.textureBytes);
+	return tex;
+}
+
+void UploadBackendMock::deleteTexture(const TexId tex)
+{
+	auto it = _textures.find(tex);
+	if (it == _textures.end()) throw runtime_error("Mock upload : texture deleted twice");
+	_stats.textures -= 1;
+	_stats.textureBytes -= it->second.size;
+	_textures.erase(it);
+}
+
+const UploadBackendMock::Texture &UploadBackendMock::getTexture(const TexId tex,
+	const int level) const
+{
+	auto it = _textures.find(tex);
+	if (it == _textures.end()) throw runtime_error("Mock upload : unknown texture");
+	if (level < 0 || level >= it->second.levels)
+		throw runtime_error("Mock upload : level out of range");
+	return it->second;
+}
+
+void UploadBackendMock::uploadTile(const TexId tex, const int level, const int x,
+	const int y, const int width, const int height, const DDSLoader::Format format,
+	const size_t size, const size_t bufferOffset)
+{
+	const Texture &texture = getTexture(tex, level);
+	if (!_uploading) throw runtime_error("Mock upload : staging buffer not bound");
+	if (format != texture.format) throw runtime_error("Mock upload : format mismatch");
+	if (x < 0 || y < 0 || x+width > max(1, texture.width>>level) ||
+		y+height > max(1, texture.height>>level))
+		throw runtime_error("Mock upload : tile out of range");
+	if (size != DDSLoader::getImageSize(format, width, height) ||
+		bufferOffset+size > _bufferSize)
+		throw runtime_error("Mock upload : wrong tile size");
+	_stats.tileUploads += 1;
+	_stats.tileBytes += size;
+	addWork(size);
+}
+
+void UploadBackendMock::uploadIndirection(const TexId tex, const int level,
+	const int width, const int height, const uint32_t *data)
+{
+	const Texture &texture = getTexture(tex, level);
+	if (texture.format != DDSLoader::Format::Undefined || !data ||
+		width != max(1, texture.width>>level) || height != max(1, texture.height>>level))
+		throw runtime_error("Mock upload : wrong indirection level");
+	addWork(sizeof(uint32_t)*width*height);
+}
+
+void UploadBackendMock::copyLevel(const TexId src, const int srcLevel,
+	const TexId dst, const int dstLevel, const int width, const int height)
+{
+	const Texture &from = getTexture(src, srcLevel);
+	const Texture &to = getTexture(dst, dstLevel);
+	if (from.format != to.format) throw runtime_error("Mock upload : format mismatch");
+	if (width != max(1, from.width>>srcLevel) || height != max(1, from.height>>srcLevel) ||
+		width != max(1, to.width>>dstLevel) || height != max(1, to.height>>dstLevel))
+		throw runtime_error("Mock upload : copied levels differ");
+	_stats.copies += 1;
+	addWork(DDSLoader::getImageSize(from.format, width, height));
+}
+
+void UploadBackendMock::setBaseLevel(const TexId tex, const int level)
+{
+	getTexture(tex, level);
+}
+
+void UploadBackendMock::addWork(const size_t bytes)
+{
+	const double seconds = _callTime + bytes/_bytesPerSecond;
+	_gpuDone = max(_gpuDone, chrono::steady_clock::now()) +
+		chrono::duration_cast<chrono::steady_clock::duration>(
+			chrono::duration<double>(seconds));
+	_stats.gpuTime += seconds;
+}
+
+UploadBackend::FenceId UploadBackendMock::insertFence()
+{
+	const FenceId fence = _nextFence++;
+	_fences[fence] = _gpuDone;
+	return fence;
+}
+
+bool UploadBackendMock::isSignaled(const FenceId fence, const bool wait)
+{
+	auto it = _fences.find(fence);
+	if (it == _fences.end()) return true;
+	if (wait) this_thread::sleep_until(it->second);
+	return chrono::steady_clock::now() >= it->second;
+}
+
+void UploadBackendMock::deleteFence(const FenceId fence)
+{
+	_fences.erase(fence);
+}
+
+UploadBackend::TimerId UploadBackendMock::beginTimer()
+{
+	const TimerId timer = _nextTimer++;
+	_timers[timer] = Timer{_stats.gpuTime, _gpuDone, false};
+	return timer;
+}
+
+void UploadBackendMock::endTimer(const TimerId timer)
+{
+	auto it = _timers.find(timer);
+	if (it == _timers.end() || it->second.ended)
+		throw runtime_error("Mock upload : timer not started");
+	it->second.gpuTime = _stats.gpuTime-it->second.gpuTime;
+	it->second.done = _gpuDone;
+	it->second.ended = true;
+}
+
+bool UploadBackendMock::getTimer(const TimerId timer, double &seconds)
+{
+	auto it = _timers.find(timer);
+	if (it == _timers.end() || !it->second.ended) return false;
+	if (chrono::steady_clock::now() < it->second.done) return false;
+	seconds = it->second.gpuTime;
+	_timers.erase(it);
+	return true;
+}
+
+void UploadBackendMock::deleteTimer(const TimerId timer)
+{
+	_timers.erase(timer);
+}
+
+const UploadBackendMock::Stats &UploadBackendMock::getStats() const
+{
+	return _stats;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "upload_backend.hpp"
+
+#include <vector>
+#include <map>
+#include <chrono>
+
+/**
+ * In-memory implementation of UploadBackend, to run the streamer without a
+ * graphics API (benchmarks, headless checks)
+ *
+ * Nothing is uploaded: textures only keep their format and size, and uploads
+ * are checked against them (throws runtime_error if out of range). A
+ * simulated GPU runs uploads one after the other, each taking a fixed time
+ * plus its size over a bandwidth, and fences are signaled when the GPU gets
+ * past them. Timers measure the time the GPU spent on work submitted between
+ * their start and end, available once it is done.
+ * @see UploadBackend
+ */
+class UploadBackendMock : public UploadBackend
+{
+public:
+	/// What went through the backend
+	struct Stats
+	{
+		/// Number of tile uploads
+		size_t tileUploads = 0;
+		/// Bytes of tile uploads
+		size_t tileBytes = 0;
+		/// Number of level copies between textures
+		size_t copies = 0;
+		/// Number of textures alive
+		size_t textures = 0;
+		/// Largest number of textures alive at once
+		size_t maxTextures = 0;
+		/// Size in bytes of the storage of textures alive
+		size_t textureBytes = 0;
+		/// Largest size in bytes of the storage of textures alive at once
+		size_t maxTextureBytes = 0;
+		/// Seconds the simulated GPU spent on uploads and copies
+		double gpuTime = 0.0;
+	};
+
+	/**
+	 * @param bytesPerSecond simulated upload and copy bandwidth
+	 * @param callTime simulated time in seconds of each upload or copy
+	 */
+	explicit UploadBackendMock(double bytesPerSecond=8e9, double callTime=20e-6);
+
+	void *createBuffer(size_t size) override;
+	void flushBuffer(size_t offset, size_t size) override;
+	void beginUploads() override;
+	void endUploads() override;
+
+	TexId createTexture(DDSLoader::Format format, int levels,
+		int width, int height) override;
+	TexId createIndirection(int levels, int width, int height) override;
+	void deleteTexture(TexId tex) override;
+
+	void uploadTile(TexId tex, int level, int x, int y, int width, int height,
+		DDSLoader::Format format, size_t size, size_t bufferOffset) override;
+	void uploadIndirection(TexId tex, int level, int width, int height,
+		const uint32_t *data) override;
+	void copyLevel(TexId src, int srcLevel, TexId dst, int dstLevel,
+		int width, int height) override;
+	void setBaseLevel(TexId tex, int level) override;
+
+	FenceId insertFence() override;
+	bool isSignaled(FenceId fence, bool wait) override;
+	void deleteFence(FenceId fence) override;
+
+	TimerId beginTimer() override;
+	void endTimer(TimerId timer) override;
+	bool getTimer(TimerId timer, double &seconds) override;
+	void deleteTimer(TimerId timer) override;
+
+	/// Returns what went through the backend so far
+	const Stats &getStats() const;
+
+private:
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	struct Texture
+	{
+		/// Block compression format, Undefined for indirection textures
+		DDSLoader::Format format;
+		int levels;
+		int width;
+		int height;
+		/// Size in bytes of the storage
+		size_t size;
+	};
+
+	/**
+	 * Returns a texture, throws runtime_error if it doesn't exist or if a
+	 * level is out of its range
+	 */
+	const Texture &getTexture(TexId tex, int level) const;
+	/// Queues work on the simulated GPU
+	void addWork(size_t bytes);
+	/// Adds a texture to the stats
+	TexId addTexture(const Texture &texture);
+
+	/// Simulated bandwidth in bytes per second
+	double _bytesPerSecond;
+	/// Simulated time of each call in seconds
+	double _callTime;
+	/// Staging buffer, with room for alignment
+	std::vector<uint8_t> _buffer;
+	/// Aligned start of the staging buffer
+	uint8_t *_bufferPtr = nullptr;
+	/// Size of the staging buffer in bytes
+	size_t _bufferSize = 0;
+	/// Between beginUploads() and endUploads()
+	bool _uploading = false;
+	/// Textures alive
+	std::map<TexId, Texture> _textures;
+	/// Id of the next texture
+	TexId _nextTex = 1;
+	/// When the simulated GPU is done with each fence
+	std::map<FenceId, TimePoint> _fences;
+	/// Id of the next fence
+	FenceId _nextFence = 1;
+	/// GPU work measured by a timer
+	struct Timer
+	{
+		/// GPU time spent so far when started, then time spent in between
+		double gpuTime;
+		/// When the simulated GPU is done with the work, once ended
+		TimePoint done;
+		bool ended;
+	};
+	/// Timers not deleted
+	std::map<TimerId, Timer> _timers;
+	/// Id of the next timer
+	TimerId _nextTimer = 1;
+	/// When the simulated GPU is done with work queued so far
+	TimePoint _gpuDone;
+	Stats _stats;
+};
@@ -0,0 +1,121 @@
+#include "upload_budget.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+/// Step of model corrections, between 0 (no learning) and 1 (last batch only)
+static const double learningRate = 0.5;
+/// Largest correction of the estimate of a batch, as a factor of it: spikes
+/// are learned fast, a stall only makes a few updates upload less
+static const double maxIncrease = 4.0;
+static const double maxDecrease = 1.0;
+/// Lowest times of models, so that estimates never reach 0
+static const double minPerUpload = 1e-7;
+static const double minPerMiB = 1e-6;
+
+/// Initial models, about a PBO upload on current hardware
+static const double cpuPerUpload = 10e-6;
+static const double cpuPerMiB = 0.05e-3;
+static const double gpuPerUpload = 20e-6;
+static const double gpuPerMiB = 0.25e-3;
+
+UploadBudget::UploadBudget(const double milliseconds)
+{
+	setBudget(milliseconds);
+	_cpu.perUpload = cpuPerUpload;
+	_cpu.defaultPerMiB = cpuPerMiB;
+	_gpu.perUpload = gpuPerUpload;
+	_gpu.defaultPerMiB = gpuPerMiB;
+}
+
+void UploadBudget::setBudget(const double milliseconds)
+{
+	_budget = max(0.0, milliseconds)*0.001;
+}
+
+double UploadBudget::getBudget() const
+{
+	return _budget;
+}
+
+/// Returns the seconds per MiB of a format in a model
+static double getPerMiB(const UploadBudget::Model &model, const DDSLoader::Format format)
+{
+	auto it = model.perMiB.find(format);
+	return (it == model.perMiB.end())?model.defaultPerMiB:it->second;
+}
+
+bool UploadBudget::fits(const Batch &batch, const DDSLoader::Format format,
+	const size_t size) const
+{
+	if (batch.uploads == 0) return true;
+	const double mib = size/(1024.0*1024.0);
+	return batch.cpuTime + _cpu.perUpload + mib*getPerMiB(_cpu, format) <= _budget &&
+		batch.gpuTime + _gpu.perUpload + mib*getPerMiB(_gpu, format) <= _budget;
+}
+
+void UploadBudget::add(Batch &batch, const DDSLoader::Format format,
+	const size_t size) const
+{
+	const double mib = size/(1024.0*1024.0);
+	batch.uploads += 1;
+	batch.bytes[format] += size;
+	batch.cpuTime += _cpu.perUpload + mib*getPerMiB(_cpu, format);
+	batch.gpuTime += _gpu.perUpload + mib*getPerMiB(_gpu, format);
+}
+
+void UploadBudget::addCpuTime(const Batch &batch, const double seconds)
+{
+	correct(_cpu, batch, seconds);
+}
+
+void UploadBudget::addGpuTime(const Batch &batch, const double seconds)
+{
+	correct(_gpu, batch, seconds);
+}
+
+const UploadBudget::Model &UploadBudget::getCpuModel() const
+{
+	return _cpu;
+}
+
+const UploadBudget::Model &UploadBudget::getGpuModel() const
+{
+	return _gpu;
+}
+
+double UploadBudget::getTime(const Model &model, const int uploads,
+	const map<DDSLoader::Format, size_t> &bytes)
+{
+	double time = uploads*model.perUpload;
+	for (const auto &p : bytes)
+	{
+		time += p.second/(1024.0*1024.0)*getPerMiB(model, p.first);
+	}
+	return time;
+}
+
+void UploadBudget::correct(Model &model, const Batch &batch, const double seconds)
+{
+	if (batch.uploads == 0) return;
+
+	// Uploads and MiB of each format are the inputs of a linear model
+	double norm = (double)batch.uploads*batch.uploads;
+	for (const auto &p : batch.bytes)
+	{
+		const double mib = p.second/(1024.0*1024.0);
+		norm += mib*mib;
+	}
+	const double estimate = getTime(model, batch.uploads, batch.bytes);
+	const double error = max(-maxDecrease*estimate,
+		min(maxIncrease*estimate, seconds-estimate));
+	const double step = learningRate*error/norm;
+
+	model.perUpload = max(minPerUpload, model.perUpload + step*batch.uploads);
+	for (const auto &p : batch.bytes)
+	{
+		const double mib = p.second/(1024.0*1024.0);
+		model.perMiB[p.first] = max(minPerMiB, getPerMiB(model, p.first) + step*mib);
+	}
+}
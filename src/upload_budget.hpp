@@ -0,0 +1,106 @@
+#pragma once
+
+#include <map>
+#include <cstddef>
+
+#include "ddsloader.hpp"
+
+/**
+ * Sizes batches of tile uploads to a time budget per update
+ *
+ * Uploads take time on the CPU (calls submitting them) and on the GPU
+ * (copies from the staging buffer), both modeled as a fixed time per upload
+ * plus a time per MiB of each format. Times measured for whole batches
+ * correct the models with a normalized least mean squares step, so they
+ * follow the machine they run on. Steps are bounded: estimates that were too
+ * low grow fast, as they cause spikes, while a single stall only makes a few
+ * updates upload less.
+ *
+ * A batch takes tiles while both its estimated CPU and GPU times fit in the
+ * budget, and always takes its first tile so that streaming goes on.
+ */
+class UploadBudget
+{
+public:
+	/// Time model of uploads on the CPU or the GPU
+	struct Model
+	{
+		/// Seconds per upload
+		double perUpload;
+		/// Seconds per MiB, by format
+		std::map<DDSLoader::Format, double> perMiB;
+		/// Seconds per MiB of formats not measured yet
+		double defaultPerMiB;
+	};
+
+	/// Tiles uploaded in one update
+	struct Batch
+	{
+		/// Number of uploads
+		int uploads = 0;
+		/// Bytes uploaded, by format
+		std::map<DDSLoader::Format, size_t> bytes;
+		/// Estimated CPU time in seconds
+		double cpuTime = 0.0;
+		/// Estimated GPU time in seconds
+		double gpuTime = 0.0;
+	};
+
+	/**
+	 * @param milliseconds time budget of uploads per update
+	 */
+	explicit UploadBudget(double milliseconds=2.0);
+
+	/**
+	 * Sets the time budget of uploads per update, on each of the CPU and GPU
+	 * @param milliseconds time budget, 0 for one tile per update
+	 */
+	void setBudget(double milliseconds);
+	/// Returns the time budget in seconds
+	double getBudget() const;
+
+	/**
+	 * Returns whether a tile fits in a batch, always true for an empty batch
+	 * @param batch tiles taken so far
+	 * @param format block compression format of the tile
+	 * @param size size of the tile in bytes
+	 */
+	bool fits(const Batch &batch, DDSLoader::Format format, size_t size) const;
+	/**
+	 * Adds a tile to a batch
+	 * @param batch tiles taken so far
+	 * @param format block compression format of the tile
+	 * @param size size of the tile in bytes
+	 */
+	void add(Batch &batch, DDSLoader::Format format, size_t size) const;
+
+	/**
+	 * Corrects the CPU model with the time a batch took
+	 * @param batch uploaded tiles
+	 * @param seconds measured time
+	 */
+	void addCpuTime(const Batch &batch, double seconds);
+	/**
+	 * Corrects the GPU model with the time a batch took
+	 * @param batch uploaded tiles
+	 * @param seconds measured time
+	 */
+	void addGpuTime(const Batch &batch, double seconds);
+
+	/// Returns the CPU time model
+	const Model &getCpuModel() const;
+	/// Returns the GPU time model
+	const Model &getGpuModel() const;
+
+private:
+	/// Returns the estimated time of a batch or tile with a model
+	static double getTime(const Model &model, int uploads,
+		const std::map<DDSLoader::Format, size_t> &bytes);
+	/// Moves a model towards the time a batch took
+	static void correct(Model &model, const Batch &batch, double seconds);
+
+	/// Time budget in seconds
+	double _budget;
+	Model _cpu;
+	Model _gpu;
+};
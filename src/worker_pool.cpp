@@ -0,0 +1,92 @@
+#include "worker_pool.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+WorkerPool::~WorkerPool()
+{
+	{
+		lock_guard<mutex> lk(_mtx);
+		_killThreads = true;
+	}
+	_startCond.notify_all();
+	for (auto &t : _threads) t.join();
+}
+
+void WorkerPool::init(const int threads)
+{
+	const int count = (threads>0)?threads:
+		std::max(1, (int)thread::hardware_concurrency());
+	// The calling thread takes part in every loop
+	for (int i=1;i<count;++i)
+		_threads.emplace_back(&WorkerPool::work, this);
+}
+
+int WorkerPool::getThreadCount() const
+{
+	return _threads.size()+1;
+}
+
+void WorkerPool::parallelFor(const size_t count, const size_t grain,
+	const function<void(size_t, size_t)> &fun)
+{
+	if (count == 0) return;
+	const size_t chunk = std::max<size_t>(1, grain);
+	// Chunks always have at most grain elements
+	if (_threads.empty() || count <= chunk)
+	{
+		for (size_t begin=0;begin<count;begin+=chunk)
+			fun(begin, std::min(count, begin+chunk));
+		return;
+	}
+
+	{
+		lock_guard<mutex> lk(_mtx);
+		_fun = &fun;
+		_count = count;
+		_grain = chunk;
+		_next = 0;
+		_finished = 0;
+		++_generation;
+	}
+	_startCond.notify_all();
+
+	runChunks();
+
+	// Every worker must be done before the loop state can change
+	unique_lock<mutex> lk(_mtx);
+	_doneCond.wait(lk, [&]{ return _finished == _threads.size(); });
+	_fun = nullptr;
+}
+
+void WorkerPool::work()
+{
+	uint64_t generation = 0;
+	while (true)
+	{
+		{
+			unique_lock<mutex> lk(_mtx);
+			_startCond.wait(lk, [&]{ return _killThreads || _generation != generation; });
+			if (_killThreads) return;
+			generation = _generation;
+		}
+
+		runChunks();
+
+		{
+			lock_guard<mutex> lk(_mtx);
+			++_finished;
+		}
+		_doneCond.notify_one();
+	}
+}
+
+void WorkerPool::runChunks()
+{
+	size_t begin;
+	while ((begin = _next.fetch_add(_grain)) < _count)
+	{
+		(*_fun)(begin, std::min(_count, begin+_grain));
+	}
+}
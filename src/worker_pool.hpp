@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Fixed set of threads running data-parallel loops
+ *
+ * parallelFor() cuts a range in chunks that the workers and the calling
+ * thread take in turn, and returns once every chunk is done.
+ */
+class WorkerPool
+{
+public:
+	WorkerPool() = default;
+	WorkerPool(const WorkerPool &) = delete;
+	WorkerPool &operator=(const WorkerPool &) = delete;
+	~WorkerPool();
+	/**
+	 * Starts the worker threads
+	 * @param threads number of threads working on a loop, calling thread
+	 * included (0 for one per core)
+	 */
+	void init(int threads=0);
+	/// Returns the number of threads working on a loop, calling thread included
+	int getThreadCount() const;
+	/**
+	 * Calls a function on chunks of [0,count) from all threads
+	 * @param count size of the range
+	 * @param grain number of elements in a chunk
+	 * @param fun function called with the [begin,end) range of each chunk,
+	 * must not throw
+	 */
+	void parallelFor(size_t count, size_t grain,
+		const std::function<void(size_t, size_t)> &fun);
+private:
+	/// Worker thread loop
+	void work();
+	/// Takes chunks of the current loop until there are none left
+	void runChunks();
+
+	std::vector<std::thread> _threads;
+	std::mutex _mtx;
+	/// Wakes workers when a loop starts or the pool is destroyed
+	std::condition_variable _startCond;
+	/// Wakes the calling thread when all workers are done with a loop
+	std::condition_variable _doneCond;
+	bool _killThreads = false;
+
+	/// Current loop
+	const std::function<void(size_t, size_t)> *_fun = nullptr;
+	size_t _count = 0;
+	size_t _grain = 1;
+	/// Start of the next chunk to take
+	std::atomic<size_t> _next{0};
+	/// Incremented at each loop
+	uint64_t _generation = 0;
+	/// Number of workers done with the current loop
+	size_t _finished = 0;
+};